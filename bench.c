@@ -0,0 +1,490 @@
+/*
+Load generator & benchmark for the chat server.
+
+Connects K synthetic clients to a running server and has every client send fixed size messages at a given rate.  Each message starts
+with the time it was due to be sent, so every client that receives the broadcast can work out the end-to-end latency.  Timing from
+when a message was due rather than when it actually went out means a stalled server shows up as latency instead of quietly lowering
+the send rate.
+
+    bench -p 5000 -c 50 -r 100 -s 64 -d 10
+
+-r 0 finds the most the server can sustain instead: clients send as fast as the server delivers, with at most -q messages in flight.
+
+Start the server first, with its console output thrown away so the terminal doesn't become the bottleneck, e.g.
+    ./chat --server --port 5000 --headless
+
+Both ends use CLOCK_MONOTONIC, so the server & bench must run on the same machine for the latency figures to mean anything.
+*/
+
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "stdbool.h"
+#include "stdatomic.h"
+#include "platform.h"
+#include "poller.h"
+#include "frame.h"
+#include "outbuf.h"
+#include "histogram.h"
+#include "connect.h"
+#include "tls.h"
+#include "pthread.h"
+
+#define RECEIVE_BUFFER_SIZE 65536
+#define MAX_EVENTS 64
+#define TIMESTAMP_DIGITS 16 // Messages start with the due time in hex, so they stay printable on the server console.
+#define UNTHROTTLED_BATCH 16 // Messages queued per client per pass with -r 0.
+#define DRAIN_US 500000 // Keep reading this long after sending stops, so messages still in flight are counted.
+
+typedef struct BenchOptions {
+    char Host[MAX_HOST_LENGTH];
+    int PortNo;
+    int ClientCount;
+    int ThreadCount;
+    double Rate; // Messages per second per client.  0 = as fast as the server delivers them, see Window.
+    int Window; // With Rate 0: messages sent but not yet delivered to every other client, across all clients.
+    int MessageSize; // Payload bytes, timestamp included.
+    double DurationSecs; // Measured part of the run.
+    double WarmupSecs; // Run before measuring starts, so connections & caches settle.
+    bool bTls; // Connect with TLS, certificate unchecked.  Needs a build with -DCHAT_TLS.
+} BenchOptions;
+
+typedef struct BenchThread BenchThread;
+
+typedef struct BenchClient {
+    SOCKET Socket;
+    TlsConnection *Tls; // NULL for plaintext.
+    BenchThread *Owner;
+    FrameDecoder Decoder;
+    OutBuffer Out;
+    bool bWantWrite;
+    bool bClosed;
+    int64_t FirstSendUs; // When this client's first message is due.  Clients are staggered across one send interval.
+    int64_t MessagesDue; // Messages queued so far.  Message N is due at FirstSendUs + N * interval.
+} BenchClient;
+
+struct BenchThread {
+    pthread_t Thread;
+    BenchClient *Clients;
+    int ClientCount;
+    Poller *Poller;
+    char *ReceiveBuffer;
+    char *Payload; // Template message.  The timestamp is written over its start before each send.
+    Histogram Latency; // Microseconds, measured part of the run only.
+    uint64_t Sent;
+    uint64_t Received;
+    uint64_t BytesReceived;
+};
+
+BenchOptions Options;
+TlsContext *BenchTls;
+int64_t StartUs; // Sending starts.
+int64_t MeasureFromUs; // Warm-up over.
+int64_t StopUs; // Sending stops.
+atomic_llong Outstanding; // Deliveries still owed by the server.  Only tracked with Rate 0, where it throttles the senders.
+
+void PrintUsage();
+bool ParseOptions(int argc, char *argv[]);
+bool ConnectClient(BenchClient *Bot);
+void *RunBenchThread(void *Arg);
+void QueueMessages(BenchThread *Self, BenchClient *Bot, int64_t Now);
+void FlushBot(BenchClient *Bot);
+void ReadFromServer(BenchClient *Bot);
+bool BenchFrameReceived(void *Context, uint8_t Type, const uint8_t *Payload, size_t Length);
+void PrintReport(BenchThread *Threads);
+
+int main(int argc, char *argv[]) {
+    BenchThread *Threads;
+    BenchClient *Bots;
+    int Counter;
+    int PerThread;
+
+    if (!ParseOptions(argc, argv)) {
+        PrintUsage();
+        return 1;
+    }
+
+    #ifdef _WIN32
+    WSADATA wsadata;
+    if (WSAStartup(0x0202, &wsadata))
+        return 1;
+    #else
+    signal(SIGPIPE, SIG_IGN);
+    #endif // _WIN32
+
+    if (Options.bTls && (BenchTls = TlsClientContext(NULL, false, NULL)) == NULL)
+        return 1;
+
+    Bots = calloc(Options.ClientCount, sizeof(BenchClient));
+    Threads = calloc(Options.ThreadCount, sizeof(BenchThread));
+    if (Bots == NULL || Threads == NULL) {
+        printf("Out of memory!\n");
+        return 1;
+    }
+
+    for (Counter = 0; Counter < Options.ClientCount; Counter++) {
+        if (!ConnectClient(&Bots[Counter])) {
+            printf("Client %d couldn't connect to %s:%d!\n", Counter, Options.Host, Options.PortNo);
+            return 1;
+        }
+    }
+    printf("%d clients connected to %s:%d.\n", Options.ClientCount, Options.Host, Options.PortNo);
+
+    StartUs = MonotonicUs() + 100000; // Give the server a moment to register the last connections.
+    MeasureFromUs = StartUs + (int64_t)(Options.WarmupSecs * 1e6);
+    StopUs = MeasureFromUs + (int64_t)(Options.DurationSecs * 1e6);
+
+    PerThread = (Options.ClientCount + Options.ThreadCount - 1) / Options.ThreadCount;
+    for (Counter = 0; Counter < Options.ThreadCount; Counter++) {
+        BenchThread *Self = &Threads[Counter];
+        int First = Counter * PerThread;
+        int Bot;
+
+        Self->Clients = Bots + First;
+        Self->ClientCount = First + PerThread <= Options.ClientCount ? PerThread : Options.ClientCount - First;
+        if (Self->ClientCount < 0)
+            Self->ClientCount = 0;
+        HistogramInit(&Self->Latency);
+        Self->Poller = PollerCreate();
+        Self->ReceiveBuffer = malloc(RECEIVE_BUFFER_SIZE);
+        Self->Payload = malloc(Options.MessageSize);
+        if (Self->Poller == NULL || Self->ReceiveBuffer == NULL || Self->Payload == NULL) {
+            printf("Out of memory!\n");
+            return 1;
+        }
+        memset(Self->Payload, 'x', Options.MessageSize);
+
+        for (Bot = 0; Bot < Self->ClientCount; Bot++) {
+            BenchClient *Client = &Self->Clients[Bot];
+            Client->Owner = Self;
+            Client->FirstSendUs = StartUs;
+            if (Options.Rate > 0) // Spread the clients over one interval so they don't all send at the same instant.
+                Client->FirstSendUs += (int64_t)((First + Bot) * (1e6 / Options.Rate) / Options.ClientCount);
+            if (!PollerAdd(Self->Poller, Client->Socket, Client, POLL_READ)) {
+                printf("Unable to watch socket with %s!\n", PollerBackendName());
+                return 1;
+            }
+        }
+    }
+
+    printf("Running: %.1fs warm-up, then %.1fs measured...\n", Options.WarmupSecs, Options.DurationSecs);
+
+    for (Counter = 1; Counter < Options.ThreadCount; Counter++) {
+        if (pthread_create(&Threads[Counter].Thread, NULL, RunBenchThread, &Threads[Counter])) {
+            printf("Error creating thread\n");
+            return 1;
+        }
+    }
+    RunBenchThread(&Threads[0]);
+    for (Counter = 1; Counter < Options.ThreadCount; Counter++)
+        pthread_join(Threads[Counter].Thread, NULL);
+
+    PrintReport(Threads);
+
+    for (Counter = 0; Counter < Options.ClientCount; Counter++) {
+        TlsFree(Bots[Counter].Tls);
+        if (!Bots[Counter].bClosed)
+            close(Bots[Counter].Socket);
+        FrameDecoderFree(&Bots[Counter].Decoder);
+        OutBufferFree(&Bots[Counter].Out);
+    }
+    for (Counter = 0; Counter < Options.ThreadCount; Counter++) {
+        PollerDestroy(Threads[Counter].Poller);
+        free(Threads[Counter].ReceiveBuffer);
+        free(Threads[Counter].Payload);
+    }
+    free(Threads);
+    free(Bots);
+    TlsContextFree(BenchTls);
+
+    #ifdef _WIN32
+    WSACleanup();
+    #endif
+    return 0;
+}
+
+void PrintUsage() {
+    printf("Usage: bench -p port [-h host] [-c clients] [-t threads] [-r rate] [-q window] [-s size] [-d seconds] [-w seconds] [-T]\n"
+           "  -h  Server host name or IP address (default 127.0.0.1)\n"
+           "  -p  Server port\n"
+           "  -c  Synthetic clients (default 10)\n"
+           "  -t  Threads driving the clients (default 1)\n"
+           "  -r  Messages per second per client, 0 = as fast as the server keeps up (default 100)\n"
+           "  -q  With -r 0, messages in flight across all clients (default 1000)\n"
+           "  -s  Message size in bytes, at least %d (default 64)\n"
+           "  -d  Measured duration in seconds (default 10)\n"
+           "  -w  Warm-up in seconds, not measured (default 1)\n"
+           "  -T  Use TLS (certificate not checked)\n", TIMESTAMP_DIGITS);
+}
+
+bool ParseOptions(int argc, char *argv[]) {
+    int Counter;
+
+    strcpy(Options.Host, "127.0.0.1");
+    Options.PortNo = 0;
+    Options.ClientCount = 10;
+    Options.ThreadCount = 1;
+    Options.Rate = 100;
+    Options.Window = 1000;
+    Options.MessageSize = 64;
+    Options.DurationSecs = 10;
+    Options.WarmupSecs = 1;
+
+    for (Counter = 1; Counter < argc; Counter++) {
+        const char *Value = Counter + 1 < argc ? argv[Counter + 1] : NULL;
+
+        if (strcmp(argv[Counter], "-T") == 0) { // The only option without a value.
+            Options.bTls = true;
+            continue;
+        }
+
+        if (argv[Counter][0] != '-' || argv[Counter][1] == '\0' || argv[Counter][2] != '\0' || Value == NULL)
+            return false;
+
+        switch (argv[Counter][1]) {
+        case 'h':
+            if (strlen(Value) >= sizeof(Options.Host))
+                return false;
+            strcpy(Options.Host, Value);
+            break;
+        case 'p': Options.PortNo = atoi(Value); break;
+        case 'c': Options.ClientCount = atoi(Value); break;
+        case 't': Options.ThreadCount = atoi(Value); break;
+        case 'r': Options.Rate = atof(Value); break;
+        case 'q': Options.Window = atoi(Value); break;
+        case 's': Options.MessageSize = atoi(Value); break;
+        case 'd': Options.DurationSecs = atof(Value); break;
+        case 'w': Options.WarmupSecs = atof(Value); break;
+        default:
+            return false;
+        }
+        Counter++; // Skip the value.
+    }
+
+    if (Options.PortNo < 1 || Options.PortNo > 65535 || Options.ClientCount < 1 || Options.ThreadCount < 1 || Options.Rate < 0 || Options.Window < 1
+        || Options.MessageSize < TIMESTAMP_DIGITS || Options.MessageSize > FRAME_DEFAULT_MAX_PAYLOAD || Options.DurationSecs <= 0
+        || Options.WarmupSecs < 0)
+        return false;
+
+    if (Options.ThreadCount > Options.ClientCount)
+        Options.ThreadCount = Options.ClientCount;
+    return true;
+}
+
+bool ConnectClient(BenchClient *Bot) {
+    Bot->Socket = ConnectHost(Options.Host, Options.PortNo, CONNECT_DEFAULT_TIMEOUT_MS);
+    if (Bot->Socket == INVALID_SOCKET)
+        return false;
+
+    if (BenchTls && ((Bot->Tls = TlsConnect(BenchTls, Bot->Socket, Options.Host)) == NULL
+                    || !TlsHandshake(Bot->Tls, CONNECT_DEFAULT_TIMEOUT_MS))) {
+        TlsFree(Bot->Tls);
+        Bot->Tls = NULL;
+        close(Bot->Socket);
+        return false;
+    }
+
+    SetNoDelay(Bot->Socket, true);
+    FrameDecoderInit(&Bot->Decoder, FRAME_DEFAULT_MAX_PAYLOAD);
+    OutBufferInit(&Bot->Out);
+    return true;
+}
+
+void *RunBenchThread(void *Arg) {
+    BenchThread *Self = Arg;
+    PollEvent Events[MAX_EVENTS];
+    int EventCount;
+    int Counter;
+    int64_t Now;
+    int64_t Wait;
+    int TimeoutMs;
+
+    while ((Now = MonotonicUs()) < StopUs + DRAIN_US) {
+        Wait = StopUs + DRAIN_US - Now;
+
+        for (Counter = 0; Counter < Self->ClientCount; Counter++) {
+            BenchClient *Bot = &Self->Clients[Counter];
+
+            if (Bot->bClosed)
+                continue;
+
+            if (Now < StopUs)
+                QueueMessages(Self, Bot, Now);
+            if (!Bot->bWantWrite)
+                FlushBot(Bot);
+
+            if (Now >= StopUs) // Draining.
+                continue;
+            else if (Options.Rate > 0) { // Sleep no longer than the next message is due.
+                int64_t Due = Bot->FirstSendUs + (int64_t)((Bot->MessagesDue) * 1e6 / Options.Rate) - Now;
+                if (Due < Wait)
+                    Wait = Due;
+            }
+            else if (!Bot->bWantWrite) // More can be sent straight away.
+                Wait = 0;
+        }
+
+        TimeoutMs = Wait > 0 ? (int)(Wait / 1000) : 0; // Round down, a loop or two too many beats sending late.
+        EventCount = PollerWait(Self->Poller, Events, MAX_EVENTS, TimeoutMs);
+        if (EventCount == -1) {
+            printf("Socket Error! Code: %d\n", LastSocketError());
+            break;
+        }
+
+        for (Counter = 0; Counter < EventCount; Counter++) {
+            BenchClient *Bot = Events[Counter].Context;
+
+            if (Bot == NULL || Bot->bClosed)
+                continue;
+            if (Events[Counter].Events & (POLL_READ | POLL_ERROR))
+                ReadFromServer(Bot);
+            if (!Bot->bClosed && (Events[Counter].Events & POLL_WRITE) && Bot->bWantWrite)
+                FlushBot(Bot);
+        }
+    }
+    return NULL;
+}
+
+// Queue every message that has fallen due since the last pass.
+void QueueMessages(BenchThread *Self, BenchClient *Bot, int64_t Now) {
+    int64_t DueUs;
+    int Queued = 0;
+    int Digit;
+
+    for (;;) {
+        if (Options.Rate > 0) {
+            DueUs = Bot->FirstSendUs + (int64_t)(Bot->MessagesDue * 1e6 / Options.Rate);
+            if (DueUs > Now || DueUs >= StopUs)
+                return;
+        }
+        else {
+            if (Bot->bWantWrite || Queued == UNTHROTTLED_BATCH || Now < StartUs
+                || atomic_load_explicit(&Outstanding, memory_order_relaxed) >= (long long)Options.Window * (Options.ClientCount - 1))
+                return;
+            DueUs = Now;
+        }
+
+        for (Digit = TIMESTAMP_DIGITS - 1; Digit >= 0; Digit--) // Hex, most significant digit first.
+            Self->Payload[TIMESTAMP_DIGITS - 1 - Digit] = "0123456789abcdef"[((uint64_t)DueUs >> (Digit * 4)) & 0xf];
+
+        if (!OutBufferAppendFrame(&Bot->Out, FRAME_MSG, Self->Payload, Options.MessageSize))
+            return;
+
+        Bot->MessagesDue++;
+        Queued++;
+        if (Options.Rate == 0)
+            atomic_fetch_add_explicit(&Outstanding, Options.ClientCount - 1, memory_order_relaxed);
+        if (DueUs >= MeasureFromUs)
+            Self->Sent++;
+    }
+}
+
+void FlushBot(BenchClient *Bot) {
+    switch (Bot->Tls ? TlsFlush(Bot->Tls, &Bot->Out, false) : OutBufferFlush(&Bot->Out, Bot->Socket, false)) {
+    case OUTBUF_ERROR:
+        printf("Server closed a connection!\n");
+        PollerRemove(Bot->Owner->Poller, Bot->Socket);
+        close(Bot->Socket);
+        Bot->bClosed = true;
+        break;
+
+    case OUTBUF_BLOCKED:
+        if (!Bot->bWantWrite)
+            PollerModify(Bot->Owner->Poller, Bot->Socket, Bot, POLL_READ | POLL_WRITE);
+        Bot->bWantWrite = true;
+        break;
+
+    default:
+        if (Bot->bWantWrite)
+            PollerModify(Bot->Owner->Poller, Bot->Socket, Bot, POLL_READ);
+        Bot->bWantWrite = false;
+    }
+}
+
+void ReadFromServer(BenchClient *Bot) {
+    long BytesReceived;
+
+    for (;;) {
+        if (Bot->Tls)
+            BytesReceived = TlsRecv(Bot->Tls, Bot->Owner->ReceiveBuffer, RECEIVE_BUFFER_SIZE);
+        else
+            BytesReceived = recv(Bot->Socket, Bot->Owner->ReceiveBuffer, RECEIVE_BUFFER_SIZE, 0);
+
+        if (BytesReceived == SOCKET_ERROR && SocketWouldBlock())
+            return;
+
+        if (BytesReceived <= 0 || !FrameDecoderFeed(&Bot->Decoder, (uint8_t *)Bot->Owner->ReceiveBuffer, BytesReceived, BenchFrameReceived, Bot)) {
+            printf("Server closed a connection!\n");
+            PollerRemove(Bot->Owner->Poller, Bot->Socket);
+            close(Bot->Socket);
+            Bot->bClosed = true;
+            return;
+        }
+    }
+}
+
+bool BenchFrameReceived(void *Context, uint8_t Type, const uint8_t *Payload, size_t Length) {
+    BenchClient *Bot = Context;
+    BenchThread *Self = Bot->Owner;
+    uint64_t DueUs = 0;
+    uint64_t Sender;
+    size_t SenderLength;
+    int Digit;
+    int64_t Now;
+
+    if (Type != FRAME_MSG || (SenderLength = VarintDecode(Payload, Length, &Sender)) == 0)
+        return true;
+    Payload += SenderLength; // The server puts the sender's user ID in front.
+    Length -= SenderLength;
+    if (Length < TIMESTAMP_DIGITS)
+        return true;
+
+    for (Digit = 0; Digit < TIMESTAMP_DIGITS; Digit++) {
+        uint8_t Char = Payload[Digit];
+        if (Char >= '0' && Char <= '9')
+            DueUs = (DueUs << 4) | (Char - '0');
+        else if (Char >= 'a' && Char <= 'f')
+            DueUs = (DueUs << 4) | (Char - 'a' + 10);
+        else
+            return true; // Not one of ours, e.g. typed by the server operator.
+    }
+
+    if (Options.Rate == 0)
+        atomic_fetch_sub_explicit(&Outstanding, 1, memory_order_relaxed);
+
+    if ((int64_t)DueUs < MeasureFromUs || (int64_t)DueUs >= StopUs)
+        return true;
+
+    Now = MonotonicUs();
+    HistogramRecord(&Self->Latency, Now - (int64_t)DueUs);
+    Self->Received++;
+    Self->BytesReceived += Length;
+    return true;
+}
+
+void PrintReport(BenchThread *Threads) {
+    Histogram Latency;
+    uint64_t Sent = 0;
+    uint64_t Received = 0;
+    uint64_t BytesReceived = 0;
+    uint64_t Expected;
+    int Counter;
+
+    HistogramInit(&Latency);
+    for (Counter = 0; Counter < Options.ThreadCount; Counter++) {
+        HistogramMerge(&Latency, &Threads[Counter].Latency);
+        Sent += Threads[Counter].Sent;
+        Received += Threads[Counter].Received;
+        BytesReceived += Threads[Counter].BytesReceived;
+    }
+    Expected = Sent * (uint64_t)(Options.ClientCount - 1); // Every message goes to everyone but its sender.
+
+    printf("\n%d clients on %d thread(s), %g msg/s per client, %d byte messages, %.1fs measured\n", Options.ClientCount,
+           Options.ThreadCount, Options.Rate, Options.MessageSize, Options.DurationSecs);
+    printf("Sent:       %llu msgs (%.0f msg/s)\n", (unsigned long long)Sent, Sent / Options.DurationSecs);
+    printf("Delivered:  %llu msgs (%.0f msg/s, %.2f MB/s), %.2f%% of expected\n", (unsigned long long)Received,
+           Received / Options.DurationSecs, BytesReceived / Options.DurationSecs / 1e6, Expected ? 100.0 * Received / Expected : 0.0);
+    printf("Latency us: p50 %lld  p99 %lld  p999 %lld  max %lld  mean %.0f\n", (long long)HistogramPercentile(&Latency, 50),
+           (long long)HistogramPercentile(&Latency, 99), (long long)HistogramPercentile(&Latency, 99.9), (long long)Latency.Max,
+           HistogramMean(&Latency));
+}
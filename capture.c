@@ -0,0 +1,93 @@
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "errno.h"
+#include "pthread.h"
+#include "frame.h"
+#include "capture.h"
+
+#define CAPTURE_BUFFER_BYTES (1024 * 1024)
+
+static pthread_mutex_t Lock = PTHREAD_MUTEX_INITIALIZER; // Guards everything below.
+static FILE *File; // NULL = not capturing.  Only set & cleared while no worker is running.
+static char *Buffer;
+static bool bFailed; // A write failed, so the rest of the trace is lost.
+static uint32_t NextConnection; // Never used yet.
+static uint32_t *Free; // Numbers of connections that have closed, to hand out again first.
+static size_t FreeCount;
+static size_t FreeCapacity;
+
+bool CaptureOpen(const char *Path) {
+    if ((File = fopen(Path, "wb")) == NULL) {
+        printf("ERROR: can't write the capture to %s: %s\n", Path, strerror(errno));
+        return false;
+    }
+    if ((Buffer = malloc(CAPTURE_BUFFER_BYTES)) != NULL) // Else stdio's own, smaller one.
+        setvbuf(File, Buffer, _IOFBF, CAPTURE_BUFFER_BYTES);
+    bFailed = false;
+    NextConnection = 0;
+    FreeCount = 0;
+    return true;
+}
+
+void CaptureClose() {
+    if (File == NULL)
+        return;
+    if (fclose(File) != 0 || bFailed)
+        printf("The capture is incomplete: writing it failed.\n");
+    File = NULL;
+    free(Buffer);
+    Buffer = NULL;
+    free(Free);
+    Free = NULL;
+    FreeCount = FreeCapacity = 0;
+}
+
+uint32_t CaptureConnection() {
+    uint32_t Connection;
+
+    if (File == NULL)
+        return CAPTURE_NONE;
+    pthread_mutex_lock(&Lock);
+    Connection = FreeCount > 0 ? Free[--FreeCount] : NextConnection++;
+    pthread_mutex_unlock(&Lock);
+    return Connection;
+}
+
+// One record.  With the lock held.
+static void WriteRecord(uint32_t Connection, const uint8_t *Bytes, size_t Length) {
+    uint8_t Header[20];
+    size_t HeaderLength = VarintEncode(Header, Connection);
+
+    HeaderLength += VarintEncode(Header + HeaderLength, Length);
+    if (!bFailed && (fwrite(Header, 1, HeaderLength, File) != HeaderLength || fwrite(Bytes, 1, Length, File) != Length))
+        bFailed = true;
+}
+
+void CaptureBytes(uint32_t Connection, const uint8_t *Bytes, size_t Length) {
+    if (Connection == CAPTURE_NONE || Length == 0) // A record of length 0 would close the connection.
+        return;
+    pthread_mutex_lock(&Lock);
+    WriteRecord(Connection, Bytes, Length);
+    pthread_mutex_unlock(&Lock);
+}
+
+void CaptureClosed(uint32_t Connection) {
+    uint32_t *NewFree;
+    size_t NewCapacity;
+
+    if (Connection == CAPTURE_NONE)
+        return;
+    pthread_mutex_lock(&Lock);
+    WriteRecord(Connection, NULL, 0);
+    if (FreeCount == FreeCapacity) {
+        NewCapacity = FreeCapacity ? FreeCapacity * 2 : 64;
+        if ((NewFree = realloc(Free, NewCapacity * sizeof(uint32_t))) != NULL) { // Else the number just isn't used again.
+            Free = NewFree;
+            FreeCapacity = NewCapacity;
+        }
+    }
+    if (FreeCount < FreeCapacity)
+        Free[FreeCount++] = Connection;
+    pthread_mutex_unlock(&Lock);
+}
@@ -0,0 +1,29 @@
+/*
+Capture of what clients send, for replay.c.
+
+With --capture FILE the server writes every recv() from every client to FILE, as it came off the wire (after TLS), in the trace format
+replay.c reads: a record of connection number, length & bytes per recv(), and a record of length 0 when the connection closes.  So real
+traffic can be replayed through the decoder & fan-out as often as needed, or handed to the fuzz target as a seed.
+
+Connection numbers are reused once their connection closes, so they stay under replay.c's limit however long the capture runs, as
+long as no more clients than that are connected at once.  Every worker writes through one stdio buffer under a lock: capturing is for
+recording a trace, not for running with.  Clients handed over by a hot restart (see handoff.h) are captured from then on, without what they sent before.
+*/
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include "stdbool.h"
+#include "stddef.h"
+#include "stdint.h"
+
+#define CAPTURE_NONE UINT32_MAX // The connection number of a client that isn't captured.
+
+bool CaptureOpen(const char *Path); // Start capturing to Path, replacing it.  Prints what's wrong & returns false if it can't.
+void CaptureClose(); // Flush & close it.  Only once no worker is running.
+
+uint32_t CaptureConnection(); // A number for a new connection.  CAPTURE_NONE if there's no capture.
+void CaptureBytes(uint32_t Connection, const uint8_t *Bytes, size_t Length); // What one recv() got.  Does nothing for CAPTURE_NONE.
+void CaptureClosed(uint32_t Connection); // The connection is gone, and its number free again.
+
+#endif // CAPTURE_H
@@ -0,0 +1,877 @@
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "stdatomic.h"
+#include "pthread.h"
+#include "poller.h"
+#include "frame.h"
+#include "outbuf.h"
+#include "message.h"
+#include "pool.h"
+#include "mpsc.h"
+#include "rooms.h"
+#include "cluster.h"
+
+#define MAX_EVENTS 64
+#define MAX_LINKS (CLUSTER_MAX_NODES * 2) // Incoming links.  Room for a restarted node's new link while its old one is still closing.
+#define STRIPE_BITS 6
+#define STRIPE_COUNT (1 << STRIPE_BITS)
+#define INITIAL_BUCKETS 16
+#define REDIAL_MS 1000 // Wait between attempts to link to a node that's down.
+#define DIAL_TIMEOUT_MS 5000
+#define PEER_MAX_QUEUED (64 << 20) // Frames for a node that has this much waiting on its link are dropped.
+#define LINK_READ_BYTES 65536
+
+typedef struct Peer {
+    char Name[USER_NAME_MAX + 1];
+    char Host[MAX_HOST_LENGTH];
+    int PortNo;
+    struct sockaddr_storage Address; // Resolved once, by ClusterConfigure().
+    socklen_t AddressLength;
+    SOCKET Socket; // The link to it.  INVALID_SOCKET while down.
+    bool bLinked; // False while connect() is still in progress.
+    bool bWantWrite; // Out is waiting on the socket becoming writable.
+    OutBuffer Out; // Frames waiting to go over the link.
+    int64_t DeadlineUs; // Down: when to dial again.  Dialling: when to give up.
+} Peer;
+
+typedef struct PeerLink { // An incoming link from another node.
+    SOCKET Socket; // INVALID_SOCKET = free slot.
+    int From; // Node that dialled it, -1 until its PEER_HELLO.
+    FrameDecoder Decoder;
+} PeerLink;
+
+typedef struct ClusterItem { // A frame for a node, posted to the cluster thread.
+    MpscNode Node; // Must come first, the queue hands back MpscNode pointers.
+    int Target;
+    Message *Shared; // The item owns one reference.
+} ClusterItem;
+
+typedef struct RingPoint {
+    uint32_t Hash;
+    int Node;
+} RingPoint;
+
+typedef struct ClusterRoom {
+    struct ClusterRoom *Next; // In its bucket.
+    uint32_t Hash;
+    size_t NameLength;
+    uint8_t Name[ROOM_NAME_MAX];
+    int OpenCount; // Workers here with members in the room.
+    uint64_t Subscribers; // Other nodes with members in it.  Only the owner has any.
+} ClusterRoom;
+
+typedef struct RoomStripe {
+    pthread_mutex_t Lock;
+    ClusterRoom **Buckets; // Chained, indexed by the low hash bits.  Capacity is a power of two.
+    size_t Capacity;
+    size_t Count;
+} RoomStripe;
+
+static Peer Peers[CLUSTER_MAX_NODES];
+static int NodeCount;
+static int SelfIndex;
+static RingPoint Ring[CLUSTER_MAX_NODES * CLUSTER_POINTS]; // Sorted by hash.
+static int PointCount;
+static PeerLink Links[MAX_LINKS];
+static RoomStripe Stripes[STRIPE_COUNT];
+static pthread_once_t StripesCreated = PTHREAD_ONCE_INIT;
+static SOCKET ListenSocket = INVALID_SOCKET;
+static Poller *ClusterPoller;
+static pthread_t Thread;
+static atomic_bool bRunning; // Frames are only queued while the thread is there to take them.
+static atomic_bool bStopping;
+static MpscQueue Queue;
+static Pool *ItemPool;
+static ClusterHandler Deliver;
+static size_t MaxPayload;
+static uint8_t *ReadBuffer;
+static atomic_ullong Dropped;
+
+static void *ClusterMain(void *Arg);
+
+static void CreateStripes() {
+    int Counter;
+    for (Counter = 0; Counter < STRIPE_COUNT; Counter++)
+        pthread_mutex_init(&Stripes[Counter].Lock, NULL);
+}
+
+// Spread the bits of an FNV hash over the whole ring.  FNV-1a on short, similar names clusters in the top bits.  (MurmurHash3's
+// finaliser.)
+static uint32_t Mix(uint32_t Hash) {
+    Hash ^= Hash >> 16;
+    Hash *= 0x85ebca6bu;
+    Hash ^= Hash >> 13;
+    Hash *= 0xc2b2ae35u;
+    Hash ^= Hash >> 16;
+    return Hash;
+}
+
+static int ComparePoints(const void *Left, const void *Right) {
+    const RingPoint *A = Left;
+    const RingPoint *B = Right;
+
+    if (A->Hash != B->Hash)
+        return A->Hash < B->Hash ? -1 : 1;
+    return A->Node - B->Node; // Same order on every node, even on a collision.
+}
+
+static void BuildRing() {
+    char Label[USER_NAME_MAX + 16];
+    int Node;
+    int Point;
+    int Length;
+
+    PointCount = 0;
+    for (Node = 0; Node < NodeCount; Node++) {
+        for (Point = 0; Point < CLUSTER_POINTS; Point++) { // Named, not numbered, so every node places them the same whatever the list order.
+            Length = snprintf(Label, sizeof(Label), "%s#%d", Peers[Node].Name, Point);
+            Ring[PointCount].Hash = Mix(RoomHash((const uint8_t *)Label, (size_t)Length));
+            Ring[PointCount].Node = Node;
+            PointCount++;
+        }
+    }
+    qsort(Ring, PointCount, sizeof(RingPoint), ComparePoints);
+}
+
+static bool ResolvePeer(Peer *Node) {
+    struct addrinfo Hints;
+    struct addrinfo *Results;
+    char PortText[8];
+
+    memset(&Hints, 0, sizeof(Hints));
+    Hints.ai_family = AF_UNSPEC;
+    Hints.ai_socktype = SOCK_STREAM;
+    Hints.ai_protocol = IPPROTO_TCP;
+    snprintf(PortText, sizeof(PortText), "%d", Node->PortNo);
+
+    if (getaddrinfo(Node->Host, PortText, &Hints, &Results) != 0)
+        return false;
+    memcpy(&Node->Address, Results->ai_addr, Results->ai_addrlen);
+    Node->AddressLength = (socklen_t)Results->ai_addrlen;
+    freeaddrinfo(Results);
+    return true;
+}
+
+// One "name=host:port" entry.  IPv6 addresses go in brackets: name=[::1]:6000.
+static bool ParseNode(const char *Entry, size_t Length, Peer *Node) {
+    const char *Equals = memchr(Entry, '=', Length);
+    const char *Host;
+    const char *Colon = NULL;
+    size_t HostLength;
+    size_t Counter;
+    long PortNo;
+    char *End;
+
+    if (Equals == NULL || !UserNameValid((const uint8_t *)Entry, (size_t)(Equals - Entry)))
+        return false;
+    memcpy(Node->Name, Entry, Equals - Entry);
+    Node->Name[Equals - Entry] = '\0';
+
+    Host = Equals + 1;
+    for (Counter = 0; Host + Counter < Entry + Length; Counter++) {
+        if (Host[Counter] == ':')
+            Colon = Host + Counter;
+    }
+    if (Colon == NULL)
+        return false;
+    HostLength = (size_t)(Colon - Host);
+    if (HostLength >= 2 && Host[0] == '[' && Host[HostLength - 1] == ']') {
+        Host++;
+        HostLength -= 2;
+    }
+    if (HostLength == 0 || HostLength >= MAX_HOST_LENGTH)
+        return false;
+    memcpy(Node->Host, Host, HostLength);
+    Node->Host[HostLength] = '\0';
+
+    PortNo = strtol(Colon + 1, &End, 10);
+    if (End != Entry + Length || End == Colon + 1 || PortNo < 1 || PortNo > 65535)
+        return false;
+    Node->PortNo = (int)PortNo;
+    return true;
+}
+
+bool ClusterConfigure(const char *Nodes, const char *Self) {
+    const char *Entry = Nodes;
+    size_t Length;
+    int Counter;
+
+    pthread_once(&StripesCreated, CreateStripes);
+    NodeCount = 0;
+    SelfIndex = 0;
+    if (Nodes[0] == '\0')
+        return true;
+
+    while (*Entry != '\0') {
+        Length = strcspn(Entry, ",");
+        if (NodeCount == CLUSTER_MAX_NODES) {
+            printf("ERROR: a cluster can't have more than %d nodes!\n", CLUSTER_MAX_NODES);
+            return false;
+        }
+        if (!ParseNode(Entry, Length, &Peers[NodeCount])) {
+            printf("ERROR: cluster nodes must be given as name=host:port, not '%.*s'!\n", (int)Length, Entry);
+            return false;
+        }
+        for (Counter = 0; Counter < NodeCount; Counter++) {
+            if (strcmp(Peers[Counter].Name, Peers[NodeCount].Name) == 0) {
+                printf("ERROR: cluster node %s is listed twice!\n", Peers[NodeCount].Name);
+                return false;
+            }
+        }
+        Peers[NodeCount].Socket = INVALID_SOCKET;
+        OutBufferInit(&Peers[NodeCount].Out);
+        NodeCount++;
+        Entry += Length;
+        if (*Entry == ',')
+            Entry++;
+    }
+
+    for (SelfIndex = 0; SelfIndex < NodeCount && strcmp(Peers[SelfIndex].Name, Self) != 0; SelfIndex++);
+    if (SelfIndex == NodeCount) {
+        printf("ERROR: this node (--node) must be one of the cluster's nodes!\n");
+        NodeCount = 0;
+        return false;
+    }
+
+    for (Counter = 0; Counter < NodeCount; Counter++) {
+        if (Counter != SelfIndex && !ResolvePeer(&Peers[Counter])) {
+            printf("ERROR: unable to resolve %s for cluster node %s!\n", Peers[Counter].Host, Peers[Counter].Name);
+            NodeCount = 0;
+            return false;
+        }
+    }
+    BuildRing();
+    return true;
+}
+
+bool ClusterEnabled() {
+    return NodeCount > 1;
+}
+
+int ClusterPortNo() {
+    return Peers[SelfIndex].PortNo;
+}
+
+int ClusterSelf() {
+    return SelfIndex;
+}
+
+const char *ClusterNodeName(int Node) {
+    return Peers[Node].Name;
+}
+
+int ClusterOwner(uint32_t RoomHash) {
+    uint32_t Hash = Mix(RoomHash);
+    int Low = 0;
+    int High = PointCount;
+    int Middle;
+
+    if (NodeCount < 2)
+        return SelfIndex;
+
+    while (Low < High) { // First point at or after the hash...
+        Middle = (Low + High) / 2;
+        if (Ring[Middle].Hash < Hash)
+            Low = Middle + 1;
+        else
+            High = Middle;
+    }
+    return Ring[Low == PointCount ? 0 : Low].Node; // ...wrapping round past the last one.
+}
+
+// Queue a frame for another node.  Takes its own reference on Shared.  Safe to call from any thread.
+static void SendToNode(int Target, Message *Shared) {
+    ClusterItem *Item;
+
+    if (!atomic_load_explicit(&bRunning, memory_order_acquire) || (Item = PoolAlloc(ItemPool)) == NULL) {
+        atomic_fetch_add_explicit(&Dropped, 1, memory_order_relaxed);
+        return;
+    }
+    Item->Target = Target;
+    Item->Shared = MessageRetain(Shared);
+    MpscPush(&Queue, &Item->Node);
+    PollerWakeup(ClusterPoller);
+}
+
+static RoomStripe *StripeOf(uint32_t Hash) {
+    return &Stripes[Hash >> (32 - STRIPE_BITS)];
+}
+
+static ClusterRoom **FindLink(RoomStripe *Stripe, const uint8_t *Name, size_t Length, uint32_t Hash) {
+    ClusterRoom **Link;
+
+    if (Stripe->Capacity == 0)
+        return NULL;
+    for (Link = &Stripe->Buckets[Hash & (Stripe->Capacity - 1)]; *Link != NULL; Link = &(*Link)->Next) {
+        if ((*Link)->Hash == Hash && (*Link)->NameLength == Length && memcmp((*Link)->Name, Name, Length) == 0)
+            return Link;
+    }
+    return NULL;
+}
+
+static bool Grow(RoomStripe *Stripe) {
+    size_t NewCapacity = Stripe->Capacity ? Stripe->Capacity * 2 : INITIAL_BUCKETS;
+    ClusterRoom **NewBuckets = calloc(NewCapacity, sizeof(ClusterRoom *));
+    ClusterRoom *Moved;
+    size_t Counter;
+
+    if (NewBuckets == NULL)
+        return false;
+    for (Counter = 0; Counter < Stripe->Capacity; Counter++) {
+        while ((Moved = Stripe->Buckets[Counter]) != NULL) {
+            Stripe->Buckets[Counter] = Moved->Next;
+            Moved->Next = NewBuckets[Moved->Hash & (NewCapacity - 1)];
+            NewBuckets[Moved->Hash & (NewCapacity - 1)] = Moved;
+        }
+    }
+    free(Stripe->Buckets);
+    Stripe->Buckets = NewBuckets;
+    Stripe->Capacity = NewCapacity;
+    return true;
+}
+
+// The room's entry, made if it's missing.  NULL if out of memory.  Stripe locked.
+static ClusterRoom *Enter(RoomStripe *Stripe, const uint8_t *Name, size_t Length, uint32_t Hash) {
+    ClusterRoom **Link = FindLink(Stripe, Name, Length, Hash);
+    ClusterRoom *Entered;
+
+    if (Link != NULL)
+        return *Link;
+    if (Stripe->Count >= Stripe->Capacity && !Grow(Stripe))
+        return NULL;
+    Entered = calloc(1, sizeof(ClusterRoom));
+    if (Entered == NULL)
+        return NULL;
+    Entered->Hash = Hash;
+    Entered->NameLength = Length;
+    memcpy(Entered->Name, Name, Length);
+    Entered->Next = Stripe->Buckets[Hash & (Stripe->Capacity - 1)];
+    Stripe->Buckets[Hash & (Stripe->Capacity - 1)] = Entered;
+    Stripe->Count++;
+    return Entered;
+}
+
+// Free the entry Link points at if nothing needs it any more.  Stripe locked.
+static void Tidy(RoomStripe *Stripe, ClusterRoom **Link) {
+    ClusterRoom *Gone = *Link;
+
+    if (Gone->OpenCount > 0 || Gone->Subscribers != 0)
+        return;
+    *Link = Gone->Next;
+    free(Gone);
+    Stripe->Count--;
+}
+
+// Tell the owner about a room while the stripe is still locked, so its subscribes & unsubscribes are queued in the order they happened.
+static void SendSubscription(uint8_t Type, const uint8_t *Name, size_t Length, uint32_t Hash) {
+    int Owner = ClusterOwner(Hash);
+    Message *Shared;
+
+    if (Owner == SelfIndex || (Shared = MessageCreateFrame(Type, Name, Length)) == NULL)
+        return;
+    SendToNode(Owner, Shared);
+    MessageRelease(Shared);
+}
+
+void ClusterRoomOpened(const uint8_t *Name, size_t Length, uint32_t Hash) {
+    RoomStripe *Stripe = StripeOf(Hash);
+    ClusterRoom *Opened;
+
+    if (NodeCount < 2)
+        return;
+
+    pthread_mutex_lock(&Stripe->Lock);
+    Opened = Enter(Stripe, Name, Length, Hash);
+    if (Opened != NULL && Opened->OpenCount++ == 0)
+        SendSubscription(PEER_SUBSCRIBE, Name, Length, Hash);
+    pthread_mutex_unlock(&Stripe->Lock);
+}
+
+void ClusterRoomClosed(const uint8_t *Name, size_t Length, uint32_t Hash) {
+    RoomStripe *Stripe = StripeOf(Hash);
+    ClusterRoom **Link;
+
+    if (NodeCount < 2)
+        return;
+
+    pthread_mutex_lock(&Stripe->Lock);
+    Link = FindLink(Stripe, Name, Length, Hash);
+    if (Link != NULL && --(*Link)->OpenCount == 0) {
+        SendSubscription(PEER_UNSUBSCRIBE, Name, Length, Hash);
+        Tidy(Stripe, Link);
+    }
+    pthread_mutex_unlock(&Stripe->Lock);
+}
+
+void ClusterBroadcast(const void *Text, size_t Length) {
+    Message *Shared;
+    int Counter;
+
+    if (NodeCount < 2 || (Shared = MessageCreateFrame(PEER_BROADCAST, Text, Length)) == NULL)
+        return;
+    for (Counter = 0; Counter < NodeCount; Counter++) { // Encoded once, queued for every node.
+        if (Counter != SelfIndex)
+            SendToNode(Counter, Shared);
+    }
+    MessageRelease(Shared);
+}
+
+void ClusterRelayRoom(const uint8_t *Payload, size_t Length, const uint8_t *Room, size_t RoomLength, uint32_t Hash, int FromNode) {
+    RoomStripe *Stripe = StripeOf(Hash);
+    int Owner = ClusterOwner(Hash);
+    ClusterRoom **Link;
+    uint64_t Targets = 0;
+    Message *Shared;
+    int Counter;
+
+    if (NodeCount < 2)
+        return;
+
+    if (Owner != SelfIndex) // Only this node's own members' messages go to the owner.  It does the rest.
+        Targets = FromNode == SelfIndex ? 1ULL << Owner : 0;
+    else {
+        pthread_mutex_lock(&Stripe->Lock);
+        Link = FindLink(Stripe, Room, RoomLength, Hash);
+        if (Link != NULL)
+            Targets = (*Link)->Subscribers & ~(1ULL << FromNode); // Not back where it came from.
+        pthread_mutex_unlock(&Stripe->Lock);
+    }
+
+    if (Targets == 0 || (Shared = MessageCreateFrame(PEER_ROOM, Payload, Length)) == NULL)
+        return;
+    for (Counter = 0; Counter < NodeCount; Counter++) {
+        if (Targets & (1ULL << Counter))
+            SendToNode(Counter, Shared);
+    }
+    MessageRelease(Shared);
+}
+
+uint64_t ClusterDropped() {
+    return atomic_load_explicit(&Dropped, memory_order_relaxed);
+}
+
+// The owner's side of PEER_SUBSCRIBE / PEER_UNSUBSCRIBE.
+static void Subscribe(int From, const uint8_t *Name, size_t Length, bool bSubscribed) {
+    uint32_t Hash = RoomHash(Name, Length);
+    RoomStripe *Stripe = StripeOf(Hash);
+    ClusterRoom **Link;
+    ClusterRoom *Entry;
+
+    pthread_mutex_lock(&Stripe->Lock);
+    if (bSubscribed) {
+        Entry = Enter(Stripe, Name, Length, Hash);
+        if (Entry != NULL)
+            Entry->Subscribers |= 1ULL << From;
+    }
+    else if ((Link = FindLink(Stripe, Name, Length, Hash)) != NULL) {
+        (*Link)->Subscribers &= ~(1ULL << From);
+        Tidy(Stripe, Link);
+    }
+    pthread_mutex_unlock(&Stripe->Lock);
+}
+
+// A node's link went down: it has no members anywhere as far as this node knows.  It subscribes again when it's back.
+static void UnsubscribeAll(int From) {
+    RoomStripe *Stripe;
+    ClusterRoom **Link;
+    size_t Bucket;
+    int Counter;
+
+    for (Counter = 0; Counter < STRIPE_COUNT; Counter++) {
+        Stripe = &Stripes[Counter];
+        pthread_mutex_lock(&Stripe->Lock);
+        for (Bucket = 0; Bucket < Stripe->Capacity; Bucket++) {
+            Link = &Stripe->Buckets[Bucket];
+            while (*Link != NULL) {
+                ClusterRoom *Entry = *Link;
+                Entry->Subscribers &= ~(1ULL << From);
+                Tidy(Stripe, Link);
+                if (*Link == Entry) // Still there.
+                    Link = &Entry->Next;
+            }
+        }
+        pthread_mutex_unlock(&Stripe->Lock);
+    }
+}
+
+// Just linked to a node: say who this is, then subscribe to every room it owns that has members here.  Ahead of anything queued for it.
+static void Introduce(Peer *Node) {
+    int Target = (int)(Node - Peers);
+    RoomStripe *Stripe;
+    ClusterRoom *Entry;
+    size_t Bucket;
+    int Counter;
+
+    OutBufferAppendFrame(&Node->Out, PEER_HELLO, Peers[SelfIndex].Name, strlen(Peers[SelfIndex].Name));
+    for (Counter = 0; Counter < STRIPE_COUNT; Counter++) {
+        Stripe = &Stripes[Counter];
+        pthread_mutex_lock(&Stripe->Lock);
+        for (Bucket = 0; Bucket < Stripe->Capacity; Bucket++) {
+            for (Entry = Stripe->Buckets[Bucket]; Entry != NULL; Entry = Entry->Next) {
+                if (Entry->OpenCount > 0 && ClusterOwner(Entry->Hash) == Target)
+                    OutBufferAppendFrame(&Node->Out, PEER_SUBSCRIBE, Entry->Name, Entry->NameLength);
+            }
+        }
+        pthread_mutex_unlock(&Stripe->Lock);
+    }
+}
+
+static void WatchPeer(Peer *Node) {
+    PollerModify(ClusterPoller, Node->Socket, Node, POLL_READ | (Node->bLinked && !Node->bWantWrite ? 0 : POLL_WRITE));
+}
+
+// The link to a node is down.  Whatever was queued for it is lost and it's dialled again in a while.
+static void Unlink(Peer *Node, int64_t NowUs) {
+    if (Node->bLinked)
+        printf("Lost the link to cluster node %s.\n", Node->Name);
+    PollerRemove(ClusterPoller, Node->Socket);
+    close(Node->Socket);
+    Node->Socket = INVALID_SOCKET;
+    Node->bLinked = false;
+    Node->bWantWrite = false;
+    OutBufferFree(&Node->Out);
+    OutBufferInit(&Node->Out);
+    Node->DeadlineUs = NowUs + REDIAL_MS * 1000LL;
+}
+
+static void Linked(Peer *Node) {
+    Node->bLinked = true;
+    printf("Linked to cluster node %s.\n", Node->Name);
+    Introduce(Node);
+    WatchPeer(Node);
+}
+
+static bool DialInProgress() {
+    #ifdef _WIN32
+    return WSAGetLastError() == WSAEWOULDBLOCK;
+    #else
+    return errno == EINPROGRESS || errno == EINTR;
+    #endif // _WIN32
+}
+
+static void Dial(Peer *Node, int64_t NowUs) {
+    Node->Socket = socket(Node->Address.ss_family, SOCK_STREAM, IPPROTO_TCP);
+    Node->DeadlineUs = NowUs + REDIAL_MS * 1000LL;
+    if (Node->Socket == INVALID_SOCKET)
+        return;
+    if (!SetNonBlocking(Node->Socket)) {
+        close(Node->Socket);
+        Node->Socket = INVALID_SOCKET;
+        return;
+    }
+    SetNoDelay(Node->Socket, true); // Frames are batched here already.
+
+    if (connect(Node->Socket, (const struct sockaddr *)&Node->Address, Node->AddressLength) == 0) {
+        PollerAdd(ClusterPoller, Node->Socket, Node, POLL_READ);
+        Linked(Node);
+        return;
+    }
+    if (!DialInProgress()) {
+        close(Node->Socket);
+        Node->Socket = INVALID_SOCKET;
+        return;
+    }
+    Node->DeadlineUs = NowUs + DIAL_TIMEOUT_MS * 1000LL;
+    PollerAdd(ClusterPoller, Node->Socket, Node, POLL_READ | POLL_WRITE); // Writable once connected.
+}
+
+// Dial every node that's down & due, give up on dials that are taking too long.  Returns how long the thread may sleep.
+static int DialPeers(int64_t NowUs) {
+    int64_t Wait = -1;
+    int64_t Remaining;
+    int Counter;
+
+    for (Counter = 0; Counter < NodeCount; Counter++) {
+        Peer *Node = &Peers[Counter];
+        if (Counter == SelfIndex || Node->bLinked)
+            continue;
+        if (NowUs >= Node->DeadlineUs) {
+            if (Node->Socket != INVALID_SOCKET)
+                Unlink(Node, NowUs);
+            else
+                Dial(Node, NowUs);
+        }
+        if (Node->bLinked)
+            continue;
+        Remaining = Node->DeadlineUs - NowUs;
+        if (Wait == -1 || Remaining < Wait)
+            Wait = Remaining;
+    }
+    return Wait == -1 ? -1 : (int)((Wait + 999) / 1000);
+}
+
+static void FlushPeer(Peer *Node) {
+    bool bWasWantWrite = Node->bWantWrite;
+    int Result = OutBufferFlush(&Node->Out, Node->Socket, false);
+
+    if (Result == OUTBUF_ERROR) {
+        Unlink(Node, MonotonicUs());
+        return;
+    }
+    Node->bWantWrite = Result == OUTBUF_BLOCKED;
+    if (Node->bWantWrite != bWasWantWrite)
+        WatchPeer(Node);
+}
+
+// Events on a link this node dialled.  Nothing is ever sent back over it, so readable means closed.
+static void PeerEvent(Peer *Node, int Events) {
+    uint8_t Ignored[256];
+    int Error = 0;
+    socklen_t Length = sizeof(Error);
+    long BytesReceived;
+
+    if (!Node->bLinked) {
+        if (getsockopt(Node->Socket, SOL_SOCKET, SO_ERROR, (char *)&Error, &Length) == SOCKET_ERROR || Error != 0 || (Events & POLL_ERROR))
+            Unlink(Node, MonotonicUs());
+        else if (Events & POLL_WRITE)
+            Linked(Node);
+        return;
+    }
+
+    if (Events & (POLL_READ | POLL_ERROR)) {
+        while ((BytesReceived = recv(Node->Socket, (char *)Ignored, sizeof(Ignored), 0)) > 0);
+        if (BytesReceived == 0 || !SocketWouldBlock()) {
+            Unlink(Node, MonotonicUs());
+            return;
+        }
+    }
+    if ((Events & POLL_WRITE) && Node->bWantWrite)
+        FlushPeer(Node);
+}
+
+static bool LinkFrameReceived(void *Context, uint8_t Type, const uint8_t *Payload, size_t Length) {
+    PeerLink *Link = Context;
+    int Counter;
+
+    if (Link->From == -1) { // Must say who it is before anything else.
+        if (Type != PEER_HELLO)
+            return false;
+        for (Counter = 0; Counter < NodeCount; Counter++) {
+            if (Counter != SelfIndex && strlen(Peers[Counter].Name) == Length && memcmp(Peers[Counter].Name, Payload, Length) == 0)
+                break;
+        }
+        if (Counter == NodeCount) {
+            printf("A server that isn't in the cluster tried to link to it: %.*s!\n", (int)Length, (const char *)Payload);
+            return false;
+        }
+        Link->From = Counter;
+        printf("Cluster node %s linked.\n", Peers[Counter].Name);
+        return true;
+    }
+
+    switch (Type) {
+    case PEER_SUBSCRIBE:
+    case PEER_UNSUBSCRIBE:
+        if (!RoomNameValid(Payload, Length))
+            return false;
+        Subscribe(Link->From, Payload, Length, Type == PEER_SUBSCRIBE);
+        return true;
+
+    case PEER_BROADCAST:
+    case PEER_ROOM:
+        Deliver(Link->From, Type, Payload, Length);
+        return true;
+    }
+    return true; // Newer nodes may send more.
+}
+
+static void CloseLink(PeerLink *Link) {
+    int Counter;
+
+    PollerRemove(ClusterPoller, Link->Socket);
+    close(Link->Socket);
+    Link->Socket = INVALID_SOCKET;
+    FrameDecoderFree(&Link->Decoder);
+    if (Link->From == -1)
+        return;
+
+    for (Counter = 0; Counter < MAX_LINKS; Counter++) { // A newer link from the same node keeps its subscriptions.
+        if (Links[Counter].Socket != INVALID_SOCKET && Links[Counter].From == Link->From)
+            return;
+    }
+    printf("Cluster node %s unlinked.\n", Peers[Link->From].Name);
+    UnsubscribeAll(Link->From);
+}
+
+static void ReadLink(PeerLink *Link) {
+    long BytesReceived;
+
+    for (;;) { // Drain the socket, as the workers do.
+        BytesReceived = recv(Link->Socket, (char *)ReadBuffer, LINK_READ_BYTES, 0);
+        if (BytesReceived == SOCKET_ERROR && SocketWouldBlock())
+            return;
+        if (BytesReceived == SOCKET_ERROR || BytesReceived == 0
+            || !FrameDecoderFeed(&Link->Decoder, ReadBuffer, (size_t)BytesReceived, LinkFrameReceived, Link)) {
+            CloseLink(Link);
+            return;
+        }
+    }
+}
+
+static void AcceptLinks() {
+    SOCKET NewSocket;
+    PeerLink *Link;
+    int Counter;
+
+    while ((NewSocket = accept(ListenSocket, NULL, NULL)) != INVALID_SOCKET) {
+        for (Counter = 0; Counter < MAX_LINKS && Links[Counter].Socket != INVALID_SOCKET; Counter++);
+        if (Counter == MAX_LINKS || !SetNonBlocking(NewSocket)) {
+            close(NewSocket);
+            continue;
+        }
+        Link = &Links[Counter];
+        Link->Socket = NewSocket;
+        Link->From = -1;
+        FrameDecoderInit(&Link->Decoder, MaxPayload);
+        if (!PollerAdd(ClusterPoller, NewSocket, Link, POLL_READ)) {
+            FrameDecoderFree(&Link->Decoder);
+            close(NewSocket);
+            Link->Socket = INVALID_SOCKET;
+        }
+    }
+}
+
+// Move everything posted for other nodes onto their links.  Appending only: they're all flushed once afterwards.
+static void DrainQueue() {
+    MpscNode *Node;
+    ClusterItem *Item;
+    Peer *Target;
+
+    while ((Node = MpscPop(&Queue)) != NULL) {
+        Item = (ClusterItem *)Node;
+        Target = &Peers[Item->Target];
+        if (!Target->bLinked || Target->Out.QueuedBytes + Item->Shared->Length > PEER_MAX_QUEUED
+            || !OutBufferAppendMessage(&Target->Out, Item->Shared))
+            atomic_fetch_add_explicit(&Dropped, 1, memory_order_relaxed);
+        MessageRelease(Item->Shared);
+        PoolFree(ItemPool, Item);
+    }
+}
+
+static void *ClusterMain(void *Arg) {
+    PollEvent Events[MAX_EVENTS];
+    int EventCount;
+    int TimeoutMs = 0;
+    int Counter;
+    void *Context;
+
+    (void)Arg;
+    while (!atomic_load(&bStopping)) {
+        EventCount = PollerWait(ClusterPoller, Events, MAX_EVENTS, TimeoutMs);
+
+        for (Counter = 0; Counter < EventCount; Counter++) {
+            Context = Events[Counter].Context;
+            if (Context == NULL) // Woken up: frames were queued.
+                continue;
+            if (Context == &ListenSocket)
+                AcceptLinks();
+            else if ((Peer *)Context >= Peers && (Peer *)Context < Peers + CLUSTER_MAX_NODES) {
+                if (((Peer *)Context)->Socket != INVALID_SOCKET) // Not unlinked earlier in this batch.
+                    PeerEvent(Context, Events[Counter].Events);
+            }
+            else if (((PeerLink *)Context)->Socket != INVALID_SOCKET) // Not closed earlier in this batch.
+                ReadLink(Context);
+        }
+
+        DrainQueue();
+        for (Counter = 0; Counter < NodeCount; Counter++) { // One write per node per pass, however many frames are queued for it.
+            if (Peers[Counter].bLinked && !Peers[Counter].bWantWrite && Peers[Counter].Out.Count > 0)
+                FlushPeer(&Peers[Counter]);
+        }
+        TimeoutMs = DialPeers(MonotonicUs());
+    }
+    return NULL;
+}
+
+bool ClusterStart(SOCKET Listening, size_t MaxFrameBytes, ClusterHandler Handler) {
+    int Counter;
+
+    ListenSocket = Listening;
+    Deliver = Handler;
+    MaxPayload = MaxFrameBytes; // Peer frames carry what clients sent, so they're never bigger.
+    for (Counter = 0; Counter < MAX_LINKS; Counter++)
+        Links[Counter].Socket = INVALID_SOCKET;
+    atomic_store(&bStopping, false);
+    MpscInit(&Queue);
+
+    if (ItemPool == NULL)
+        ItemPool = PoolCreate(sizeof(ClusterItem), 1024);
+    if (ReadBuffer == NULL)
+        ReadBuffer = malloc(LINK_READ_BYTES);
+    ClusterPoller = PollerCreate();
+    if (ItemPool == NULL || ReadBuffer == NULL || ClusterPoller == NULL || !PollerAdd(ClusterPoller, ListenSocket, &ListenSocket, POLL_READ))
+        return false;
+
+    atomic_store_explicit(&bRunning, true, memory_order_release);
+    if (pthread_create(&Thread, NULL, ClusterMain, NULL)) {
+        atomic_store(&bRunning, false);
+        return false;
+    }
+    return true;
+}
+
+void ClusterStop() {
+    MpscNode *Node;
+    ClusterItem *Item;
+    RoomStripe *Stripe;
+    ClusterRoom *Gone;
+    size_t Bucket;
+    int Counter;
+
+    if (!atomic_load(&bRunning)) { // Never started, or failed to.
+        if (ListenSocket != INVALID_SOCKET)
+            close(ListenSocket);
+        ListenSocket = INVALID_SOCKET;
+        if (ClusterPoller != NULL)
+            PollerDestroy(ClusterPoller);
+        ClusterPoller = NULL;
+        return;
+    }
+
+    atomic_store(&bRunning, false);
+    atomic_store(&bStopping, true);
+    PollerWakeup(ClusterPoller);
+    pthread_join(Thread, NULL);
+
+    while ((Node = MpscPop(&Queue)) != NULL) { // Queued just before it stopped.
+        Item = (ClusterItem *)Node;
+        MessageRelease(Item->Shared);
+        PoolFree(ItemPool, Item);
+    }
+    for (Counter = 0; Counter < NodeCount; Counter++) {
+        if (Peers[Counter].Socket != INVALID_SOCKET)
+            close(Peers[Counter].Socket);
+        Peers[Counter].Socket = INVALID_SOCKET;
+        Peers[Counter].bLinked = false;
+        OutBufferFree(&Peers[Counter].Out);
+    }
+    for (Counter = 0; Counter < MAX_LINKS; Counter++) {
+        if (Links[Counter].Socket != INVALID_SOCKET) {
+            close(Links[Counter].Socket);
+            FrameDecoderFree(&Links[Counter].Decoder);
+            Links[Counter].Socket = INVALID_SOCKET;
+        }
+    }
+    for (Counter = 0; Counter < STRIPE_COUNT; Counter++) {
+        Stripe = &Stripes[Counter];
+        pthread_mutex_lock(&Stripe->Lock);
+        for (Bucket = 0; Bucket < Stripe->Capacity; Bucket++) {
+            while ((Gone = Stripe->Buckets[Bucket]) != NULL) {
+                Stripe->Buckets[Bucket] = Gone->Next;
+                free(Gone);
+            }
+        }
+        free(Stripe->Buckets);
+        Stripe->Buckets = NULL;
+        Stripe->Capacity = Stripe->Count = 0;
+        pthread_mutex_unlock(&Stripe->Lock);
+    }
+
+    close(ListenSocket);
+    ListenSocket = INVALID_SOCKET;
+    PollerDestroy(ClusterPoller);
+    ClusterPoller = NULL;
+    free(ReadBuffer);
+    ReadBuffer = NULL;
+}
@@ -0,0 +1,75 @@
+/*
+Cluster mode: several servers sharing the same rooms, so a room is no longer capped by the sockets one machine can hold open.
+
+Every node is given the same list of nodes and told which one it is:
+
+    --cluster alpha=10.0.0.1:6000,beta=10.0.0.2:6000,gamma=10.0.0.3:6000 --node beta
+
+Each node listens for the others on its own entry's port, dials every other node once and keeps that link up for good, redialling
+whenever it drops.  A link only ever carries frames one way, from the node that dialled it, so there's no deciding who connects to
+whom.  The frames are frame.h's, with the PEER_ types below, and are batched like a client's: everything queued for a node during a
+pass of the cluster thread goes out in one vectored write.
+
+Rooms are placed on nodes by consistent hashing.  Every node has CLUSTER_POINTS points on a 32-bit ring and a room belongs to the node
+with the first point at or after its hash, so changing the node list only moves the rooms next to the points that came or went.  The
+room's owner is its hub:
+
+- a node with members in a room subscribes to it at the owner (and unsubscribes when the last one leaves);
+- a member's message is delivered to the members on its own node, and sent once to the owner;
+- the owner delivers it to its members & relays it once to every other subscribed node, which delivers it to theirs.
+
+A room message therefore crosses to each node with members in the room once, however many members are there, and never travels more
+than two hops.  Messages to everyone go straight to every other node, once each.
+
+User IDs are only meaningful on the node that handed them out, so what arrives from another node is from nobody (USER_NONE), and direct
+messages only reach users on the same node.  Frames for a node whose link is down are dropped and counted.  POSIX & Windows.
+*/
+
+#ifndef CLUSTER_H
+#define CLUSTER_H
+
+#include "stdbool.h"
+#include "stddef.h"
+#include "stdint.h"
+#include "platform.h"
+
+#define CLUSTER_MAX_NODES 64 // Subscribers are kept as a bit mask.
+#define CLUSTER_POINTS 64 // Ring points per node.  More spreads rooms more evenly.
+
+enum {
+    PEER_HELLO = 1, // The dialling node's name.  First frame on every link.
+    PEER_BROADCAST, // Text for every client.
+    PEER_ROOM, // A FRAME_ROOM_MSG payload: room name length, name, text.
+    PEER_SUBSCRIBE, // Room name.  Sent to the owner: the sender has members in it now...
+    PEER_UNSUBSCRIBE // ...or no longer does.
+};
+
+// Called on the cluster thread for every PEER_BROADCAST & PEER_ROOM another node sends.
+typedef void (*ClusterHandler)(int FromNode, uint8_t Type, const uint8_t *Payload, size_t Length);
+
+// Read the node list & find this node in it.  Prints what's wrong & returns false if it can't.  Nodes empty = no cluster.
+bool ClusterConfigure(const char *Nodes, const char *Self);
+bool ClusterEnabled(); // Configured with more than one node.
+int ClusterPortNo(); // This node's port, to listen on for the others.
+
+// Start the cluster thread on a socket already listening on ClusterPortNo().  ClusterStop() closes the socket, even if this fails.
+bool ClusterStart(SOCKET ListenSocket, size_t MaxFrameBytes, ClusterHandler Handler);
+void ClusterStop(); // Close every link & stop the thread.  Frames queued later are dropped.
+
+int ClusterSelf();
+const char *ClusterNodeName(int Node);
+int ClusterOwner(uint32_t RoomHash); // Node the room belongs to.
+
+// A worker opened / closed its copy of a room.  The owner is told when the first worker opens it & when the last one closes it.
+void ClusterRoomOpened(const uint8_t *Name, size_t Length, uint32_t Hash);
+void ClusterRoomClosed(const uint8_t *Name, size_t Length, uint32_t Hash);
+
+void ClusterBroadcast(const void *Text, size_t Length); // Send a message for everyone to every other node.
+
+// Pass a room message on: from this node's own members (FromNode = ClusterSelf()) to the owner, and from the owner to the other
+// subscribed nodes.  Does nothing on a node that has no one to pass it to.
+void ClusterRelayRoom(const uint8_t *Payload, size_t Length, const uint8_t *Room, size_t RoomLength, uint32_t Hash, int FromNode);
+
+uint64_t ClusterDropped(); // Frames dropped because the link to their node was down or too far behind.
+
+#endif // CLUSTER_H
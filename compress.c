@@ -0,0 +1,154 @@
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "compress.h"
+
+#ifdef CHAT_ZLIB
+
+#include <zlib.h>
+
+#define COMPRESS_LEVEL 6
+#define RAW_DEFLATE -15 // Window bits: negative = no zlib header or checksum, which would cost 6 bytes a message.
+
+// What chat is made of, so short messages have something to refer back to.  Deflate reaches the end of the dictionary with the
+// shortest distances, so the most common strings come last.
+static const char BuiltInDictionary[] =
+    "https://www. .com/ .org .net .html .png .jpg github.com/ youtube.com/watch?v= "
+    "Thank you so much! Happy birthday! Congratulations! Good morning everyone. Good night everyone. "
+    "I don't think so. I don't know. I'm not sure. Let me know if you have any questions. "
+    "What do you think? How are you doing? What are you doing? Where are you? See you later. See you tomorrow. "
+    "Welcome to the room. Has anyone seen? Does anyone know how to? Can someone help me with "
+    "because actually probably definitely something anything everything nothing someone anyone everyone "
+    "tomorrow tonight today yesterday morning afternoon evening weekend Monday Friday "
+    "meeting please thanks sorry again about after before could would should there their they're "
+    "people really right think thing going doing being getting make made know knew want need have "
+    "that's what's it's I've I'll I'd you're you'll we're we'll don't can't won't didn't doesn't isn't "
+    "lol lmao haha omg btw imo tbh idk brb afk np ty thx ok okay yeah yes no maybe sure cool nice great "
+    " the  and  to  of  a  in  is  it  you  that  for  on  with  this  be  are  not  at  was  have  but  so  just  like  me  my  what  do  can ";
+
+struct Compressor {
+    z_stream Stream;
+};
+
+struct Decompressor {
+    z_stream Stream;
+};
+
+static const uint8_t *Dictionary = (const uint8_t *)BuiltInDictionary;
+static size_t DictionaryLength = sizeof(BuiltInDictionary) - 1;
+static uint8_t *LoadedDictionary; // Dictionary when it came from a file.
+static uint32_t DictionaryId;
+
+bool CompressionConfigure(const char *DictionaryFile) {
+    FILE *File;
+    long Length;
+
+    if (DictionaryFile[0] != '\0') {
+        File = fopen(DictionaryFile, "rb");
+        if (File == NULL) {
+            printf("ERROR: unable to open the compression dictionary %s!\n", DictionaryFile);
+            return false;
+        }
+        if (fseek(File, 0, SEEK_END) != 0 || (Length = ftell(File)) <= 0 || Length > COMPRESS_DICTIONARY_MAX
+            || fseek(File, 0, SEEK_SET) != 0) {
+            printf("ERROR: the compression dictionary must be 1 to %d bytes!\n", COMPRESS_DICTIONARY_MAX);
+            fclose(File);
+            return false;
+        }
+        free(LoadedDictionary);
+        LoadedDictionary = malloc((size_t)Length);
+        if (LoadedDictionary == NULL || fread(LoadedDictionary, 1, (size_t)Length, File) != (size_t)Length) {
+            printf("ERROR: unable to read the compression dictionary %s!\n", DictionaryFile);
+            fclose(File);
+            return false;
+        }
+        fclose(File);
+        Dictionary = LoadedDictionary;
+        DictionaryLength = (size_t)Length;
+    }
+    DictionaryId = (uint32_t)adler32(adler32(0L, Z_NULL, 0), Dictionary, (uInt)DictionaryLength);
+    return true;
+}
+
+uint32_t CompressionDictionaryId() {
+    return DictionaryId;
+}
+
+Compressor *CompressorCreate() {
+    Compressor *Packer = calloc(1, sizeof(Compressor));
+
+    if (Packer != NULL && deflateInit2(&Packer->Stream, COMPRESS_LEVEL, Z_DEFLATED, RAW_DEFLATE, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        free(Packer);
+        return NULL;
+    }
+    return Packer;
+}
+
+void CompressorFree(Compressor *Packer) {
+    if (Packer == NULL)
+        return;
+    deflateEnd(&Packer->Stream);
+    free(Packer);
+}
+
+size_t Compress(Compressor *Packer, const uint8_t *In, size_t Length, uint8_t *Out, size_t Capacity) {
+    z_stream *Stream = &Packer->Stream;
+
+    // Every message starts from the dictionary alone, so it can be read without the ones before it.
+    if (deflateReset(Stream) != Z_OK || deflateSetDictionary(Stream, Dictionary, (uInt)DictionaryLength) != Z_OK)
+        return 0;
+    Stream->next_in = (Bytef *)In;
+    Stream->avail_in = (uInt)Length;
+    Stream->next_out = Out;
+    Stream->avail_out = (uInt)Capacity;
+    if (deflate(Stream, Z_FINISH) != Z_STREAM_END) // Out of room: it wouldn't have come out any smaller.
+        return 0;
+    return Capacity - Stream->avail_out;
+}
+
+Decompressor *DecompressorCreate() {
+    Decompressor *Unpacker = calloc(1, sizeof(Decompressor));
+
+    if (Unpacker != NULL && inflateInit2(&Unpacker->Stream, RAW_DEFLATE) != Z_OK) {
+        free(Unpacker);
+        return NULL;
+    }
+    return Unpacker;
+}
+
+void DecompressorFree(Decompressor *Unpacker) {
+    if (Unpacker == NULL)
+        return;
+    inflateEnd(&Unpacker->Stream);
+    free(Unpacker);
+}
+
+bool Decompress(Decompressor *Unpacker, const uint8_t *In, size_t Length, uint8_t *Out, size_t Expected) {
+    z_stream *Stream = &Unpacker->Stream;
+
+    if (inflateReset(Stream) != Z_OK || inflateSetDictionary(Stream, Dictionary, (uInt)DictionaryLength) != Z_OK)
+        return false;
+    Stream->next_in = (Bytef *)In;
+    Stream->avail_in = (uInt)Length;
+    Stream->next_out = Out;
+    Stream->avail_out = (uInt)Expected;
+    return inflate(Stream, Z_FINISH) == Z_STREAM_END && Stream->avail_out == 0 && Stream->avail_in == 0;
+}
+
+#else // CHAT_ZLIB
+
+bool CompressionConfigure(const char *DictionaryFile) {
+    (void)DictionaryFile;
+    printf("ERROR: this build has no compression support.  Rebuild with -DCHAT_ZLIB -lz.\n");
+    return false;
+}
+
+uint32_t CompressionDictionaryId() { return 0; }
+Compressor *CompressorCreate() { return NULL; }
+void CompressorFree(Compressor *Packer) { (void)Packer; }
+size_t Compress(Compressor *Packer, const uint8_t *In, size_t Length, uint8_t *Out, size_t Capacity) { (void)Packer; (void)In; (void)Length; (void)Out; (void)Capacity; return 0; }
+Decompressor *DecompressorCreate() { return NULL; }
+void DecompressorFree(Decompressor *Unpacker) { (void)Unpacker; }
+bool Decompress(Decompressor *Unpacker, const uint8_t *In, size_t Length, uint8_t *Out, size_t Expected) { (void)Unpacker; (void)In; (void)Length; (void)Out; (void)Expected; return false; }
+
+#endif // CHAT_ZLIB
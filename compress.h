@@ -0,0 +1,46 @@
+/*
+Per-message compression (zlib).  Compiled in with -DCHAT_ZLIB and linked with -lz.  Without CHAT_ZLIB the same functions exist but
+CompressionConfigure() only says so & returns false, and nobody compresses.
+
+Chat messages are short, and deflate on its own barely shrinks a 60 byte line: there's nothing earlier in it to refer back to.  So every
+message is deflated as if it followed a preset dictionary, a few KiB of the words & phrases chat is made of, which both ends have.  Each
+message is still compressed on its own, with no state carried from one to the next, so:
+
+- the server compresses a message once, when it's built, and every client that asked for compression is sent the same bytes;
+- a client can decompress any message it's sent without having seen the others, history replays included.
+
+A client asks with FRAME_COMPRESS and the dictionary's ID (its Adler-32), and only gets FRAME_PACKED frames if the server has the same
+dictionary.  The built in one is used unless both ends are given the same --compress-dict file: a dictionary trained on real traffic
+(e.g. the most common substrings of a day's logs, most common last) does better still.
+*/
+
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include "stdbool.h"
+#include "stddef.h"
+#include "stdint.h"
+
+#define COMPRESS_DICTIONARY_MAX 32768 // Deflate can't look back further than this.
+
+typedef struct Compressor Compressor;
+typedef struct Decompressor Decompressor;
+
+// Load the dictionary from DictionaryFile, or use the built in one if it's empty.  Prints why & returns false if it can't.  Before any
+// compressor is created.
+bool CompressionConfigure(const char *DictionaryFile);
+uint32_t CompressionDictionaryId();
+
+Compressor *CompressorCreate(); // One per thread.  NULL if out of memory.
+void CompressorFree(Compressor *Packer);
+
+// Deflate Length bytes into Out.  Returns the compressed size, or 0 if that wouldn't fit in Capacity.
+size_t Compress(Compressor *Packer, const uint8_t *In, size_t Length, uint8_t *Out, size_t Capacity);
+
+Decompressor *DecompressorCreate();
+void DecompressorFree(Decompressor *Unpacker);
+
+// Inflate into Out, which must come out exactly Expected bytes.  Returns false if the data is corrupt or doesn't.
+bool Decompress(Decompressor *Unpacker, const uint8_t *In, size_t Length, uint8_t *Out, size_t Expected);
+
+#endif // COMPRESS_H
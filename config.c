@@ -0,0 +1,326 @@
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "stddef.h"
+#include "ctype.h"
+#include "platform.h"
+#include "config.h"
+#include "connect.h"
+#include "frame.h"
+
+typedef enum { OPTION_MODE, OPTION_INT, OPTION_SIZE, OPTION_BOOL, OPTION_HOST, OPTION_PATH, OPTION_LIST, OPTION_NAME } OptionType;
+
+typedef struct ConfigOption {
+    const char *Name;
+    OptionType Type;
+    size_t Offset; // Of the field in ChatConfig.
+    long long Min; // Range allowed for OPTION_INT / OPTION_SIZE.
+    long long Max;
+    const char *Help;
+} ConfigOption;
+
+#define SERVER_FIELD(Field) (offsetof(ChatConfig, Server) + offsetof(ServerConfig, Field))
+
+static const ConfigOption Options[] = {
+    { "mode", OPTION_MODE, offsetof(ChatConfig, Mode), 0, 0, "server or client" },
+    { "port", OPTION_INT, offsetof(ChatConfig, PortNo), 1, 65535, "Port to listen on / connect to" },
+    { "host", OPTION_HOST, offsetof(ChatConfig, Host), 0, 0, "Client: host name or IP address of the server (default 127.0.0.1)" },
+    { "connect-timeout", OPTION_INT, offsetof(ChatConfig, ConnectTimeoutMs), 1, 3600000, "Client: give up connecting after this many ms (default 10000)" },
+    { "tls", OPTION_BOOL, offsetof(ChatConfig, bTls), 0, 0, "Client: connect with TLS (default false)" },
+    { "tls-verify", OPTION_BOOL, offsetof(ChatConfig, bTlsVerify), 0, 0, "Client: check the server's certificate (default true)" },
+    { "tls-ca", OPTION_PATH, offsetof(ChatConfig, TlsCaFile), 0, 0, "Client: trusted CA certificates, PEM (default the system's)" },
+    { "tls-session", OPTION_PATH, offsetof(ChatConfig, TlsSessionFile), 0, 0, "Client: file keeping the TLS session so reconnects resume" },
+    { "name", OPTION_NAME, offsetof(ChatConfig, Username), 0, 0, "Client: user name to log in with (default none: shown as They)" },
+    { "compress", OPTION_BOOL, offsetof(ChatConfig, bCompress), 0, 0, "Client: ask the server to compress messages, CHAT_ZLIB builds only (default false)" },
+    { "tui", OPTION_BOOL, offsetof(ChatConfig, bTui), 0, 0, "Client: full screen, with what you type kept below what others send (default false)" },
+    { "download-dir", OPTION_PATH, offsetof(ChatConfig, DownloadDirectory), 0, 0, "Client: save files others send here (default none: they're only announced)" },
+    { "compress-dict", OPTION_PATH, offsetof(ChatConfig, CompressDictFile), 0, 0, "Compression dictionary, the same file for server & clients (default built in)" },
+    { "bind", OPTION_HOST, SERVER_FIELD(BindAddress), 0, 0, "Server: local IPv4 / IPv6 address to listen on (default any, both families)" },
+    { "workers", OPTION_INT, SERVER_FIELD(WorkerCount), 0, 1024, "Server: event loop threads, 0 = one per CPU (default 0)" },
+    { "pin-workers", OPTION_BOOL, SERVER_FIELD(bPinWorkers), 0, 0, "Server: pin each worker to a CPU, Linux only (default true)" },
+    { "io-uring", OPTION_BOOL, SERVER_FIELD(bIoUring), 0, 0, "Server: run the workers on io_uring, Linux builds with CHAT_IO_URING only (default false)" },
+    { "tls-cert", OPTION_PATH, SERVER_FIELD(TlsCertFile), 0, 0, "Server: certificate chain, PEM.  Set = TLS only" },
+    { "tls-key", OPTION_PATH, SERVER_FIELD(TlsKeyFile), 0, 0, "Server: private key, PEM (default in the tls-cert file)" },
+    { "headless", OPTION_BOOL, SERVER_FIELD(bHeadless), 0, 0, "Server: relay only, no console input or output; stop with SIGTERM (default false)" },
+    { "max-clients", OPTION_INT, SERVER_FIELD(MaxClients), 0, 10000000, "Server: refuse connections beyond this many, 0 = no limit (default 0)" },
+    { "max-frame", OPTION_SIZE, SERVER_FIELD(MaxFrameBytes), 1, 1 << 30, "Server: largest message a client may send, in bytes (default 1048576)" },
+    { "receive-buffer", OPTION_SIZE, SERVER_FIELD(ReceiveBufferSize), 1024, 1 << 26, "Server: bytes read from a socket per recv (default 65536)" },
+    { "flush-bytes", OPTION_SIZE, SERVER_FIELD(FlushThresholdBytes), 1, 1 << 30, "Server: flush a connection once this much is queued (default 65536)" },
+    { "coalesce-us", OPTION_INT, SERVER_FIELD(CoalesceWindowUs), 0, 1000000, "Server: how long queued messages may wait for more (default 0)" },
+    { "nodelay", OPTION_BOOL, SERVER_FIELD(bTcpNoDelay), 0, 0, "Server: set TCP_NODELAY on client sockets (default true)" },
+    { "cork", OPTION_BOOL, SERVER_FIELD(bTcpCork), 0, 0, "Server: wrap each flush in TCP_CORK, Linux only (default false)" },
+    { "high-watermark", OPTION_SIZE, SERVER_FIELD(HighWatermarkBytes), 1, 1 << 30, "Server: stop reading from a client with this many bytes queued for it (default 1048576)" },
+    { "low-watermark", OPTION_SIZE, SERVER_FIELD(LowWatermarkBytes), 0, 1 << 30, "Server: read from it again once it drains to this (default 262144)" },
+    { "max-queued", OPTION_SIZE, SERVER_FIELD(MaxQueuedBytes), 1, 1 << 30, "Server: drop a client with more than this queued for it (default 8388608)" },
+    { "client-msg-rate", OPTION_INT, SERVER_FIELD(ClientMessagesPerSec), 0, 1000000000, "Server: messages a client may send a second, 0 = no limit (default 0)" },
+    { "client-msg-burst", OPTION_INT, SERVER_FIELD(ClientMessageBurst), 0, 1000000000, "Server: ...and at once, 0 = a second's worth (default 0)" },
+    { "client-byte-rate", OPTION_SIZE, SERVER_FIELD(ClientBytesPerSec), 0, 1 << 30, "Server: bytes a client may send a second, 0 = no limit (default 0)" },
+    { "client-byte-burst", OPTION_SIZE, SERVER_FIELD(ClientByteBurst), 0, 1 << 30, "Server: ...and at once, 0 = a second's worth (default 0)" },
+    { "room-msg-rate", OPTION_INT, SERVER_FIELD(RoomMessagesPerSec), 0, 1000000000, "Server: messages a room may be sent a second, per worker, 0 = no limit (default 0)" },
+    { "room-msg-burst", OPTION_INT, SERVER_FIELD(RoomMessageBurst), 0, 1000000000, "Server: ...and at once, 0 = a second's worth (default 0)" },
+    { "room-byte-rate", OPTION_SIZE, SERVER_FIELD(RoomBytesPerSec), 0, 1 << 30, "Server: bytes a room may be sent a second, per worker, 0 = no limit (default 0)" },
+    { "room-byte-burst", OPTION_SIZE, SERVER_FIELD(RoomByteBurst), 0, 1 << 30, "Server: ...and at once, 0 = a second's worth (default 0)" },
+    { "metrics-port", OPTION_INT, SERVER_FIELD(MetricsPortNo), 0, 65535, "Server: serve Prometheus metrics over HTTP on this port, 0 = off (default 0)" },
+    { "stats-interval", OPTION_INT, SERVER_FIELD(StatsIntervalSecs), 0, 86400, "Server: print a stats line every this many seconds, 0 = off (default 0)" },
+    { "history", OPTION_INT, SERVER_FIELD(HistoryMessages), 0, 100000, "Server: messages per room replayed to new members, 0 = none (default 50)" },
+    { "log-dir", OPTION_PATH, SERVER_FIELD(LogDirectory), 0, 0, "Server: keep room messages in a log in this directory, read back on restart (default none)" },
+    { "log-segment-bytes", OPTION_SIZE, SERVER_FIELD(LogSegmentBytes), 65536, 1 << 30, "Server: size of each log segment file (default 67108864)" },
+    { "log-segments", OPTION_INT, SERVER_FIELD(LogMaxSegments), 1, 100000, "Server: delete the oldest log segments past this many (default 16)" },
+    { "log-sync-ms", OPTION_INT, SERVER_FIELD(LogSyncMs), 1, 3600000, "Server: sync the log to disk this often (default 1000)" },
+    { "history-bytes", OPTION_SIZE, SERVER_FIELD(HistoryBytes), 0, 1 << 30, "Server: most bytes of history kept per room (default 65536)" },
+    { "ping-interval", OPTION_INT, SERVER_FIELD(PingIntervalMs), 0, 86400000, "Server: ping a client silent for this many ms, 0 = never (default 30000)" },
+    { "idle-timeout", OPTION_INT, SERVER_FIELD(IdleTimeoutMs), 0, 86400000, "Server: drop a client silent for this many ms, 0 = never (default 90000)" },
+    { "handshake-timeout", OPTION_INT, SERVER_FIELD(HandshakeTimeoutMs), 0, 3600000, "Server: drop a TLS client that hasn't finished its handshake in this many ms, 0 = never (default 10000)" },
+    { "compression", OPTION_BOOL, SERVER_FIELD(bCompression), 0, 0, "Server: compress messages for clients that ask, CHAT_ZLIB builds only (default false)" },
+    { "cluster", OPTION_LIST, SERVER_FIELD(ClusterNodes), 0, 0, "Server: every node of the cluster, this one too, as name=host:port,... (default none)" },
+    { "node", OPTION_NAME, SERVER_FIELD(NodeName), 0, 0, "Server: which of the cluster's nodes this server is" },
+    { "handoff", OPTION_PATH, SERVER_FIELD(HandoffPath), 0, 0, "Server: take over from the server on this Unix socket, & hand over to the next one there (default none)" },
+    { "capture", OPTION_PATH, SERVER_FIELD(CaptureFile), 0, 0, "Server: write what clients send to this file, as a trace replay can replay (default none)" },
+};
+
+#define OPTION_COUNT (sizeof(Options) / sizeof(Options[0]))
+
+void ChatConfigDefaults(ChatConfig *Config) {
+    memset(Config, 0, sizeof(ChatConfig));
+    Config->Mode = MODE_UNSET;
+    strcpy(Config->Host, "127.0.0.1");
+    Config->ConnectTimeoutMs = CONNECT_DEFAULT_TIMEOUT_MS;
+    Config->bTlsVerify = true;
+    ServerConfigDefaults(&Config->Server);
+}
+
+void ChatConfigPrintUsage() {
+    size_t Counter;
+
+    printf("Usage: chat                       Ask for everything interactively\n"
+           "       chat --server [options]    Run a server\n"
+           "       chat --client [options]    Run a client\n\n"
+           "  --config FILE                   Read options from FILE, one \"key = value\" per line\n");
+    for (Counter = 0; Counter < OPTION_COUNT; Counter++)
+        printf("  --%-30s%s\n", Options[Counter].Name, Options[Counter].Help);
+}
+
+static const ConfigOption *FindOption(const char *Name) {
+    size_t Counter;
+
+    for (Counter = 0; Counter < OPTION_COUNT; Counter++) {
+        if (strcmp(Options[Counter].Name, Name) == 0)
+            return &Options[Counter];
+    }
+    return NULL;
+}
+
+static bool ParseBool(const char *Value, bool *Result) {
+    if (!strcmp(Value, "1") || !strcmp(Value, "true") || !strcmp(Value, "yes") || !strcmp(Value, "on"))
+        *Result = true;
+    else if (!strcmp(Value, "0") || !strcmp(Value, "false") || !strcmp(Value, "no") || !strcmp(Value, "off"))
+        *Result = false;
+    else
+        return false;
+    return true;
+}
+
+// Set one option from its text value.  Where says where the value came from, for the error message.
+static bool SetOption(ChatConfig *Config, const char *Name, const char *Value, const char *Where) {
+    const ConfigOption *Option = FindOption(Name);
+    char *Field;
+    char *End;
+    long long Number;
+
+    if (Option == NULL) {
+        printf("%s: unknown option '%s'\n", Where, Name);
+        return false;
+    }
+    Field = (char *)Config + Option->Offset;
+
+    switch (Option->Type) {
+    case OPTION_MODE:
+        if (strcmp(Value, "server") == 0)
+            *(int *)Field = MODE_SERVER;
+        else if (strcmp(Value, "client") == 0)
+            *(int *)Field = MODE_CLIENT;
+        else {
+            printf("%s: mode must be server or client, not '%s'\n", Where, Value);
+            return false;
+        }
+        return true;
+
+    case OPTION_INT:
+    case OPTION_SIZE:
+        Number = strtoll(Value, &End, 10);
+        if (End == Value || *End != '\0' || Number < Option->Min || Number > Option->Max) {
+            printf("%s: %s must be a number from %lld to %lld, not '%s'\n", Where, Name, Option->Min, Option->Max, Value);
+            return false;
+        }
+        if (Option->Type == OPTION_INT)
+            *(int *)Field = (int)Number;
+        else
+            *(size_t *)Field = (size_t)Number;
+        return true;
+
+    case OPTION_BOOL:
+        if (!ParseBool(Value, (bool *)Field)) {
+            printf("%s: %s must be true or false, not '%s'\n", Where, Name, Value);
+            return false;
+        }
+        return true;
+
+    case OPTION_HOST: // Checked properly by getaddrinfo() when it's used.
+    case OPTION_PATH:
+    case OPTION_LIST: // Checked by whatever reads it.
+        if (strlen(Value) >= (Option->Type == OPTION_HOST ? MAX_HOST_LENGTH : MAX_PATH_LENGTH)) {
+            printf("%s: %s is too long\n", Where, Name);
+            return false;
+        }
+        strcpy(Field, Value);
+        return true;
+
+    case OPTION_NAME:
+        if (!UserNameValid((const uint8_t *)Value, strlen(Value))) {
+            printf("%s: %s must be 1 to %d characters with no spaces, not '%s'\n", Where, Name, USER_NAME_MAX, Value);
+            return false;
+        }
+        strcpy(Field, Value);
+        return true;
+    }
+    return false;
+}
+
+static char *Trim(char *Text) {
+    char *End;
+
+    while (isspace((unsigned char)*Text))
+        Text++;
+    End = Text + strlen(Text);
+    while (End > Text && isspace((unsigned char)End[-1]))
+        *--End = '\0';
+    return Text;
+}
+
+bool ChatConfigLoadFile(ChatConfig *Config, const char *Path) {
+    FILE *File = fopen(Path, "r");
+    char Line[512];
+    char Where[300];
+    char *Comment;
+    char *Equals;
+    int LineNo = 0;
+    bool bSuccess = true;
+
+    if (File == NULL) {
+        printf("Unable to open config file %s\n", Path);
+        return false;
+    }
+
+    while (fgets(Line, sizeof(Line), File) != NULL) {
+        LineNo++;
+        snprintf(Where, sizeof(Where), "%s:%d", Path, LineNo);
+
+        Comment = strchr(Line, '#');
+        if (Comment)
+            *Comment = '\0';
+        if (*Trim(Line) == '\0') // Blank or comment only.
+            continue;
+
+        Equals = strchr(Line, '=');
+        if (Equals == NULL) {
+            printf("%s: expected key = value\n", Where);
+            bSuccess = false;
+            continue;
+        }
+        *Equals = '\0';
+        if (!SetOption(Config, Trim(Line), Trim(Equals + 1), Where))
+            bSuccess = false; // Keep going so every mistake in the file is reported at once.
+    }
+
+    fclose(File);
+    return bSuccess;
+}
+
+bool ChatConfigParseArgs(ChatConfig *Config, int argc, char *argv[]) {
+    char Name[64];
+    const char *Value;
+    const char *Equals;
+    const ConfigOption *Option;
+    int Counter;
+
+    for (Counter = 1; Counter < argc; Counter++) { // Load the config file first so the command line can override it.
+        if (strcmp(argv[Counter], "--config") == 0 && Counter + 1 < argc) {
+            if (!ChatConfigLoadFile(Config, argv[++Counter]))
+                return false;
+        }
+        else if (strncmp(argv[Counter], "--config=", 9) == 0 && !ChatConfigLoadFile(Config, argv[Counter] + 9))
+            return false;
+    }
+
+    for (Counter = 1; Counter < argc; Counter++) {
+        const char *Arg = argv[Counter];
+
+        if (strcmp(Arg, "--help") == 0 || strcmp(Arg, "-h") == 0) {
+            ChatConfigPrintUsage();
+            exit(0);
+        }
+        if (strcmp(Arg, "--server") == 0) {
+            Config->Mode = MODE_SERVER;
+            continue;
+        }
+        if (strcmp(Arg, "--client") == 0) {
+            Config->Mode = MODE_CLIENT;
+            continue;
+        }
+        if (strcmp(Arg, "--config") == 0) { // Already loaded.
+            Counter++;
+            continue;
+        }
+        if (strncmp(Arg, "--config=", 9) == 0)
+            continue;
+        if (strncmp(Arg, "--", 2) != 0) {
+            printf("Unexpected argument '%s'.  Try --help.\n", Arg);
+            return false;
+        }
+
+        Arg += 2;
+        Equals = strchr(Arg, '=');
+        if (strlen(Arg) >= sizeof(Name) || (Equals && (size_t)(Equals - Arg) >= sizeof(Name))) {
+            printf("Unknown option '--%s'.  Try --help.\n", Arg);
+            return false;
+        }
+
+        if (Equals) { // --key=value
+            memcpy(Name, Arg, Equals - Arg);
+            Name[Equals - Arg] = '\0';
+            Value = Equals + 1;
+        }
+        else {
+            strcpy(Name, Arg);
+            Option = FindOption(Name);
+            if (Option == NULL && strncmp(Name, "no-", 3) == 0 && (Option = FindOption(Name + 3)) && Option->Type == OPTION_BOOL) {
+                memmove(Name, Name + 3, strlen(Name + 3) + 1); // --no-key
+                Value = "false";
+            }
+            else if (Option && Option->Type == OPTION_BOOL && (Counter + 1 >= argc || strncmp(argv[Counter + 1], "--", 2) == 0))
+                Value = "true"; // --key on its own
+            else if (Counter + 1 < argc)
+                Value = argv[++Counter];
+            else {
+                printf("Option '--%s' needs a value.  Try --help.\n", Name);
+                return false;
+            }
+        }
+
+        if (!SetOption(Config, Name, Value, "command line"))
+            return false;
+    }
+
+    if (Config->Mode == MODE_UNSET) {
+        printf("Choose --server or --client (or set mode in the config file).  Try --help.\n");
+        return false;
+    }
+    if (Config->PortNo == 0) {
+        printf("A --port is required.  Try --help.\n");
+        return false;
+    }
+
+    Config->Server.PortNo = Config->PortNo;
+    memcpy(Config->Server.CompressDictFile, Config->CompressDictFile, sizeof(Config->CompressDictFile));
+    return true;
+}
@@ -0,0 +1,49 @@
+/*
+Startup configuration.
+
+With no arguments the program asks for everything interactively, as it always has.  Given any arguments it takes its settings from the
+command line and an optional config file instead, and goes straight to listening / connecting without a single prompt, so it can run
+under systemd, in containers or many times over from a script.
+
+    chat --server --port 5000 --workers 4
+    chat --client --host 127.0.0.1 --port 5000
+    chat --config /etc/chat.conf --workers 8
+
+A config file holds the same options, one "key = value" per line, # starts a comment.  Command line options override the file
+wherever they appear.  Booleans take true/false, yes/no, on/off or 1/0; on the command line "--cork" alone means true and "--no-cork"
+false.  Run with --help for the full list.
+*/
+
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include "stdbool.h"
+#include "platform.h"
+#include "server.h"
+#include "frame.h"
+
+enum { MODE_UNSET, MODE_SERVER, MODE_CLIENT };
+
+typedef struct ChatConfig {
+    int Mode;
+    int PortNo; // Port to listen on / connect to.
+    char Host[MAX_HOST_LENGTH]; // Server to connect to in client mode.  Name, IPv4 or IPv6 address.
+    int ConnectTimeoutMs; // Give up connecting after this long.
+    bool bTls; // Client: connect with TLS.
+    bool bTlsVerify; // Client: check the server's certificate & name.
+    char TlsCaFile[MAX_PATH_LENGTH]; // Client: trusted certificates.  Empty = the system's.
+    char TlsSessionFile[MAX_PATH_LENGTH]; // Client: keeps the session ticket between runs so reconnects resume.
+    char Username[USER_NAME_MAX + 1]; // Client: name to log in with.  Empty = anonymous.
+    bool bCompress; // Client: ask the server to compress what it sends (see compress.h).
+    bool bTui; // Client: full screen terminal UI, the line being typed kept at the bottom (see tui.h).
+    char DownloadDirectory[MAX_PATH_LENGTH]; // Client: where files others send are saved (see transfer.h).  Empty = not saved.
+    char CompressDictFile[MAX_PATH_LENGTH]; // Either: compression dictionary, the same on both ends.  Empty = the built in one.
+    ServerConfig Server; // Server mode settings.  Its PortNo & CompressDictFile are filled in from the ones above.
+} ChatConfig;
+
+void ChatConfigDefaults(ChatConfig *Config);
+bool ChatConfigLoadFile(ChatConfig *Config, const char *Path); // Prints what's wrong & returns false on a bad file.
+bool ChatConfigParseArgs(ChatConfig *Config, int argc, char *argv[]); // Loads --config first, then applies the rest.  Exits on --help.
+void ChatConfigPrintUsage();
+
+#endif // CONFIG_H
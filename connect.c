@@ -0,0 +1,158 @@
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "stdbool.h"
+#include "platform.h"
+#include "connect.h"
+
+#define MAX_ADDRESSES 16 // Addresses tried per host.  Resolvers rarely return more, and beyond this the timeout would run out anyway.
+
+static bool ConnectInProgress() {
+    #ifdef _WIN32
+    return WSAGetLastError() == WSAEWOULDBLOCK;
+    #else
+    return errno == EINPROGRESS || errno == EINTR;
+    #endif // _WIN32
+}
+
+static int SocketErrorOf(SOCKET Socket) {
+    int Error = 0;
+    socklen_t Length = sizeof(Error);
+
+    if (getsockopt(Socket, SOL_SOCKET, SO_ERROR, (char *)&Error, &Length) == SOCKET_ERROR)
+        return LastSocketError();
+    return Error;
+}
+
+// Put the resolver's addresses in RFC 8305 order: alternate between the families, starting with the one it listed first.
+static int OrderAddresses(struct addrinfo *Results, struct addrinfo **Ordered) {
+    struct addrinfo *First[MAX_ADDRESSES];
+    struct addrinfo *Other[MAX_ADDRESSES];
+    struct addrinfo *Entry;
+    int FirstCount = 0;
+    int OtherCount = 0;
+    int Count = 0;
+    int Counter;
+
+    for (Entry = Results; Entry; Entry = Entry->ai_next) {
+        if (Entry->ai_family == Results->ai_family && FirstCount < MAX_ADDRESSES)
+            First[FirstCount++] = Entry;
+        else if (Entry->ai_family != Results->ai_family && OtherCount < MAX_ADDRESSES)
+            Other[OtherCount++] = Entry;
+    }
+
+    for (Counter = 0; Count < MAX_ADDRESSES && (Counter < FirstCount || Counter < OtherCount); Counter++) {
+        if (Counter < FirstCount)
+            Ordered[Count++] = First[Counter];
+        if (Counter < OtherCount && Count < MAX_ADDRESSES)
+            Ordered[Count++] = Other[Counter];
+    }
+    return Count;
+}
+
+SOCKET ConnectHost(const char *Host, int PortNo, int TimeoutMs) {
+    struct addrinfo Hints;
+    struct addrinfo *Results;
+    struct addrinfo *Ordered[MAX_ADDRESSES];
+    PollFd Pending[MAX_ADDRESSES]; // Attempts still in progress.
+    int PendingCount = 0;
+    int AddressCount;
+    int Next = 0; // Next address to try.
+    int LastError = 0;
+    int Error;
+    int Counter;
+    int Ready;
+    char PortText[8];
+    SOCKET Winner = INVALID_SOCKET;
+    SOCKET Attempt;
+    int64_t Now = MonotonicUs();
+    int64_t Deadline = Now + (int64_t)TimeoutMs * 1000;
+    int64_t NextAttemptUs = Now;
+    int64_t WaitUntil;
+
+    memset(&Hints, 0, sizeof(Hints));
+    Hints.ai_family = AF_UNSPEC;
+    Hints.ai_socktype = SOCK_STREAM;
+    Hints.ai_protocol = IPPROTO_TCP;
+    Hints.ai_flags = AI_ADDRCONFIG; // Don't offer IPv6 addresses to a host with no IPv6 (or vice versa).
+    snprintf(PortText, sizeof(PortText), "%d", PortNo);
+
+    Error = getaddrinfo(Host, PortText, &Hints, &Results);
+    if (Error) {
+        printf("\nERROR: UNABLE TO RESOLVE %s: %s\n", Host, gai_strerror(Error));
+        return INVALID_SOCKET;
+    }
+    AddressCount = OrderAddresses(Results, Ordered);
+
+    while (Winner == INVALID_SOCKET) {
+        Now = MonotonicUs();
+        if (Now >= Deadline) {
+            printf("\nERROR: TIMED OUT CONNECTING TO %s\n", Host);
+            break;
+        }
+
+        // Start the next attempt if it's due, or if nothing else is left running.
+        if (Next < AddressCount && (Now >= NextAttemptUs || PendingCount == 0)) {
+            struct addrinfo *Address = Ordered[Next++];
+
+            NextAttemptUs = Now + CONNECT_ATTEMPT_DELAY_MS * 1000;
+            Attempt = socket(Address->ai_family, Address->ai_socktype, Address->ai_protocol);
+            if (Attempt == INVALID_SOCKET) {
+                LastError = LastSocketError();
+                continue;
+            }
+            if (!SetNonBlocking(Attempt)) {
+                LastError = LastSocketError();
+                close(Attempt);
+                continue;
+            }
+
+            if (connect(Attempt, Address->ai_addr, (socklen_t)Address->ai_addrlen) == 0) { // Connected on the spot (e.g. loopback).
+                Winner = Attempt;
+                break;
+            }
+            if (!ConnectInProgress()) {
+                LastError = LastSocketError();
+                close(Attempt);
+                continue; // Failed outright.  Move on to the next address now rather than after the delay.
+            }
+
+            Pending[PendingCount].fd = Attempt;
+            Pending[PendingCount].events = POLLOUT;
+            Pending[PendingCount].revents = 0;
+            PendingCount++;
+        }
+
+        if (PendingCount == 0) { // Every address has been tried and failed.
+            printf("\nERROR: UNABLE TO CONNECT TO %s (error %d)\n", Host, LastError);
+            break;
+        }
+
+        WaitUntil = Next < AddressCount && NextAttemptUs < Deadline ? NextAttemptUs : Deadline;
+        Ready = poll(Pending, PendingCount, (int)((WaitUntil - Now + 999) / 1000));
+        if (Ready <= 0)
+            continue; // Timed out (time for the next attempt, or the deadline) or interrupted.
+
+        for (Counter = PendingCount - 1; Counter >= 0; Counter--) {
+            if (Pending[Counter].revents == 0)
+                continue;
+
+            Error = SocketErrorOf(Pending[Counter].fd);
+            if (Error == 0 && Winner == INVALID_SOCKET) {
+                Winner = Pending[Counter].fd;
+                Pending[Counter] = Pending[--PendingCount];
+                continue;
+            }
+            if (Error != 0) {
+                LastError = Error;
+                close(Pending[Counter].fd);
+                Pending[Counter] = Pending[--PendingCount];
+            }
+        }
+    }
+
+    for (Counter = 0; Counter < PendingCount; Counter++) // Attempts that lost the race.
+        close(Pending[Counter].fd);
+    freeaddrinfo(Results);
+    return Winner;
+}
@@ -0,0 +1,21 @@
+/*
+Outgoing connections by host name, over IPv4 or IPv6.
+
+The host is resolved with getaddrinfo and the addresses are tried Happy Eyeballs style (RFC 8305): families alternate, starting with
+whichever the resolver put first, and a new non-blocking attempt starts every CONNECT_ATTEMPT_DELAY_MS (or straight away when one
+fails) while the earlier ones keep going.  The first to connect wins and the rest are closed.  A broken IPv6 route therefore costs a
+quarter of a second instead of the kernel's whole SYN retry period, and nothing waits longer than the timeout given.
+*/
+
+#ifndef CONNECT_H
+#define CONNECT_H
+
+#include "platform.h"
+
+#define CONNECT_ATTEMPT_DELAY_MS 250 // RFC 8305's recommended Connection Attempt Delay.
+#define CONNECT_DEFAULT_TIMEOUT_MS 10000
+
+// Returns a connected, non-blocking socket, or INVALID_SOCKET after printing why not.  Winsock must already be started.
+SOCKET ConnectHost(const char *Host, int PortNo, int TimeoutMs);
+
+#endif // CONNECT_H
@@ -0,0 +1,182 @@
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "stdarg.h"
+#include "stdatomic.h"
+#include "pthread.h"
+#include "platform.h"
+#include "mpsc.h"
+#include "console.h"
+#include "tui.h"
+
+#define WRITE_BATCH_SIZE 65536 // The writer gathers lines into a buffer this big & writes each buffer with one call.
+
+typedef struct ConsoleLine {
+    MpscNode Node; // Must come first, the queue hands back MpscNode pointers.
+    size_t Length;
+    char Text[];
+} ConsoleLine;
+
+static MpscQueue Lines;
+static atomic_int QueuedLines; // Pushed but not yet written.
+static atomic_int DroppedLines;
+static bool bConsoleStarted = false;
+static pthread_mutex_t WriterLock = PTHREAD_MUTEX_INITIALIZER; // Only taken to sleep & wake the writer, never to queue a line.
+static pthread_cond_t WriterWake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t WriterIdle = PTHREAD_COND_INITIALIZER; // Signalled when the queue has been emptied, for ConsoleFlush().
+static int64_t LastFrameUs; // When the writer last drew the TUI.
+
+static void *WriteConsole(void *Unused);
+
+bool ConsoleStart() {
+    pthread_t WriterThread;
+
+    if (bConsoleStarted)
+        return true;
+
+    MpscInit(&Lines);
+    if (pthread_create(&WriterThread, NULL, WriteConsole, NULL))
+        return false;
+
+    pthread_detach(WriterThread);
+    bConsoleStarted = true;
+    return true;
+}
+
+void ConsolePrintf(const char *Format, ...) {
+    va_list Args;
+    ConsoleLine *Line;
+    int Length;
+
+    va_start(Args, Format);
+    if (!bConsoleStarted) {
+        vprintf(Format, Args);
+        va_end(Args);
+        return;
+    }
+
+    if (atomic_load_explicit(&QueuedLines, memory_order_relaxed) >= CONSOLE_MAX_QUEUED) { // Terminal can't keep up.  Drop, don't wait.
+        atomic_fetch_add_explicit(&DroppedLines, 1, memory_order_relaxed);
+        va_end(Args);
+        return;
+    }
+
+    { // Measure first so a line of any length is kept in full.
+        va_list Measure;
+        va_copy(Measure, Args);
+        Length = vsnprintf(NULL, 0, Format, Measure);
+        va_end(Measure);
+    }
+
+    Line = Length >= 0 ? malloc(sizeof(ConsoleLine) + Length + 1) : NULL;
+    if (Line == NULL) {
+        atomic_fetch_add_explicit(&DroppedLines, 1, memory_order_relaxed);
+        va_end(Args);
+        return;
+    }
+    vsnprintf(Line->Text, Length + 1, Format, Args);
+    va_end(Args);
+    Line->Length = Length;
+
+    MpscPush(&Lines, &Line->Node);
+    if (atomic_fetch_add(&QueuedLines, 1) == 0) { // The writer may be asleep.
+        pthread_mutex_lock(&WriterLock);
+        pthread_cond_signal(&WriterWake);
+        pthread_mutex_unlock(&WriterLock);
+    }
+}
+
+void ConsoleFlush() {
+    if (!bConsoleStarted)
+        return;
+
+    pthread_mutex_lock(&WriterLock);
+    while (atomic_load(&QueuedLines) > 0)
+        pthread_cond_wait(&WriterIdle, &WriterLock);
+    pthread_mutex_unlock(&WriterLock);
+}
+
+void ConsoleRedraw() {
+    if (!bConsoleStarted)
+        return;
+
+    pthread_mutex_lock(&WriterLock);
+    pthread_cond_signal(&WriterWake);
+    pthread_mutex_unlock(&WriterLock);
+}
+
+static void *WriteConsole(void *Unused) {
+    char *Batch = malloc(WRITE_BATCH_SIZE);
+    size_t BatchLength = 0;
+    MpscNode *Node;
+    ConsoleLine *Line;
+    int Pending;
+    int Taken;
+    int Dropped;
+    char Note[64];
+    int64_t WaitUs;
+    bool bTui;
+    (void)Unused;
+
+    for (;;) {
+        pthread_mutex_lock(&WriterLock);
+        while ((Pending = atomic_load(&QueuedLines)) == 0 && !TuiPending()) {
+            pthread_cond_broadcast(&WriterIdle);
+            pthread_cond_wait(&WriterWake, &WriterLock);
+        }
+        pthread_mutex_unlock(&WriterLock);
+
+        if ((bTui = TuiActive())) { // One frame per TUI_FRAME_MS at most.  Whatever comes in meanwhile is drawn with it.
+            WaitUs = LastFrameUs + TUI_FRAME_MS * 1000 - MonotonicUs();
+            if (WaitUs > 0)
+                SleepMs((int)(WaitUs / 1000) + 1);
+            Pending = atomic_load(&QueuedLines);
+        }
+
+        for (Taken = 0; Taken < Pending; ) {
+            Node = MpscPop(&Lines);
+            if (Node == NULL) { // A producer is mid push.  It has counted its line already, so it'll be there in a moment.
+                SleepMs(0);
+                continue;
+            }
+            Line = (ConsoleLine *)Node;
+            Taken++;
+            if (bTui && TuiAppend(Line->Text, Line->Length)) {
+                free(Line);
+                continue;
+            }
+
+            if (Batch && BatchLength + Line->Length > WRITE_BATCH_SIZE) {
+                fwrite(Batch, 1, BatchLength, stdout);
+                BatchLength = 0;
+            }
+            if (Batch && Line->Length <= WRITE_BATCH_SIZE) {
+                memcpy(Batch + BatchLength, Line->Text, Line->Length);
+                BatchLength += Line->Length;
+            }
+            else // Bigger than a whole batch (or no batch buffer at all).
+                fwrite(Line->Text, 1, Line->Length, stdout);
+            free(Line);
+        }
+
+        if (BatchLength)
+            fwrite(Batch, 1, BatchLength, stdout);
+        BatchLength = 0;
+
+        Dropped = atomic_exchange(&DroppedLines, 0);
+        if (Dropped) {
+            snprintf(Note, sizeof(Note), "[%d lines not shown, the console couldn't keep up]\n", Dropped);
+            if (!bTui || !TuiAppend(Note, strlen(Note)))
+                fputs(Note, stdout);
+        }
+        if (bTui) {
+            TuiRender();
+            LastFrameUs = MonotonicUs();
+        }
+        fflush(stdout);
+
+        atomic_fetch_sub(&QueuedLines, Taken); // Only now, so ConsoleFlush() doesn't return before the lines are out.
+    }
+
+    return NULL;
+}
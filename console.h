@@ -0,0 +1,27 @@
+/*
+Asynchronous console output.
+
+The chat loops never write to the terminal themselves.  ConsolePrintf() formats the line and queues it for a writer thread, which
+writes whatever has built up in one go.  A slow terminal or a full pipe therefore only ever holds up the writer thread, never the
+socket loops.  The queue is bounded: once CONSOLE_MAX_QUEUED lines are waiting, new lines are dropped and counted, and the writer
+reports how many were lost once it catches up.
+
+Until ConsoleStart() is called, ConsolePrintf() writes straight to stdout like printf.
+
+With the TUI running (see tui.h) the writer adds the lines to its scrollback instead, and draws one frame with all of them, at most every
+TUI_FRAME_MS.
+*/
+
+#ifndef CONSOLE_H
+#define CONSOLE_H
+
+#include "stdbool.h"
+
+#define CONSOLE_MAX_QUEUED 4096 // Lines waiting for the terminal before new ones are dropped.
+
+bool ConsoleStart(); // Start the writer thread if it isn't running yet.
+void ConsolePrintf(const char *Format, ...);
+void ConsoleFlush(); // Wait until everything queued so far has been written.  Call before printing to stdout directly again.
+void ConsoleRedraw(); // Wake the writer to draw the TUI, which has changed with no new line.
+
+#endif // CONSOLE_H
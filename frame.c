@@ -0,0 +1,235 @@
+#include "stdlib.h"
+#include "string.h"
+#include "frame.h"
+
+enum { STATE_LENGTH, STATE_TYPE, STATE_PAYLOAD };
+
+size_t VarintEncode(uint8_t *Out, uint64_t Value) {
+    size_t Written = 0;
+
+    while (Value >= 0x80) {
+        Out[Written++] = (uint8_t)(Value | 0x80);
+        Value >>= 7;
+    }
+    Out[Written++] = (uint8_t)Value;
+    return Written;
+}
+
+size_t VarintDecode(const uint8_t *Data, size_t Length, uint64_t *Value) {
+    uint64_t Result = 0;
+    size_t Counter;
+
+    for (Counter = 0; Counter < Length && Counter < 10; Counter++) {
+        Result |= (uint64_t)(Data[Counter] & 0x7F) << (7 * Counter);
+        if ((Data[Counter] & 0x80) == 0) {
+            *Value = Result;
+            return Counter + 1;
+        }
+    }
+    return 0;
+}
+
+static bool NameValid(const uint8_t *Name, size_t Length, size_t MaxLength) {
+    size_t Counter;
+
+    if (Length == 0 || Length > MaxLength)
+        return false;
+    for (Counter = 0; Counter < Length; Counter++) {
+        if (Name[Counter] <= ' ' || Name[Counter] >= 0x7F)
+            return false;
+    }
+    return true;
+}
+
+bool RoomNameValid(const uint8_t *Name, size_t Length) {
+    return NameValid(Name, Length, ROOM_NAME_MAX);
+}
+
+bool UserNameValid(const uint8_t *Name, size_t Length) {
+    return NameValid(Name, Length, USER_NAME_MAX);
+}
+
+bool FrameSplitRoomMessage(const uint8_t *Payload, size_t Length, const uint8_t **Room, size_t *RoomLength, const uint8_t **Text,
+                           size_t *TextLength) {
+    if (Length < 1 || (size_t)Payload[0] + 1 > Length || !RoomNameValid(Payload + 1, Payload[0]))
+        return false;
+
+    *Room = Payload + 1;
+    *RoomLength = Payload[0];
+    *Text = Payload + 1 + Payload[0];
+    *TextLength = Length - 1 - Payload[0];
+    return true;
+}
+
+size_t FrameBuildRoomMessage(uint8_t *Out, const char *Room, size_t RoomLength, const char *Text, size_t TextLength) {
+    Out[0] = (uint8_t)RoomLength;
+    memcpy(Out + 1, Room, RoomLength);
+    memcpy(Out + 1 + RoomLength, Text, TextLength);
+    return 1 + RoomLength + TextLength;
+}
+
+bool FrameSplitStream(const uint8_t *Payload, size_t Length, const uint8_t **Room, size_t *RoomLength, uint64_t *Stream,
+                      const uint8_t **Rest, size_t *RestLength) {
+    size_t StreamLength;
+
+    if (Length < 1 || (size_t)Payload[0] + 1 > Length || (Payload[0] > 0 && !RoomNameValid(Payload + 1, Payload[0]))
+        || (StreamLength = VarintDecode(Payload + 1 + Payload[0], Length - 1 - Payload[0], Stream)) == 0)
+        return false;
+
+    *Room = Payload + 1;
+    *RoomLength = Payload[0];
+    *Rest = Payload + 1 + Payload[0] + StreamLength;
+    *RestLength = Length - 1 - Payload[0] - StreamLength;
+    return true;
+}
+
+size_t FrameBuildStream(uint8_t *Out, const char *Room, size_t RoomLength, uint64_t Stream) {
+    Out[0] = (uint8_t)RoomLength;
+    memcpy(Out + 1, Room, RoomLength);
+    return 1 + RoomLength + VarintEncode(Out + 1 + RoomLength, Stream);
+}
+
+size_t FrameEncodeHeader(uint8_t *Out, uint8_t Type, size_t PayloadLength) {
+    size_t Written = VarintEncode(Out, PayloadLength);
+    Out[Written++] = Type;
+    return Written;
+}
+
+size_t FrameEncode(uint8_t *Out, uint8_t Type, const void *Payload, size_t Length) {
+    size_t HeaderLength = FrameEncodeHeader(Out, Type, Length);
+    memcpy(Out + HeaderLength, Payload, Length);
+    return HeaderLength + Length;
+}
+
+void FrameDecoderInit(FrameDecoder *Decoder, size_t MaxPayload) {
+    memset(Decoder, 0, sizeof(FrameDecoder));
+    Decoder->State = STATE_LENGTH;
+    Decoder->MaxPayload = MaxPayload;
+}
+
+void FrameDecoderFree(FrameDecoder *Decoder) {
+    free(Decoder->Buffer);
+    Decoder->Buffer = NULL;
+    Decoder->Capacity = 0;
+}
+
+// Try to take a whole frame straight out of the received bytes, skipping the copy into Buffer.  Only possible between frames.
+// Returns bytes consumed, 0 if the frame isn't all there (the slow path then takes over) or -1 on error.
+static long DecodeWholeFrame(FrameDecoder *Decoder, const uint8_t *Data, size_t Length, FrameHandler Handler, void *Context) {
+    uint64_t PayloadLength;
+    size_t HeaderLength = VarintDecode(Data, Length < 5 ? Length : 5, &PayloadLength);
+
+    if (HeaderLength == 0) // Not all of the length has arrived (or it's longer than 5 bytes, which the slow path reports).
+        return 0;
+    if (PayloadLength > Decoder->MaxPayload)
+        return -1;
+    if (Length - HeaderLength < PayloadLength + 1)
+        return 0;
+
+    if (!Handler(Context, Data[HeaderLength], Data + HeaderLength + 1, (size_t)PayloadLength))
+        return -1;
+    return (long)(HeaderLength + 1 + PayloadLength);
+}
+
+bool FrameDecoderFeed(FrameDecoder *Decoder, const uint8_t *Data, size_t Length, FrameHandler Handler, void *Context) {
+    size_t Take;
+    long Consumed;
+
+    Decoder->bPaused = false;
+    Decoder->Unread = 0;
+    while (Length > 0) {
+        if (Decoder->State == STATE_LENGTH && Decoder->Shift == 0) {
+            Consumed = DecodeWholeFrame(Decoder, Data, Length, Handler, Context);
+            if (Consumed < 0)
+                return false;
+            if (Consumed > 0) {
+                Data += Consumed;
+                Length -= (size_t)Consumed;
+                if (Decoder->bPaused)
+                    break;
+                continue;
+            }
+        }
+
+        switch (Decoder->State) {
+        case STATE_LENGTH:
+            if (Decoder->Shift > 28 || (Decoder->Shift == 28 && (*Data & 0x70))) // Must fit in 32 bits, so 5 varint bytes at most.
+                return false;
+            Decoder->Length |= (uint32_t)(*Data & 0x7F) << Decoder->Shift;
+            Decoder->Shift += 7;
+            if ((*Data & 0x80) == 0) {
+                if (Decoder->Length > Decoder->MaxPayload)
+                    return false;
+                Decoder->State = STATE_TYPE;
+            }
+            Data++;
+            Length--;
+            break;
+
+        case STATE_TYPE:
+            Decoder->Type = *Data++;
+            Length--;
+            Decoder->Have = 0;
+            Decoder->State = STATE_PAYLOAD;
+            if (Decoder->Length > Decoder->Capacity) {
+                uint8_t *NewBuffer = realloc(Decoder->Buffer, Decoder->Length);
+                if (NewBuffer == NULL)
+                    return false;
+                Decoder->Buffer = NewBuffer;
+                Decoder->Capacity = Decoder->Length;
+            }
+            break;
+
+        case STATE_PAYLOAD:
+            Take = Decoder->Length - Decoder->Have;
+            if (Take > Length)
+                Take = Length;
+            memcpy(Decoder->Buffer + Decoder->Have, Data, Take);
+            Decoder->Have += Take;
+            Data += Take;
+            Length -= Take;
+            break;
+        }
+
+        if (Decoder->State == STATE_PAYLOAD && Decoder->Have == Decoder->Length) { // Frame complete (possibly with an empty payload).
+            Decoder->State = STATE_LENGTH;
+            Decoder->Length = 0;
+            Decoder->Shift = 0;
+            if (!Handler(Context, Decoder->Type, Decoder->Have ? Decoder->Buffer : Data, Decoder->Have)) // Never NULL, even if empty.
+                return false;
+            if (Decoder->bPaused)
+                break;
+        }
+    }
+    Decoder->Unread = Length;
+    return true;
+}
+
+void FrameDecoderPause(FrameDecoder *Decoder) {
+    Decoder->bPaused = true;
+}
+
+size_t FrameDecoderPending(const FrameDecoder *Decoder, uint8_t *Out) {
+    size_t Written = 0;
+    int Shift;
+
+    switch (Decoder->State) {
+    case STATE_LENGTH: // Only part of the varint: every byte of it so far had its high bit set.
+        for (Shift = 0; Shift < Decoder->Shift; Shift += 7)
+            Out[Written++] = (uint8_t)(((Decoder->Length >> Shift) & 0x7F) | 0x80);
+        break;
+
+    case STATE_TYPE:
+        Written = VarintEncode(Out, Decoder->Length);
+        break;
+
+    case STATE_PAYLOAD:
+        Written = VarintEncode(Out, Decoder->Length);
+        Out[Written++] = Decoder->Type;
+        if (Decoder->Have > 0)
+            memcpy(Out + Written, Decoder->Buffer, Decoder->Have);
+        Written += Decoder->Have;
+        break;
+    }
+    return Written;
+}
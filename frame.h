@@ -0,0 +1,114 @@
+/*
+Wire framing.  Every message on a socket is sent as a frame:
+
+    +----------------------+-------------+------------------+
+    | payload length       | type        | payload          |
+    | varint, 1 to 5 bytes | 1 byte      | length bytes     |
+    +----------------------+-------------+------------------+
+
+The varint is little-endian base 128 (7 bits per byte, high bit set on every byte except the last).  TCP is a byte stream and recv()
+can return any slice of it, so the decoder is an incremental state machine: feed it whatever arrived and it hands back every frame
+that is now complete, keeping any partial frame until the rest turns up.
+*/
+
+#ifndef FRAME_H
+#define FRAME_H
+
+#include "stdbool.h"
+#include "stddef.h"
+#include "stdint.h"
+
+#define FRAME_HEADER_MAX 6 // Longest possible varint plus the type byte.
+#define FRAME_DEFAULT_MAX_PAYLOAD (1024 * 1024) // Frames claiming to be bigger than this are treated as a protocol error.
+
+enum FrameType {
+    FRAME_MSG = 1, // Chat message to everyone.  Payload is the text, not NUL terminated.
+    FRAME_JOIN = 2, // Client to server: join the room named by the payload.
+    FRAME_LEAVE = 3, // Client to server: leave the room named by the payload.
+    FRAME_ROOM_MSG = 4, // Chat message to one room.  Payload is the room name's length (1 byte), the room name & then the text.
+    FRAME_LOGIN = 5, // Client to server: take the user name in the payload.  Sent again to change name.
+    FRAME_USER = 6, // Server to client: varint user ID, then the name it stands for from now on.
+    FRAME_USER_GONE = 7, // Server to client: varint ID of a user who left.  The ID may be handed out again.
+    FRAME_NOTICE = 8, // Server to client: text from the server itself, e.g. why a login was refused.
+    FRAME_DIRECT = 9, // Private message.  Client to server: varint ID of who it's for, then the text.
+    FRAME_HISTORY = 10, // Client to server: varint message count, then the name of a room it's in.  Answered with its last messages.
+    FRAME_PING = 11, // Either way: are you still there?  Payload is anything.  Answered with a FRAME_PONG carrying the same payload.
+    FRAME_PONG = 12,
+    FRAME_COMPRESS = 13, // Client to server: varint ID of its compression dictionary (see compress.h).  Answered with the same ID if the
+                         // server agrees to send FRAME_PACKED from then on, empty if it won't.
+    FRAME_PACKED = 14, // Server to client: the type of the frame it stands for (1 byte), that frame's payload length (varint), then the
+                       // payload deflated with the dictionary.
+
+    // A file, streamed to a room or everyone.  Each of these starts with the room name's length (1 byte) & the room name, empty for
+    // everyone, then the varint stream ID its sender picked, and is relayed as it came, like FRAME_ROOM_MSG.
+    FRAME_FILE = 15, // Offer: then the varint file size & the file name.
+    FRAME_CHUNK = 16, // Then the varint offset of the data in the file & the data.  Not sent on to clients already behind, see server.h.
+    FRAME_FILE_END = 17 // All sent.  Or, if anything follows, why the rest never will be.
+};
+
+// Names are only sent once, in FRAME_USER.  Everything a user says reaches other clients with a varint ID in front of the payload
+// they sent: FRAME_MSG, FRAME_ROOM_MSG & FRAME_DIRECT from the server all start with the sender's ID.  USER_NONE means the server
+// operator or a client that hasn't logged in.
+#define USER_NONE 0
+
+#define ROOM_NAME_MAX 64
+#define USER_NAME_MAX 32
+
+bool RoomNameValid(const uint8_t *Name, size_t Length); // 1 to ROOM_NAME_MAX printable characters, no spaces.
+bool UserNameValid(const uint8_t *Name, size_t Length); // Same rules, 1 to USER_NAME_MAX characters.
+
+// Pick a FRAME_ROOM_MSG payload apart.  Returns false if it's malformed or the room name isn't valid.
+bool FrameSplitRoomMessage(const uint8_t *Payload, size_t Length, const uint8_t **Room, size_t *RoomLength, const uint8_t **Text,
+                           size_t *TextLength);
+
+// Pick apart the start shared by FRAME_FILE, FRAME_CHUNK & FRAME_FILE_END.  Room is left empty for everyone.  Returns false if it's
+// malformed.
+bool FrameSplitStream(const uint8_t *Payload, size_t Length, const uint8_t **Room, size_t *RoomLength, uint64_t *Stream,
+                      const uint8_t **Rest, size_t *RestLength);
+
+// Build the start of one of those.  Out needs room for 11 + RoomLength bytes.  Returns its size.
+size_t FrameBuildStream(uint8_t *Out, const char *Room, size_t RoomLength, uint64_t Stream);
+
+// Build a FRAME_ROOM_MSG payload.  Out needs room for 1 + RoomLength + TextLength bytes.  Returns the payload size.
+size_t FrameBuildRoomMessage(uint8_t *Out, const char *Room, size_t RoomLength, const char *Text, size_t TextLength);
+
+size_t VarintEncode(uint8_t *Out, uint64_t Value); // Out needs room for 10 bytes.  Returns bytes written.
+size_t VarintDecode(const uint8_t *Data, size_t Length, uint64_t *Value); // Returns bytes read or 0 if Data doesn't hold a whole varint.
+
+// Write a frame header for a payload of PayloadLength bytes.  Returns the number of header bytes (at most FRAME_HEADER_MAX).
+size_t FrameEncodeHeader(uint8_t *Out, uint8_t Type, size_t PayloadLength);
+
+// Write a whole frame.  Out needs room for FRAME_HEADER_MAX + Length bytes.  Returns the frame size.
+size_t FrameEncode(uint8_t *Out, uint8_t Type, const void *Payload, size_t Length);
+
+// Called once per complete frame.  Payload is only valid during the call.  Return false to stop decoding (e.g. the connection was dropped).
+typedef bool (*FrameHandler)(void *Context, uint8_t Type, const uint8_t *Payload, size_t Length);
+
+typedef struct FrameDecoder {
+    int State; // Which part of the frame the next byte belongs to.
+    uint32_t Length; // Payload length, built up one varint byte at a time.
+    int Shift;
+    uint8_t Type;
+    uint8_t *Buffer; // Holds a payload that arrived split over several recv() calls.
+    size_t Capacity;
+    size_t Have; // Payload bytes collected so far.
+    size_t MaxPayload;
+    bool bPaused; // See FrameDecoderPause().
+    size_t Unread; // Bytes the last FrameDecoderFeed() left alone because of a pause.
+} FrameDecoder;
+
+void FrameDecoderInit(FrameDecoder *Decoder, size_t MaxPayload);
+void FrameDecoderFree(FrameDecoder *Decoder);
+
+// Feed received bytes.  Calls Handler for each frame completed by them.  Returns false on a malformed or oversized frame, or if Handler
+// asked to stop.  After a false return the stream can't be trusted any more and the connection should be closed.
+bool FrameDecoderFeed(FrameDecoder *Decoder, const uint8_t *Data, size_t Length, FrameHandler Handler, void *Context);
+
+// From a Handler: FrameDecoderFeed() returns true straight after this frame, with what it didn't get to in Unread, to be fed later.
+void FrameDecoderPause(FrameDecoder *Decoder);
+
+// The bytes of the frame it's in the middle of, as they came in, so they can be fed to another decoder.  Out needs room for
+// FRAME_HEADER_MAX + Have bytes.  Returns how many (0 between frames).
+size_t FrameDecoderPending(const FrameDecoder *Decoder, uint8_t *Out);
+
+#endif // FRAME_H
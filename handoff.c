@@ -0,0 +1,263 @@
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "stdatomic.h"
+#include "pthread.h"
+#include "handoff.h"
+
+#ifndef _WIN32
+
+#include <sys/un.h>
+
+#define HEADER_BYTES 6
+#define LISTEN_TICK_MS 100 // How often the handoff thread looks to see if it should stop.
+
+static SOCKET Listener = INVALID_SOCKET;
+static atomic_int Accepted = INVALID_SOCKET; // Set by the handoff thread.
+static char ListenPath[MAX_PATH_LENGTH];
+static HandoffRequested OnRequested;
+static pthread_t Thread;
+static bool bThreadRunning;
+static atomic_bool bStopping;
+
+static bool FillAddress(struct sockaddr_un *Address, const char *Path) {
+    memset(Address, 0, sizeof(struct sockaddr_un));
+    Address->sun_family = AF_UNIX;
+    if (strlen(Path) >= sizeof(Address->sun_path))
+        return false;
+    strcpy(Address->sun_path, Path);
+    return true;
+}
+
+SOCKET HandoffConnect(const char *Path) {
+    struct sockaddr_un Address;
+    struct timeval Timeout;
+    SOCKET Link;
+
+    if (!FillAddress(&Address, Path) || (Link = socket(AF_UNIX, SOCK_STREAM, 0)) == INVALID_SOCKET)
+        return INVALID_SOCKET;
+    if (connect(Link, (struct sockaddr *)&Address, sizeof(Address)) != 0) { // Nobody there (or only a stale socket file).
+        close(Link);
+        return INVALID_SOCKET;
+    }
+    Timeout.tv_sec = HANDOFF_TIMEOUT_MS / 1000;
+    Timeout.tv_usec = HANDOFF_TIMEOUT_MS % 1000 * 1000;
+    setsockopt(Link, SOL_SOCKET, SO_RCVTIMEO, &Timeout, sizeof(Timeout));
+    return Link;
+}
+
+static void *HandoffMain(void *Arg) {
+    PollFd Waiting;
+    SOCKET Link;
+    int Flags;
+
+    (void)Arg;
+    while (!atomic_load(&bStopping)) {
+        Waiting.fd = Listener;
+        Waiting.events = POLLIN;
+        Waiting.revents = 0;
+        if (poll(&Waiting, 1, LISTEN_TICK_MS) <= 0 || (Link = accept(Listener, NULL, NULL)) == INVALID_SOCKET)
+            continue;
+
+        if ((Flags = fcntl(Link, F_GETFL, 0)) != -1) // The listener is non-blocking.  Some platforms pass that on.
+            fcntl(Link, F_SETFL, Flags & ~O_NONBLOCK);
+        close(Listener); // Only one server takes over.  The next one listens here once it has.
+        Listener = INVALID_SOCKET;
+        unlink(ListenPath);
+        atomic_store(&Accepted, Link);
+        OnRequested();
+        break;
+    }
+    return NULL;
+}
+
+bool HandoffListen(const char *Path, HandoffRequested Requested) {
+    struct sockaddr_un Address;
+
+    if (!FillAddress(&Address, Path)) {
+        printf("ERROR: the handoff socket path %s is too long!\n", Path);
+        return false;
+    }
+    unlink(Path); // Whoever was listening here has already handed over, or died without cleaning up.
+    Listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (Listener == INVALID_SOCKET || bind(Listener, (struct sockaddr *)&Address, sizeof(Address)) != 0 || listen(Listener, 1) != 0
+        || !SetNonBlocking(Listener)) {
+        printf("ERROR: unable to listen for a new server on %s!\n", Path);
+        if (Listener != INVALID_SOCKET)
+            close(Listener);
+        Listener = INVALID_SOCKET;
+        return false;
+    }
+
+    strcpy(ListenPath, Path);
+    OnRequested = Requested;
+    atomic_store(&bStopping, false);
+    if (pthread_create(&Thread, NULL, HandoffMain, NULL)) {
+        printf("ERROR: unable to start the handoff thread!\n");
+        close(Listener);
+        Listener = INVALID_SOCKET;
+        unlink(Path);
+        return false;
+    }
+    bThreadRunning = true;
+    return true;
+}
+
+SOCKET HandoffAccepted() {
+    return atomic_load(&Accepted);
+}
+
+void HandoffStop() {
+    if (bThreadRunning) {
+        atomic_store(&bStopping, true);
+        pthread_join(Thread, NULL);
+        bThreadRunning = false;
+    }
+    if (Listener != INVALID_SOCKET) { // Nobody took over.
+        close(Listener);
+        Listener = INVALID_SOCKET;
+        unlink(ListenPath);
+    }
+}
+
+void HandoffFinish() {
+    SOCKET Link = atomic_load(&Accepted);
+
+    HandoffStop();
+    if (Link != INVALID_SOCKET) {
+        HandoffSend(Link, HANDOFF_DONE, NULL, 0, NULL, 0);
+        close(Link);
+        atomic_store(&Accepted, INVALID_SOCKET);
+    }
+}
+
+bool HandoffSend(SOCKET Link, uint8_t Type, const uint8_t *Payload, size_t Length, const SOCKET *Sockets, int Count) {
+    uint8_t Header[HEADER_BYTES];
+    union {
+        struct cmsghdr Align;
+        char Space[CMSG_SPACE(sizeof(int) * HANDOFF_SOCKETS_MAX)];
+    } Control;
+    struct msghdr Record;
+    struct iovec Vector;
+    struct cmsghdr *Attached;
+    size_t Sent;
+    ssize_t Result;
+
+    if (Length > UINT32_MAX || Count > HANDOFF_SOCKETS_MAX)
+        return false;
+    Header[0] = (uint8_t)Length;
+    Header[1] = (uint8_t)(Length >> 8);
+    Header[2] = (uint8_t)(Length >> 16);
+    Header[3] = (uint8_t)(Length >> 24);
+    Header[4] = Type;
+    Header[5] = (uint8_t)Count;
+
+    memset(&Record, 0, sizeof(Record));
+    Vector.iov_base = Header;
+    Vector.iov_len = HEADER_BYTES;
+    Record.msg_iov = &Vector;
+    Record.msg_iovlen = 1;
+    if (Count > 0) {
+        memset(&Control, 0, sizeof(Control));
+        Record.msg_control = Control.Space;
+        Record.msg_controllen = CMSG_SPACE(sizeof(int) * Count);
+        Attached = CMSG_FIRSTHDR(&Record);
+        Attached->cmsg_level = SOL_SOCKET;
+        Attached->cmsg_type = SCM_RIGHTS;
+        Attached->cmsg_len = CMSG_LEN(sizeof(int) * Count);
+        memcpy(CMSG_DATA(Attached), Sockets, sizeof(int) * Count);
+    }
+    if (sendmsg(Link, &Record, 0) != HEADER_BYTES)
+        return false;
+
+    for (Sent = 0; Sent < Length; Sent += (size_t)Result) {
+        if ((Result = send(Link, Payload + Sent, Length - Sent, 0)) <= 0)
+            return false;
+    }
+    return true;
+}
+
+// Read exactly Length bytes.
+static bool ReceiveAll(SOCKET Link, uint8_t *Data, size_t Length) {
+    size_t Have;
+    ssize_t Result;
+
+    for (Have = 0; Have < Length; Have += (size_t)Result) {
+        if ((Result = recv(Link, Data + Have, Length - Have, 0)) <= 0)
+            return false;
+    }
+    return true;
+}
+
+bool HandoffReceive(SOCKET Link, uint8_t *Type, uint8_t **Payload, size_t *Length, SOCKET *Sockets, int *Count) {
+    uint8_t Header[HEADER_BYTES];
+    union {
+        struct cmsghdr Align;
+        char Space[CMSG_SPACE(sizeof(int) * HANDOFF_SOCKETS_MAX)];
+    } Control;
+    struct msghdr Record;
+    struct iovec Vector;
+    struct cmsghdr *Attached;
+    ssize_t Result;
+    int Counter;
+
+    *Count = 0;
+    *Payload = NULL;
+    memset(&Record, 0, sizeof(Record));
+    Vector.iov_base = Header;
+    Vector.iov_len = HEADER_BYTES;
+    Record.msg_iov = &Vector;
+    Record.msg_iovlen = 1;
+    Record.msg_control = Control.Space;
+    Record.msg_controllen = sizeof(Control.Space);
+    if ((Result = recvmsg(Link, &Record, 0)) <= 0)
+        return false;
+
+    // The sockets come with the first byte of the header, and the kernel never reads past them into the next record's.
+    for (Attached = CMSG_FIRSTHDR(&Record); Attached != NULL; Attached = CMSG_NXTHDR(&Record, Attached)) {
+        if (Attached->cmsg_level != SOL_SOCKET || Attached->cmsg_type != SCM_RIGHTS)
+            continue;
+        for (Counter = 0; Counter < (int)((Attached->cmsg_len - CMSG_LEN(0)) / sizeof(int)); Counter++) {
+            if (*Count < HANDOFF_SOCKETS_MAX)
+                memcpy(&Sockets[(*Count)++], CMSG_DATA(Attached) + Counter * sizeof(int), sizeof(int));
+        }
+    }
+
+    if ((Record.msg_flags & MSG_CTRUNC) || !ReceiveAll(Link, Header + Result, HEADER_BYTES - (size_t)Result) || Header[5] != *Count)
+        goto Failed;
+    *Type = Header[4];
+    *Length = (size_t)Header[0] | (size_t)Header[1] << 8 | (size_t)Header[2] << 16 | (size_t)Header[3] << 24;
+    if ((*Payload = malloc(*Length ? *Length : 1)) == NULL || !ReceiveAll(Link, *Payload, *Length))
+        goto Failed;
+    return true;
+
+Failed:
+    for (Counter = 0; Counter < *Count; Counter++)
+        close(Sockets[Counter]);
+    *Count = 0;
+    free(*Payload);
+    *Payload = NULL;
+    return false;
+}
+
+#else // _WIN32
+
+SOCKET HandoffConnect(const char *Path) {
+    (void)Path;
+    return INVALID_SOCKET;
+}
+
+bool HandoffListen(const char *Path, HandoffRequested Requested) {
+    (void)Path;
+    (void)Requested;
+    printf("ERROR: handing over to a new server needs Unix domain sockets, which this platform doesn't pass sockets over!\n");
+    return false;
+}
+
+SOCKET HandoffAccepted() { return INVALID_SOCKET; }
+void HandoffStop() {}
+void HandoffFinish() {}
+bool HandoffSend(SOCKET Link, uint8_t Type, const uint8_t *Payload, size_t Length, const SOCKET *Sockets, int Count) { (void)Link; (void)Type; (void)Payload; (void)Length; (void)Sockets; (void)Count; return false; }
+bool HandoffReceive(SOCKET Link, uint8_t *Type, uint8_t **Payload, size_t *Length, SOCKET *Sockets, int *Count) { (void)Link; (void)Type; (void)Payload; (void)Length; (void)Sockets; (void)Count; return false; }
+
+#endif // _WIN32
@@ -0,0 +1,62 @@
+/*
+Hot restart: a running server handing its connections over to the one replacing it, so a deploy drops nobody.
+
+Start every server with the same --handoff PATH.  A server starting up first tries to connect to the Unix domain socket at PATH.  If
+an older server is listening there, it hands over, as SCM_RIGHTS messages on that one connection:
+
+- its listen sockets first, so connections keep queuing on them throughout and none is refused;
+- then each client's socket, with what it takes to carry on: its user name & ID, the rooms it's in, whether it asked for compression,
+  whatever it had sent that hadn't been decoded yet, and whatever it was owed that hadn't been sent yet.
+
+Before that, the old server stops accepting and stops reading from its clients, then sends them what it already had queued for them,
+for HANDOFF_DRAIN_MS at most.  Afterwards it shuts down as usual, which only closes its own copies of the sockets, lets go of its log,
+cluster & metrics ports, says it's done and exits.  Only then does the new server open those and start serving, where the old one left
+off.  Either way the new one then listens on PATH itself, for the next restart.
+
+What can't be handed over is closed, and those clients reconnect as if the server had restarted the old way: TLS connections, whose
+state lives inside OpenSSL (so they resume their sessions), and on io_uring, clients with a send still in flight once the time is up.
+The new server tells everyone those have gone.  Messages from other cluster nodes that arrive during the handover are missed.  Not on
+windows.
+
+Each record is a 6 byte header: the payload length (4 bytes, little endian), the record type & the number of sockets that come with it,
+attached to the header.  Then the payload.
+*/
+
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include "stdbool.h"
+#include "stddef.h"
+#include "stdint.h"
+#include "platform.h"
+
+#define HANDOFF_DRAIN_MS 2000
+#define HANDOFF_SOCKETS_MAX 64 // Sockets passed in one record.
+#define HANDOFF_TIMEOUT_MS 30000 // The new server gives up on an old one that goes quiet for this long.
+
+enum {
+    HANDOFF_LISTEN = 1, // Some of the old server's listen sockets.  No payload.
+    HANDOFF_CLIENT = 2, // One client's socket & its state (see server.c's SaveClient()).
+    HANDOFF_GONE = 3, // FRAME_USER_GONE frames for the users whose clients were closed instead.
+    HANDOFF_DONE = 4 // The old server has let go of everything else.  No payload.
+};
+
+typedef void (*HandoffRequested)(); // Called on the handoff thread.
+
+// A new server starting: connect to the old one's handoff socket, to ask it to hand over.  INVALID_SOCKET if no server is listening
+// there.
+SOCKET HandoffConnect(const char *Path);
+
+// Wait for the next server on Path, on a thread of its own, and call Requested once one connects.  Prints why & returns false if it
+// can't listen.  A socket file left at Path by a server that didn't shut down cleanly is replaced.
+bool HandoffListen(const char *Path, HandoffRequested Requested);
+SOCKET HandoffAccepted(); // The new server's connection, once Requested has been called.  INVALID_SOCKET before.
+void HandoffStop(); // Stop waiting.  Requested is never called after this returns.
+void HandoffFinish(); // Tell the new server, if there is one, that everything else is let go of (HANDOFF_DONE).
+
+// One record, blocking.  Sockets are duplicated into the receiving process, the sender's copies stay open.
+bool HandoffSend(SOCKET Link, uint8_t Type, const uint8_t *Payload, size_t Length, const SOCKET *Sockets, int Count);
+// The next record.  *Payload is malloc'd (free it), and Sockets needs room for HANDOFF_SOCKETS_MAX.  False if the link failed.
+bool HandoffReceive(SOCKET Link, uint8_t *Type, uint8_t **Payload, size_t *Length, SOCKET *Sockets, int *Count);
+
+#endif // HANDOFF_H
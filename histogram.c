@@ -0,0 +1,105 @@
+#include "string.h"
+#include "histogram.h"
+
+#define HALF_BUCKETS (HISTOGRAM_SUB_BUCKETS / 2)
+#define SUB_BUCKET_BITS 5 // log2(HISTOGRAM_SUB_BUCKETS)
+
+static int HighestBit(uint64_t Value) {
+    #if defined(__GNUC__) || defined(__clang__)
+    return 63 - __builtin_clzll(Value);
+    #else
+    int Bit = 0;
+    while (Value >>= 1)
+        Bit++;
+    return Bit;
+    #endif
+}
+
+static int BucketIndex(uint64_t Value) {
+    int Shift;
+
+    if (Value < HISTOGRAM_SUB_BUCKETS)
+        return (int)Value;
+
+    Shift = HighestBit(Value) - (SUB_BUCKET_BITS - 1); // Keeps the top 5 bits, so Value >> Shift is in [16, 32).
+    return HISTOGRAM_SUB_BUCKETS + (Shift - 1) * HALF_BUCKETS + (int)((Value >> Shift) - HALF_BUCKETS);
+}
+
+// Largest value that lands in bucket Index.
+static int64_t BucketTop(int Index) {
+    int Shift;
+    uint64_t Sub;
+
+    if (Index < HISTOGRAM_SUB_BUCKETS)
+        return Index;
+
+    Shift = (Index - HISTOGRAM_SUB_BUCKETS) / HALF_BUCKETS + 1;
+    Sub = (Index - HISTOGRAM_SUB_BUCKETS) % HALF_BUCKETS + HALF_BUCKETS;
+    return (int64_t)(((Sub + 1) << Shift) - 1);
+}
+
+void HistogramInit(Histogram *H) {
+    memset(H, 0, sizeof(Histogram));
+    H->Min = INT64_MAX;
+}
+
+void HistogramRecord(Histogram *H, int64_t Value) {
+    if (Value < 0)
+        Value = 0;
+
+    H->Counts[BucketIndex((uint64_t)Value)]++;
+    H->Total++;
+    H->Sum += (double)Value;
+    if (Value < H->Min)
+        H->Min = Value;
+    if (Value > H->Max)
+        H->Max = Value;
+}
+
+void HistogramMerge(Histogram *Into, const Histogram *From) {
+    int Counter;
+
+    for (Counter = 0; Counter < HISTOGRAM_BUCKETS; Counter++)
+        Into->Counts[Counter] += From->Counts[Counter];
+    Into->Total += From->Total;
+    Into->Sum += From->Sum;
+    if (From->Min < Into->Min)
+        Into->Min = From->Min;
+    if (From->Max > Into->Max)
+        Into->Max = From->Max;
+}
+
+int64_t HistogramPercentile(const Histogram *H, double Percentile) {
+    uint64_t Wanted;
+    uint64_t Seen = 0;
+    int Counter;
+
+    if (H->Total == 0)
+        return 0;
+
+    Wanted = (uint64_t)(Percentile / 100.0 * (double)H->Total + 0.5); // Rank of the value asked for.
+    if (Wanted < 1)
+        Wanted = 1;
+    if (Wanted > H->Total)
+        Wanted = H->Total;
+
+    for (Counter = 0; Counter < HISTOGRAM_BUCKETS; Counter++) {
+        Seen += H->Counts[Counter];
+        if (Seen >= Wanted)
+            return BucketTop(Counter) < H->Max ? BucketTop(Counter) : H->Max;
+    }
+    return H->Max;
+}
+
+double HistogramMean(const Histogram *H) {
+    return H->Total ? H->Sum / (double)H->Total : 0.0;
+}
+
+uint64_t HistogramCountAtOrBelow(const Histogram *H, int64_t Value) {
+    uint64_t Count = 0;
+    int Counter;
+
+    for (Counter = 0; Counter < HISTOGRAM_BUCKETS && BucketTop(Counter) <= Value; Counter++)
+        Count += H->Counts[Counter];
+    return Count;
+}
@@ -0,0 +1,34 @@
+/*
+Latency histogram with HDR style log-linear buckets.
+
+Values below HISTOGRAM_SUB_BUCKETS are counted exactly.  Above that, every power of two range is split into HISTOGRAM_SUB_BUCKETS / 2
+equal buckets, so any value is recorded to within about 6% of itself whatever its size, in a fixed 8 KiB table with no allocation.
+Recording is a couple of shifts and an increment, cheap enough for every message on the hot path.
+
+A histogram belongs to one thread.  Give each thread its own and merge them for reporting.
+*/
+
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include "stdint.h"
+
+#define HISTOGRAM_SUB_BUCKETS 32
+#define HISTOGRAM_BUCKETS (HISTOGRAM_SUB_BUCKETS + 59 * (HISTOGRAM_SUB_BUCKETS / 2)) // Covers every non-negative int64_t.
+
+typedef struct Histogram {
+    uint64_t Counts[HISTOGRAM_BUCKETS];
+    uint64_t Total; // Values recorded.
+    int64_t Min;
+    int64_t Max;
+    double Sum;
+} Histogram;
+
+void HistogramInit(Histogram *H);
+void HistogramRecord(Histogram *H, int64_t Value); // Negative values are recorded as 0.
+void HistogramMerge(Histogram *Into, const Histogram *From);
+int64_t HistogramPercentile(const Histogram *H, double Percentile); // e.g. 99.9.  The top of the bucket the value fell in, 0 if empty.
+double HistogramMean(const Histogram *H);
+uint64_t HistogramCountAtOrBelow(const Histogram *H, int64_t Value); // Values in buckets whose top is Value or less.
+
+#endif // HISTOGRAM_H
@@ -0,0 +1,276 @@
+#include "stdlib.h"
+#include "string.h"
+#include "pthread.h"
+#include "frame.h"
+#include "history.h"
+
+#define STRIPE_BITS 6
+#define STRIPE_COUNT (1 << STRIPE_BITS) // Rooms hash to a stripe, so two workers only contend when their rooms share one.
+#define IDLE_PER_STRIPE 16 // Histories of rooms nobody is in, kept for reconnecting clients.
+#define INITIAL_SLOTS 16
+
+typedef struct RoomHistory {
+    char Name[ROOM_NAME_MAX];
+    size_t NameLength;
+    uint32_t Hash;
+    int OpenCount; // Workers with members in the room.
+    uint64_t LastUsed; // Stripe clock when it was last sent to or closed, to pick the idle history to throw away.
+    size_t Bytes; // In the ring.
+    int Head; // Oldest message.
+    int Count;
+    HistoryEntry Ring[]; // MaxMessages slots.
+} RoomHistory;
+
+typedef struct HistoryStripe {
+    pthread_mutex_t Lock;
+    RoomHistory **Slots; // Open addressing, NULL = empty.  Capacity is a power of two, kept under 3/4 full.
+    size_t Capacity;
+    size_t Count;
+    int IdleCount;
+    uint64_t Clock;
+} HistoryStripe;
+
+static HistoryStripe Stripes[STRIPE_COUNT];
+static pthread_once_t StripesCreated = PTHREAD_ONCE_INIT;
+static int MaxMessages;
+static size_t MaxBytes;
+
+static void CreateStripes() {
+    int Counter;
+    for (Counter = 0; Counter < STRIPE_COUNT; Counter++)
+        pthread_mutex_init(&Stripes[Counter].Lock, NULL);
+}
+
+void HistoryConfigure(int Messages, size_t Bytes) {
+    pthread_once(&StripesCreated, CreateStripes);
+    MaxMessages = Messages;
+    MaxBytes = Bytes;
+}
+
+static HistoryStripe *StripeOf(uint32_t Hash) {
+    return &Stripes[Hash >> (32 - STRIPE_BITS)]; // Top bits.  The low ones pick the slot within the stripe.
+}
+
+// Slot holding the room's history, or the empty slot where it would go.
+static size_t Probe(const HistoryStripe *Stripe, const uint8_t *Name, size_t Length, uint32_t Hash) {
+    size_t Mask = Stripe->Capacity - 1;
+    size_t Index = Hash & Mask;
+    RoomHistory *Candidate;
+
+    while ((Candidate = Stripe->Slots[Index]) != NULL) {
+        if (Candidate->Hash == Hash && Candidate->NameLength == Length && memcmp(Candidate->Name, Name, Length) == 0)
+            break;
+        Index = (Index + 1) & Mask;
+    }
+    return Index;
+}
+
+static RoomHistory *Find(const HistoryStripe *Stripe, const uint8_t *Name, size_t Length, uint32_t Hash) {
+    if (Stripe->Count == 0)
+        return NULL;
+    return Stripe->Slots[Probe(Stripe, Name, Length, Hash)];
+}
+
+static bool Grow(HistoryStripe *Stripe) {
+    size_t NewCapacity = Stripe->Capacity ? Stripe->Capacity * 2 : INITIAL_SLOTS;
+    RoomHistory **NewSlots = calloc(NewCapacity, sizeof(RoomHistory *));
+    RoomHistory **OldSlots = Stripe->Slots;
+    size_t OldCapacity = Stripe->Capacity;
+    size_t Counter;
+
+    if (NewSlots == NULL)
+        return false;
+
+    Stripe->Slots = NewSlots;
+    Stripe->Capacity = NewCapacity;
+    for (Counter = 0; Counter < OldCapacity; Counter++) {
+        if (OldSlots[Counter])
+            NewSlots[Probe(Stripe, (const uint8_t *)OldSlots[Counter]->Name, OldSlots[Counter]->NameLength, OldSlots[Counter]->Hash)] = OldSlots[Counter];
+    }
+    free(OldSlots);
+    return true;
+}
+
+static void FreeHistory(RoomHistory *Gone) {
+    while (Gone->Count > 0) {
+        MessageRelease(Gone->Ring[Gone->Head].Shared);
+        Gone->Head = (Gone->Head + 1) % MaxMessages;
+        Gone->Count--;
+    }
+    free(Gone);
+}
+
+// Backward-shift deletion, as in rooms.c.
+static void RemoveSlot(HistoryStripe *Stripe, size_t Index) {
+    size_t Mask = Stripe->Capacity - 1;
+    size_t Next = Index;
+    size_t Home;
+
+    FreeHistory(Stripe->Slots[Index]);
+    Stripe->Slots[Index] = NULL;
+    Stripe->Count--;
+
+    for (;;) {
+        Next = (Next + 1) & Mask;
+        if (Stripe->Slots[Next] == NULL)
+            return;
+
+        Home = Stripe->Slots[Next]->Hash & Mask;
+        if (((Next - Home) & Mask) >= ((Next - Index) & Mask)) {
+            Stripe->Slots[Index] = Stripe->Slots[Next];
+            Stripe->Slots[Next] = NULL;
+            Index = Next;
+        }
+    }
+}
+
+// Too many idle histories: throw away the one nobody has used for longest.  Rare, so a scan of the stripe is fine.
+static void EvictIdle(HistoryStripe *Stripe) {
+    size_t Oldest = 0;
+    bool bFound = false;
+    size_t Counter;
+
+    for (Counter = 0; Counter < Stripe->Capacity; Counter++) {
+        RoomHistory *Candidate = Stripe->Slots[Counter];
+        if (Candidate && Candidate->OpenCount == 0 && (!bFound || Candidate->LastUsed < Stripe->Slots[Oldest]->LastUsed)) {
+            Oldest = Counter;
+            bFound = true;
+        }
+    }
+    if (bFound) {
+        RemoveSlot(Stripe, Oldest);
+        Stripe->IdleCount--;
+    }
+}
+
+void HistoryRoomOpened(const uint8_t *Name, size_t Length, uint32_t Hash) {
+    HistoryStripe *Stripe = StripeOf(Hash);
+    RoomHistory *Opened;
+
+    if (MaxMessages == 0)
+        return;
+
+    pthread_mutex_lock(&Stripe->Lock);
+    Opened = Find(Stripe, Name, Length, Hash);
+    if (Opened != NULL && Opened->OpenCount++ == 0)
+        Stripe->IdleCount--;
+    else if (Opened == NULL && ((Stripe->Count + 1) * 4 <= Stripe->Capacity * 3 || Grow(Stripe))) {
+        Opened = calloc(1, sizeof(RoomHistory) + MaxMessages * sizeof(Message *)); // Without a history the room just has none.
+        if (Opened != NULL) {
+            memcpy(Opened->Name, Name, Length);
+            Opened->NameLength = Length;
+            Opened->Hash = Hash;
+            Opened->OpenCount = 1;
+            Stripe->Slots[Probe(Stripe, Name, Length, Hash)] = Opened;
+            Stripe->Count++;
+        }
+    }
+    pthread_mutex_unlock(&Stripe->Lock);
+}
+
+void HistoryRoomClosed(const uint8_t *Name, size_t Length, uint32_t Hash) {
+    HistoryStripe *Stripe = StripeOf(Hash);
+    RoomHistory *Closed;
+
+    if (MaxMessages == 0)
+        return;
+
+    pthread_mutex_lock(&Stripe->Lock);
+    Closed = Find(Stripe, Name, Length, Hash);
+    if (Closed != NULL && --Closed->OpenCount == 0) {
+        Closed->LastUsed = ++Stripe->Clock;
+        if (++Stripe->IdleCount > IDLE_PER_STRIPE)
+            EvictIdle(Stripe);
+    }
+    pthread_mutex_unlock(&Stripe->Lock);
+}
+
+void HistoryRecord(const uint8_t *Name, size_t Length, uint32_t Hash, Message *Shared, uint32_t Sender, uint32_t Generation) {
+    HistoryStripe *Stripe = StripeOf(Hash);
+    RoomHistory *Target;
+    HistoryEntry *Slot;
+
+    if (MaxMessages == 0 || Shared->Length > MaxBytes)
+        return;
+
+    pthread_mutex_lock(&Stripe->Lock);
+    Target = Find(Stripe, Name, Length, Hash);
+    if (Target != NULL) {
+        while (Target->Count == MaxMessages || Target->Bytes + Shared->Length > MaxBytes) { // Make room, oldest first.
+            Target->Bytes -= Target->Ring[Target->Head].Shared->Length;
+            MessageRelease(Target->Ring[Target->Head].Shared);
+            Target->Head = (Target->Head + 1) % MaxMessages;
+            Target->Count--;
+        }
+        Slot = &Target->Ring[(Target->Head + Target->Count++) % MaxMessages];
+        Slot->Shared = MessageRetain(Shared);
+        Slot->Sender = Sender;
+        Slot->Generation = Generation;
+        Target->Bytes += Shared->Length;
+        Target->LastUsed = ++Stripe->Clock;
+    }
+    pthread_mutex_unlock(&Stripe->Lock);
+}
+
+void HistoryRestore(const uint8_t *Name, size_t Length, uint32_t Hash, Message *Shared) {
+    HistoryStripe *Stripe = StripeOf(Hash);
+    bool bMissing;
+
+    if (MaxMessages == 0)
+        return;
+
+    pthread_mutex_lock(&Stripe->Lock);
+    bMissing = Find(Stripe, Name, Length, Hash) == NULL;
+    pthread_mutex_unlock(&Stripe->Lock);
+
+    if (bMissing) { // Opened & closed straight away, so it starts out idle like any room nobody is in.
+        HistoryRoomOpened(Name, Length, Hash);
+        HistoryRoomClosed(Name, Length, Hash);
+    }
+    HistoryRecord(Name, Length, Hash, Shared, USER_NONE, 0);
+}
+
+int HistorySnapshot(const uint8_t *Name, size_t Length, uint32_t Hash, HistoryEntry *Out, int Max) {
+    HistoryStripe *Stripe = StripeOf(Hash);
+    RoomHistory *Source;
+    int Taken = 0;
+    int Counter;
+
+    if (MaxMessages == 0)
+        return 0;
+
+    pthread_mutex_lock(&Stripe->Lock);
+    Source = Find(Stripe, Name, Length, Hash);
+    if (Source != NULL) {
+        Taken = Source->Count < Max ? Source->Count : Max; // The newest ones.
+        for (Counter = 0; Counter < Taken; Counter++) { // Just a reference each.  The bytes are shared, not copied.
+            Out[Counter] = Source->Ring[(Source->Head + Source->Count - Taken + Counter) % MaxMessages];
+            MessageRetain(Out[Counter].Shared);
+        }
+    }
+    pthread_mutex_unlock(&Stripe->Lock);
+    return Taken;
+}
+
+void HistoryReset() {
+    HistoryStripe *Stripe;
+    size_t Slot;
+    int Counter;
+
+    if (MaxMessages == 0)
+        return;
+
+    for (Counter = 0; Counter < STRIPE_COUNT; Counter++) {
+        Stripe = &Stripes[Counter];
+        pthread_mutex_lock(&Stripe->Lock);
+        for (Slot = 0; Slot < Stripe->Capacity; Slot++) {
+            if (Stripe->Slots[Slot])
+                FreeHistory(Stripe->Slots[Slot]);
+        }
+        free(Stripe->Slots);
+        Stripe->Slots = NULL;
+        Stripe->Capacity = Stripe->Count = 0;
+        Stripe->IdleCount = 0;
+        pthread_mutex_unlock(&Stripe->Lock);
+    }
+}
@@ -0,0 +1,46 @@
+/*
+Recent messages per room, so whoever joins a room sees what was just said in it.
+
+Every room has a ring of the last few FRAME_ROOM_MSG messages sent to it, as the shared messages themselves (see message.h): the ring
+holds a reference on each, nothing is copied or encoded again, and the slots are allocated once with the ring.  A new member is sent
+the lot by queueing those same references, which go out in one vectored write with whatever else is queued for it.
+
+Rooms live on every worker with members in them, but the history has to be the same everywhere, so it's kept here, shared, in a set of
+lock striped hash maps.  Only the sending worker records a message, one lock round trip per room message.  A room's history outlives
+its last member for a while, so clients reconnecting still see it.  Idle histories are thrown away oldest first once there are too many.
+
+A message names its sender by user ID, and IDs are handed out again once their user has gone (see users.h).  So each message is kept
+with its sender's ID & that ID's generation, and whoever replays it checks the sender is still the same user before sending it as it is.
+*/
+
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include "stdbool.h"
+#include "stddef.h"
+#include "stdint.h"
+#include "message.h"
+
+typedef struct HistoryEntry {
+    Message *Shared;
+    uint32_t Sender; // The user ID in the frame.  USER_NONE if it's from nobody in particular.
+    uint32_t Generation; // Of Sender, when it was sent.
+} HistoryEntry;
+
+void HistoryConfigure(int MaxMessages, size_t MaxBytes); // Per room.  0 messages = keep no history.  Only while no worker is running.
+
+// A worker opened / closed its copy of a room (its first member joined, its last left).  A history is only thrown away once no worker has
+// the room open.
+void HistoryRoomOpened(const uint8_t *Name, size_t Length, uint32_t Hash);
+void HistoryRoomClosed(const uint8_t *Name, size_t Length, uint32_t Hash);
+
+// Takes its own reference to Shared, evicting the oldest.  Sender & Generation as in HistoryEntry.
+void HistoryRecord(const uint8_t *Name, size_t Length, uint32_t Hash, Message *Shared, uint32_t Sender, uint32_t Generation);
+void HistoryRestore(const uint8_t *Name, size_t Length, uint32_t Hash, Message *Shared); // From nobody, on startup, for rooms nobody is in yet.
+
+// Up to Max of the room's messages, oldest first, each with a reference the caller must release.  Returns how many.
+int HistorySnapshot(const uint8_t *Name, size_t Length, uint32_t Hash, HistoryEntry *Out, int Max);
+
+void HistoryReset(); // Release every message & free all histories.  Only once no worker is running.
+
+#endif // HISTORY_H
@@ -0,0 +1,78 @@
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "stdatomic.h"
+#include "pthread.h"
+#include "input.h"
+#include "spsc.h"
+#include "tui.h"
+
+#define INPUT_QUEUE_SIZE 64 // Typed lines waiting to be sent.  The input thread waits for room rather than lose a line.
+#define INPUT_LINE_MAX 65536 // Longer lines (a paste, say) are sent as several messages of this many bytes.
+
+static SpscRing InputQueue; // Lines typed by the user.  Pushed by the input thread, popped by the chat loop.
+static _Atomic(Poller *) InputWakePoller; // Loop to wake when a line arrives.
+static bool bInputThreadStarted = false;
+
+static void *WaitForUserInput(void *Unused);
+
+bool StartInputThread(Poller *WakePoller) {
+    pthread_t InputThread;
+
+    atomic_store(&InputWakePoller, WakePoller);
+
+    if (bInputThreadStarted)
+        return true;
+
+    if (!SpscInit(&InputQueue, INPUT_QUEUE_SIZE))
+        return false;
+
+    if (pthread_create(&InputThread, NULL, WaitForUserInput, NULL))
+        return false;
+
+    pthread_detach(InputThread);
+    bInputThreadStarted = true;
+    return true;
+}
+
+char *NextInputLine() {
+    return bInputThreadStarted ? SpscPop(&InputQueue) : NULL;
+}
+
+// Hand a line to the chat loop.
+static void QueueLine(char *Line) {
+    while (!SpscPush(&InputQueue, Line)) // The chat loop is behind.  Wait for it rather than drop the line.
+        SleepMs(1);
+
+    PollerWakeup(atomic_load(&InputWakePoller)); // The chat loop is asleep in PollerWait().  Wake it so the message goes out straight away.
+}
+
+static void *WaitForUserInput(void *Unused) {
+    static char LineBuffer[INPUT_LINE_MAX + 1]; // Only this thread's, and too big for some stacks.
+    char *Line;
+    size_t LineLength;
+    (void)Unused;
+
+    if (TuiActive()) { // The TUI reads the keys & edits the line itself.
+        while ((Line = TuiReadLine()) != NULL)
+            QueueLine(Line);
+        return NULL;
+    }
+
+    while (fgets(LineBuffer, sizeof(LineBuffer), stdin) != NULL) {
+        //trim newline characters so they aren't sent to the other party.
+        LineLength = strlen(LineBuffer);
+        if (LineLength > 0 && LineBuffer[LineLength - 1] == '\n')
+            LineBuffer[--LineLength] = '\0';
+        if (LineLength > 0 && LineBuffer[LineLength - 1] == '\r')
+            LineBuffer[--LineLength] = '\0';
+
+        Line = malloc(LineLength + 1);
+        if (Line == NULL)
+            continue;
+        memcpy(Line, LineBuffer, LineLength + 1);
+        QueueLine(Line);
+    }
+
+    return NULL; // stdin closed.  The chat carries on, there's just nothing more to send.
+}
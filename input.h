@@ -0,0 +1,19 @@
+/*
+Console input thread.  Reads lines from stdin with plain fgets on its own thread, so the chat loops never block on the keyboard, and
+hands each line over through a lock-free SPSC ring.  After every line it wakes the loop that consumes them.  With the TUI running (see
+tui.h) it reads keys through that instead.
+*/
+
+#ifndef INPUT_H
+#define INPUT_H
+
+#include "stdbool.h"
+#include "poller.h"
+
+// Start the input thread if it isn't running yet and make it wake WakePoller after each line.  The thread lives for the rest of the
+// program, so starting a second chat reuses it.
+bool StartInputThread(Poller *WakePoller);
+
+char *NextInputLine(); // Oldest line typed and not yet taken, without its newline, or NULL.  The caller frees it.
+
+#endif // INPUT_H
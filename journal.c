@@ -0,0 +1,676 @@
+#define _GNU_SOURCE // MAP_POPULATE.
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "stdatomic.h"
+#include "pthread.h"
+#include "frame.h"
+#include "rooms.h"
+#include "journal.h"
+#ifndef _WIN32
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#endif // _WIN32
+
+#ifndef _WIN32
+
+#define RECORD_HEADER 8 // u32 frame length, u32 room hash.
+#define RECORD_ALIGN 8
+#define INDEX_STRIDE 32 // Room messages per index entry.  A query reads at most this many extra of the room's records.
+#define INDEX_BUCKETS 4096 // Power of two.
+#define SPARE_SEGMENTS 4 // Live slots beyond MaxSegments, for segments added before the thread gets round to deleting old ones.
+
+typedef struct Segment {
+    uint64_t Seq;
+    int Fd;
+    uint8_t *Data;
+    size_t Size;
+    size_t Tail; // Bytes appended.  AppendLock.
+    size_t SyncedTail; // Bytes msync()'d.  Thread only.
+} Segment;
+
+typedef struct IndexEntry {
+    uint64_t MessageNo; // Of the room's messages, counting from the first one the index has seen.
+    uint64_t SegmentSeq;
+    size_t Offset;
+} IndexEntry;
+
+typedef struct RoomIndex {
+    struct RoomIndex *Next; // Bucket chain.
+    char Name[ROOM_NAME_MAX];
+    size_t NameLength;
+    uint32_t Hash;
+    uint64_t Total; // Messages so far.
+    IndexEntry *Entries; // Entries[First] up to Entries[Count - 1] are live, oldest first.
+    int First;
+    int Count;
+    int Capacity;
+} RoomIndex;
+
+static char Directory[4096];
+static size_t SegmentBytes;
+static int MaxSegments;
+static int SyncIntervalMs;
+static bool bOpen;
+
+// Segments still on disk, oldest first, and always consecutive.  Appending only ever adds one at the end, publishing it through
+// LiveCount, so readers just need LiveLock to keep the thread from deleting any while they read.
+static pthread_rwlock_t LiveLock = PTHREAD_RWLOCK_INITIALIZER;
+static Segment **Live;
+static atomic_int LiveCount;
+
+static pthread_mutex_t AppendLock = PTHREAD_MUTEX_INITIALIZER; // Guards Current, Spare, every Tail & the index.
+static Segment *Current;
+static Segment *Spare; // Ready to take over from Current.  Made by the thread.
+static RoomIndex *Index[INDEX_BUCKETS];
+static atomic_ullong Dropped;
+
+static pthread_t SyncThread;
+static pthread_mutex_t ThreadLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ThreadWake = PTHREAD_COND_INITIALIZER;
+static bool bStopThread;
+
+static uint32_t LoadU32(const uint8_t *Data) {
+    uint32_t Value;
+    memcpy(&Value, Data, 4);
+    return Value;
+}
+
+static void StoreU32(uint8_t *Data, uint32_t Value) {
+    memcpy(Data, &Value, 4);
+}
+
+static size_t RecordSize(size_t FrameLength) {
+    return (RECORD_HEADER + FrameLength + RECORD_ALIGN - 1) & ~(size_t)(RECORD_ALIGN - 1);
+}
+
+// Pick the room out of a FRAME_ROOM_MSG as the server sends it: header, sender ID, room message payload.  False if it isn't one.
+static bool FrameRoom(const uint8_t *Frame, size_t Length, const uint8_t **Room, size_t *RoomLength) {
+    uint64_t PayloadLength;
+    uint64_t Sender;
+    size_t Used = VarintDecode(Frame, Length, &PayloadLength);
+    size_t IdLength;
+    const uint8_t *Text;
+    size_t TextLength;
+
+    if (Used == 0 || Used + 1 + PayloadLength != Length || Frame[Used] != FRAME_ROOM_MSG)
+        return false;
+    Used++;
+    if ((IdLength = VarintDecode(Frame + Used, Length - Used, &Sender)) == 0)
+        return false;
+    Used += IdLength;
+    return FrameSplitRoomMessage(Frame + Used, Length - Used, Room, RoomLength, &Text, &TextLength);
+}
+
+static RoomIndex *FindIndex(const uint8_t *Room, size_t Length, uint32_t Hash, bool bCreate) {
+    RoomIndex **Link = &Index[Hash & (INDEX_BUCKETS - 1)];
+    RoomIndex *Found;
+
+    for (Found = *Link; Found != NULL; Found = Found->Next) {
+        if (Found->Hash == Hash && Found->NameLength == Length && memcmp(Found->Name, Room, Length) == 0)
+            return Found;
+    }
+    if (!bCreate || (Found = calloc(1, sizeof(RoomIndex))) == NULL)
+        return NULL;
+    memcpy(Found->Name, Room, Length);
+    Found->NameLength = Length;
+    Found->Hash = Hash;
+    Found->Next = *Link;
+    *Link = Found;
+    return Found;
+}
+
+// Count one more message for the room, and index it if it's due.  An index that can't grow just gets sparser.
+static void IndexMessage(const uint8_t *Room, size_t Length, uint32_t Hash, uint64_t SegmentSeq, size_t Offset) {
+    RoomIndex *Target = FindIndex(Room, Length, Hash, true);
+    IndexEntry *NewEntries;
+    int NewCapacity;
+
+    if (Target == NULL)
+        return;
+
+    if (Target->Count == Target->First || Target->Total % INDEX_STRIDE == 0) {
+        if (Target->First > 0 && Target->Count == Target->Capacity) { // Reuse the space left by entries for deleted segments.
+            memmove(Target->Entries, Target->Entries + Target->First, (Target->Count - Target->First) * sizeof(IndexEntry));
+            Target->Count -= Target->First;
+            Target->First = 0;
+        }
+        if (Target->Count == Target->Capacity) {
+            NewCapacity = Target->Capacity ? Target->Capacity * 2 : 8;
+            NewEntries = realloc(Target->Entries, NewCapacity * sizeof(IndexEntry));
+            if (NewEntries != NULL) {
+                Target->Entries = NewEntries;
+                Target->Capacity = NewCapacity;
+            }
+        }
+        if (Target->Count < Target->Capacity) {
+            Target->Entries[Target->Count].MessageNo = Target->Total;
+            Target->Entries[Target->Count].SegmentSeq = SegmentSeq;
+            Target->Entries[Target->Count].Offset = Offset;
+            Target->Count++;
+        }
+    }
+    Target->Total++;
+}
+
+// Forget index entries for segments up to Seq.  Rooms left with none are forgotten too.
+static void TrimIndex(uint64_t Seq) {
+    RoomIndex **Link;
+    RoomIndex *Room;
+    int Bucket;
+
+    for (Bucket = 0; Bucket < INDEX_BUCKETS; Bucket++) {
+        Link = &Index[Bucket];
+        while ((Room = *Link) != NULL) {
+            while (Room->First < Room->Count && Room->Entries[Room->First].SegmentSeq <= Seq)
+                Room->First++;
+            if (Room->First < Room->Count) {
+                Link = &Room->Next;
+                continue;
+            }
+            *Link = Room->Next;
+            free(Room->Entries);
+            free(Room);
+        }
+    }
+}
+
+static void SegmentPath(char *Path, size_t Size, uint64_t Seq) {
+    snprintf(Path, Size, "%s/%016llx.seg", Directory, (unsigned long long)Seq);
+}
+
+static void CloseSegment(Segment *Closed, bool bDelete) {
+    char Path[4200];
+
+    munmap(Closed->Data, Closed->Size);
+    close(Closed->Fd);
+    if (bDelete) {
+        SegmentPath(Path, sizeof(Path), Closed->Seq);
+        unlink(Path);
+    }
+    free(Closed);
+}
+
+// Map a segment file, creating & preallocating it if need be.  Pages are faulted in now, so appending never waits on one.
+static Segment *MapSegment(uint64_t Seq, bool bCreate) {
+    char Path[4200];
+    struct stat Info;
+    bool bSized = true;
+    Segment *Mapped = calloc(1, sizeof(Segment));
+
+    if (Mapped == NULL)
+        return NULL;
+    SegmentPath(Path, sizeof(Path), Seq);
+    Mapped->Seq = Seq;
+    Mapped->Fd = open(Path, bCreate ? O_RDWR | O_CREAT | O_TRUNC : O_RDWR, 0644);
+    if (Mapped->Fd == -1) {
+        free(Mapped);
+        return NULL;
+    }
+
+    if (bCreate) {
+        #ifdef __linux__
+        bSized = posix_fallocate(Mapped->Fd, 0, (off_t)SegmentBytes) == 0; // Real blocks, so a full disk shows up here, not as SIGBUS.
+        #else
+        bSized = ftruncate(Mapped->Fd, (off_t)SegmentBytes) == 0;
+        #endif // __linux__
+    }
+    if (!bSized) {
+        close(Mapped->Fd);
+        unlink(Path);
+        free(Mapped);
+        return NULL;
+    }
+    if (fstat(Mapped->Fd, &Info) != 0 || Info.st_size < RECORD_HEADER) {
+        close(Mapped->Fd);
+        free(Mapped);
+        return NULL;
+    }
+
+    Mapped->Size = (size_t)Info.st_size;
+    #ifdef MAP_POPULATE
+    Mapped->Data = mmap(NULL, Mapped->Size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, Mapped->Fd, 0);
+    #else
+    Mapped->Data = mmap(NULL, Mapped->Size, PROT_READ | PROT_WRITE, MAP_SHARED, Mapped->Fd, 0);
+    #endif // MAP_POPULATE
+    if (Mapped->Data == MAP_FAILED) {
+        close(Mapped->Fd);
+        free(Mapped);
+        return NULL;
+    }
+    return Mapped;
+}
+
+// Read a segment back on startup: find where writing stopped, index what's there & hand every record to Restore.
+static void ScanSegment(Segment *Scanned, JournalRestoreHandler Restore) {
+    size_t Offset = 0;
+    uint32_t Length;
+    const uint8_t *Frame;
+    const uint8_t *Room;
+    size_t RoomLength;
+
+    while (Offset + RECORD_HEADER <= Scanned->Size) {
+        Length = LoadU32(Scanned->Data + Offset);
+        Frame = Scanned->Data + Offset + RECORD_HEADER;
+        // Zero is the end.  So is anything half written: a crash can leave the length on disk without the frame.
+        if (Length == 0 || Offset + RecordSize(Length) > Scanned->Size || !FrameRoom(Frame, Length, &Room, &RoomLength)
+            || LoadU32(Scanned->Data + Offset + 4) != RoomHash(Room, RoomLength))
+            break;
+        IndexMessage(Room, RoomLength, LoadU32(Scanned->Data + Offset + 4), Scanned->Seq, Offset);
+        if (Restore)
+            Restore(Room, RoomLength, LoadU32(Scanned->Data + Offset + 4), Frame, Length);
+        Offset += RecordSize(Length);
+    }
+
+    if (Offset < Scanned->Size) // Clear any partial record, so it can't be mistaken for a whole one once it's written over.
+        memset(Scanned->Data + Offset, 0, Scanned->Size - Offset < RECORD_HEADER ? Scanned->Size - Offset : RECORD_HEADER);
+    Scanned->Tail = Scanned->SyncedTail = Offset;
+}
+
+static int CompareSeqs(const void *Left, const void *Right) {
+    uint64_t A = *(const uint64_t *)Left;
+    uint64_t B = *(const uint64_t *)Right;
+    return A < B ? -1 : A > B;
+}
+
+// Sequence numbers of every segment in Directory, sorted.  Returns how many, -1 if the directory can't be read.
+static int ListSegments(uint64_t **Seqs) {
+    DIR *Listing = opendir(Directory);
+    struct dirent *Entry;
+    unsigned long long Seq;
+    char Extra;
+    uint64_t *Grown;
+    int Count = 0;
+    int Capacity = 0;
+
+    *Seqs = NULL;
+    if (Listing == NULL)
+        return -1;
+
+    while ((Entry = readdir(Listing)) != NULL) {
+        if (strlen(Entry->d_name) != 20 || sscanf(Entry->d_name, "%16llx.se%c", &Seq, &Extra) != 2 || Extra != 'g' || Seq == 0)
+            continue;
+        if (Count == Capacity) {
+            Capacity = Capacity ? Capacity * 2 : 16;
+            if ((Grown = realloc(*Seqs, Capacity * sizeof(uint64_t))) == NULL)
+                break;
+            *Seqs = Grown;
+        }
+        (*Seqs)[Count++] = Seq;
+    }
+    closedir(Listing);
+    qsort(*Seqs, Count, sizeof(uint64_t), CompareSeqs);
+    return Count;
+}
+
+static void SyncSegment(Segment *Synced) {
+    long PageSize = sysconf(_SC_PAGESIZE);
+    size_t Tail;
+    size_t From;
+
+    pthread_mutex_lock(&AppendLock);
+    Tail = Synced->Tail;
+    pthread_mutex_unlock(&AppendLock);
+
+    if (Tail == Synced->SyncedTail)
+        return;
+    From = Synced->SyncedTail & ~(size_t)(PageSize - 1); // msync() wants a page aligned start.
+    if (msync(Synced->Data + From, Tail - From, MS_SYNC) == 0)
+        Synced->SyncedTail = Tail;
+}
+
+// The log's own thread: sync, keep a spare segment ready & delete the oldest ones, so the event loops never wait on the disk.
+static void *SyncMain(void *Arg) {
+    struct timespec Deadline;
+    Segment *Made;
+    Segment *Oldest;
+    uint64_t NextSeq;
+    int Counter;
+    (void)Arg;
+
+    pthread_mutex_lock(&ThreadLock);
+    while (!bStopThread) {
+        clock_gettime(CLOCK_REALTIME, &Deadline);
+        Deadline.tv_sec += SyncIntervalMs / 1000;
+        Deadline.tv_nsec += (long)(SyncIntervalMs % 1000) * 1000000;
+        if (Deadline.tv_nsec >= 1000000000) {
+            Deadline.tv_sec++;
+            Deadline.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&ThreadWake, &ThreadLock, &Deadline); // Woken early when a segment fills.
+        pthread_mutex_unlock(&ThreadLock);
+
+        for (Counter = 0; Counter < atomic_load_explicit(&LiveCount, memory_order_acquire); Counter++) // Only this thread removes any.
+            SyncSegment(Live[Counter]);
+
+        pthread_mutex_lock(&AppendLock);
+        NextSeq = Spare ? 0 : Current->Seq + 1;
+        pthread_mutex_unlock(&AppendLock);
+        if (NextSeq != 0 && (Made = MapSegment(NextSeq, true)) != NULL) {
+            pthread_mutex_lock(&AppendLock);
+            Spare = Made;
+            pthread_mutex_unlock(&AppendLock);
+        }
+
+        while (atomic_load_explicit(&LiveCount, memory_order_acquire) > MaxSegments) {
+            pthread_rwlock_wrlock(&LiveLock); // No query is reading it...
+            pthread_mutex_lock(&AppendLock); // ...and nobody is adding a segment.
+            Oldest = Live[0];
+            memmove(Live, Live + 1, (atomic_load(&LiveCount) - 1) * sizeof(Segment *));
+            atomic_fetch_sub(&LiveCount, 1);
+            TrimIndex(Oldest->Seq);
+            pthread_mutex_unlock(&AppendLock);
+            pthread_rwlock_unlock(&LiveLock);
+            CloseSegment(Oldest, true);
+        }
+
+        pthread_mutex_lock(&ThreadLock);
+    }
+    pthread_mutex_unlock(&ThreadLock);
+    return NULL;
+}
+
+bool JournalOpen(const char *Path, size_t Bytes, int Segments, int SyncMs, JournalRestoreHandler Restore) {
+    uint64_t *Seqs;
+    int SeqCount;
+    int Counter;
+    Segment *Opened;
+
+    if (strlen(Path) >= sizeof(Directory)) {
+        printf("ERROR: the message log directory name is too long!\n");
+        return false;
+    }
+    strcpy(Directory, Path);
+    SegmentBytes = Bytes;
+    MaxSegments = Segments;
+    SyncIntervalMs = SyncMs;
+
+    mkdir(Directory, 0755); // Fine if it's there already.
+    if ((SeqCount = ListSegments(&Seqs)) == -1) {
+        printf("ERROR: unable to read the message log directory %s!\n", Directory);
+        return false;
+    }
+
+    Live = calloc(MaxSegments + SPARE_SEGMENTS, sizeof(Segment *));
+    if (Live == NULL) {
+        free(Seqs);
+        return false;
+    }
+
+    for (Counter = 0; Counter < SeqCount; Counter++) {
+        if (SeqCount - Counter > MaxSegments) { // Over the limit, e.g. after lowering it.  Oldest go first.
+            char OldPath[4200];
+            SegmentPath(OldPath, sizeof(OldPath), Seqs[Counter]);
+            unlink(OldPath);
+            continue;
+        }
+        if (atomic_load(&LiveCount) > 0 && Seqs[Counter] != Live[atomic_load(&LiveCount) - 1]->Seq + 1) {
+            printf("ERROR: segment %016llx of the message log is missing!\n", (unsigned long long)Live[atomic_load(&LiveCount) - 1]->Seq + 1);
+            break;
+        }
+        if ((Opened = MapSegment(Seqs[Counter], false)) == NULL) {
+            printf("ERROR: unable to map message log segment %016llx!\n", (unsigned long long)Seqs[Counter]);
+            break;
+        }
+        ScanSegment(Opened, Restore);
+        Live[atomic_fetch_add(&LiveCount, 1)] = Opened;
+    }
+    free(Seqs);
+
+    if (Counter < SeqCount || (atomic_load(&LiveCount) == 0 && (Live[0] = MapSegment(1, true)) == NULL)) {
+        if (Counter == SeqCount)
+            printf("ERROR: unable to create a message log segment in %s!\n", Directory);
+        bOpen = true;
+        JournalClose();
+        return false;
+    }
+    if (atomic_load(&LiveCount) == 0)
+        atomic_store(&LiveCount, 1);
+    Current = Live[atomic_load(&LiveCount) - 1];
+
+    bStopThread = false;
+    if (pthread_create(&SyncThread, NULL, SyncMain, NULL)) {
+        printf("Error creating thread\n");
+        bOpen = true;
+        JournalClose();
+        return false;
+    }
+    bOpen = true;
+    pthread_cond_signal(&ThreadWake); // Make the first spare straight away.
+    return true;
+}
+
+void JournalClose() {
+    RoomIndex *Room;
+    int Counter;
+
+    if (!bOpen)
+        return;
+
+    if (Live[0] != NULL && Current != NULL) { // The thread only runs once there's a current segment.
+        pthread_mutex_lock(&ThreadLock);
+        bStopThread = true;
+        pthread_cond_signal(&ThreadWake);
+        pthread_mutex_unlock(&ThreadLock);
+        pthread_join(SyncThread, NULL);
+    }
+
+    for (Counter = 0; Counter < atomic_load(&LiveCount); Counter++) {
+        SyncSegment(Live[Counter]);
+        CloseSegment(Live[Counter], false);
+    }
+    if (Spare)
+        CloseSegment(Spare, false); // Kept.  It's empty, and will be picked up as the current segment next time.
+    for (Counter = 0; Counter < INDEX_BUCKETS; Counter++) {
+        while ((Room = Index[Counter]) != NULL) {
+            Index[Counter] = Room->Next;
+            free(Room->Entries);
+            free(Room);
+        }
+    }
+    free(Live);
+    Live = NULL;
+    atomic_store(&LiveCount, 0);
+    Current = Spare = NULL;
+    bOpen = false;
+}
+
+void JournalAppend(const uint8_t *Room, size_t RoomLength, uint32_t Hash, const Message *Shared) {
+    uint64_t PayloadLength;
+    uint64_t Sender;
+    const uint8_t *Body;
+    size_t BodyLength;
+    uint8_t Header[FRAME_HEADER_MAX + 1];
+    size_t HeaderLength;
+    size_t Size;
+    uint8_t *Record;
+    bool bRolled = false;
+
+    if (!bOpen)
+        return;
+
+    // The same frame from USER_NONE: a new header, then the one byte ID, then the payload after the sender's.
+    Body = Shared->Data + VarintDecode(Shared->Data, Shared->Length, &PayloadLength) + 1;
+    BodyLength = (size_t)PayloadLength - VarintDecode(Body, (size_t)PayloadLength, &Sender);
+    Body += (size_t)PayloadLength - BodyLength;
+    HeaderLength = FrameEncodeHeader(Header, FRAME_ROOM_MSG, 1 + BodyLength);
+    Header[HeaderLength++] = USER_NONE;
+    Size = RecordSize(HeaderLength + BodyLength);
+
+    if (Size + RECORD_HEADER > SegmentBytes) // Always leave room for the zero length that ends a segment.
+        return;
+
+    pthread_mutex_lock(&AppendLock);
+    if (Current->Tail + Size + RECORD_HEADER > Current->Size) {
+        if (Spare == NULL || atomic_load_explicit(&LiveCount, memory_order_relaxed) == MaxSegments + SPARE_SEGMENTS) {
+            pthread_mutex_unlock(&AppendLock);
+            atomic_fetch_add_explicit(&Dropped, 1, memory_order_relaxed);
+            return;
+        }
+        Live[atomic_load_explicit(&LiveCount, memory_order_relaxed)] = Spare;
+        atomic_store_explicit(&LiveCount, atomic_load_explicit(&LiveCount, memory_order_relaxed) + 1, memory_order_release);
+        Current = Spare;
+        Spare = NULL;
+        bRolled = true;
+    }
+
+    Record = Current->Data + Current->Tail;
+    StoreU32(Record + 4, Hash);
+    memcpy(Record + RECORD_HEADER, Header, HeaderLength);
+    memcpy(Record + RECORD_HEADER + HeaderLength, Body, BodyLength);
+    StoreU32(Record, (uint32_t)(HeaderLength + BodyLength)); // Length last.  Until it's there, the record ends the segment.
+    IndexMessage(Room, RoomLength, Hash, Current->Seq, Current->Tail);
+    Current->Tail += Size;
+    pthread_mutex_unlock(&AppendLock);
+
+    if (bRolled) { // Have the thread make the next spare now rather than on its next round.
+        pthread_mutex_lock(&ThreadLock);
+        pthread_cond_signal(&ThreadWake);
+        pthread_mutex_unlock(&ThreadLock);
+    }
+}
+
+typedef struct QueryState {
+    const uint8_t *Room;
+    size_t RoomLength;
+    uint32_t Hash;
+    uint64_t FirstWanted; // MessageNo of the first message to return.
+    size_t Bytes; // Pass 1: everything wanted.  Pass 2: written so far.
+    size_t Skip; // Pass 2: bytes of the oldest wanted messages left out to stay under MaxBytes.
+    Message *Out;
+} QueryState;
+
+// Read the room's records from Start up to the end snapshot, measuring (pass 1) or copying (pass 2) the ones wanted.
+static void ScanRoom(QueryState *Query, const IndexEntry *Start, uint64_t EndSeq, size_t EndTail, bool bWrite) {
+    uint64_t MessageNo = Start->MessageNo;
+    size_t Offset = Start->Offset;
+    size_t Skipped = 0;
+    int Position = (int)(Start->SegmentSeq - Live[0]->Seq);
+    Segment *Scanned;
+    uint32_t Length;
+    const uint8_t *Frame;
+    const uint8_t *Room;
+    size_t RoomLength;
+
+    for (; Position < atomic_load_explicit(&LiveCount, memory_order_acquire); Position++, Offset = 0) {
+        Scanned = Live[Position];
+        while (Scanned->Seq < EndSeq ? Offset + RECORD_HEADER <= Scanned->Size : Offset < EndTail) {
+            if ((Length = LoadU32(Scanned->Data + Offset)) == 0)
+                break;
+            Frame = Scanned->Data + Offset + RECORD_HEADER;
+            if (LoadU32(Scanned->Data + Offset + 4) == Query->Hash && FrameRoom(Frame, Length, &Room, &RoomLength)
+                && RoomLength == Query->RoomLength && memcmp(Room, Query->Room, RoomLength) == 0) {
+                if (MessageNo >= Query->FirstWanted) {
+                    if (!bWrite)
+                        Query->Bytes += Length;
+                    else if (Skipped < Query->Skip)
+                        Skipped += Length;
+                    else {
+                        memcpy(Query->Out->Data + Query->Bytes, Frame, Length); // Straight from the mapped pages.
+                        Query->Bytes += Length;
+                    }
+                }
+                MessageNo++;
+            }
+            Offset += RecordSize(Length);
+        }
+        if (Scanned->Seq == EndSeq)
+            return;
+    }
+}
+
+Message *JournalQuery(const uint8_t *Room, size_t RoomLength, uint32_t Hash, int Count, size_t MaxBytes) {
+    QueryState Query;
+    IndexEntry Start;
+    RoomIndex *Found;
+    uint64_t EndSeq = 0;
+    size_t EndTail = 0;
+    size_t Total;
+    int Entry;
+
+    if (!bOpen || Count <= 0)
+        return NULL;
+
+    memset(&Query, 0, sizeof(Query));
+    Query.Room = Room;
+    Query.RoomLength = RoomLength;
+    Query.Hash = Hash;
+    memset(&Start, 0, sizeof(Start));
+
+    pthread_rwlock_rdlock(&LiveLock); // Segments stay put until the scan is over.
+    pthread_mutex_lock(&AppendLock);
+    Found = FindIndex(Room, RoomLength, Hash, false);
+    if (Found != NULL && Found->First < Found->Count) {
+        Query.FirstWanted = Found->Total > (uint64_t)Count ? Found->Total - Count : 0;
+        for (Entry = Found->Count - 1; Entry > Found->First && Found->Entries[Entry].MessageNo > Query.FirstWanted; Entry--);
+        Start = Found->Entries[Entry]; // Last entry at or before the first message wanted, or the oldest there is.
+        EndSeq = Current->Seq;
+        EndTail = Current->Tail; // Records appended after this aren't looked at, so they can be written while we read.
+    }
+    pthread_mutex_unlock(&AppendLock);
+
+    if (EndSeq != 0) {
+        ScanRoom(&Query, &Start, EndSeq, EndTail, false);
+        Total = Query.Bytes;
+        if (Total > 0) {
+            Query.Skip = Total > MaxBytes ? Total - MaxBytes : 0; // At least that much, in whole messages, oldest first.
+            Query.Out = MessageCreate(Total);
+            Query.Bytes = 0;
+            if (Query.Out != NULL)
+                ScanRoom(&Query, &Start, EndSeq, EndTail, true);
+            if (Query.Out != NULL)
+                Query.Out->Length = Query.Bytes;
+            if (Query.Out != NULL && Query.Bytes == 0) {
+                MessageRelease(Query.Out);
+                Query.Out = NULL;
+            }
+        }
+    }
+    pthread_rwlock_unlock(&LiveLock);
+    return Query.Out;
+}
+
+uint64_t JournalDropped() {
+    return atomic_load_explicit(&Dropped, memory_order_relaxed);
+}
+
+#else
+
+bool JournalOpen(const char *Directory, size_t SegmentBytes, int MaxSegments, int SyncIntervalMs, JournalRestoreHandler Restore) {
+    (void)Directory;
+    (void)SegmentBytes;
+    (void)MaxSegments;
+    (void)SyncIntervalMs;
+    (void)Restore;
+    printf("ERROR: the message log needs mmap(), which windows builds don't have!\n");
+    return false;
+}
+
+void JournalClose() {
+}
+
+void JournalAppend(const uint8_t *Room, size_t RoomLength, uint32_t Hash, const Message *Shared) {
+    (void)Room;
+    (void)RoomLength;
+    (void)Hash;
+    (void)Shared;
+}
+
+Message *JournalQuery(const uint8_t *Room, size_t RoomLength, uint32_t Hash, int Count, size_t MaxBytes) {
+    (void)Room;
+    (void)RoomLength;
+    (void)Hash;
+    (void)Count;
+    (void)MaxBytes;
+    return NULL;
+}
+
+uint64_t JournalDropped() {
+    return 0;
+}
+
+#endif // _WIN32
@@ -0,0 +1,51 @@
+/*
+Durable room history: an append-only log of every room message, in memory mapped segment files.
+
+    <dir>/0000000000000001.seg  0000000000000002.seg  ...
+
+Each segment is preallocated & mapped whole, and holds records one after the other, padded to 8 bytes:
+
+    +--------------+--------------+--------------------------------------+
+    | frame length | room hash    | the FRAME_ROOM_MSG frame, unsigned   |
+    | u32          | u32          | length bytes                         |
+    +--------------+--------------+--------------------------------------+
+
+A frame is kept as it was sent except for the sender, which is always USER_NONE: user IDs only mean anything to the process that gave
+them out, and are handed to someone else once their user leaves (see users.h).  So what the log gives back is from nobody.
+
+A zero length marks where the writing stopped.  Appending is a memcpy into the mapped pages under a short lock: no system call, and no
+page fault either, since segments are faulted in as they're made.  A background thread does everything that can block: msync()ing what
+was appended every so often, preparing the next segment before the current one fills, and deleting the oldest past the limit.  If the
+next segment isn't ready in time, records are dropped rather than the event loop kept waiting.
+
+For every room the log keeps a sparse index, one entry per INDEX_STRIDE messages, of where they are.  A history query starts at the
+entry before the messages it wants and reads forward straight from the mapped pages, skipping other rooms' records by hash.  On startup
+every segment is read back the same way to rebuild the index & the in-memory room histories (history.h).
+
+POSIX only, it needs mmap().
+*/
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include "stdbool.h"
+#include "stddef.h"
+#include "stdint.h"
+#include "message.h"
+
+// Called for every record found on startup, oldest first.
+typedef void (*JournalRestoreHandler)(const uint8_t *Room, size_t RoomLength, uint32_t Hash, const uint8_t *Frame, size_t Length);
+
+// Open (or create) the log in Directory & start its thread.  Prints what's wrong & returns false if it can't.
+bool JournalOpen(const char *Directory, size_t SegmentBytes, int MaxSegments, int SyncIntervalMs, JournalRestoreHandler Restore);
+void JournalClose(); // Syncs everything & stops the thread.
+
+void JournalAppend(const uint8_t *Room, size_t RoomLength, uint32_t Hash, const Message *Shared); // Shared holds a FRAME_ROOM_MSG, as sent.
+
+// The room's last Count messages (fewer if the log doesn't go back that far, or they'd come to more than MaxBytes), as frames one after
+// the other in a single message.  NULL if there are none.
+Message *JournalQuery(const uint8_t *Room, size_t RoomLength, uint32_t Hash, int Count, size_t MaxBytes);
+
+uint64_t JournalDropped(); // Records dropped because no segment was ready for them.
+
+#endif // JOURNAL_H
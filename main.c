@@ -18,36 +18,29 @@ What I learned:
 #include "string.h"
 #include "stdlib.h"
 #include "ctype.h"
-#define HAVE_STRUCT_TIMESPEC
-#ifdef _WIN32 // Win32 platforms use winsock.
-#include <winsock2.h>
-typedef int socklen_t;
-#define close closesocket
-#else // Non windows platforms use berkeley sockets.  To allow the program to compile under these platforms, some items have to be redefined.
-#include <unistd.h>
-#include <arpa/inet.h>
-#include <netinet/in.h>
-#include <sys/ioctl.h>
-#include <sys/socket.h>
-#define SOCKET uint
-#define SOCKET_ERROR -1
-#define INVALID_SOCKET -1
-#endif
-#include "pthread.h"
+#include "platform.h" // winsock / berkeley sockets differences live here.
+#include "poller.h"
+#include "frame.h"
+#include "outbuf.h"
+#include "input.h"
+#include "config.h"
+#include "console.h"
+#include "connect.h"
+#include "tls.h"
+#include "users.h"
+#include "compress.h"
+#include "transfer.h"
+#include "tui.h"
 
 /*
 # Future potential improvements:
 #
-# Resolve hostnames
-# Add IPv6 support
 # Add a default port / IP
-# Add SSL/Encryption
 # IP validation: Handle case there more than 4 octets are provided.
-# Add username support?
 #
 # Possible implementations for simple chat program to support both POSIX & WIN32 systems to allow cross-platform real-time chat:
 #
-# Solution 1) SELECTED / IMPLEMENTED: Use threading
+# Solution 1) SELECTED / IMPLEMENTED: Use threading (the default)
 # - KB INPUT/OUTPUT: Use ANSI C IO functions
 # - THREADING: use pthreads/pthreads-win32.  Threading is needed because we are using ANSI C IO functions and not modifying console input to raw & don't want to use windows specific stdin polling options, just fgets on a separate thread.  Use
 # - SOCKETS: Use IFDEFS to change from winsock to sockets (minimal)
@@ -61,7 +54,7 @@ typedef int socklen_t;
 # - ADVANTAGES: Can easily access other console functions for improvements.  Can port to sdl & emscripten.
 # - DISADVANTAGES: Less learning on my side.
 #
-# Solution 3) Change console modes manually.
+# Solution 3) ALSO IMPLEMENTED with --tui (see tui.h): Change console modes manually.
 # - KB INPUT/OUTPUT: Use standard ANSI C KB functions
 # - CONSOLE MODE: Have a ChangeConsoleToRaw
 # - SOCKETS: Use IFDEFS to change from winsock to sockets (minimal)
@@ -71,49 +64,78 @@ typedef int socklen_t;
 */
 
 // function definitions.
-bool ConnectToHost(int PortNo, char *IPAddressBuffer);
+bool ConnectToHost(const ChatConfig *Config);
 void CloseConnection();
-bool HostServer(int PortNo);
-void Chat();
-void *WaitForUserInput(); // Function executed on second thread when in chat to avoid blocking issues.
+bool RunServer(ServerConfig *Config);
+void HandleStopSignal(int Signal);
+bool RunClient(const ChatConfig *Config);
+void Chat(const char *Username, bool bTui);
+bool FlushToServer();
+bool SendLine(const char *Line);
+bool SendRoomCommand(bool bJoin, const char *Room);
+bool SendLogin(const char *Name);
+bool SendHistoryRequest(const char *Count);
+bool SendDirect(const char *Line);
+bool SendCompressRequest();
+bool UnpackFrame(const uint8_t *Payload, size_t Length);
+bool RememberUser(uint64_t Id, const uint8_t *Name, size_t Length);
+const char *UserName(uint64_t Id);
+uint64_t FindUser(const char *Name, size_t Length);
+bool ServerFrameReceived(void *Context, uint8_t Type, const uint8_t *Payload, size_t Length);
 void ClearInputBuffer();
 void GetValidPortNo(int *PortNo);
-void GetValidIP(char *IPAddressBuffer);
+void GetValidHost(char *HostBuffer);
 
 // Global variables
-bool bHasMessageWaiting;
 bool bPerformExit;
 
-char ReceiveBuffer[300]; // Used to hold messages sent by other party.
+#define RECEIVE_BUFFER_SIZE 65536
+char ReceiveBuffer[RECEIVE_BUFFER_SIZE]; // Used to hold bytes sent by other party until the frame decoder has picked them apart.
 char InputBuffer[300]; // Used for any user input strings.
 
-fd_set FDS; // file descriptor set used by winsock / sockets
-struct timeval TV;
-SOCKET ServerSocket; // SOCKET handle used to host server or connect to server.
+#define POLL_TIMEOUT_MS -1 // The chat loop sleeps until the socket is ready or the input thread wakes it, so an idle chat uses no CPU.
+#define MAX_EVENTS 64 // Socket events handled per wait.
+#define SEND_HIGH_WATERMARK (1 << 20) // Stop taking typed lines while this much is waiting for the server.  They wait in the input ring.
+
+Poller *ChatPoller; // Event backend (epoll / kqueue / WSAPoll / poll) watching the server socket.
+SOCKET ServerSocket; // SOCKET handle used to connect to server.
+TlsContext *ClientTls; // Set with --tls.
+TlsConnection *ServerTls; // TLS session on ServerSocket, NULL for plaintext.
+Decompressor *ServerUnpacker; // Set with --compress.
+FrameDecoder ServerDecoder; // Reassembles frames sent by the server.
+OutBuffer ServerOut; // Frames waiting to be sent to the server.
+bool bServerWantWrite; // ServerOut is waiting on the socket becoming writable.
+bool bTransferReady; // More of a file to send as soon as the loop has been round.
+char CurrentRoom[ROOM_NAME_MAX + 1]; // Room typed lines go to after /join.  Empty = everyone.
+char (*UserNames)[USER_NAME_MAX + 1]; // Names the server has told us about, indexed by user ID.  Empty = nobody has that ID.
+size_t UserNameCount;
 
 enum { CLIENT, SERVER, UNSET } ConnectionMode = UNSET; // Used to set the program in host or client mode.
 
-int main() {
+int main(int argc, char *argv[]) {
 
     //Zero strings
-    memset(ReceiveBuffer,'\0',300);
     memset(InputBuffer,'\0',300);
 
-
-	bool bConnectionSuccess= false;
-
     char InputChar = 0; // Used to store input from user temporarily if user input needs to be validated.
-    char IPAddressBuffer[50] = "";
     int PortNo = 0;
-
-    // Set timeval used by select function for wait period to 500 microseconds.
-	TV.tv_sec = 0;
-	TV.tv_usec = 500;
+    ChatConfig Config;
 
     #ifndef _WIN32
     setbuf(stdout, NULL); // Set stdout to flush straight away on POSIX platforms as opposed to waiting for newline.
+    signal(SIGPIPE, SIG_IGN); // Sending to a client that just left should be an error we handle, not a signal that kills the server.
     #endif // _WIN32
 
+    ChatConfigDefaults(&Config);
+
+    if (argc > 1) { // Started with options: no prompts at all, and no waiting for enter at the end.
+        if (!ChatConfigParseArgs(&Config, argc, argv))
+            return 1;
+        if (Config.Mode == MODE_SERVER)
+            return RunServer(&Config.Server) ? 0 : 1;
+        return RunClient(&Config) ? 0 : 1;
+    }
+
 	while (ConnectionMode != CLIENT && ConnectionMode != SERVER) { // Loop until a valid ConnectionMode has been selected.
 		printf("Press 1 to run chat server or 2 to run chat client and then press enter: ");
 		InputChar = getchar();
@@ -125,46 +147,22 @@ int main() {
 
             GetValidPortNo(&PortNo); // Ask user for Port No and make sure it's valid
 
-            bConnectionSuccess = HostServer(PortNo);
-
-            if (bConnectionSuccess) {
-                printf("\nAccepted Connection!!\n");
-                Chat();
-            }
-            else {
-                printf("\n Connection failed! :( \n ");
-                #ifdef _WIN32
-                printf("\nError code: %d\n", WSAGetLastError());
-                #endif // _WIN32
-            }
-            CloseConnection();
+            Config.Server.PortNo = PortNo;
+            RunServer(&Config.Server);
 		}
 		else if (InputChar == '2') { // CLIENT MODE
 			printf("\nYou have selected to run the chat client.\n");
             ConnectionMode = CLIENT;
 
-            GetValidPortNo(&PortNo); // Ask user for Port No and validate
+            GetValidPortNo(&Config.PortNo); // Ask user for Port No and validate
 
-            printf("\nYou have entered port no: %d\n", PortNo);
+            printf("\nYou have entered port no: %d\n", Config.PortNo);
 
-            GetValidIP(IPAddressBuffer); // Ask user for IP & validate.
+            GetValidHost(Config.Host); // Ask user for the server's name or IP & validate.
 
-            printf("\nYou have entered IP Address: %s\n", IPAddressBuffer);
+            printf("\nYou have entered host: %s\n", Config.Host);
 
-            // Attempt to connect to socket
-            bConnectionSuccess = ConnectToHost(PortNo, IPAddressBuffer);
-
-            if (bConnectionSuccess) {
-                printf("\nConnection Success!! \n");
-                Chat();
-            }
-            else {
-                printf("\nConnection failed!! :( \n");
-                #ifdef _WIN32
-                printf("\nError code: %d\n", WSAGetLastError());
-                #endif // _WIN32
-            }
-            CloseConnection();
+            RunClient(&Config);
 		}
 		else {
 			printf("\nYou have provided invalid input... try again!\n");
@@ -177,104 +175,116 @@ int main() {
 	return 0;
 }
 
-
-bool ConnectToHost(int PortNo, char* IPAddressBuffer) {
-    #ifdef _WIN32
-    WSADATA wsadata; //Create wsadata struct used to start up WINSOCK
-
-    int error = WSAStartup(0x0202, &wsadata); // Start up WINSOCK
-
-    if (error)
-        return false;
-
-    if (wsadata.wVersion != 0x0202) // Did we get the right WINSOCK version?
-    {
-        WSACleanup();
-        return false;
+bool RunServer(ServerConfig *Config) {
+    bool bConnectionSuccess = HostServer(Config);
+    ServerStats Stats;
+
+    if (bConnectionSuccess) {
+        signal(SIGINT, HandleStopSignal); // Shut down cleanly when a service manager (or Ctrl+C) asks.
+        signal(SIGTERM, HandleStopSignal);
+        ServeClients();
+        GetServerStats(&Stats);
+        if (Stats.PausedReads || Stats.SlowConsumersDropped)
+            printf("Reads paused %llu time(s), %llu slow client(s) dropped.\n", Stats.PausedReads, Stats.SlowConsumersDropped);
     }
+    else {
+        printf("\n Connection failed! :( \n ");
+        #ifdef _WIN32
+        printf("\nError code: %d\n", WSAGetLastError());
+        #endif // _WIN32
+    }
+    CloseServer();
+    return bConnectionSuccess;
+}
 
-    SOCKADDR_IN target;  //Fill out info required to connect to a socket on win32
-    #else
-
-    struct sockaddr_in target; //declare new internet socket address
-
-    #endif // _WIN32
+void HandleStopSignal(int Signal) {
+    (void)Signal;
+    StopServer();
+}
 
-    target.sin_family = AF_INET; // IPv4 socket
-    target.sin_port = htons (PortNo); // Port number of server to connect to w/ correct byte order
-    target.sin_addr.s_addr = inet_addr(IPAddressBuffer); // provide pointer to IP address
+bool RunClient(const ChatConfig *Config) {
+    // Attempt to connect to socket
+    bool bConnectionSuccess = ConnectToHost(Config);
 
-    ServerSocket = socket (AF_INET, SOCK_STREAM, IPPROTO_TCP); //create socket
-    if (ServerSocket == INVALID_SOCKET) {
-        printf("\nERROR: UNABLE TO CREATE SOCKET\n");
-        return false; // Couldn't create socket
+    if (bConnectionSuccess) {
+        printf("\nConnection Success!! \n");
+        Chat(Config->Username, Config->bTui);
     }
-
-    // Try to actually connect to host. Moment of truth.
-    #ifdef _WIN32
-    if (connect(ServerSocket, (SOCKADDR *)&target, sizeof(target)) == SOCKET_ERROR)
-    #else
-    if (connect(ServerSocket,(struct sockaddr *) &target, sizeof(target)) == SOCKET_ERROR)
-    #endif //
-    {
-        printf("\nERROR: SOCKET ERROR DURING CONNECT!\n");
-        return false;
+    else {
+        printf("\nConnection failed!! :( \n");
+        #ifdef _WIN32
+        printf("\nError code: %d\n", WSAGetLastError());
+        #endif // _WIN32
     }
-    else
-        return true;  // SUCCESS MOTHERFUCKER!!
+    CloseConnection();
+    return bConnectionSuccess;
 }
 
-bool HostServer(int PortNo)
-{
+
+bool ConnectToHost(const ChatConfig *Config) {
+    char Description[128];
+
     #ifdef _WIN32
-    WSADATA wsadata;
+    WSADATA wsadata; //Create wsadata struct used to start up WINSOCK
 
-    int error = WSAStartup(0x0202, &wsadata);
+    int error = WSAStartup(0x0202, &wsadata); // Start up WINSOCK
 
     if (error)
         return false;
 
-    if (wsadata.wVersion != 0x0202) // Exit if it's not the right winsock version.
+    if (wsadata.wVersion != 0x0202) // Did we get the right WINSOCK version?
     {
         WSACleanup();
         return false;
     }
     #endif // _WIN32
 
-    struct sockaddr_in ServerSockAddr;
-
-    ServerSockAddr.sin_family = AF_INET; // IPv4 Address
-    ServerSockAddr.sin_port = htons(PortNo); // Select Port No used for the socket
-
-    //Accept a connection on any interface
-
-    ServerSockAddr.sin_addr.s_addr = htonl(INADDR_ANY);
-
-    // define TCP socket stream
-    ServerSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-
+    // Resolve the host & race its IPv4 / IPv6 addresses.  Moment of truth.
+    ServerSocket = ConnectHost(Config->Host, Config->PortNo, Config->ConnectTimeoutMs);
     if (ServerSocket == INVALID_SOCKET)
         return false;
 
-    if (bind(ServerSocket, (struct sockaddr *)&ServerSockAddr, sizeof(ServerSockAddr)) == SOCKET_ERROR)
-    {
-        return false;
+    if (Config->bTls) { // Finish the handshake here so Chat() only ever sees an established session.
+        ClientTls = TlsClientContext(Config->TlsCaFile, Config->bTlsVerify, Config->TlsSessionFile);
+        if (ClientTls == NULL || (ServerTls = TlsConnect(ClientTls, ServerSocket, Config->Host)) == NULL
+            || !TlsHandshake(ServerTls, Config->ConnectTimeoutMs))
+            return false;
+        if (TlsHandshakeCompleted(ServerTls, Description, sizeof(Description)))
+            printf("\nSecured with %s\n", Description);
     }
 
-    listen(ServerSocket, SOMAXCONN);
-
-    printf("\nSocket listening on port %d.  Waiting on connection from client...", PortNo);
+    TransferConfigure(Config->DownloadDirectory);
+    if (Config->bCompress && (!CompressionConfigure(Config->CompressDictFile) || (ServerUnpacker = DecompressorCreate()) == NULL))
+        return false;
 
-    ServerSocket = accept(ServerSocket,NULL,NULL);
+    SetNoDelay(ServerSocket, true); // Messages are batched per loop pass already, Nagle would only delay them.
 
-    return true;
+    // Chat() waits on the socket through the event backend.  ConnectHost() has left it non-blocking, as the backend needs.
+    ChatPoller = PollerCreate();
+    if (ChatPoller == NULL || !PollerAdd(ChatPoller, ServerSocket, &ServerSocket, POLL_READ)) {
+        printf("\nERROR: UNABLE TO WATCH SOCKET WITH %s!\n", PollerBackendName());
+        return false;
+    }
+    return true;  // SUCCESS MOTHERFUCKER!!
 }
 
 void CloseConnection()
 {
+    TlsFree(ServerTls);
+    ServerTls = NULL;
+    TlsContextFree(ClientTls);
+    ClientTls = NULL;
+    DecompressorFree(ServerUnpacker);
+    ServerUnpacker = NULL;
+
     if (ServerSocket)
         close(ServerSocket);
 
+    if (ChatPoller) {
+        PollerDestroy(ChatPoller);
+        ChatPoller = NULL;
+    }
+
     #ifdef _WIN32
     WSACleanup(); //Clean up winsock
     #endif
@@ -282,108 +292,392 @@ void CloseConnection()
 
 
 // In chat
-void Chat()
+void Chat(const char *Username, bool bTui)
 {
     bPerformExit = false;
 
-    int SelectResponse; // Used to check if we have data waiting in the socket ready to be consumed.
-    bHasMessageWaiting = false;
-    pthread_t InputThread;
+    PollEvent Events[MAX_EVENTS];
+    int EventCount; // Used to check if we have data waiting in the socket ready to be consumed.
+    int Counter;
+    int BytesReceived;
+    char *Line;
 
-    printf("Connected.  Type your message and press enter to send it.  Type QUIT and press enter to Quit.\n");
-
-    // Create the input thread before the chat loop
-    if (pthread_create(&InputThread, NULL, WaitForUserInput, &bHasMessageWaiting))
-    {
+    if (bTui)
+        TuiStart(); // Prints why if it can't.  The chat carries on without it.
+    if (!ConsoleStart()) // Received messages are printed by their own thread so the terminal never holds up the socket.
         printf("Error creating thread\n");
-    }
+
+    ConsolePrintf("Connected.  Type your message and press enter to send it.  Type QUIT and press enter to Quit.\n");
+    ConsolePrintf("Type /join ROOM to talk in a room instead of to everyone, /history to see what was said in it, and /leave to leave it.\n");
+    ConsolePrintf("Type /name NAME to pick a name, and /msg NAME MESSAGE to send a message to one person only.\n");
+    ConsolePrintf("Type /send FILE to send a file to the room you're in, or everyone.\n");
+
+    FrameDecoderInit(&ServerDecoder, FRAME_DEFAULT_MAX_PAYLOAD);
+    OutBufferInit(&ServerOut);
+    bServerWantWrite = false;
+    bTransferReady = false;
+    CurrentRoom[0] = '\0';
+    if (Username[0] != '\0' && !SendLogin(Username)) // Goes out with the first flush.
+        bPerformExit = true;
+    if (ServerUnpacker && !SendCompressRequest())
+        bPerformExit = true;
+
+    if (!StartInputThread(ChatPoller))
+        ConsolePrintf("Error creating thread\n");
 
     // Begin chat loop.  Allow it to continue until someone types QUIT or other party disconnects.
     do {
-             if (bHasMessageWaiting) { // If the input thread has completed.
-                pthread_join(InputThread, NULL);
-
-                if (send(ServerSocket, InputBuffer, (int)strlen(InputBuffer), 0) == SOCKET_ERROR) {  // Send the message & check for errors.
-                    #ifdef _WIN32
-                    int SocketError = WSAGetLastError();
-                    if (SocketError == WSAECONNRESET)
-                        printf("Other party disconnected!\n");
-                    else
-                        printf("Socket Error! Code: %d\n", SocketError);
-                    #endif // _WIN32
+            // Send everything typed since the last wakeup, unless the server has stopped reading.  Then the input thread backs up instead.
+            while (!bPerformExit && ServerOut.QueuedBytes < SEND_HIGH_WATERMARK && (Line = NextInputLine()) != NULL) {
+                if (strcmp(Line, "QUIT") == 0)
+                    bPerformExit = true;
+                else if (!SendLine(Line)) {  // Queue the message & check for errors.
+                    ConsolePrintf("Out of memory!\n");
                     bPerformExit = true;
                 }
-
-                // Reset mesage waiting bool & InputBuffer
-                bHasMessageWaiting = false;
-                memset(InputBuffer,'\0',300);
-
-                // Create the input thread again
-                if (pthread_create(&InputThread, NULL, WaitForUserInput, NULL)) {
-                    printf("Error creating thread\n");
-                }
+                free(Line);
             }
 
-            // Prep file descriptor set
-            FD_ZERO(&FDS);
-            FD_SET(ServerSocket, &FDS);
+            // Everything typed since the last pass goes out in one write.
+            if (!bPerformExit && !bServerWantWrite && !FlushToServer()) {
+                #ifdef _WIN32
+                int SocketError = WSAGetLastError();
+                if (SocketError == WSAECONNRESET)
+                    ConsolePrintf("Other party disconnected!\n");
+                else
+                    ConsolePrintf("Socket Error! Code: %d\n", SocketError);
+                #endif // _WIN32
+                bPerformExit = true;
+            }
+            if (bPerformExit)
+                break;
 
-            SelectResponse = select(32, &FDS, NULL, NULL, &TV);
+            EventCount = PollerWait(ChatPoller, Events, MAX_EVENTS, bTransferReady && !bServerWantWrite ? 0 : POLL_TIMEOUT_MS);
 
-            if (SelectResponse == -1) {
+            if (EventCount == -1) {
                 #ifdef _WIN32
                 int SocketError = WSAGetLastError();
                 if (SocketError == WSAECONNRESET)
-                    printf("Other party disconnected!\n");
+                    ConsolePrintf("Other party disconnected!\n");
                 else
-                    printf("Socket Error! Code: %d\n", SocketError);
+                    ConsolePrintf("Socket Error! Code: %d\n", SocketError);
                 #endif // _WIN32
                 bPerformExit = true;
             }
-            else if (SelectResponse > 0) {
-                switch (recv(ServerSocket, ReceiveBuffer, 300, 0)) {
-                case SOCKET_ERROR: ; // Semi-colon used as empty statement for C stndard compliance
-                    #ifdef _WIN32
-                    int SocketError = WSAGetLastError();
-                    if (SocketError == WSAECONNRESET)
-                        printf("Other party disconnected!\n");
-                    else
-                        printf("Socket Error! Code: %d\n", SocketError);
-                    #endif
-                    bPerformExit = true;
-                    break;
+            for (Counter = 0; Counter < EventCount; Counter++) {
+                if (Events[Counter].Context == NULL) // Woken by the input thread.  Its messages are sent at the top of the loop.
+                    continue;
 
-                case 0: //0 bytes received means other party gracefully closed the connection.
-                    printf("Other party quit!\n");
+                if ((Events[Counter].Events & POLL_WRITE) && bServerWantWrite && !FlushToServer()) {
+                    ConsolePrintf("Other party disconnected!\n");
                     bPerformExit = true;
                     break;
-
-                default:
-                    printf("They said: %s\n", ReceiveBuffer);
-                    memset(ReceiveBuffer,'\0',strlen(ReceiveBuffer)); // Clear the chat buffer
                 }
+
+                do { // Only one socket is watched.  Drain it, edge-triggered backends won't report it again until more data arrives.
+                    if (ServerTls)
+                        BytesReceived = (int)TlsRecv(ServerTls, ReceiveBuffer, RECEIVE_BUFFER_SIZE);
+                    else
+                        BytesReceived = recv(ServerSocket, ReceiveBuffer, RECEIVE_BUFFER_SIZE, 0);
+                    switch (BytesReceived) {
+                    case SOCKET_ERROR: ; // Semi-colon used as empty statement for C stndard compliance
+                        if (SocketWouldBlock())
+                            break;
+                        #ifdef _WIN32
+                        int SocketError = WSAGetLastError();
+                        if (SocketError == WSAECONNRESET)
+                            ConsolePrintf("Other party disconnected!\n");
+                        else
+                            ConsolePrintf("Socket Error! Code: %d\n", SocketError);
+                        #endif
+                        bPerformExit = true;
+                        break;
+
+                    case 0: //0 bytes received means other party gracefully closed the connection.
+                        ConsolePrintf("Other party quit!\n");
+                        bPerformExit = true;
+                        break;
+
+                    default: // Could be part of a message or several at once.  The decoder hands back each complete one.
+                        if (!FrameDecoderFeed(&ServerDecoder, (uint8_t *)ReceiveBuffer, BytesReceived, ServerFrameReceived, NULL)) {
+                            ConsolePrintf("Server sent a malformed message!\n");
+                            bPerformExit = true;
+                        }
+                    }
+                } while (BytesReceived > 0 && !bPerformExit);
             }
 
     } while (bPerformExit != true);
+
+    TransferStop();
+    FrameDecoderFree(&ServerDecoder);
+    OutBufferFree(&ServerOut);
+    free(UserNames);
+    UserNames = NULL;
+    UserNameCount = 0;
+    ConsoleFlush(); // Anything printed from here on goes straight to stdout.
+    TuiStop();
 }
 
-void *WaitForUserInput() {
-    // printf("bHasMessageWaiting is at address: %p\n", (void*)&bHasMessageWaiting);
-    fgets(InputBuffer, 300, stdin);
+// Write whatever is queued for the server, then the next chunk of a file being sent.  Returns false if the connection failed.
+bool FlushToServer() {
+    int Pumped = TransferPump(&ServerOut, ServerSocket, ServerTls == NULL); // First, in case it's half way through a chunk.
+    int Flushed;
 
-    //trim newline characters so they aren't sent to the other party.
+    if (Pumped == TRANSFER_ERROR)
+        return false;
+    if (Pumped == TRANSFER_BLOCKED) // The rest of the chunk has to go before anything in ServerOut.
+        Flushed = OUTBUF_BLOCKED;
+    else
+        Flushed = ServerTls ? TlsFlush(ServerTls, &ServerOut, false) : OutBufferFlush(&ServerOut, ServerSocket, false);
+    bTransferReady = Pumped == TRANSFER_MORE;
 
-    size_t LastChar = strlen (InputBuffer) - 1;
-    if (InputBuffer[LastChar] == '\n')
-        InputBuffer[LastChar] = '\0';
+    switch (Flushed) {
+    case OUTBUF_ERROR:
+        return false;
 
-    LastChar = strlen (InputBuffer) - 1;
-    if (InputBuffer[LastChar] == '\r')
-        InputBuffer[LastChar] = '\0';
+    case OUTBUF_BLOCKED: // Socket buffer full.  Carry on when the backend says it's writable again.
+        if (!bServerWantWrite)
+            PollerModify(ChatPoller, ServerSocket, &ServerSocket, POLL_READ | POLL_WRITE);
+        bServerWantWrite = true;
+        return true;
+
+    default:
+        if (bServerWantWrite)
+            PollerModify(ChatPoller, ServerSocket, &ServerSocket, POLL_READ);
+        bServerWantWrite = false;
+        return true;
+    }
+}
 
-    bHasMessageWaiting = true;
-    pthread_exit(NULL);
-    return NULL; // avoid warning regarding reaching end of non-void function
+// Queue a typed line: a room command, or a message for the current room or everyone.  Returns false if out of memory.
+bool SendLine(const char *Line) {
+    size_t RoomLength = strlen(CurrentRoom);
+    size_t LineLength = strlen(Line);
+    uint8_t *Payload;
+    bool bQueued;
+
+    if (strncmp(Line, "/join ", 6) == 0)
+        return SendRoomCommand(true, Line + 6);
+    if (strcmp(Line, "/leave") == 0)
+        return SendRoomCommand(false, CurrentRoom);
+    if (strncmp(Line, "/leave ", 7) == 0)
+        return SendRoomCommand(false, Line + 7);
+    if (strncmp(Line, "/name ", 6) == 0)
+        return SendLogin(Line + 6);
+    if (strncmp(Line, "/msg ", 5) == 0)
+        return SendDirect(Line + 5);
+    if (strcmp(Line, "/history") == 0 || strncmp(Line, "/history ", 9) == 0)
+        return SendHistoryRequest(Line[8] ? Line + 9 : "20");
+    if (strncmp(Line, "/send ", 6) == 0)
+        return TransferStart(&ServerOut, ServerSocket, Line + 6, CurrentRoom);
+
+    if (RoomLength == 0)
+        return OutBufferAppendFrame(&ServerOut, FRAME_MSG, Line, LineLength);
+
+    Payload = malloc(1 + RoomLength + LineLength);
+    if (Payload == NULL)
+        return false;
+    bQueued = OutBufferAppendFrame(&ServerOut, FRAME_ROOM_MSG, Payload,
+                                   FrameBuildRoomMessage(Payload, CurrentRoom, RoomLength, Line, LineLength));
+    free(Payload);
+    return bQueued;
+}
+
+// /join makes the room the current one.  /leave on its own leaves the current room.
+bool SendRoomCommand(bool bJoin, const char *Room) {
+    size_t RoomLength = strlen(Room);
+
+    if (!bJoin && RoomLength == 0) {
+        ConsolePrintf("You're not in a room.\n");
+        return true;
+    }
+    if (!RoomNameValid((const uint8_t *)Room, RoomLength)) {
+        ConsolePrintf("Room names are 1 to %d characters with no spaces.\n", ROOM_NAME_MAX);
+        return true;
+    }
+    if (!OutBufferAppendFrame(&ServerOut, bJoin ? FRAME_JOIN : FRAME_LEAVE, Room, RoomLength))
+        return false;
+
+    if (bJoin) {
+        memmove(CurrentRoom, Room, RoomLength + 1);
+        TuiSetPrompt(CurrentRoom);
+        ConsolePrintf("Joined %s.  Messages now go to %s only.\n", CurrentRoom, CurrentRoom);
+        return true;
+    }
+
+    ConsolePrintf("Left %s.\n", Room);
+    if (strcmp(Room, CurrentRoom) == 0) {
+        CurrentRoom[0] = '\0';
+        TuiSetPrompt(CurrentRoom);
+    }
+    return true;
+}
+
+bool SendLogin(const char *Name) {
+    if (!UserNameValid((const uint8_t *)Name, strlen(Name))) {
+        ConsolePrintf("Names are 1 to %d characters with no spaces.\n", USER_NAME_MAX);
+        return true;
+    }
+    return OutBufferAppendFrame(&ServerOut, FRAME_LOGIN, Name, strlen(Name));
+}
+
+// /history [N]: the current room's last N messages.
+bool SendHistoryRequest(const char *Count) {
+    uint8_t Payload[10 + ROOM_NAME_MAX];
+    size_t RoomLength = strlen(CurrentRoom);
+    char *End;
+    long Wanted = strtol(Count, &End, 10);
+    size_t CountLength;
+
+    if (RoomLength == 0) {
+        ConsolePrintf("Join a room first.\n");
+        return true;
+    }
+    if (End == Count || *End != '\0' || Wanted < 1) {
+        ConsolePrintf("Type /history or /history N, for the last N messages.\n");
+        return true;
+    }
+    CountLength = VarintEncode(Payload, (uint64_t)Wanted);
+    memcpy(Payload + CountLength, CurrentRoom, RoomLength);
+    return OutBufferAppendFrame(&ServerOut, FRAME_HISTORY, Payload, CountLength + RoomLength);
+}
+
+// /msg NAME MESSAGE.  The server only knows users by ID, so look the name up in what it has told us.
+bool SendDirect(const char *Line) {
+    const char *Text = strchr(Line, ' ');
+    size_t TextLength;
+    uint8_t *Payload;
+    uint64_t Id;
+    size_t IdLength;
+    bool bQueued;
+
+    if (Text == NULL || Text[1] == '\0') {
+        ConsolePrintf("Type /msg NAME MESSAGE.\n");
+        return true;
+    }
+    if ((Id = FindUser(Line, (size_t)(Text - Line))) == USER_NONE) {
+        ConsolePrintf("Nobody called %.*s is here.\n", (int)(Text - Line), Line);
+        return true;
+    }
+
+    Text++;
+    TextLength = strlen(Text);
+    Payload = malloc(10 + TextLength);
+    if (Payload == NULL)
+        return false;
+    IdLength = VarintEncode(Payload, Id);
+    memcpy(Payload + IdLength, Text, TextLength);
+    bQueued = OutBufferAppendFrame(&ServerOut, FRAME_DIRECT, Payload, IdLength + TextLength);
+    free(Payload);
+    return bQueued;
+}
+
+// Note the name the server gave an ID.  An empty name forgets it.
+bool RememberUser(uint64_t Id, const uint8_t *Name, size_t Length) {
+    size_t NewCount = UserNameCount ? UserNameCount : 64;
+    char (*NewNames)[USER_NAME_MAX + 1];
+
+    if (Id >= USERS_MAX || Length > USER_NAME_MAX)
+        return false;
+
+    if (Id >= UserNameCount) {
+        while (NewCount <= Id)
+            NewCount *= 2;
+        NewNames = realloc(UserNames, NewCount * sizeof(*UserNames));
+        if (NewNames == NULL)
+            return false;
+        memset(NewNames + UserNameCount, 0, (NewCount - UserNameCount) * sizeof(*UserNames));
+        UserNames = NewNames;
+        UserNameCount = NewCount;
+    }
+    memcpy(UserNames[Id], Name, Length);
+    UserNames[Id][Length] = '\0';
+    return true;
+}
+
+const char *UserName(uint64_t Id) {
+    if (Id >= UserNameCount || UserNames[Id][0] == '\0')
+        return "They"; // Not logged in, or the server operator.
+    return UserNames[Id];
+}
+
+uint64_t FindUser(const char *Name, size_t Length) {
+    size_t Counter;
+
+    for (Counter = 1; Counter < UserNameCount; Counter++) {
+        if (strlen(UserNames[Counter]) == Length && memcmp(UserNames[Counter], Name, Length) == 0)
+            return Counter;
+    }
+    return USER_NONE;
+}
+
+bool ServerFrameReceived(void *Context, uint8_t Type, const uint8_t *Payload, size_t Length) {
+    const uint8_t *Room;
+    const uint8_t *Text;
+    size_t RoomLength;
+    size_t TextLength;
+    uint64_t Id = USER_NONE;
+    size_t IdLength;
+    (void)Context;
+
+    if (Type == FRAME_MSG || Type == FRAME_ROOM_MSG || Type == FRAME_DIRECT || Type == FRAME_USER || Type == FRAME_USER_GONE
+        || Type == FRAME_FILE || Type == FRAME_CHUNK || Type == FRAME_FILE_END) {
+        if ((IdLength = VarintDecode(Payload, Length, &Id)) == 0) // Every one of these starts with a user ID.
+            return false;
+        Payload += IdLength;
+        Length -= IdLength;
+    }
+
+    if (Type == FRAME_MSG)
+        ConsolePrintf("%s said: %.*s\n", UserName(Id), (int)Length, (const char *)Payload);
+    else if (Type == FRAME_ROOM_MSG && FrameSplitRoomMessage(Payload, Length, &Room, &RoomLength, &Text, &TextLength))
+        ConsolePrintf("[%.*s] %s said: %.*s\n", (int)RoomLength, (const char *)Room, UserName(Id), (int)TextLength, (const char *)Text);
+    else if (Type == FRAME_DIRECT)
+        ConsolePrintf("%s (direct): %.*s\n", UserName(Id), (int)Length, (const char *)Payload);
+    else if (Type == FRAME_USER)
+        RememberUser(Id, Payload, Length);
+    else if (Type == FRAME_USER_GONE) {
+        TransferSenderGone(Id);
+        RememberUser(Id, Payload, 0);
+    }
+    else if (Type == FRAME_FILE || Type == FRAME_CHUNK || Type == FRAME_FILE_END)
+        TransferReceived(Type, Id, UserName(Id), Payload, Length);
+    else if (Type == FRAME_NOTICE)
+        ConsolePrintf("Server: %.*s\n", (int)Length, (const char *)Payload);
+    else if (Type == FRAME_PING) // Goes out with the next flush, at the top of the chat loop.
+        return OutBufferAppendFrame(&ServerOut, FRAME_PONG, Payload, Length);
+    else if (Type == FRAME_PACKED && ServerUnpacker)
+        return UnpackFrame(Payload, Length);
+    else if (Type == FRAME_COMPRESS && Length == 0)
+        ConsolePrintf("The server won't compress messages: compression is off there, or its dictionary isn't this one.\n");
+    return true; // Frame types this version doesn't know are skipped so newer servers can still talk to it.
+}
+
+// Ask for compressed messages (see compress.h).  The server answers with FRAME_COMPRESS either way.
+bool SendCompressRequest() {
+    uint8_t Id[10];
+
+    return OutBufferAppendFrame(&ServerOut, FRAME_COMPRESS, Id, VarintEncode(Id, CompressionDictionaryId()));
+}
+
+// A FRAME_PACKED: inflate it & handle the frame inside as if it had come as it is.
+bool UnpackFrame(const uint8_t *Payload, size_t Length) {
+    uint64_t Expected;
+    size_t VarintLength;
+    uint8_t *Unpacked;
+    bool bHandled;
+
+    if (Length < 2 || Payload[0] == FRAME_PACKED || (VarintLength = VarintDecode(Payload + 1, Length - 1, &Expected)) == 0
+        || Expected > FRAME_DEFAULT_MAX_PAYLOAD)
+        return false;
+    Unpacked = malloc(Expected ? (size_t)Expected : 1);
+    if (Unpacked == NULL)
+        return false;
+    bHandled = Decompress(ServerUnpacker, Payload + 1 + VarintLength, Length - 1 - VarintLength, Unpacked, (size_t)Expected)
+               && ServerFrameReceived(NULL, Payload[0], Unpacked, (size_t)Expected);
+    free(Unpacked);
+    return bHandled;
 }
 
 void ClearInputBuffer() {
@@ -411,68 +705,33 @@ void GetValidPortNo(int *PortNo) {
     } while (!bValidInput);
 }
 
-void GetValidIP(char *IPAddressBuffer) {
+void GetValidHost(char *HostBuffer) {
     bool bValidInput = false;
-    char LastIPOctet[20] = ""; // Used as part of IP validation routine.
-    int IPBufferLength = 0;
     char InputChar = 0;
     int Counter = 0;
-    int OctetCounter = 0; // Used to ensure IP address provided by used has 4 octets / 3 dots.
 
-   // Get IP address and validate
+    // Get the host and check it only has characters a host name, IPv4 or IPv6 address can contain.  getaddrinfo() does the rest.
     do {
         bValidInput = false; // Reset bValidInput flag
-        printf("\nWhat's the IP address you'd like to connect to? ");
+        printf("\nWhat's the host name or IP address you'd like to connect to? ");
 
-        fgets(InputBuffer, 300, stdin); // Get IP from user and store in InputBuffer
+        fgets(InputBuffer, 300, stdin); // Get host from user and store in InputBuffer
 
-        if (sscanf(InputBuffer, "%s", IPAddressBuffer) == 1) { // Store the first word provided by the user into the IPAddressBuffer string.
-
-            bValidInput = true; // Valid thus far.  May be deemed invalid with next checks
-            OctetCounter = 0;
-
-            IPBufferLength = strlen(IPAddressBuffer);
-
-            memset(LastIPOctet, '\0', 20); // Reinit this string in case this isn't the users first go at this.
-
-            for (Counter = 0; Counter < IPBufferLength; Counter++) { // Test for a valid IP
-                InputChar = IPAddressBuffer[Counter];
+        if (sscanf(InputBuffer, "%255s", HostBuffer) == 1) { // Store the first word provided by the user into HostBuffer.
+            bValidInput = true;
 
-                if ((!isdigit(InputChar)) && (InputChar != '.')) { // First check if the character is valid in an IP address.
-                    bValidInput = false;
-                    break;
-                }
+            for (Counter = 0; HostBuffer[Counter] != '\0'; Counter++) {
+                InputChar = HostBuffer[Counter];
 
-                if (InputChar == '.' && strlen(LastIPOctet) == 0) { // Check if the user is ending an octet prematurely.
+                if (!isalnum((unsigned char)InputChar) && InputChar != '.' && InputChar != '-' && InputChar != '_' && InputChar != ':'
+                    && InputChar != '%') { // ':' for IPv6, '%' for an IPv6 scope such as fe80::1%eth0.
                     bValidInput = false;
                     break;
                 }
-
-                if (InputChar == '.') { // Count how many octets / dots are listed in IP.
-                    OctetCounter++;
-                }
-
-                if (InputChar == '.' && strlen(LastIPOctet) > 0) { // Check if the last octet input was valid
-                    if (atoi(LastIPOctet) > 255 || atoi(LastIPOctet) < 0) {
-                        bValidInput = false;
-                        break;
-                    }
-                    memset(LastIPOctet, '\0', 20); // Reset this string so it can be used for the next octet
-                }
-                else {
-                    char cToStr[2]; // Convert character to String so strcat can be used.
-                    cToStr[0] = InputChar;
-                    cToStr[1] = '\0';
-                    strcat(LastIPOctet, cToStr); // Add current character onto LastIPOctet string used by IP validation routine.
-                }
             }
-            if (OctetCounter != 3) // Invalid if the user has not provided 4 octets.
-                bValidInput = false;
-            if (atoi(LastIPOctet) > 255 || atoi(LastIPOctet) < 0) // Check last octet
-                bValidInput = false;
         }
         if (!bValidInput)
-            printf("\nInvalid Input IP address.  Try again.\n");
+            printf("\nInvalid host name or IP address.  Try again.\n");
     }
     while (!bValidInput);
 }
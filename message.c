@@ -0,0 +1,66 @@
+#include "stdlib.h"
+#include "pthread.h"
+#include "message.h"
+#include "frame.h"
+#include "pool.h"
+
+// Whole allocation sizes (header included) of the message pools.  Chat lines land in the first few.  Anything bigger than the last is malloc'd.
+static const size_t SizeClasses[] = { 64, 128, 256, 512, 1024, 2048, 4096, 8192, 16384, 65536 };
+#define SIZE_CLASS_COUNT (int)(sizeof(SizeClasses) / sizeof(SizeClasses[0]))
+
+static Pool *MessagePools[SIZE_CLASS_COUNT];
+static pthread_once_t PoolsCreated = PTHREAD_ONCE_INIT;
+
+static void CreatePools() {
+    int Class;
+    for (Class = 0; Class < SIZE_CLASS_COUNT; Class++) // Roughly 256 KiB slabs, but never fewer than 4 messages per slab.
+        MessagePools[Class] = PoolCreate(SizeClasses[Class], SizeClasses[Class] < 65536 ? 262144 / SizeClasses[Class] : 4);
+}
+
+Message *MessageCreate(size_t Length) {
+    Message *NewMessage = NULL;
+    size_t Needed = sizeof(Message) + Length;
+    int Class;
+
+    pthread_once(&PoolsCreated, CreatePools);
+
+    for (Class = 0; Class < SIZE_CLASS_COUNT && SizeClasses[Class] < Needed; Class++);
+
+    if (Class < SIZE_CLASS_COUNT && MessagePools[Class] != NULL)
+        NewMessage = PoolAlloc(MessagePools[Class]);
+    else {
+        Class = -1;
+        NewMessage = malloc(Needed);
+    }
+
+    if (NewMessage == NULL)
+        return NULL;
+
+    atomic_init(&NewMessage->RefCount, 1);
+    NewMessage->SizeClass = Class;
+    NewMessage->Length = Length;
+    NewMessage->Packed = NULL;
+    return NewMessage;
+}
+
+Message *MessageCreateFrame(uint8_t Type, const void *Payload, size_t Length) {
+    Message *NewMessage = MessageCreate(FRAME_HEADER_MAX + Length);
+    if (NewMessage == NULL)
+        return NULL;
+
+    NewMessage->Length = FrameEncode(NewMessage->Data, Type, Payload, Length); // Usually shorter than the worst case allowed for.
+    return NewMessage;
+}
+
+void MessageRelease(Message *Shared) {
+    // Release ordering on the decrement & acquire before the free make every other holder's reads happen before the memory goes away.
+    if (atomic_fetch_sub_explicit(&Shared->RefCount, 1, memory_order_release) == 1) {
+        atomic_thread_fence(memory_order_acquire);
+        if (Shared->Packed)
+            MessageRelease(Shared->Packed);
+        if (Shared->SizeClass >= 0)
+            PoolFree(MessagePools[Shared->SizeClass], Shared);
+        else
+            free(Shared);
+    }
+}
@@ -0,0 +1,38 @@
+/*
+Immutable, reference counted message buffers.
+
+A message holds one encoded frame.  It is allocated once when the frame is built (e.g. when the server receives a chat line) and never
+changed afterwards, so any number of out buffers, on any number of threads, can point at the same bytes.  Every holder owns one
+reference.  The last MessageRelease() frees it.
+
+A message can carry a compressed twin, made along with it and released with it, so it's compressed once however many clients are sent it.
+
+Messages come from size-classed slab pools (pool.h), so building one for every received line doesn't go through malloc.
+*/
+
+#ifndef MESSAGE_H
+#define MESSAGE_H
+
+#include "stddef.h"
+#include "stdint.h"
+#include "stdatomic.h"
+
+typedef struct Message {
+    atomic_int RefCount;
+    int SizeClass; // Pool it came from (see message.c), -1 if too big for any and malloc'd.
+    size_t Length; // Bytes in Data.
+    struct Message *Packed; // The same frame compressed (see compress.h), for the clients that asked.  NULL = not worth it.  Owns a reference.
+    uint8_t Data[]; // The encoded frame, header included.
+} Message;
+
+Message *MessageCreate(size_t Length); // Data is left for the caller to fill in.  Starts with one reference.
+Message *MessageCreateFrame(uint8_t Type, const void *Payload, size_t Length); // Encode a frame into a new message.  See frame.h.
+
+static inline Message *MessageRetain(Message *Shared) {
+    atomic_fetch_add_explicit(&Shared->RefCount, 1, memory_order_relaxed); // The caller already holds a reference so it can't be freed meanwhile.
+    return Shared;
+}
+
+void MessageRelease(Message *Shared);
+
+#endif // MESSAGE_H
@@ -0,0 +1,426 @@
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "stdarg.h"
+#include "platform.h"
+#include "console.h"
+#include "metrics.h"
+
+#define REPORTER_TICK_MS 250 // Longest the reporter waits before checking for a stop request.
+#define HTTP_TIMEOUT_US 1000000 // A scraper gets this long, all told, to send its request & take the reply.
+#define HTTP_REQUEST_MAX 2048
+
+typedef struct MetricInfo {
+    const char *Name;
+    const char *Help;
+} MetricInfo;
+
+static const MetricInfo CounterInfo[METRIC_COUNTERS] = {
+    { "chat_connections_accepted_total", "Client connections taken on." },
+    { "chat_connections_closed_total", "Client connections closed, for any reason." },
+    { "chat_messages_received_total", "Chat messages received from clients." },
+    { "chat_bytes_received_total", "Bytes read from client sockets." },
+    { "chat_deliveries_total", "Messages queued for a client.  A broadcast to N clients counts N." },
+    { "chat_bytes_sent_total", "Bytes written to client sockets." },
+    { "chat_loop_iterations_total", "Event loop wakeups, one poller wait each." },
+    { "chat_recv_calls_total", "recv() calls on client sockets." },
+    { "chat_send_calls_total", "send() calls on client sockets." },
+    { "chat_recv_errors_total", "recv() calls that failed." },
+    { "chat_send_errors_total", "Flushes that failed." },
+    { "chat_protocol_errors_total", "Clients dropped for sending a malformed frame." },
+    { "chat_reads_paused_total", "Times a client went over the high watermark and stopped being read." },
+    { "chat_slow_consumers_dropped_total", "Clients dropped for having too much queued." },
+    { "chat_pings_sent_total", "Pings sent to clients that had gone quiet." },
+    { "chat_timeouts_total", "Clients dropped for staying silent too long or not finishing their handshake." },
+    { "chat_file_chunks_skipped_total", "File chunks not sent to clients that were already behind." },
+    { "chat_throttled_total", "Times a client went over a rate limit and was held back." },
+    { "chat_messages_cleaned_total", "Messages with control characters, escape sequences or invalid UTF-8 taken out." },
+    { "chat_inbox_items_total", "Messages & sockets handed over from other workers." },
+};
+
+static const MetricInfo GaugeInfo[METRIC_GAUGES] = {
+    { "chat_clients", "Connected clients." },
+    { "chat_queued_bytes", "Bytes waiting in out buffers, as of the last publish." },
+};
+
+static const MetricInfo HistogramInfo[METRIC_HISTOGRAMS] = {
+    { "chat_broadcast_latency_seconds", "From a message being read to it being queued for every client of a worker." },
+    { "chat_flush_wait_seconds", "From a frame being queued to the flush that writes it." },
+    { "chat_loop_busy_seconds", "Time an event loop pass spends working." },
+};
+
+// Histogram bucket bounds for Prometheus, in microseconds.  The underlying histogram is far finer, these are just what's exported.
+static const int64_t BucketBoundsUs[] = { 10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000,
+                                          1000000, 2500000, 5000000, 10000000 };
+
+#define BUCKET_BOUNDS (sizeof(BucketBoundsUs) / sizeof(BucketBoundsUs[0]))
+
+// Text built up for a reply.  Grows as needed.  bFailed is set if memory ran out, and the text is thrown away.
+typedef struct TextBuffer {
+    char *Data;
+    size_t Length;
+    size_t Capacity;
+    bool bFailed;
+} TextBuffer;
+
+typedef struct Reporter {
+    Metrics **All;
+    int Count;
+    SOCKET HttpSocket;
+    int StatsIntervalSecs;
+    pthread_t Thread;
+    atomic_bool bStopping;
+    // Totals as of the last stats line, so the line can show rates & what happened since.
+    uint64_t LastTotals[METRIC_COUNTERS];
+    Histogram LastHistograms[METRIC_HISTOGRAMS];
+    int64_t LastStatsUs;
+} Reporter;
+
+static Reporter *Running;
+
+void MetricsInit(Metrics *M) {
+    int Counter;
+
+    memset(M, 0, sizeof(Metrics));
+    for (Counter = 0; Counter < METRIC_HISTOGRAMS; Counter++) {
+        HistogramInit(&M->Recording[Counter]);
+        HistogramInit(&M->Published[Counter]);
+    }
+    M->LastPublishUs = MonotonicUs();
+    pthread_mutex_init(&M->Lock, NULL);
+}
+
+void MetricsFree(Metrics *M) {
+    pthread_mutex_destroy(&M->Lock);
+}
+
+uint64_t MetricsTotal(Metrics **All, int Count, int Counter) {
+    uint64_t Total = 0;
+    int Index;
+
+    for (Index = 0; Index < Count; Index++)
+        Total += atomic_load_explicit(&All[Index]->Counters[Counter], memory_order_relaxed);
+    return Total;
+}
+
+bool MetricsPending(const Metrics *M) {
+    int Counter;
+
+    for (Counter = 0; Counter < METRIC_HISTOGRAMS; Counter++) {
+        if (M->Recording[Counter].Total > 0)
+            return true;
+    }
+    return false;
+}
+
+bool MetricsPublishDue(const Metrics *M, int64_t NowUs) {
+    return NowUs - M->LastPublishUs >= METRICS_PUBLISH_US && MetricsPending(M);
+}
+
+void MetricsPublish(Metrics *M, int64_t NowUs) {
+    int Counter;
+
+    pthread_mutex_lock(&M->Lock);
+    for (Counter = 0; Counter < METRIC_HISTOGRAMS; Counter++)
+        HistogramMerge(&M->Published[Counter], &M->Recording[Counter]);
+    pthread_mutex_unlock(&M->Lock);
+
+    for (Counter = 0; Counter < METRIC_HISTOGRAMS; Counter++)
+        HistogramInit(&M->Recording[Counter]);
+    M->LastPublishUs = NowUs;
+}
+
+// Every worker's published histograms added together.
+static void MergePublished(Metrics **All, int Count, Histogram *Merged) {
+    int Index;
+    int Counter;
+
+    for (Counter = 0; Counter < METRIC_HISTOGRAMS; Counter++)
+        HistogramInit(&Merged[Counter]);
+
+    for (Index = 0; Index < Count; Index++) {
+        pthread_mutex_lock(&All[Index]->Lock);
+        for (Counter = 0; Counter < METRIC_HISTOGRAMS; Counter++)
+            HistogramMerge(&Merged[Counter], &All[Index]->Published[Counter]);
+        pthread_mutex_unlock(&All[Index]->Lock);
+    }
+}
+
+static void Append(TextBuffer *Text, const char *Format, ...) {
+    va_list Args;
+    int Needed;
+    size_t NewCapacity;
+    char *NewData;
+
+    if (Text->bFailed)
+        return;
+
+    for (;;) {
+        va_start(Args, Format);
+        Needed = vsnprintf(Text->Data + Text->Length, Text->Capacity - Text->Length, Format, Args);
+        va_end(Args);
+        if (Needed < 0) {
+            Text->bFailed = true;
+            return;
+        }
+        if ((size_t)Needed < Text->Capacity - Text->Length) {
+            Text->Length += Needed;
+            return;
+        }
+
+        NewCapacity = Text->Capacity * 2 > Text->Length + Needed + 1 ? Text->Capacity * 2 : Text->Length + Needed + 1;
+        NewData = realloc(Text->Data, NewCapacity);
+        if (NewData == NULL) {
+            Text->bFailed = true;
+            return;
+        }
+        Text->Data = NewData;
+        Text->Capacity = NewCapacity;
+    }
+}
+
+// Prometheus text exposition format.  Counters & gauges are per worker, so a saturated core stands out.  Histograms are merged.
+static void FormatPrometheus(Metrics **All, int Count, TextBuffer *Text) {
+    Histogram Merged[METRIC_HISTOGRAMS];
+    int Counter;
+    int Index;
+    size_t Bound;
+
+    for (Counter = 0; Counter < METRIC_COUNTERS; Counter++) {
+        Append(Text, "# HELP %s %s\n# TYPE %s counter\n", CounterInfo[Counter].Name, CounterInfo[Counter].Help, CounterInfo[Counter].Name);
+        for (Index = 0; Index < Count; Index++)
+            Append(Text, "%s{worker=\"%d\"} %llu\n", CounterInfo[Counter].Name, Index,
+                   (unsigned long long)atomic_load_explicit(&All[Index]->Counters[Counter], memory_order_relaxed));
+    }
+
+    for (Counter = 0; Counter < METRIC_GAUGES; Counter++) {
+        Append(Text, "# HELP %s %s\n# TYPE %s gauge\n", GaugeInfo[Counter].Name, GaugeInfo[Counter].Help, GaugeInfo[Counter].Name);
+        for (Index = 0; Index < Count; Index++)
+            Append(Text, "%s{worker=\"%d\"} %lld\n", GaugeInfo[Counter].Name, Index,
+                   (long long)atomic_load_explicit(&All[Index]->Gauges[Counter], memory_order_relaxed));
+    }
+
+    Append(Text, "# HELP chat_inbox_depth Items posted to a worker's inbox and not yet picked up.\n# TYPE chat_inbox_depth gauge\n");
+    for (Index = 0; Index < Count; Index++) {
+        uint64_t Drained = atomic_load_explicit(&All[Index]->Counters[METRIC_INBOX_DRAINED], memory_order_relaxed);
+        uint64_t Posted = atomic_load_explicit(&All[Index]->InboxPosted, memory_order_relaxed);
+        Append(Text, "chat_inbox_depth{worker=\"%d\"} %llu\n", Index, (unsigned long long)(Posted > Drained ? Posted - Drained : 0));
+    }
+
+    MergePublished(All, Count, Merged);
+    for (Counter = 0; Counter < METRIC_HISTOGRAMS; Counter++) {
+        Append(Text, "# HELP %s %s\n# TYPE %s histogram\n", HistogramInfo[Counter].Name, HistogramInfo[Counter].Help, HistogramInfo[Counter].Name);
+        for (Bound = 0; Bound < BUCKET_BOUNDS; Bound++)
+            Append(Text, "%s_bucket{le=\"%g\"} %llu\n", HistogramInfo[Counter].Name, (double)BucketBoundsUs[Bound] / 1e6,
+                   (unsigned long long)HistogramCountAtOrBelow(&Merged[Counter], BucketBoundsUs[Bound]));
+        Append(Text, "%s_bucket{le=\"+Inf\"} %llu\n%s_sum %.6f\n%s_count %llu\n", HistogramInfo[Counter].Name,
+               (unsigned long long)Merged[Counter].Total, HistogramInfo[Counter].Name, Merged[Counter].Sum / 1e6,
+               HistogramInfo[Counter].Name, (unsigned long long)Merged[Counter].Total);
+    }
+}
+
+// Wait for Socket to be ready, but no later than DeadlineUs.
+static bool WaitFor(SOCKET Socket, short Events, int64_t DeadlineUs) {
+    PollFd Entry;
+    int64_t LeftUs = DeadlineUs - MonotonicUs();
+
+    if (LeftUs <= 0)
+        return false;
+    Entry.fd = Socket;
+    Entry.events = Events;
+    Entry.revents = 0;
+    return poll(&Entry, 1, (int)((LeftUs + 999) / 1000)) > 0;
+}
+
+static bool SendAll(SOCKET Socket, const char *Data, size_t Length, int64_t DeadlineUs) {
+    long BytesSent;
+
+    while (Length > 0) {
+        BytesSent = send(Socket, Data, (int)Length, 0);
+        if (BytesSent == SOCKET_ERROR) {
+            if (!SocketWouldBlock() || !WaitFor(Socket, POLLOUT, DeadlineUs))
+                return false;
+            continue;
+        }
+        Data += BytesSent;
+        Length -= BytesSent;
+    }
+    return true;
+}
+
+// One request per connection, HTTP/1.0 style.  Anything asking for something other than / or /metrics gets a 404.  Served on the
+// reporter thread, so the whole exchange has one deadline: a scraper trickling its request a byte at a time can't hold it up for long.
+static void ServeScrape(Reporter *Self, SOCKET Scraper) {
+    int64_t DeadlineUs = MonotonicUs() + HTTP_TIMEOUT_US;
+    char Request[HTTP_REQUEST_MAX];
+    size_t Received = 0;
+    long BytesReceived;
+    TextBuffer Body = { NULL, 0, 0, false };
+    char Header[256];
+    bool bFound;
+
+    SetNonBlocking(Scraper); // Whether accepted sockets inherit it differs between systems.
+
+    while (Received < sizeof(Request) - 1) {
+        if (!WaitFor(Scraper, POLLIN, DeadlineUs))
+            return;
+        BytesReceived = recv(Scraper, Request + Received, (int)(sizeof(Request) - 1 - Received), 0);
+        if (BytesReceived == SOCKET_ERROR && SocketWouldBlock())
+            continue;
+        if (BytesReceived <= 0)
+            return;
+        Received += BytesReceived;
+        Request[Received] = '\0';
+        if (strstr(Request, "\r\n\r\n") || strstr(Request, "\n\n"))
+            break;
+    }
+    Request[Received] = '\0';
+
+    bFound = strncmp(Request, "GET /metrics ", 13) == 0 || strncmp(Request, "GET / ", 6) == 0;
+    if (bFound)
+        FormatPrometheus(Self->All, Self->Count, &Body);
+    else
+        Append(&Body, "Not found.  Metrics are at /metrics.\n");
+
+    if (Body.bFailed) {
+        free(Body.Data);
+        return;
+    }
+
+    snprintf(Header, sizeof(Header), "HTTP/1.0 %s\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n",
+             bFound ? "200 OK" : "404 Not Found", Body.Length);
+    if (SendAll(Scraper, Header, strlen(Header), DeadlineUs))
+        SendAll(Scraper, Body.Data, Body.Length, DeadlineUs);
+    free(Body.Data);
+}
+
+// Totals minus what they were last time, so percentiles cover the interval rather than the whole run.  Min isn't known for the
+// interval, and the max used is the run's, so only percentiles & counts are meaningful.
+static void HistogramSince(const Histogram *Now, const Histogram *Before, Histogram *Since) {
+    int Counter;
+
+    HistogramInit(Since);
+    for (Counter = 0; Counter < HISTOGRAM_BUCKETS; Counter++)
+        Since->Counts[Counter] = Now->Counts[Counter] - Before->Counts[Counter];
+    Since->Total = Now->Total - Before->Total;
+    Since->Sum = Now->Sum - Before->Sum;
+    Since->Min = 0;
+    Since->Max = Now->Max;
+}
+
+static void PrintStats(Reporter *Self, int64_t NowUs) {
+    uint64_t Totals[METRIC_COUNTERS];
+    Histogram Merged[METRIC_HISTOGRAMS];
+    Histogram Broadcast, Loop;
+    double Seconds = (double)(NowUs - Self->LastStatsUs) / 1e6;
+    long long Clients = 0, Queued = 0;
+    uint64_t Messages, Syscalls;
+    int Counter;
+
+    for (Counter = 0; Counter < METRIC_COUNTERS; Counter++)
+        Totals[Counter] = MetricsTotal(Self->All, Self->Count, Counter);
+    for (Counter = 0; Counter < Self->Count; Counter++) {
+        Clients += atomic_load_explicit(&Self->All[Counter]->Gauges[GAUGE_CLIENTS], memory_order_relaxed);
+        Queued += atomic_load_explicit(&Self->All[Counter]->Gauges[GAUGE_QUEUED_BYTES], memory_order_relaxed);
+    }
+    MergePublished(Self->All, Self->Count, Merged);
+    HistogramSince(&Merged[HISTOGRAM_BROADCAST_US], &Self->LastHistograms[HISTOGRAM_BROADCAST_US], &Broadcast);
+    HistogramSince(&Merged[HISTOGRAM_LOOP_US], &Self->LastHistograms[HISTOGRAM_LOOP_US], &Loop);
+
+    Messages = Totals[METRIC_MESSAGES_IN] - Self->LastTotals[METRIC_MESSAGES_IN];
+    Syscalls = Totals[METRIC_LOOPS] + Totals[METRIC_RECV_CALLS] + Totals[METRIC_SEND_CALLS]
+             - Self->LastTotals[METRIC_LOOPS] - Self->LastTotals[METRIC_RECV_CALLS] - Self->LastTotals[METRIC_SEND_CALLS];
+
+    ConsolePrintf("Stats: %lld client(s), %.0f msg/s in, %.0f deliveries/s, %.2f MB/s out, %.2f syscalls/msg, broadcast p50 %lld us "
+                  "p99 %lld us, loop p99 %lld us, %lld bytes queued, %llu dropped slow\n",
+                  Clients, (double)Messages / Seconds,
+                  (double)(Totals[METRIC_DELIVERIES] - Self->LastTotals[METRIC_DELIVERIES]) / Seconds,
+                  (double)(Totals[METRIC_BYTES_OUT] - Self->LastTotals[METRIC_BYTES_OUT]) / Seconds / 1e6,
+                  Messages ? (double)Syscalls / (double)Messages : 0.0,
+                  (long long)HistogramPercentile(&Broadcast, 50.0), (long long)HistogramPercentile(&Broadcast, 99.0),
+                  (long long)HistogramPercentile(&Loop, 99.0), Queued, (unsigned long long)Totals[METRIC_SLOW_DROPS]);
+
+    memcpy(Self->LastTotals, Totals, sizeof(Totals));
+    memcpy(Self->LastHistograms, Merged, sizeof(Merged));
+    Self->LastStatsUs = NowUs;
+}
+
+static void *ReporterMain(void *Arg) {
+    Reporter *Self = Arg;
+    PollFd Listener;
+    SOCKET Scraper;
+    int64_t NowUs;
+    int WaitMs;
+
+    while (!atomic_load(&Self->bStopping)) {
+        NowUs = MonotonicUs();
+        WaitMs = REPORTER_TICK_MS;
+        if (Self->StatsIntervalSecs > 0) {
+            int64_t DueUs = Self->LastStatsUs + Self->StatsIntervalSecs * 1000000LL;
+            if (NowUs >= DueUs) {
+                PrintStats(Self, NowUs);
+                continue;
+            }
+            if ((DueUs - NowUs) / 1000 < WaitMs)
+                WaitMs = (int)((DueUs - NowUs + 999) / 1000);
+        }
+
+        if (Self->HttpSocket == INVALID_SOCKET) {
+            SleepMs(WaitMs);
+            continue;
+        }
+
+        Listener.fd = Self->HttpSocket;
+        Listener.events = POLLIN;
+        Listener.revents = 0;
+        if (poll(&Listener, 1, WaitMs) <= 0)
+            continue;
+
+        // Back to the top once this wait would have been over, so scrapers coming one after another can't put off the stats line.
+        while (MonotonicUs() - NowUs < WaitMs * 1000LL && (Scraper = accept(Self->HttpSocket, NULL, NULL)) != INVALID_SOCKET) {
+            ServeScrape(Self, Scraper);
+            close(Scraper);
+        }
+    }
+    return NULL;
+}
+
+bool MetricsStartReporter(Metrics **All, int Count, SOCKET HttpSocket, int StatsIntervalSecs) {
+    Reporter *Self;
+    int Counter;
+
+    if (Running)
+        return false;
+
+    Self = calloc(1, sizeof(Reporter));
+    if (Self == NULL)
+        return false;
+
+    Self->All = All;
+    Self->Count = Count;
+    Self->HttpSocket = HttpSocket;
+    Self->StatsIntervalSecs = StatsIntervalSecs;
+    Self->LastStatsUs = MonotonicUs();
+    atomic_init(&Self->bStopping, false);
+    for (Counter = 0; Counter < METRIC_HISTOGRAMS; Counter++)
+        HistogramInit(&Self->LastHistograms[Counter]);
+
+    if (pthread_create(&Self->Thread, NULL, ReporterMain, Self)) {
+        free(Self);
+        return false;
+    }
+    Running = Self;
+    return true;
+}
+
+void MetricsStopReporter() {
+    if (Running == NULL)
+        return;
+
+    atomic_store(&Running->bStopping, true);
+    pthread_join(Running->Thread, NULL);
+    if (Running->HttpSocket != INVALID_SOCKET)
+        close(Running->HttpSocket);
+    free(Running);
+    Running = NULL;
+}
@@ -0,0 +1,98 @@
+/*
+Runtime metrics for the server.
+
+Every worker owns one Metrics block.  Its counters and gauges are written by that worker alone, with a relaxed atomic load & store
+rather than a locked read-modify-write, so counting costs about as much as a plain increment and any thread may read them at any time.
+Latency histograms (histogram.h) are recorded into the worker's private copy and merged into a shared copy under a lock about once a
+second, so the hot path never takes the lock and readers never see a histogram half way through an update.
+
+The reporter thread reads every block and serves them as Prometheus text on an HTTP port, prints a stats line every few seconds, or
+both.  It runs beside the workers and never touches their sockets, so a slow scrape can't hold up a message.
+*/
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "stdbool.h"
+#include "stdint.h"
+#include "stdatomic.h"
+#include "platform.h"
+#include "histogram.h"
+#include "pthread.h"
+
+#define METRICS_PUBLISH_US 1000000 // How often a worker hands its histograms over to readers.
+
+enum MetricCounter {
+    METRIC_ACCEPTED,
+    METRIC_CLOSED,
+    METRIC_MESSAGES_IN,
+    METRIC_BYTES_IN,
+    METRIC_DELIVERIES, // Messages queued for a client.  One broadcast to N clients is N deliveries.
+    METRIC_BYTES_OUT,
+    METRIC_LOOPS, // PollerWait() calls.
+    METRIC_RECV_CALLS,
+    METRIC_SEND_CALLS,
+    METRIC_RECV_ERRORS,
+    METRIC_SEND_ERRORS,
+    METRIC_PROTOCOL_ERRORS,
+    METRIC_READS_PAUSED,
+    METRIC_SLOW_DROPS,
+    METRIC_PINGS, // Pings sent to clients that had gone quiet.
+    METRIC_TIMEOUTS, // Clients dropped by an idle or handshake timeout.
+    METRIC_CHUNKS_SKIPPED, // File chunks not sent to a client that was already behind (see FRAME_CHUNK).
+    METRIC_THROTTLED, // Times a client went over a rate limit and stopped being read from for a while.
+    METRIC_MESSAGES_CLEANED, // Messages whose text had control characters, escape sequences or invalid UTF-8 taken out (see text.h).
+    METRIC_INBOX_DRAINED,
+    METRIC_COUNTERS
+};
+
+enum MetricGauge {
+    GAUGE_CLIENTS,
+    GAUGE_QUEUED_BYTES, // Bytes waiting in out buffers.  Updated when the worker publishes.
+    METRIC_GAUGES
+};
+
+enum MetricHistogram {
+    HISTOGRAM_BROADCAST_US, // From recv() returning a message to it being queued for every client of a worker.
+    HISTOGRAM_FLUSH_WAIT_US, // From a frame being queued to the flush that writes it.
+    HISTOGRAM_LOOP_US, // Time a pass of the event loop spends working, sleep excluded.
+    METRIC_HISTOGRAMS
+};
+
+typedef struct Metrics {
+    atomic_ullong Counters[METRIC_COUNTERS];
+    atomic_llong Gauges[METRIC_GAUGES];
+    Histogram Recording[METRIC_HISTOGRAMS]; // Owner only.
+    int64_t LastPublishUs;
+    pthread_mutex_t Lock;
+    Histogram Published[METRIC_HISTOGRAMS]; // Everything recorded up to LastPublishUs.  Guarded by Lock.
+    atomic_ullong InboxPosted; // The one field other threads write: items posted to the worker's inbox.  Depth = posted - drained.
+} Metrics;
+
+void MetricsInit(Metrics *M);
+void MetricsFree(Metrics *M);
+
+static inline void MetricsCount(Metrics *M, int Counter, uint64_t Amount) {
+    atomic_store_explicit(&M->Counters[Counter], atomic_load_explicit(&M->Counters[Counter], memory_order_relaxed) + Amount, memory_order_relaxed);
+}
+
+static inline void MetricsSet(Metrics *M, int Gauge, int64_t Value) {
+    atomic_store_explicit(&M->Gauges[Gauge], Value, memory_order_relaxed);
+}
+
+static inline void MetricsRecord(Metrics *M, int Which, int64_t Us) {
+    HistogramRecord(&M->Recording[Which], Us);
+}
+
+uint64_t MetricsTotal(Metrics **All, int Count, int Counter); // A counter summed over every block.
+
+bool MetricsPublishDue(const Metrics *M, int64_t NowUs); // Something is recorded & it's been METRICS_PUBLISH_US since the last publish.
+bool MetricsPending(const Metrics *M); // Something is recorded that readers can't see yet.
+void MetricsPublish(Metrics *M, int64_t NowUs);
+
+// Start the reporter for All.  HttpSocket is a listening socket to serve GET /metrics on (INVALID_SOCKET for none), and a stats line
+// is printed every StatsIntervalSecs (0 for none).  The blocks must outlive MetricsStopReporter().
+bool MetricsStartReporter(Metrics **All, int Count, SOCKET HttpSocket, int StatsIntervalSecs);
+void MetricsStopReporter(); // Stop the reporter & close HttpSocket.
+
+#endif // METRICS_H
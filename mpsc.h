@@ -0,0 +1,70 @@
+/*
+Lock-free multi-producer / single-consumer queue (Dmitry Vyukov's intrusive design).
+
+Any number of threads may push, one thread pops.  A push is a single atomic exchange, so producers never wait on each other or on the
+consumer.  Nodes are embedded in the caller's own structs (put the MpscNode first and cast).
+
+A pop can briefly see nothing while a producer is half way through a push.  Producers wake the consumer after pushing, so it simply
+tries again on the next wakeup.
+*/
+
+#ifndef MPSC_H
+#define MPSC_H
+
+#include "stddef.h"
+#include "stdatomic.h"
+
+typedef struct MpscNode {
+    _Atomic(struct MpscNode *) Next;
+} MpscNode;
+
+typedef struct MpscQueue {
+    _Alignas(64) _Atomic(MpscNode *) Head; // Last node pushed.  Shared by the producers.
+    _Alignas(64) MpscNode *Tail; // Next node to pop.  Consumer only.
+    MpscNode Stub; // Placeholder that keeps the list non-empty.
+} MpscQueue;
+
+static inline void MpscInit(MpscQueue *Queue) {
+    atomic_init(&Queue->Stub.Next, NULL);
+    atomic_init(&Queue->Head, &Queue->Stub);
+    Queue->Tail = &Queue->Stub;
+}
+
+static inline void MpscPush(MpscQueue *Queue, MpscNode *Node) {
+    MpscNode *Previous;
+
+    atomic_store_explicit(&Node->Next, NULL, memory_order_relaxed);
+    Previous = atomic_exchange_explicit(&Queue->Head, Node, memory_order_acq_rel);
+    atomic_store_explicit(&Previous->Next, Node, memory_order_release); // Links the node in.  Until now the consumer can't reach it.
+}
+
+static inline MpscNode *MpscPop(MpscQueue *Queue) {
+    MpscNode *Tail = Queue->Tail;
+    MpscNode *Next = atomic_load_explicit(&Tail->Next, memory_order_acquire);
+
+    if (Tail == &Queue->Stub) { // Skip over the stub.
+        if (Next == NULL)
+            return NULL;
+        Queue->Tail = Next;
+        Tail = Next;
+        Next = atomic_load_explicit(&Next->Next, memory_order_acquire);
+    }
+
+    if (Next != NULL) {
+        Queue->Tail = Next;
+        return Tail;
+    }
+
+    if (Tail != atomic_load_explicit(&Queue->Head, memory_order_acquire))
+        return NULL; // A producer is mid push.  Its wakeup will bring us back.
+
+    MpscPush(Queue, &Queue->Stub); // Tail is the last node.  Put the stub behind it so it can be taken without emptying the list.
+    Next = atomic_load_explicit(&Tail->Next, memory_order_acquire);
+    if (Next != NULL) {
+        Queue->Tail = Next;
+        return Tail;
+    }
+    return NULL;
+}
+
+#endif // MPSC_H
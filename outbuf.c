@@ -0,0 +1,140 @@
+#include "stdlib.h"
+#include "string.h"
+#include "outbuf.h"
+
+void OutBufferInit(OutBuffer *Out) {
+    memset(Out, 0, sizeof(OutBuffer));
+}
+
+void OutBufferFree(OutBuffer *Out) {
+    while (Out->Count > 0) {
+        MessageRelease(Out->Entries[Out->Head].Shared);
+        Out->Head = (Out->Head + 1) & (Out->Capacity - 1);
+        Out->Count--;
+    }
+    free(Out->Entries);
+    memset(Out, 0, sizeof(OutBuffer));
+}
+
+// Double the ring, unwrapping it so the oldest entry is at the front again.
+static bool Grow(OutBuffer *Out) {
+    size_t NewCapacity = Out->Capacity ? Out->Capacity * 2 : 16;
+    OutEntry *NewEntries = malloc(NewCapacity * sizeof(OutEntry));
+    size_t Counter;
+
+    if (NewEntries == NULL)
+        return false;
+
+    for (Counter = 0; Counter < Out->Count; Counter++)
+        NewEntries[Counter] = Out->Entries[(Out->Head + Counter) & (Out->Capacity - 1)];
+
+    free(Out->Entries);
+    Out->Entries = NewEntries;
+    Out->Capacity = NewCapacity;
+    Out->Head = 0;
+    return true;
+}
+
+bool OutBufferAppendMessage(OutBuffer *Out, Message *Shared) {
+    OutEntry *Entry;
+
+    if (Out->Count == Out->Capacity && !Grow(Out))
+        return false;
+
+    if (Out->QueuedBytes == 0)
+        Out->FirstQueuedUs = MonotonicUs();
+
+    Entry = &Out->Entries[(Out->Head + Out->Count) & (Out->Capacity - 1)];
+    Entry->Shared = MessageRetain(Shared);
+    Entry->Offset = 0;
+    Out->Count++;
+    Out->QueuedBytes += Shared->Length;
+    return true;
+}
+
+bool OutBufferAppendFrame(OutBuffer *Out, uint8_t Type, const void *Payload, size_t Length) {
+    Message *Frame = MessageCreateFrame(Type, Payload, Length);
+    bool bQueued;
+
+    if (Frame == NULL)
+        return false;
+
+    bQueued = OutBufferAppendMessage(Out, Frame);
+    MessageRelease(Frame); // The queue holds the only reference now.
+    return bQueued;
+}
+
+// Drop Sent bytes from the front of the queue, releasing every message that has gone out completely.
+void OutBufferConsume(OutBuffer *Out, size_t Sent) {
+    Out->QueuedBytes -= Sent;
+
+    while (Sent > 0) {
+        OutEntry *Entry = &Out->Entries[Out->Head];
+        size_t Left = Entry->Shared->Length - Entry->Offset;
+
+        if (Sent < Left) {
+            Entry->Offset += Sent;
+            return;
+        }
+
+        Sent -= Left;
+        MessageRelease(Entry->Shared);
+        Out->Head = (Out->Head + 1) & (Out->Capacity - 1);
+        Out->Count--;
+    }
+}
+
+size_t OutBufferGather(const OutBuffer *Out, uint8_t *Buffer, size_t Max) {
+    const OutEntry *Entry;
+    size_t Copied = 0;
+    size_t Chunk;
+    size_t Counter;
+
+    for (Counter = 0; Counter < Out->Count && Copied < Max; Counter++) {
+        Entry = &Out->Entries[(Out->Head + Counter) & (Out->Capacity - 1)];
+        Chunk = Entry->Shared->Length - Entry->Offset;
+        if (Chunk > Max - Copied)
+            Chunk = Max - Copied;
+        memcpy(Buffer + Copied, Entry->Shared->Data + Entry->Offset, Chunk);
+        Copied += Chunk;
+    }
+    return Copied;
+}
+
+int OutBufferVectors(const OutBuffer *Out, IoVec *Vectors, int Max) {
+    const OutEntry *Entry;
+    int VectorCount;
+
+    for (VectorCount = 0; (size_t)VectorCount < Out->Count && VectorCount < Max; VectorCount++) {
+        Entry = &Out->Entries[(Out->Head + VectorCount) & (Out->Capacity - 1)];
+        IOVEC_BASE(Vectors[VectorCount]) = (void *)(Entry->Shared->Data + Entry->Offset);
+        IOVEC_LEN(Vectors[VectorCount]) = Entry->Shared->Length - Entry->Offset;
+    }
+    return VectorCount;
+}
+
+int OutBufferFlush(OutBuffer *Out, SOCKET Socket, bool bCork) {
+    IoVec Vectors[OUT_MAX_IOVECS];
+    int VectorCount;
+    long BytesSent;
+    int Result = OUTBUF_DONE;
+
+    if (bCork)
+        SetCork(Socket, true);
+
+    while (Out->Count > 0) {
+        VectorCount = OutBufferVectors(Out, Vectors, OUT_MAX_IOVECS);
+        BytesSent = SendVector(Socket, Vectors, VectorCount);
+        Out->SendCalls++;
+        if (BytesSent == SOCKET_ERROR) {
+            Result = SocketWouldBlock() ? OUTBUF_BLOCKED : OUTBUF_ERROR;
+            break;
+        }
+        OutBufferConsume(Out, (size_t)BytesSent);
+    }
+
+    if (bCork)
+        SetCork(Socket, false);
+
+    return Out->Count == 0 ? OUTBUF_DONE : Result;
+}
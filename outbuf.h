@@ -0,0 +1,55 @@
+/*
+Per connection outbound queue.
+
+Frames are queued as they are produced and written out later with as few syscalls as possible: everything queued goes out through
+one scatter / gather SendVector() call per flush, however many frames that is.  Data that doesn't fit in the socket buffer stays queued
+until the socket is writable again, so a slow reader never blocks the event loop.
+
+The queue holds references to shared messages (see message.h) rather than copies, so broadcasting one message to N connections costs
+N pointers, not N copies of the payload.
+*/
+
+#ifndef OUTBUF_H
+#define OUTBUF_H
+
+#include "platform.h"
+#include "message.h"
+
+#define OUT_MAX_IOVECS 128 // Messages handed to a single SendVector() call.
+
+typedef struct OutEntry {
+    Message *Shared;
+    size_t Offset; // Bytes of this message already sent.
+} OutEntry;
+
+typedef struct OutBuffer {
+    OutEntry *Entries; // Ring of queued messages, oldest at Head.
+    size_t Capacity; // Always a power of two.
+    size_t Head;
+    size_t Count;
+    size_t QueuedBytes;
+    int64_t FirstQueuedUs; // When the oldest unsent byte was queued.  Used by the coalescing window.
+    unsigned SendCalls; // SendVector() calls made by OutBufferFlush().  Whoever keeps count reads & resets it.
+} OutBuffer;
+
+enum { OUTBUF_DONE, OUTBUF_BLOCKED, OUTBUF_ERROR }; // OutBufferFlush results.
+
+void OutBufferInit(OutBuffer *Out);
+void OutBufferFree(OutBuffer *Out); // Releases everything still queued.
+
+bool OutBufferAppendMessage(OutBuffer *Out, Message *Shared); // Takes a new reference on Shared.  The caller keeps its own.
+bool OutBufferAppendFrame(OutBuffer *Out, uint8_t Type, const void *Payload, size_t Length); // Build a frame for this connection alone.
+
+// Write as much as the socket will take.  bCork wraps the writes in TCP_CORK so a flush needing several calls leaves in full segments.
+int OutBufferFlush(OutBuffer *Out, SOCKET Socket, bool bCork);
+
+// Point Vectors at up to Max queued messages, oldest first, without dequeuing them.  For senders that complete later (see uring.h),
+// which then OutBufferConsume() what went out.  Returns how many were filled in.
+int OutBufferVectors(const OutBuffer *Out, IoVec *Vectors, int Max);
+
+// For transports that can't take the shared messages directly (TLS without kernel offload): copy up to Max queued bytes, oldest
+// first, into Buffer without dequeuing them, and later drop the bytes that actually went out.
+size_t OutBufferGather(const OutBuffer *Out, uint8_t *Buffer, size_t Max);
+void OutBufferConsume(OutBuffer *Out, size_t Sent);
+
+#endif // OUTBUF_H
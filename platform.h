@@ -0,0 +1,184 @@
+/*
+Platform glue shared by every part of the chat program.  Win32 platforms use winsock, everything else uses berkeley sockets.
+
+To allow the same code to compile under both, some winsock names are (re)defined for POSIX here.
+*/
+
+#ifndef PLATFORM_H
+#define PLATFORM_H
+
+#include "stdbool.h"
+#include "stdint.h"
+#include "string.h"
+#include "errno.h"
+#include "signal.h" // Standard C, so SIGINT & SIGTERM handlers work on Win32 as well.
+#define HAVE_STRUCT_TIMESPEC
+#ifdef _WIN32 // Win32 platforms use winsock.
+#ifndef _WIN32_WINNT
+#define _WIN32_WINNT 0x0600 // WSAPoll needs Vista or newer.
+#endif
+#include <winsock2.h>
+#include <ws2tcpip.h>
+typedef int socklen_t;
+typedef WSAPOLLFD PollFd;
+typedef WSABUF IoVec; // Scatter / gather entry for SendVector.
+#define IOVEC_BASE(Vec) (Vec).buf
+#define IOVEC_LEN(Vec) (Vec).len
+#define close closesocket
+#define poll WSAPoll
+#define SHUT_RDWR SD_BOTH
+#else // Non windows platforms use berkeley sockets.
+#include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#include <netinet/tcp.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <poll.h>
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#define HAVE_SEND_FILE // SendFileRange() works here.
+#elif defined(__APPLE__) || defined(__FreeBSD__)
+#include <sys/types.h>
+#define HAVE_SEND_FILE
+#endif
+typedef struct pollfd PollFd;
+typedef struct iovec IoVec; // Scatter / gather entry for SendVector.
+#define IOVEC_BASE(Vec) (Vec).iov_base
+#define IOVEC_LEN(Vec) (Vec).iov_len
+#define SOCKET int
+#define SOCKET_ERROR -1
+#define INVALID_SOCKET -1
+#endif
+
+#define MAX_HOST_LENGTH 256 // Host names & IPv4 / IPv6 addresses, terminator included.
+#define MAX_PATH_LENGTH 512 // File names given in the configuration.
+
+// Put a socket into non-blocking mode.  Required by the edge-triggered event backends, which drain sockets until they would block.
+static inline bool SetNonBlocking(SOCKET Socket) {
+    #ifdef _WIN32
+    u_long Mode = 1;
+    return ioctlsocket(Socket, FIONBIO, &Mode) == 0;
+    #else
+    int Flags = fcntl(Socket, F_GETFL, 0);
+    return Flags != -1 && fcntl(Socket, F_SETFL, Flags | O_NONBLOCK) != -1;
+    #endif // _WIN32
+}
+
+// Error code of the last failed socket call.
+static inline int LastSocketError() {
+    #ifdef _WIN32
+    return WSAGetLastError();
+    #else
+    return errno;
+    #endif // _WIN32
+}
+
+// True if the last failed socket call only failed because a non-blocking socket had nothing to give / no room.
+static inline bool SocketWouldBlock() {
+    #ifdef _WIN32
+    return WSAGetLastError() == WSAEWOULDBLOCK;
+    #else
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+    #endif // _WIN32
+}
+
+// Send several buffers with one syscall (sendmsg / WSASend).  Returns bytes sent or SOCKET_ERROR.
+static inline long SendVector(SOCKET Socket, IoVec *Vectors, int Count) {
+    #ifdef _WIN32
+    DWORD BytesSent;
+    if (WSASend(Socket, Vectors, (DWORD)Count, &BytesSent, 0, NULL, NULL) == SOCKET_ERROR)
+        return SOCKET_ERROR;
+    return (long)BytesSent;
+    #else
+    struct msghdr Message;
+    memset(&Message, 0, sizeof(Message));
+    Message.msg_iov = Vectors;
+    Message.msg_iovlen = Count;
+    #ifdef MSG_NOSIGNAL
+    return (long)sendmsg(Socket, &Message, MSG_NOSIGNAL);
+    #else
+    return (long)sendmsg(Socket, &Message, 0);
+    #endif // MSG_NOSIGNAL
+    #endif // _WIN32
+}
+
+// Send Length bytes of File from Offset with sendfile(), straight from the page cache without copying them through user space.  Returns
+// bytes sent or SOCKET_ERROR, like SendVector.  Only where HAVE_SEND_FILE is defined, SOCKET_ERROR everywhere else.  (TransmitFile()
+// would do on windows, but only on blocking or overlapped sockets.)
+static inline long SendFileRange(SOCKET Socket, int File, int64_t Offset, size_t Length) {
+    #if defined(__linux__)
+    off_t At = (off_t)Offset;
+    return (long)sendfile(Socket, File, &At, Length);
+    #elif defined(__APPLE__)
+    off_t Sent = (off_t)Length;
+    if (sendfile(File, Socket, (off_t)Offset, &Sent, NULL, 0) == -1 && Sent == 0) // A partial send fails with EAGAIN but counts.
+        return SOCKET_ERROR;
+    return (long)Sent;
+    #elif defined(__FreeBSD__)
+    off_t Sent = 0;
+    if (sendfile(File, Socket, (off_t)Offset, Length, NULL, &Sent, 0) == -1 && Sent == 0)
+        return SOCKET_ERROR;
+    return (long)Sent;
+    #else
+    (void)Socket;
+    (void)File;
+    (void)Offset;
+    (void)Length;
+    return SOCKET_ERROR;
+    #endif
+}
+
+// Switch Nagle's algorithm off.  Small frames are coalesced by the out buffers instead, Nagle would only add latency on top.
+static inline void SetNoDelay(SOCKET Socket, bool bNoDelay) {
+    int Value = bNoDelay;
+    setsockopt(Socket, IPPROTO_TCP, TCP_NODELAY, (const char *)&Value, sizeof(Value));
+}
+
+// Cap a socket's kernel buffer, SO_SNDBUF or SO_RCVBUF.  Switches Linux's auto tuning of it off.
+static inline void SetSocketBuffer(SOCKET Socket, int Option, int Bytes) {
+    setsockopt(Socket, SOL_SOCKET, Option, (const char *)&Bytes, sizeof(Bytes));
+}
+
+// Hold back partial TCP segments while a flush is written in several pieces.  Linux only, a no-op elsewhere.
+static inline void SetCork(SOCKET Socket, bool bCork) {
+    #ifdef TCP_CORK
+    int Value = bCork;
+    setsockopt(Socket, IPPROTO_TCP, TCP_CORK, &Value, sizeof(Value));
+    #else
+    (void)Socket;
+    (void)bCork;
+    #endif // TCP_CORK
+}
+
+// Microseconds from an arbitrary fixed point.  Never goes backwards, unlike the time of day.
+static inline int64_t MonotonicUs() {
+    #ifdef _WIN32
+    LARGE_INTEGER Frequency, Counter;
+    QueryPerformanceFrequency(&Frequency);
+    QueryPerformanceCounter(&Counter);
+    return (int64_t)(Counter.QuadPart / Frequency.QuadPart * 1000000 + Counter.QuadPart % Frequency.QuadPart * 1000000 / Frequency.QuadPart);
+    #else
+    struct timespec Now;
+    clock_gettime(CLOCK_MONOTONIC, &Now);
+    return (int64_t)Now.tv_sec * 1000000 + Now.tv_nsec / 1000;
+    #endif // _WIN32
+}
+
+// Give up the CPU for a few milliseconds.  Only for threads that are allowed to block, never for the event loop.
+static inline void SleepMs(int Milliseconds) {
+    #ifdef _WIN32
+    Sleep(Milliseconds);
+    #else
+    struct timespec Duration;
+    Duration.tv_sec = Milliseconds / 1000;
+    Duration.tv_nsec = (Milliseconds % 1000) * 1000000L;
+    nanosleep(&Duration, NULL);
+    #endif // _WIN32
+}
+
+#endif // PLATFORM_H
@@ -0,0 +1,433 @@
+#include "stdlib.h"
+#include "string.h"
+#include "stdatomic.h"
+#include "poller.h"
+
+#if defined(__linux__)
+#define POLLER_EPOLL
+#include <sys/epoll.h>
+#elif defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__NetBSD__) || defined(__DragonFly__)
+#define POLLER_KQUEUE
+#include <sys/types.h>
+#include <sys/event.h>
+#include <sys/time.h>
+#else
+#define POLLER_POLL // WSAPoll on Windows, poll() on any other POSIX platform.  Both share the same shape so they share the code.
+#endif
+
+#if defined(POLLER_EPOLL)
+#include <sys/eventfd.h>
+#endif
+
+/*
+Wakeup channel.  PollerWakeup() makes it readable so a thread blocked in PollerWait() returns straight away.
+
+- Linux: an eventfd, both ends are the same descriptor.
+- Windows: WSAPoll can only wait on sockets (not event handles), so a loopback UDP socket connected to itself is used.
+- Other POSIX: a self-pipe.
+*/
+typedef struct Wakeup {
+    SOCKET ReadEnd;
+    SOCKET WriteEnd;
+    atomic_bool bPending; // Set while a wakeup is in flight so repeated wakeups only cost one syscall.
+} Wakeup;
+
+static bool OpenWakeup(Wakeup *Wake) {
+    atomic_init(&Wake->bPending, false);
+    #if defined(POLLER_EPOLL)
+    Wake->ReadEnd = Wake->WriteEnd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    return Wake->ReadEnd != -1;
+    #elif defined(_WIN32)
+    struct sockaddr_in Loopback;
+    socklen_t LoopbackLength = sizeof(Loopback);
+
+    memset(&Loopback, 0, sizeof(Loopback));
+    Loopback.sin_family = AF_INET;
+    Loopback.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    Loopback.sin_port = 0; // Any free port.
+
+    Wake->ReadEnd = Wake->WriteEnd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (Wake->ReadEnd == INVALID_SOCKET)
+        return false;
+
+    if (bind(Wake->ReadEnd, (struct sockaddr *)&Loopback, sizeof(Loopback)) == SOCKET_ERROR
+        || getsockname(Wake->ReadEnd, (struct sockaddr *)&Loopback, &LoopbackLength) == SOCKET_ERROR
+        || connect(Wake->ReadEnd, (struct sockaddr *)&Loopback, LoopbackLength) == SOCKET_ERROR
+        || !SetNonBlocking(Wake->ReadEnd)) {
+        close(Wake->ReadEnd);
+        return false;
+    }
+    return true;
+    #else
+    int Ends[2];
+    if (pipe(Ends) == -1)
+        return false;
+
+    Wake->ReadEnd = Ends[0];
+    Wake->WriteEnd = Ends[1];
+    fcntl(Ends[0], F_SETFD, FD_CLOEXEC);
+    fcntl(Ends[1], F_SETFD, FD_CLOEXEC);
+    return SetNonBlocking(Ends[0]) && SetNonBlocking(Ends[1]);
+    #endif
+}
+
+static void CloseWakeup(Wakeup *Wake) {
+    close(Wake->ReadEnd);
+    if (Wake->WriteEnd != Wake->ReadEnd)
+        close(Wake->WriteEnd);
+}
+
+static void SignalWakeup(Wakeup *Wake) {
+    if (atomic_exchange(&Wake->bPending, true))
+        return; // The waiting thread hasn't consumed the last wakeup yet.  That one will do.
+
+    #if defined(POLLER_EPOLL)
+    uint64_t One = 1;
+    if (write(Wake->WriteEnd, &One, sizeof(One)) == -1) {} // Only fails if the counter would overflow, which still wakes the reader.
+    #elif defined(_WIN32)
+    send(Wake->WriteEnd, "", 1, 0);
+    #else
+    if (write(Wake->WriteEnd, "", 1) == -1) {} // A full pipe is already readable.
+    #endif
+}
+
+// Empty the channel, then clear the pending flag.  Anything published before a skipped SignalWakeup() is visible once this returns.
+static void DrainWakeup(Wakeup *Wake) {
+    char Discard[64];
+    #ifdef _WIN32
+    while (recv(Wake->ReadEnd, Discard, sizeof(Discard), 0) > 0);
+    #else
+    while (read(Wake->ReadEnd, Discard, sizeof(Discard)) > 0);
+    #endif // _WIN32
+    atomic_store(&Wake->bPending, false);
+}
+
+#if defined(POLLER_EPOLL)
+
+struct Poller {
+    int EpollFd;
+    Wakeup Wake;
+    struct epoll_event Events[256];
+};
+
+const char *PollerBackendName() { return "epoll"; }
+int PollerHandle(Poller *Poller) { return Poller->EpollFd; }
+
+Poller *PollerCreate() {
+    Poller *NewPoller = calloc(1, sizeof(Poller));
+    if (NewPoller == NULL)
+        return NULL;
+
+    NewPoller->EpollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (NewPoller->EpollFd == -1) {
+        free(NewPoller);
+        return NULL;
+    }
+
+    if (!OpenWakeup(&NewPoller->Wake)) {
+        close(NewPoller->EpollFd);
+        free(NewPoller);
+        return NULL;
+    }
+
+    if (!PollerAdd(NewPoller, NewPoller->Wake.ReadEnd, &NewPoller->Wake, POLL_READ)) {
+        PollerDestroy(NewPoller);
+        return NULL;
+    }
+    return NewPoller;
+}
+
+void PollerDestroy(Poller *Poller) {
+    CloseWakeup(&Poller->Wake);
+    close(Poller->EpollFd);
+    free(Poller);
+}
+
+static uint32_t ToEpollEvents(int Events) {
+    uint32_t EpollEvents = EPOLLET | EPOLLRDHUP;
+    if (Events & POLL_READ)
+        EpollEvents |= EPOLLIN;
+    if (Events & POLL_WRITE)
+        EpollEvents |= EPOLLOUT;
+    return EpollEvents;
+}
+
+bool PollerAdd(Poller *Poller, SOCKET Socket, void *Context, int Events) {
+    struct epoll_event Event;
+    Event.events = ToEpollEvents(Events);
+    Event.data.ptr = Context;
+    return epoll_ctl(Poller->EpollFd, EPOLL_CTL_ADD, Socket, &Event) == 0;
+}
+
+bool PollerModify(Poller *Poller, SOCKET Socket, void *Context, int Events) {
+    struct epoll_event Event;
+    Event.events = ToEpollEvents(Events);
+    Event.data.ptr = Context;
+    return epoll_ctl(Poller->EpollFd, EPOLL_CTL_MOD, Socket, &Event) == 0;
+}
+
+void PollerRemove(Poller *Poller, SOCKET Socket) {
+    struct epoll_event Event; // Ignored, but kernels before 2.6.9 insist on a non-NULL pointer.
+    epoll_ctl(Poller->EpollFd, EPOLL_CTL_DEL, Socket, &Event);
+}
+
+int PollerWait(Poller *Poller, PollEvent *Events, int MaxEvents, int TimeoutMs) {
+    int Counter;
+    int Ready;
+
+    if (MaxEvents > 256)
+        MaxEvents = 256;
+
+    Ready = epoll_wait(Poller->EpollFd, Poller->Events, MaxEvents, TimeoutMs);
+    if (Ready == -1)
+        return errno == EINTR ? 0 : -1;
+
+    for (Counter = 0; Counter < Ready; Counter++) {
+        uint32_t EpollEvents = Poller->Events[Counter].events;
+        Events[Counter].Context = Poller->Events[Counter].data.ptr;
+        if (Events[Counter].Context == &Poller->Wake) {
+            DrainWakeup(&Poller->Wake);
+            Events[Counter].Context = NULL;
+        }
+        Events[Counter].Events = 0;
+        if (EpollEvents & (EPOLLIN | EPOLLRDHUP))
+            Events[Counter].Events |= POLL_READ; // Hang ups are reported as readable so recv() can see the 0 byte read.
+        if (EpollEvents & EPOLLOUT)
+            Events[Counter].Events |= POLL_WRITE;
+        if (EpollEvents & (EPOLLERR | EPOLLHUP))
+            Events[Counter].Events |= POLL_ERROR;
+    }
+    return Ready;
+}
+
+#elif defined(POLLER_KQUEUE)
+
+struct Poller {
+    int KqueueFd;
+    Wakeup Wake;
+    struct kevent Events[256];
+};
+
+const char *PollerBackendName() { return "kqueue"; }
+int PollerHandle(Poller *Poller) { return Poller->KqueueFd; }
+
+Poller *PollerCreate() {
+    Poller *NewPoller = calloc(1, sizeof(Poller));
+    if (NewPoller == NULL)
+        return NULL;
+
+    NewPoller->KqueueFd = kqueue();
+    if (NewPoller->KqueueFd == -1) {
+        free(NewPoller);
+        return NULL;
+    }
+
+    if (!OpenWakeup(&NewPoller->Wake)) {
+        close(NewPoller->KqueueFd);
+        free(NewPoller);
+        return NULL;
+    }
+
+    if (!PollerAdd(NewPoller, NewPoller->Wake.ReadEnd, &NewPoller->Wake, POLL_READ)) {
+        PollerDestroy(NewPoller);
+        return NULL;
+    }
+    return NewPoller;
+}
+
+void PollerDestroy(Poller *Poller) {
+    CloseWakeup(&Poller->Wake);
+    close(Poller->KqueueFd);
+    free(Poller);
+}
+
+// kqueue watches reading & writing with separate filters, so each one is switched on or off on its own.
+static bool ApplyFilters(Poller *Poller, SOCKET Socket, void *Context, int Events) {
+    struct kevent Changes[2];
+
+    EV_SET(&Changes[0], Socket, EVFILT_READ, (Events & POLL_READ) ? EV_ADD | EV_ENABLE | EV_CLEAR : EV_ADD | EV_DISABLE, 0, 0, Context);
+    EV_SET(&Changes[1], Socket, EVFILT_WRITE, (Events & POLL_WRITE) ? EV_ADD | EV_ENABLE | EV_CLEAR : EV_ADD | EV_DISABLE, 0, 0, Context);
+    return kevent(Poller->KqueueFd, Changes, 2, NULL, 0, NULL) == 0;
+}
+
+bool PollerAdd(Poller *Poller, SOCKET Socket, void *Context, int Events) {
+    return ApplyFilters(Poller, Socket, Context, Events);
+}
+
+bool PollerModify(Poller *Poller, SOCKET Socket, void *Context, int Events) {
+    return ApplyFilters(Poller, Socket, Context, Events);
+}
+
+void PollerRemove(Poller *Poller, SOCKET Socket) {
+    struct kevent Changes[2];
+
+    EV_SET(&Changes[0], Socket, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+    EV_SET(&Changes[1], Socket, EVFILT_WRITE, EV_DELETE, 0, 0, NULL);
+    kevent(Poller->KqueueFd, Changes, 2, NULL, 0, NULL);
+}
+
+int PollerWait(Poller *Poller, PollEvent *Events, int MaxEvents, int TimeoutMs) {
+    struct timespec Timeout;
+    int Counter;
+    int Ready;
+
+    if (MaxEvents > 256)
+        MaxEvents = 256;
+
+    Timeout.tv_sec = TimeoutMs / 1000;
+    Timeout.tv_nsec = (TimeoutMs % 1000) * 1000000L;
+
+    Ready = kevent(Poller->KqueueFd, NULL, 0, Poller->Events, MaxEvents, TimeoutMs < 0 ? NULL : &Timeout);
+    if (Ready == -1)
+        return errno == EINTR ? 0 : -1;
+
+    for (Counter = 0; Counter < Ready; Counter++) {
+        Events[Counter].Context = Poller->Events[Counter].udata;
+        Events[Counter].Events = Poller->Events[Counter].filter == EVFILT_WRITE ? POLL_WRITE : POLL_READ;
+        if (Events[Counter].Context == &Poller->Wake) {
+            DrainWakeup(&Poller->Wake);
+            Events[Counter].Context = NULL;
+        }
+        if (Poller->Events[Counter].flags & EV_ERROR)
+            Events[Counter].Events |= POLL_ERROR;
+    }
+    return Ready;
+}
+
+#else // POLLER_POLL
+
+struct Poller {
+    PollFd *Fds; // Sockets being watched, packed at the front of the array.
+    void **Contexts; // Context for each entry in Fds.
+    int Count;
+    int Capacity;
+    Wakeup Wake;
+};
+
+#ifdef _WIN32
+const char *PollerBackendName() { return "WSAPoll"; }
+#else
+const char *PollerBackendName() { return "poll"; }
+#endif // _WIN32
+int PollerHandle(Poller *Poller) { (void)Poller; return -1; }
+
+Poller *PollerCreate() {
+    Poller *NewPoller = calloc(1, sizeof(Poller));
+    if (NewPoller == NULL)
+        return NULL;
+
+    if (!OpenWakeup(&NewPoller->Wake)) {
+        free(NewPoller);
+        return NULL;
+    }
+
+    if (!PollerAdd(NewPoller, NewPoller->Wake.ReadEnd, &NewPoller->Wake, POLL_READ)) {
+        PollerDestroy(NewPoller);
+        return NULL;
+    }
+    return NewPoller;
+}
+
+void PollerDestroy(Poller *Poller) {
+    CloseWakeup(&Poller->Wake);
+    free(Poller->Fds);
+    free(Poller->Contexts);
+    free(Poller);
+}
+
+static short ToPollEvents(int Events) {
+    short PollEvents = 0;
+    if (Events & POLL_READ)
+        PollEvents |= POLLIN;
+    if (Events & POLL_WRITE)
+        PollEvents |= POLLOUT;
+    return PollEvents;
+}
+
+static int FindSocket(Poller *Poller, SOCKET Socket) {
+    int Counter;
+    for (Counter = 0; Counter < Poller->Count; Counter++) {
+        if (Poller->Fds[Counter].fd == Socket)
+            return Counter;
+    }
+    return -1;
+}
+
+bool PollerAdd(Poller *Poller, SOCKET Socket, void *Context, int Events) {
+    if (Poller->Count == Poller->Capacity) {
+        int NewCapacity = Poller->Capacity ? Poller->Capacity * 2 : 16;
+        PollFd *NewFds = realloc(Poller->Fds, NewCapacity * sizeof(PollFd));
+        void **NewContexts = NewFds ? realloc(Poller->Contexts, NewCapacity * sizeof(void *)) : NULL;
+
+        if (NewFds)
+            Poller->Fds = NewFds;
+        if (NewContexts == NULL)
+            return false;
+        Poller->Contexts = NewContexts;
+        Poller->Capacity = NewCapacity;
+    }
+
+    Poller->Fds[Poller->Count].fd = Socket;
+    Poller->Fds[Poller->Count].events = ToPollEvents(Events);
+    Poller->Fds[Poller->Count].revents = 0;
+    Poller->Contexts[Poller->Count] = Context;
+    Poller->Count++;
+    return true;
+}
+
+bool PollerModify(Poller *Poller, SOCKET Socket, void *Context, int Events) {
+    int Index = FindSocket(Poller, Socket);
+    if (Index == -1)
+        return false;
+
+    Poller->Fds[Index].events = ToPollEvents(Events);
+    Poller->Contexts[Index] = Context;
+    return true;
+}
+
+void PollerRemove(Poller *Poller, SOCKET Socket) {
+    int Index = FindSocket(Poller, Socket);
+    if (Index == -1)
+        return;
+
+    Poller->Count--; // Move the last entry into the free slot to keep the arrays packed.
+    Poller->Fds[Index] = Poller->Fds[Poller->Count];
+    Poller->Contexts[Index] = Poller->Contexts[Poller->Count];
+}
+
+int PollerWait(Poller *Poller, PollEvent *Events, int MaxEvents, int TimeoutMs) {
+    int Counter;
+    int Found = 0;
+    int Ready;
+
+    Ready = poll(Poller->Fds, Poller->Count, TimeoutMs);
+    if (Ready == SOCKET_ERROR)
+        return SocketWouldBlock() ? 0 : -1;
+
+    for (Counter = 0; Counter < Poller->Count && Found < Ready && Found < MaxEvents; Counter++) {
+        short PollEvents = Poller->Fds[Counter].revents;
+        if (PollEvents == 0)
+            continue;
+
+        Events[Found].Context = Poller->Contexts[Counter];
+        Events[Found].Events = 0;
+        if (Events[Found].Context == &Poller->Wake) {
+            DrainWakeup(&Poller->Wake);
+            Events[Found].Context = NULL;
+        }
+        if (PollEvents & (POLLIN | POLLHUP))
+            Events[Found].Events |= POLL_READ;
+        if (PollEvents & POLLOUT)
+            Events[Found].Events |= POLL_WRITE;
+        if (PollEvents & (POLLERR | POLLNVAL))
+            Events[Found].Events |= POLL_ERROR;
+        Found++;
+    }
+    return Found;
+}
+
+#endif
+
+void PollerWakeup(Poller *Poller) {
+    SignalWakeup(&Poller->Wake);
+}
@@ -0,0 +1,42 @@
+/*
+Socket readiness backend.  Picks the best mechanism the platform has:
+
+- Linux: epoll, edge-triggered.
+- BSD / macOS: kqueue, edge-triggered (EV_CLEAR).
+- Windows: WSAPoll, level-triggered.  IOCP is completion based rather than readiness based so it doesn't fit this interface.
+- Anything else: poll(), level-triggered.
+
+With the edge-triggered backends a socket is only reported when it *becomes* ready, so the caller must keep reading / writing until the
+socket would block.  Every caller does that regardless of backend, which keeps the level-triggered backends correct too.
+*/
+
+#ifndef POLLER_H
+#define POLLER_H
+
+#include "platform.h"
+
+enum { POLL_READ = 1, POLL_WRITE = 2, POLL_ERROR = 4 };
+
+typedef struct PollEvent {
+    void *Context; // Pointer registered alongside the socket.  NULL if the wait was ended by PollerWakeup().
+    int Events; // POLL_READ / POLL_WRITE / POLL_ERROR bits.
+} PollEvent;
+
+typedef struct Poller Poller;
+
+Poller *PollerCreate();
+void PollerDestroy(Poller *Poller);
+const char *PollerBackendName();
+int PollerHandle(Poller *Poller); // epoll / kqueue descriptor, readable while events are waiting, to nest the poller in another loop.  -1 if none.
+
+bool PollerAdd(Poller *Poller, SOCKET Socket, void *Context, int Events);
+bool PollerModify(Poller *Poller, SOCKET Socket, void *Context, int Events); // Change the events a socket is watched for.
+void PollerRemove(Poller *Poller, SOCKET Socket); // Must be called before the socket is closed.
+
+// Wait up to TimeoutMs (-1 = forever) for sockets to become ready.  Returns the number of events stored in Events or -1 on error.
+int PollerWait(Poller *Poller, PollEvent *Events, int MaxEvents, int TimeoutMs);
+
+// Make a PollerWait() on another thread return.  Safe to call from any thread.  Lets a loop sleep on its sockets & still notice other work.
+void PollerWakeup(Poller *Poller);
+
+#endif // POLLER_H
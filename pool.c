@@ -0,0 +1,106 @@
+#include "stdlib.h"
+#include "stdatomic.h"
+#include "pool.h"
+
+typedef struct PoolCache {
+    PoolFreeNode *Free;
+    size_t Count;
+} PoolCache;
+
+static atomic_int PoolCount;
+static _Thread_local PoolCache Caches[POOL_MAX_POOLS]; // This thread's free list for every pool, zeroed for each new thread.
+
+Pool *PoolCreate(size_t ObjectSize, size_t ObjectsPerSlab) {
+    Pool *NewPool;
+    int CacheIndex = atomic_fetch_add(&PoolCount, 1);
+
+    if (CacheIndex >= POOL_MAX_POOLS)
+        return NULL;
+
+    NewPool = calloc(1, sizeof(Pool));
+    if (NewPool == NULL)
+        return NULL;
+
+    if (ObjectSize < sizeof(PoolFreeNode))
+        ObjectSize = sizeof(PoolFreeNode);
+    NewPool->ObjectSize = (ObjectSize + 15) & ~(size_t)15;
+    NewPool->ObjectsPerSlab = ObjectsPerSlab > 0 ? ObjectsPerSlab : 1;
+    NewPool->CacheIndex = CacheIndex;
+    pthread_mutex_init(&NewPool->Lock, NULL);
+    return NewPool;
+}
+
+// Refill an empty thread cache with a batch from the depot, carving a new slab first if the depot is empty too.
+static void Refill(Pool *Source, PoolCache *Cache) {
+    size_t Counter;
+
+    pthread_mutex_lock(&Source->Lock);
+
+    if (Source->Depot == NULL) {
+        char *Slab = malloc(Source->ObjectSize * Source->ObjectsPerSlab);
+        if (Slab != NULL) {
+            for (Counter = 0; Counter < Source->ObjectsPerSlab; Counter++) {
+                PoolFreeNode *Node = (PoolFreeNode *)(Slab + Counter * Source->ObjectSize);
+                Node->Next = Source->Depot;
+                Source->Depot = Node;
+            }
+            Source->DepotCount += Source->ObjectsPerSlab;
+            Source->SlabCount++;
+        }
+    }
+
+    for (Counter = 0; Counter < POOL_BATCH && Source->Depot; Counter++) {
+        PoolFreeNode *Node = Source->Depot;
+        Source->Depot = Node->Next;
+        Source->DepotCount--;
+        Node->Next = Cache->Free;
+        Cache->Free = Node;
+        Cache->Count++;
+    }
+
+    pthread_mutex_unlock(&Source->Lock);
+}
+
+void *PoolAlloc(Pool *Source) {
+    PoolCache *Cache = &Caches[Source->CacheIndex];
+    PoolFreeNode *Node;
+
+    if (Cache->Free == NULL)
+        Refill(Source, Cache);
+
+    Node = Cache->Free;
+    if (Node == NULL)
+        return NULL;
+
+    Cache->Free = Node->Next;
+    Cache->Count--;
+    return Node;
+}
+
+void PoolFree(Pool *Source, void *Object) {
+    PoolCache *Cache = &Caches[Source->CacheIndex];
+    PoolFreeNode *Node = Object;
+    PoolFreeNode *Batch;
+    PoolFreeNode *BatchTail;
+    size_t Counter;
+
+    Node->Next = Cache->Free;
+    Cache->Free = Node;
+    Cache->Count++;
+
+    if (Cache->Count < 2 * POOL_BATCH)
+        return;
+
+    // This thread frees more than it allocates (e.g. it sends messages other threads received).  Hand a batch back to the depot.
+    Batch = BatchTail = Cache->Free;
+    for (Counter = 1; Counter < POOL_BATCH; Counter++)
+        BatchTail = BatchTail->Next;
+    Cache->Free = BatchTail->Next;
+    Cache->Count -= POOL_BATCH;
+
+    pthread_mutex_lock(&Source->Lock);
+    BatchTail->Next = Source->Depot;
+    Source->Depot = Batch;
+    Source->DepotCount += POOL_BATCH;
+    pthread_mutex_unlock(&Source->Lock);
+}
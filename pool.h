@@ -0,0 +1,39 @@
+/*
+Slab pools for fixed size objects (connection state, message buffers).
+
+Objects are carved out of big slabs and recycled through free lists, so the hot path never touches malloc / free.  Each thread keeps
+its own small free list per pool and only takes the pool lock to swap a whole batch with the shared depot, when its list runs dry or
+grows too long.  An object may be freed on a different thread from the one that allocated it (a message broadcast across workers),
+it simply joins the freeing thread's list.
+
+Pools live for the rest of the program once created.  Slabs are never handed back to the system.
+*/
+
+#ifndef POOL_H
+#define POOL_H
+
+#include "stddef.h"
+#include "pthread.h"
+
+#define POOL_MAX_POOLS 32 // Pools that can exist at once.  Each thread has a cache slot for every one.
+#define POOL_BATCH 32 // Objects moved between a thread's cache and the shared depot at a time.
+
+typedef struct PoolFreeNode {
+    struct PoolFreeNode *Next;
+} PoolFreeNode;
+
+typedef struct Pool {
+    size_t ObjectSize; // Rounded up so every object is 16 byte aligned.
+    size_t ObjectsPerSlab;
+    int CacheIndex; // Slot in each thread's cache array.
+    pthread_mutex_t Lock; // Guards the fields below.
+    PoolFreeNode *Depot; // Objects not cached by any thread.
+    size_t DepotCount;
+    size_t SlabCount;
+} Pool;
+
+Pool *PoolCreate(size_t ObjectSize, size_t ObjectsPerSlab); // NULL if out of memory or POOL_MAX_POOLS pools already exist.
+void *PoolAlloc(Pool *Source); // Contents are undefined.  NULL if out of memory.
+void PoolFree(Pool *Source, void *Object);
+
+#endif // POOL_H
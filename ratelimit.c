@@ -0,0 +1,20 @@
+#include "ratelimit.h"
+
+#define MICROS 1000000
+
+int64_t RateTake(RateBucket *Bucket, const RateLimit *Limit, int64_t Count, int64_t NowUs) {
+    int64_t Burst = Limit->Burst > 0 ? Limit->Burst : Limit->PerSecond;
+    int64_t ElapsedUs = NowUs - Bucket->RefilledUs;
+    int64_t Over;
+
+    if (Limit->PerSecond <= 0)
+        return 0;
+    // Each microsecond makes up PerSecond millionths.  Compared by division first, so a bucket left alone for days can't overflow.
+    if (ElapsedUs > 0)
+        Bucket->Spent = ElapsedUs > Bucket->Spent / Limit->PerSecond ? 0 : Bucket->Spent - ElapsedUs * Limit->PerSecond;
+    Bucket->RefilledUs = NowUs;
+
+    Bucket->Spent += Count * MICROS;
+    Over = Bucket->Spent - (Burst - 1) * MICROS; // Past the point where less than a whole token is left.
+    return Over > 0 ? (Over + Limit->PerSecond - 1) / Limit->PerSecond : 0;
+}
@@ -0,0 +1,34 @@
+/*
+Token buckets, for rate limits.
+
+A bucket holds up to Burst tokens and gains PerSecond of them a second.  No timer tops it up: every take first adds whatever it gained
+since the last one, from the caller's clock, so a bucket costs nothing while it isn't used.  A zeroed bucket is full.
+
+Taking never fails.  It can leave the bucket in debt, and RateTake() says how long until it's out again: as long as whoever took it
+waits that long before taking more, the debt never grows past one take each.  So something that goes over a limit is held back, for as
+long as it went over by, rather than refused.
+
+Tokens are counted in millionths, so a rate up to a billion a second is exact to the microsecond.
+*/
+
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include "stdbool.h"
+#include "stdint.h"
+
+typedef struct RateLimit {
+    int64_t PerSecond; // 0 = no limit.
+    int64_t Burst; // 0 = one second's worth.
+} RateLimit;
+
+typedef struct RateBucket {
+    int64_t Spent; // Millionths of a token taken & not yet made up.
+    int64_t RefilledUs;
+} RateBucket;
+
+// Top up Bucket to NowUs, then take Count tokens.  Returns how many microseconds from NowUs until it has a whole token again: 0 if it
+// still has one now (or Limit is no limit).
+int64_t RateTake(RateBucket *Bucket, const RateLimit *Limit, int64_t Count, int64_t NowUs);
+
+#endif // RATELIMIT_H
@@ -0,0 +1,847 @@
+/*
+Deterministic replay of client traffic through the server's receive path, in process and with no sockets, to measure what decoding &
+fan-out cost per message.  Built with -DCHAT_FUZZ it's a libFuzzer target over the same path instead.
+
+A trace is what clients sent, one record per recv(), as the bytes came off the wire.  A server started with --capture writes one (see
+capture.h), or -g makes up a synthetic one:
+
+    +----------------------+----------------------+-----------------+
+    | connection           | length               | bytes           |
+    | varint               | varint               | length bytes    |
+    +----------------------+----------------------+-----------------+
+
+A connection opens at its first record and closes at a record of length 0, or at the end of the trace.  Each record is fed to its
+connection's FrameDecoder, and each frame that completes is handled the way the server's one worker would, with the same parts: names
+go through the user registry, rooms through a RoomTable, and every message has its text cleaned (see text.h), is built once as a
+shared Message carrying the sender's ID, then queued by reference on each receiver's OutBuffer.  After every record whatever is queued is gathered (the copy a send would
+make) & consumed.  What this leaves out is server.c's own plumbing: the inboxes to other workers, history, metrics & rate limits.
+Nothing waits on anything, so the same trace always does exactly the same work.
+
+    replay -g trace.bin -c 100 -n 1000000 -s 64 -r 10    write a synthetic trace (100 clients, 10 rooms, 1M messages of 64 bytes)
+    replay trace.bin -i 10                               replay it (or a captured one) 10 times & report the fastest, in ns & cycles per message
+    replay -f crash-1234 ...                             run inputs through the fuzz target's checks, without libFuzzer
+
+The fuzz target takes its input as a trace and replays it twice, once as it's recorded and once a byte at a time, and the frames decoded
+& handled must come out the same both times.  So a change to the decoder (SIMD scanning for frame boundaries, say, or branchless varint
+parsing) that gets a split frame wrong is caught, as well as one that reads out of bounds.  Everything a client is sent is decoded
+again too, so a malformed frame built on the way out is caught as well.  It needs clang:
+
+    clang -g -O1 -fsanitize=fuzzer,address,undefined -DCHAT_FUZZ -o replay_fuzz replay.c frame.c message.c pool.c outbuf.c rooms.c users.c text.c -lpthread
+    ./replay_fuzz corpus/
+*/
+
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "stdbool.h"
+#include "stdint.h"
+#include "platform.h"
+#include "frame.h"
+#include "message.h"
+#include "outbuf.h"
+#include "rooms.h"
+#include "users.h"
+#include "text.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_CYCLE_COUNTER // The TSC, which counts at the CPU's base clock, not its boosted one.
+#endif
+
+#define REPLAY_CONNECTIONS_MAX 65536 // Records for connections numbered higher are skipped.
+#define REPLAY_ROOMS_MAX 64 // Rooms a connection may be in, as MAX_ROOMS_PER_CLIENT in server.c.
+#define GATHER_BYTES 65536 // Gathered from an out buffer at a time.
+#define RECORD_BATCH_BYTES 4096 // The synthetic trace puts a connection's consecutive frames in one record up to this size.
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+typedef struct ReplayOptions {
+    const char *TracePath; // Replay this, or with -g write it.
+    bool bGenerate;
+    bool bCheckFiles; // -f: the rest of the arguments are fuzz inputs.
+    int Iterations;
+    int ClientCount; // The rest are for -g.
+    long MessageCount;
+    int MessageSize;
+    int RoomCount; // 0 = every message goes to everyone.
+    unsigned Seed;
+} ReplayOptions;
+
+typedef struct ReplayClient {
+    int Connection;
+    int Index; // Where it is in Connected.
+    UserId Id;
+    FrameDecoder Decoder;
+    OutBuffer Out;
+    MembershipList Rooms;
+    bool bFlushing; // In Flushing already.
+    FrameDecoder Sent; // When checking: decodes what it's sent.
+} ReplayClient;
+
+typedef struct ReplayStats {
+    uint64_t Records;
+    uint64_t BytesIn;
+    uint64_t Frames; // Decoded from the clients.
+    uint64_t Messages; // Of those, chat messages: FRAME_MSG, FRAME_ROOM_MSG & FRAME_DIRECT.
+    uint64_t Deliveries; // Messages queued for a receiver.
+    uint64_t BytesOut;
+    uint64_t Dropped; // Connections closed for sending a malformed frame.
+    uint64_t Digest; // When checking: FNV-1a of every frame handled & every connection dropped, in order.
+} ReplayStats;
+
+ReplayOptions Options;
+ReplayStats Stats;
+ReplayClient *Clients[REPLAY_CONNECTIONS_MAX]; // By connection number.  NULL = not open.
+ReplayClient **Connected; // Open connections, packed, for broadcasts.
+int ConnectedCount;
+int ConnectedCapacity;
+ReplayClient **ById; // Logged in connections by user ID.
+size_t ByIdCapacity;
+ReplayClient **Flushing; // Have something queued since the last flush.
+int FlushingCount;
+RoomTable Rooms;
+uint8_t Gathered[GATHER_BYTES];
+uint8_t *Cleaned; // The frame being handled, if its text had to be cleaned.
+size_t CleanedCapacity;
+bool bChecking; // The fuzz target's checks are on.
+
+void PrintUsage();
+bool ParseOptions(int argc, char *argv[]);
+uint8_t *ReadFile(const char *Path, size_t *Length);
+bool WriteTrace(const char *Path);
+bool RunReplay(const uint8_t *Trace, size_t Length, bool bByteAtATime);
+bool NextRecord(const uint8_t *Trace, size_t Length, size_t *Offset, uint64_t *Connection, const uint8_t **Bytes, size_t *Size);
+ReplayClient *OpenConnection(int Connection);
+void CloseConnection(ReplayClient *Leaver);
+void FlushAll();
+bool ReplayFrameReceived(void *Context, uint8_t Type, const uint8_t *Payload, size_t Length);
+bool SentFrameReceived(void *Context, uint8_t Type, const uint8_t *Payload, size_t Length);
+void Deliver(ReplayClient *Receiver, Message *Shared);
+void Broadcast(ReplayClient *Sender, Message *Shared);
+Message *CreateUserFrame(uint8_t Type, UserId Sender, const void *Body, size_t Length);
+bool SendNotice(ReplayClient *Receiver, const char *Text);
+bool LogIn(ReplayClient *Member, const uint8_t *Name, size_t Length);
+bool JoinRoom(ReplayClient *Member, const uint8_t *Name, size_t Length);
+bool LeaveRoom(ReplayClient *Member, const uint8_t *Name, size_t Length);
+bool SendToRoom(ReplayClient *Sender, const uint8_t *Payload, size_t Length);
+bool SendDirect(ReplayClient *Sender, const uint8_t *Payload, size_t Length);
+const uint8_t *CleanText(const uint8_t *Payload, size_t *Length, size_t Skip);
+void CheckInput(const uint8_t *Data, size_t Length);
+void Digest(const void *Data, size_t Length);
+
+static inline uint64_t CycleCount() {
+    #ifdef HAVE_CYCLE_COUNTER
+    return __rdtsc();
+    #else
+    return 0;
+    #endif // HAVE_CYCLE_COUNTER
+}
+
+#ifndef CHAT_FUZZ
+
+int main(int argc, char *argv[]) {
+    uint8_t *Trace;
+    size_t Length;
+    int Counter;
+    int64_t StartUs;
+    int64_t BestUs = INT64_MAX;
+    uint64_t StartCycles;
+    uint64_t BestCycles = UINT64_MAX;
+
+    if (!ParseOptions(argc, argv)) {
+        PrintUsage();
+        return 1;
+    }
+    if (Options.bGenerate)
+        return WriteTrace(Options.TracePath) ? 0 : 1;
+
+    if (Options.bCheckFiles) {
+        for (Counter = 1; Counter < argc; Counter++) {
+            if (strcmp(argv[Counter], "-f") == 0 || (Trace = ReadFile(argv[Counter], &Length)) == NULL)
+                continue;
+            CheckInput(Trace, Length); // Aborts on a mismatch, as under libFuzzer.
+            printf("%s: ok, %llu frame(s).\n", argv[Counter], (unsigned long long)Stats.Frames);
+            free(Trace);
+        }
+        return 0;
+    }
+
+    if ((Trace = ReadFile(Options.TracePath, &Length)) == NULL)
+        return 1;
+    for (Counter = 0; Counter < Options.Iterations; Counter++) { // The fastest run is the one least disturbed by everything else.
+        StartUs = MonotonicUs();
+        StartCycles = CycleCount();
+        if (!RunReplay(Trace, Length, false)) {
+            printf("Out of memory!\n");
+            return 1;
+        }
+        if (CycleCount() - StartCycles < BestCycles)
+            BestCycles = CycleCount() - StartCycles;
+        if (MonotonicUs() - StartUs < BestUs)
+            BestUs = MonotonicUs() - StartUs;
+    }
+
+    printf("%llu records, %llu bytes in: %llu frames, %llu of them messages.  %llu deliveries, %llu bytes out.\n",
+           (unsigned long long)Stats.Records, (unsigned long long)Stats.BytesIn, (unsigned long long)Stats.Frames,
+           (unsigned long long)Stats.Messages, (unsigned long long)Stats.Deliveries, (unsigned long long)Stats.BytesOut);
+    if (Stats.Dropped)
+        printf("%llu connection(s) dropped for sending a malformed frame.\n", (unsigned long long)Stats.Dropped);
+    if (Stats.Messages == 0) {
+        printf("No messages to time.\n");
+        return 0;
+    }
+    printf("Fastest of %d: %.3f ms, %.1f ns per message", Options.Iterations, BestUs / 1e3, BestUs * 1e3 / Stats.Messages);
+    #ifdef HAVE_CYCLE_COUNTER
+    printf(", %.0f cycles per message, %.1f per delivery", (double)BestCycles / Stats.Messages,
+           Stats.Deliveries ? (double)BestCycles / Stats.Deliveries : 0.0);
+    #endif // HAVE_CYCLE_COUNTER
+    printf(".\n");
+    free(Trace);
+    return 0;
+}
+
+void PrintUsage() {
+    printf("Usage: replay TRACE [-i iterations]\n"
+           "       replay -g TRACE [-c clients] [-n messages] [-s size] [-r rooms] [-S seed]\n"
+           "       replay -f INPUT...\n"
+           "  -i  Replays, the fastest is reported (default 5)\n"
+           "  -g  Write a synthetic trace to TRACE instead\n"
+           "  -c  Clients, each logged in & in one room (default 100)\n"
+           "  -n  Messages: 80%% to a room, 15%% to everyone & 5%% direct, 5%% of them split over two records (default 1000000)\n"
+           "  -s  Message size in bytes (default 64)\n"
+           "  -r  Rooms, 0 = every message to everyone (default 10)\n"
+           "  -S  Random seed (default 1)\n"
+           "  -f  Check each INPUT as the fuzz target does\n");
+}
+
+bool ParseOptions(int argc, char *argv[]) {
+    int Counter;
+
+    Options.TracePath = NULL;
+    Options.Iterations = 5;
+    Options.ClientCount = 100;
+    Options.MessageCount = 1000000;
+    Options.MessageSize = 64;
+    Options.RoomCount = 10;
+    Options.Seed = 1;
+
+    for (Counter = 1; Counter < argc; Counter++) {
+        const char *Value = Counter + 1 < argc ? argv[Counter + 1] : NULL;
+
+        if (strcmp(argv[Counter], "-f") == 0) { // Every other argument is an input.
+            Options.bCheckFiles = true;
+            return argc > 2;
+        }
+        if (argv[Counter][0] != '-') {
+            if (Options.TracePath != NULL)
+                return false;
+            Options.TracePath = argv[Counter];
+            continue;
+        }
+        if (argv[Counter][1] == '\0' || argv[Counter][2] != '\0' || Value == NULL)
+            return false;
+
+        switch (argv[Counter][1]) {
+        case 'g':
+            Options.bGenerate = true;
+            Options.TracePath = Value;
+            break;
+        case 'i': Options.Iterations = atoi(Value); break;
+        case 'c': Options.ClientCount = atoi(Value); break;
+        case 'n': Options.MessageCount = atol(Value); break;
+        case 's': Options.MessageSize = atoi(Value); break;
+        case 'r': Options.RoomCount = atoi(Value); break;
+        case 'S': Options.Seed = (unsigned)strtoul(Value, NULL, 10); break;
+        default:
+            return false;
+        }
+        Counter++; // Skip the value.
+    }
+
+    return Options.TracePath != NULL && Options.Iterations > 0 && Options.ClientCount > 0 && Options.ClientCount < REPLAY_CONNECTIONS_MAX
+           && Options.MessageCount >= 0 && Options.MessageSize > 0 && Options.MessageSize <= FRAME_DEFAULT_MAX_PAYLOAD - ROOM_NAME_MAX - 1
+           && Options.RoomCount >= 0;
+}
+
+uint8_t *ReadFile(const char *Path, size_t *Length) {
+    FILE *File = fopen(Path, "rb");
+    uint8_t *Data = NULL;
+    long Size = 0;
+
+    if (File == NULL || fseek(File, 0, SEEK_END) != 0 || (Size = ftell(File)) < 0 || fseek(File, 0, SEEK_SET) != 0
+        || (Data = malloc(Size ? (size_t)Size : 1)) == NULL || fread(Data, 1, (size_t)Size, File) != (size_t)Size) {
+        printf("ERROR: unable to read %s!\n", Path);
+        free(Data);
+        Data = NULL;
+    }
+    if (File != NULL)
+        fclose(File);
+    *Length = (size_t)Size;
+    return Data;
+}
+
+// The synthetic trace.  Built in memory, then written in one go.
+typedef struct TraceWriter {
+    uint8_t *Data;
+    size_t Length;
+    size_t Capacity;
+    int OpenConnection; // Whose record is still being added to, -1 = none.
+    size_t OpenStart; // Where its bytes start.
+    size_t OpenLengthAt; // Where its length goes once it's known.
+    uint32_t Random;
+} TraceWriter;
+
+static uint32_t NextRandom(TraceWriter *Writer) { // xorshift32: the same seed always makes the same trace.
+    Writer->Random ^= Writer->Random << 13;
+    Writer->Random ^= Writer->Random >> 17;
+    Writer->Random ^= Writer->Random << 5;
+    return Writer->Random;
+}
+
+static bool TraceReserve(TraceWriter *Writer, size_t Length) {
+    size_t NewCapacity = Writer->Capacity ? Writer->Capacity : 65536;
+    uint8_t *NewData;
+
+    if (Writer->Length + Length <= Writer->Capacity)
+        return true;
+    while (NewCapacity < Writer->Length + Length)
+        NewCapacity *= 2;
+    if ((NewData = realloc(Writer->Data, NewCapacity)) == NULL)
+        return false;
+    Writer->Data = NewData;
+    Writer->Capacity = NewCapacity;
+    return true;
+}
+
+// Finish the open record: its length, as a varint, goes where room was left for the longest one.
+static void TraceCloseRecord(TraceWriter *Writer) {
+    uint8_t Varint[10];
+    size_t Length = Writer->Length - Writer->OpenStart;
+    size_t VarintLength;
+
+    if (Writer->OpenConnection < 0)
+        return;
+    VarintLength = VarintEncode(Varint, Length);
+    memmove(Writer->Data + Writer->OpenLengthAt + VarintLength, Writer->Data + Writer->OpenStart, Length);
+    memcpy(Writer->Data + Writer->OpenLengthAt, Varint, VarintLength);
+    Writer->Length = Writer->OpenLengthAt + VarintLength + Length;
+    Writer->OpenConnection = -1;
+}
+
+// Bytes from Connection: added to its open record, as if they'd come in the same recv(), or else to a new one.
+static bool TraceAdd(TraceWriter *Writer, int Connection, const uint8_t *Bytes, size_t Length, bool bNewRecord) {
+    if (Writer->OpenConnection != Connection || bNewRecord || Writer->Length - Writer->OpenStart + Length > RECORD_BATCH_BYTES) {
+        TraceCloseRecord(Writer);
+        if (!TraceReserve(Writer, 20))
+            return false;
+        Writer->Length += VarintEncode(Writer->Data + Writer->Length, (uint64_t)Connection);
+        Writer->OpenLengthAt = Writer->Length;
+        Writer->Length += 10;
+        Writer->OpenStart = Writer->Length;
+        Writer->OpenConnection = Connection;
+    }
+    if (!TraceReserve(Writer, Length))
+        return false;
+    memcpy(Writer->Data + Writer->Length, Bytes, Length);
+    Writer->Length += Length;
+    return true;
+}
+
+static bool TraceAddFrame(TraceWriter *Writer, int Connection, uint8_t Type, const void *Payload, size_t Length, uint8_t *Frame) {
+    size_t FrameLength = FrameEncode(Frame, Type, Payload, Length);
+    size_t Split;
+
+    if (FrameLength < 2 || NextRandom(Writer) % 20 != 0) // Most frames come whole, often several to a record.
+        return TraceAdd(Writer, Connection, Frame, FrameLength, NextRandom(Writer) % 2 == 0);
+    Split = 1 + NextRandom(Writer) % (FrameLength - 1); // The rest of this one comes in the next recv().
+    return TraceAdd(Writer, Connection, Frame, Split, true) && TraceAdd(Writer, Connection, Frame + Split, FrameLength - Split, true);
+}
+
+bool WriteTrace(const char *Path) {
+    TraceWriter Writer;
+    uint8_t *Frame = malloc(FRAME_HEADER_MAX + 10 + 1 + ROOM_NAME_MAX + Options.MessageSize);
+    uint8_t *Payload = malloc(10 + 1 + ROOM_NAME_MAX + Options.MessageSize);
+    char *Text = malloc(Options.MessageSize);
+    char Name[ROOM_NAME_MAX + 1];
+    long Counter;
+    int Connection;
+    int Kind;
+    size_t Length;
+    FILE *File;
+    bool bWritten = true;
+
+    memset(&Writer, 0, sizeof(Writer));
+    Writer.OpenConnection = -1;
+    Writer.Random = Options.Seed ? Options.Seed : 1;
+    if (Frame == NULL || Payload == NULL || Text == NULL) {
+        printf("Out of memory!\n");
+        return false;
+    }
+    for (Counter = 0; Counter < Options.MessageSize; Counter++)
+        Text[Counter] = 'a' + Counter % 26;
+
+    for (Connection = 0; Connection < Options.ClientCount && bWritten; Connection++) { // Everyone logs in & joins their room first.
+        Length = (size_t)snprintf(Name, sizeof(Name), "user%d", Connection);
+        bWritten = TraceAddFrame(&Writer, Connection, FRAME_LOGIN, Name, Length, Frame);
+        if (Options.RoomCount > 0) {
+            Length = (size_t)snprintf(Name, sizeof(Name), "room%d", Connection % Options.RoomCount);
+            bWritten = bWritten && TraceAddFrame(&Writer, Connection, FRAME_JOIN, Name, Length, Frame);
+        }
+    }
+
+    for (Counter = 0; Counter < Options.MessageCount && bWritten; Counter++) {
+        Connection = (int)(NextRandom(&Writer) % (uint32_t)Options.ClientCount);
+        Text[0] = 'a' + Counter % 26; // Not every message the same.
+        Kind = (int)(NextRandom(&Writer) % 100);
+        if (Kind < 5 && Options.ClientCount > 1) { // IDs are handed out in login order, from 1.
+            Length = VarintEncode(Payload, 1 + NextRandom(&Writer) % (uint32_t)Options.ClientCount);
+            memcpy(Payload + Length, Text, Options.MessageSize);
+            bWritten = TraceAddFrame(&Writer, Connection, FRAME_DIRECT, Payload, Length + Options.MessageSize, Frame);
+        }
+        else if (Kind < 20 || Options.RoomCount == 0)
+            bWritten = TraceAddFrame(&Writer, Connection, FRAME_MSG, Text, Options.MessageSize, Frame);
+        else {
+            Length = (size_t)snprintf(Name, sizeof(Name), "room%d", Connection % Options.RoomCount);
+            bWritten = TraceAddFrame(&Writer, Connection, FRAME_ROOM_MSG, Payload,
+                                     FrameBuildRoomMessage(Payload, Name, Length, Text, Options.MessageSize), Frame);
+        }
+    }
+    TraceCloseRecord(&Writer);
+
+    if (!bWritten)
+        printf("Out of memory!\n");
+    else if ((File = fopen(Path, "wb")) == NULL || fwrite(Writer.Data, 1, Writer.Length, File) != Writer.Length || fclose(File) != 0) {
+        printf("ERROR: unable to write %s!\n", Path);
+        bWritten = false;
+    }
+    else
+        printf("Wrote %s: %d clients, %ld messages, %zu bytes.\n", Path, Options.ClientCount, Options.MessageCount, Writer.Length);
+    free(Writer.Data);
+    free(Frame);
+    free(Payload);
+    free(Text);
+    return bWritten;
+}
+
+#endif // !CHAT_FUZZ
+
+// The next record of the trace at *Offset.  False at the end, and if what's left isn't a whole record.
+bool NextRecord(const uint8_t *Trace, size_t Length, size_t *Offset, uint64_t *Connection, const uint8_t **Bytes, size_t *Size) {
+    uint64_t RecordLength;
+    size_t Used;
+
+    if ((Used = VarintDecode(Trace + *Offset, Length - *Offset, Connection)) == 0)
+        return false;
+    *Offset += Used;
+    if ((Used = VarintDecode(Trace + *Offset, Length - *Offset, &RecordLength)) == 0 || RecordLength > Length - *Offset - Used)
+        return false;
+    *Offset += Used;
+    *Bytes = Trace + *Offset;
+    *Size = (size_t)RecordLength;
+    *Offset += *Size;
+    return true;
+}
+
+// Replay a whole trace, from nobody connected to nobody connected.  bByteAtATime feeds the decoders one byte per call instead of a
+// record.  Returns false if out of memory.
+bool RunReplay(const uint8_t *Trace, size_t Length, bool bByteAtATime) {
+    size_t Offset = 0;
+    uint64_t Connection;
+    const uint8_t *Bytes;
+    size_t Size;
+    size_t Counter;
+    ReplayClient *Sender;
+    bool bDecoded;
+
+    memset(&Stats, 0, sizeof(Stats));
+    Stats.Digest = FNV_OFFSET;
+    RoomTableInit(&Rooms);
+
+    while (NextRecord(Trace, Length, &Offset, &Connection, &Bytes, &Size)) {
+        Stats.Records++;
+        if (Connection >= REPLAY_CONNECTIONS_MAX || (Clients[Connection] == NULL && Size == 0))
+            continue;
+        if ((Sender = Clients[Connection]) == NULL && (Sender = OpenConnection((int)Connection)) == NULL)
+            return false;
+        if (Size == 0) {
+            CloseConnection(Sender);
+            FlushAll();
+            continue;
+        }
+
+        Stats.BytesIn += Size;
+        if (!bByteAtATime)
+            bDecoded = FrameDecoderFeed(&Sender->Decoder, Bytes, Size, ReplayFrameReceived, Sender);
+        else {
+            for (Counter = 0, bDecoded = true; Counter < Size && bDecoded; Counter++)
+                bDecoded = FrameDecoderFeed(&Sender->Decoder, Bytes + Counter, 1, ReplayFrameReceived, Sender);
+        }
+        FlushAll(); // The pass's sends, once everything read in it has been handled.
+        if (!bDecoded) { // As the server does.  The next record for it is a new connection.
+            Stats.Dropped++;
+            if (bChecking)
+                Digest(&Connection, sizeof(Connection));
+            CloseConnection(Sender);
+            FlushAll();
+        }
+    }
+
+    while (ConnectedCount > 0) {
+        CloseConnection(Connected[ConnectedCount - 1]);
+        FlushAll();
+    }
+    RoomTableFree(&Rooms);
+    UsersReset();
+    free(Connected);
+    Connected = NULL;
+    ConnectedCapacity = 0;
+    free(ById);
+    ById = NULL;
+    ByIdCapacity = 0;
+    free(Flushing);
+    Flushing = NULL;
+    return true;
+}
+
+ReplayClient *OpenConnection(int Connection) {
+    ReplayClient *Joiner;
+    ReplayClient **NewConnected;
+    int NewCapacity = ConnectedCapacity ? ConnectedCapacity * 2 : 64;
+
+    if (ConnectedCount == ConnectedCapacity) { // Flushing may hold every connection at once too, so it grows with Connected.
+        if ((NewConnected = realloc(Connected, NewCapacity * sizeof(ReplayClient *))) == NULL)
+            return NULL;
+        Connected = NewConnected;
+        if ((NewConnected = realloc(Flushing, NewCapacity * sizeof(ReplayClient *))) == NULL)
+            return NULL;
+        Flushing = NewConnected;
+        ConnectedCapacity = NewCapacity;
+    }
+    if ((Joiner = calloc(1, sizeof(ReplayClient))) == NULL)
+        return NULL;
+
+    Joiner->Connection = Connection;
+    Joiner->Id = USER_NONE;
+    FrameDecoderInit(&Joiner->Decoder, FRAME_DEFAULT_MAX_PAYLOAD);
+    FrameDecoderInit(&Joiner->Sent, FRAME_DEFAULT_MAX_PAYLOAD + 16); // A relayed frame is its sender's ID bigger.
+    OutBufferInit(&Joiner->Out);
+    Joiner->Index = ConnectedCount;
+    Connected[ConnectedCount++] = Joiner;
+    Clients[Connection] = Joiner;
+    return Joiner;
+}
+
+// Call with nothing queued for anyone, right after FlushAll(): Leaver is freed here and can't be left in Flushing.
+void CloseConnection(ReplayClient *Leaver) {
+    uint8_t Body[10];
+    UserId Id = Leaver->Id;
+    Message *Shared;
+
+    while (Leaver->Rooms.Count > 0)
+        RoomLeave(&Rooms, &Leaver->Rooms, Leaver->Rooms.Count - 1);
+    RoomMembershipFree(&Leaver->Rooms);
+
+    Connected[Leaver->Index] = Connected[--ConnectedCount];
+    Connected[Leaver->Index]->Index = Leaver->Index;
+    Clients[Leaver->Connection] = NULL;
+    FrameDecoderFree(&Leaver->Decoder);
+    FrameDecoderFree(&Leaver->Sent);
+    OutBufferFree(&Leaver->Out);
+    free(Leaver);
+
+    if (Id != USER_NONE) {
+        UserUnregister(Id);
+        ById[Id] = NULL;
+        if ((Shared = MessageCreateFrame(FRAME_USER_GONE, Body, VarintEncode(Body, Id))) != NULL)
+            Broadcast(NULL, Shared);
+    }
+}
+
+// What every connection was sent during the pass goes out: gathered, as a send would copy it, & consumed.
+void FlushAll() {
+    ReplayClient *Receiver;
+    size_t Length;
+    int Counter;
+
+    for (Counter = 0; Counter < FlushingCount; Counter++) {
+        Receiver = Flushing[Counter];
+        Receiver->bFlushing = false;
+        while (Receiver->Out.Count > 0 && (Length = OutBufferGather(&Receiver->Out, Gathered, GATHER_BYTES)) > 0) {
+            if (bChecking && !FrameDecoderFeed(&Receiver->Sent, Gathered, Length, SentFrameReceived, NULL)) {
+                fprintf(stderr, "Connection %d was sent a malformed frame!\n", Receiver->Connection);
+                abort();
+            }
+            OutBufferConsume(&Receiver->Out, Length);
+            Stats.BytesOut += Length;
+        }
+    }
+    FlushingCount = 0;
+}
+
+bool SentFrameReceived(void *Context, uint8_t Type, const uint8_t *Payload, size_t Length) {
+    (void)Context;
+    (void)Type;
+    (void)Payload;
+    (void)Length;
+    return true;
+}
+
+bool ReplayFrameReceived(void *Context, uint8_t Type, const uint8_t *Payload, size_t Length) {
+    ReplayClient *Sender = Context;
+
+    Stats.Frames++;
+    if (bChecking) {
+        Digest(&Sender->Connection, sizeof(Sender->Connection));
+        Digest(&Type, 1);
+        Digest(&Length, sizeof(Length));
+        Digest(Payload, Length);
+    }
+
+    switch (Type) {
+    case FRAME_MSG:
+        Stats.Messages++;
+        if ((Payload = CleanText(Payload, &Length, 0)) != NULL && Length > 0)
+            Broadcast(Sender, CreateUserFrame(FRAME_MSG, Sender->Id, Payload, Length));
+        return true;
+
+    case FRAME_ROOM_MSG:
+        Stats.Messages++;
+        return SendToRoom(Sender, Payload, Length);
+
+    case FRAME_DIRECT:
+        Stats.Messages++;
+        return SendDirect(Sender, Payload, Length);
+
+    case FRAME_JOIN:
+        return JoinRoom(Sender, Payload, Length);
+
+    case FRAME_LEAVE:
+        return LeaveRoom(Sender, Payload, Length);
+
+    case FRAME_LOGIN:
+        return LogIn(Sender, Payload, Length);
+
+    case FRAME_PING:
+        if (!OutBufferAppendFrame(&Sender->Out, FRAME_PONG, Payload, Length))
+            return true;
+        Deliver(Sender, NULL);
+        return true;
+    }
+    return true; // History, compression & files aren't replayed.
+}
+
+// Queue Shared for Receiver.  NULL if something has been queued already, by OutBufferAppendFrame().
+void Deliver(ReplayClient *Receiver, Message *Shared) {
+    if (Shared != NULL) {
+        if (!OutBufferAppendMessage(&Receiver->Out, Shared))
+            return;
+        Stats.Deliveries++;
+    }
+    if (!Receiver->bFlushing) {
+        Receiver->bFlushing = true;
+        Flushing[FlushingCount++] = Receiver;
+    }
+}
+
+// To every connection but Sender (NULL = everyone), then the caller's reference is dropped.
+void Broadcast(ReplayClient *Sender, Message *Shared) {
+    int Counter;
+
+    if (Shared == NULL)
+        return;
+    for (Counter = 0; Counter < ConnectedCount; Counter++) {
+        if (Connected[Counter] != Sender)
+            Deliver(Connected[Counter], Shared);
+    }
+    MessageRelease(Shared);
+}
+
+// As server.c's CreateUserFrame(), without the compressed twin.
+Message *CreateUserFrame(uint8_t Type, UserId Sender, const void *Body, size_t Length) {
+    uint8_t Id[10];
+    uint8_t Header[FRAME_HEADER_MAX];
+    size_t IdLength = VarintEncode(Id, Sender);
+    size_t HeaderLength = FrameEncodeHeader(Header, Type, IdLength + Length);
+    Message *Shared = MessageCreate(HeaderLength + IdLength + Length);
+
+    if (Shared == NULL)
+        return NULL;
+    memcpy(Shared->Data, Header, HeaderLength);
+    memcpy(Shared->Data + HeaderLength, Id, IdLength);
+    memcpy(Shared->Data + HeaderLength + IdLength, Body, Length);
+    return Shared;
+}
+
+bool SendNotice(ReplayClient *Receiver, const char *Text) {
+    if (OutBufferAppendFrame(&Receiver->Out, FRAME_NOTICE, Text, strlen(Text)))
+        Deliver(Receiver, NULL);
+    return true;
+}
+
+bool LogIn(ReplayClient *Member, const uint8_t *Name, size_t Length) {
+    uint8_t Body[10];
+    UserId Id;
+    uint32_t Generation;
+    size_t NewCapacity = ByIdCapacity ? ByIdCapacity : 256;
+    ReplayClient **NewById;
+    Message *Shared;
+
+    if (!UserNameValid(Name, Length))
+        return false;
+    if ((Id = UserRegister(Name, Length, 0, &Generation)) == USER_NONE)
+        return SendNotice(Member, "That name is taken.");
+    if (Id >= ByIdCapacity) {
+        while (NewCapacity <= Id)
+            NewCapacity *= 2;
+        if ((NewById = realloc(ById, NewCapacity * sizeof(ReplayClient *))) == NULL) {
+            UserUnregister(Id);
+            return SendNotice(Member, "Out of memory.");
+        }
+        memset(NewById + ByIdCapacity, 0, (NewCapacity - ByIdCapacity) * sizeof(ReplayClient *));
+        ById = NewById;
+        ByIdCapacity = NewCapacity;
+    }
+
+    if (Member->Id != USER_NONE) {
+        UserUnregister(Member->Id);
+        ById[Member->Id] = NULL;
+        Broadcast(Member, MessageCreateFrame(FRAME_USER_GONE, Body, VarintEncode(Body, Member->Id)));
+    }
+    Member->Id = Id;
+    ById[Id] = Member;
+
+    if ((Shared = MessageCreate(USER_FRAME_MAX)) != NULL) {
+        Shared->Length = UserFrameUser(Shared->Data, Id, Name, Length);
+        Broadcast(Member, Shared);
+    }
+    if ((Shared = UserDirectory()) != NULL) {
+        Deliver(Member, Shared);
+        MessageRelease(Shared);
+    }
+    return true;
+}
+
+bool JoinRoom(ReplayClient *Member, const uint8_t *Name, size_t Length) {
+    bool bCreated;
+
+    if (!RoomNameValid(Name, Length))
+        return false;
+    if (Member->Rooms.Count < REPLAY_ROOMS_MAX)
+        RoomJoin(&Rooms, Name, Length, Member, &Member->Rooms, &bCreated);
+    return true;
+}
+
+bool LeaveRoom(ReplayClient *Member, const uint8_t *Name, size_t Length) {
+    Room *Left;
+    int Slot;
+
+    if (!RoomNameValid(Name, Length))
+        return false;
+    Left = RoomFind(&Rooms, Name, Length, RoomHash(Name, Length));
+    if (Left != NULL && (Slot = RoomMembershipFind(&Member->Rooms, Left)) != -1)
+        RoomLeave(&Rooms, &Member->Rooms, Slot);
+    return true;
+}
+
+bool SendToRoom(ReplayClient *Sender, const uint8_t *Payload, size_t Length) {
+    const uint8_t *Name;
+    const uint8_t *Text;
+    size_t NameLength;
+    size_t TextLength;
+    Room *Target;
+    Message *Shared;
+    int Counter;
+
+    if (!FrameSplitRoomMessage(Payload, Length, &Name, &NameLength, &Text, &TextLength))
+        return false;
+    Target = RoomFind(&Rooms, Name, NameLength, RoomHash(Name, NameLength));
+    if (Target == NULL || RoomMembershipFind(&Sender->Rooms, Target) == -1) // Members only.
+        return true;
+    if ((Payload = CleanText(Payload, &Length, 1 + NameLength)) == NULL || Length == 1 + NameLength
+        || (Shared = CreateUserFrame(FRAME_ROOM_MSG, Sender->Id, Payload, Length)) == NULL)
+        return true;
+
+    for (Counter = 0; Counter < Target->MemberCount; Counter++) {
+        if (Target->Members[Counter].Owner != Sender)
+            Deliver(Target->Members[Counter].Owner, Shared);
+    }
+    MessageRelease(Shared);
+    return true;
+}
+
+bool SendDirect(ReplayClient *Sender, const uint8_t *Payload, size_t Length) {
+    uint64_t Target;
+    size_t IdLength = VarintDecode(Payload, Length, &Target);
+    Message *Shared;
+
+    if (IdLength == 0)
+        return false;
+    if (Sender->Id == USER_NONE)
+        return SendNotice(Sender, "Pick a name before sending direct messages.");
+    if (Target >= ByIdCapacity || ById[Target] == NULL)
+        return SendNotice(Sender, "No such user.");
+    if ((Payload = CleanText(Payload, &Length, IdLength)) == NULL || Length == IdLength
+        || (Shared = CreateUserFrame(FRAME_DIRECT, Sender->Id, Payload + IdLength, Length - IdLength)) == NULL)
+        return true;
+    Deliver(ById[Target], Shared);
+    MessageRelease(Shared);
+    return true;
+}
+
+// As server.c's CleanText().  When checking, what comes out must need no more cleaning.
+const uint8_t *CleanText(const uint8_t *Payload, size_t *Length, size_t Skip) {
+    size_t Clean = Skip + TextCleanPrefix(Payload + Skip, *Length - Skip);
+    uint8_t *NewBuffer;
+
+    if (Clean == *Length)
+        return Payload;
+    if (*Length > CleanedCapacity) {
+        if ((NewBuffer = realloc(Cleaned, *Length)) == NULL)
+            return NULL;
+        Cleaned = NewBuffer;
+        CleanedCapacity = *Length;
+    }
+    memcpy(Cleaned, Payload, Clean);
+    *Length = Clean + TextClean(Cleaned + Clean, Payload + Clean, *Length - Clean);
+    if (bChecking && TextCleanPrefix(Cleaned + Skip, *Length - Skip) != *Length - Skip) {
+        fprintf(stderr, "Cleaned text still needs cleaning!\n");
+        abort();
+    }
+    return Cleaned;
+}
+
+void Digest(const void *Data, size_t Length) {
+    const uint8_t *Bytes = Data;
+    size_t Counter;
+
+    for (Counter = 0; Counter < Length; Counter++)
+        Stats.Digest = (Stats.Digest ^ Bytes[Counter]) * FNV_PRIME;
+}
+
+// The fuzz target's checks: the same frames, handled the same way, whether they come a record or a byte at a time.  Aborts if not.
+void CheckInput(const uint8_t *Data, size_t Length) {
+    ReplayStats Whole;
+
+    bChecking = true;
+    if (!RunReplay(Data, Length, false))
+        return;
+    Whole = Stats;
+    if (!RunReplay(Data, Length, true))
+        return;
+    if (Whole.Digest != Stats.Digest || Whole.Frames != Stats.Frames || Whole.Deliveries != Stats.Deliveries
+        || Whole.BytesOut != Stats.BytesOut || Whole.Dropped != Stats.Dropped) {
+        fprintf(stderr, "Decoding a byte at a time differs: %llu frames & %llu bytes out, against %llu & %llu a record at a time!\n",
+                (unsigned long long)Stats.Frames, (unsigned long long)Stats.BytesOut, (unsigned long long)Whole.Frames,
+                (unsigned long long)Whole.BytesOut);
+        abort();
+    }
+}
+
+#ifdef CHAT_FUZZ
+
+int LLVMFuzzerTestOneInput(const uint8_t *Data, size_t Length) {
+    CheckInput(Data, Length);
+    return 0;
+}
+
+#endif // CHAT_FUZZ
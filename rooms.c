@@ -0,0 +1,207 @@
+#include "stdlib.h"
+#include "string.h"
+#include "rooms.h"
+
+#define INITIAL_TABLE_SLOTS 16
+#define INITIAL_MEMBERS 4
+
+uint32_t RoomHash(const uint8_t *Name, size_t Length) {
+    uint32_t Hash = 2166136261u;
+    size_t Counter;
+
+    for (Counter = 0; Counter < Length; Counter++) {
+        Hash ^= Name[Counter];
+        Hash *= 16777619u;
+    }
+    return Hash;
+}
+
+void RoomTableInit(RoomTable *Table) {
+    memset(Table, 0, sizeof(RoomTable));
+}
+
+static void FreeRoom(Room *Gone) {
+    free(Gone->Members);
+    free(Gone);
+}
+
+void RoomTableFree(RoomTable *Table) {
+    size_t Counter;
+
+    for (Counter = 0; Counter < Table->Capacity; Counter++) {
+        if (Table->Slots[Counter])
+            FreeRoom(Table->Slots[Counter]);
+    }
+    free(Table->Slots);
+    memset(Table, 0, sizeof(RoomTable));
+}
+
+// Slot holding the room, or the empty slot where it would go.  Linear probing, so a lookup is usually one or two cache lines.
+static size_t Probe(const RoomTable *Table, const uint8_t *Name, size_t Length, uint32_t Hash) {
+    size_t Mask = Table->Capacity - 1;
+    size_t Index = Hash & Mask;
+    Room *Candidate;
+
+    while ((Candidate = Table->Slots[Index]) != NULL) {
+        if (Candidate->Hash == Hash && Candidate->NameLength == Length && memcmp(Candidate->Name, Name, Length) == 0)
+            break;
+        Index = (Index + 1) & Mask;
+    }
+    return Index;
+}
+
+Room *RoomFind(const RoomTable *Table, const uint8_t *Name, size_t Length, uint32_t Hash) {
+    if (Table->Count == 0)
+        return NULL;
+    return Table->Slots[Probe(Table, Name, Length, Hash)];
+}
+
+static bool Grow(RoomTable *Table) {
+    size_t NewCapacity = Table->Capacity ? Table->Capacity * 2 : INITIAL_TABLE_SLOTS;
+    Room **NewSlots = calloc(NewCapacity, sizeof(Room *));
+    Room **OldSlots = Table->Slots;
+    size_t OldCapacity = Table->Capacity;
+    size_t Counter;
+
+    if (NewSlots == NULL)
+        return false;
+
+    Table->Slots = NewSlots;
+    Table->Capacity = NewCapacity;
+    for (Counter = 0; Counter < OldCapacity; Counter++) {
+        if (OldSlots[Counter])
+            NewSlots[Probe(Table, (const uint8_t *)OldSlots[Counter]->Name, OldSlots[Counter]->NameLength, OldSlots[Counter]->Hash)] = OldSlots[Counter];
+    }
+    free(OldSlots);
+    return true;
+}
+
+// Remove the room in slot Index.  Later entries of the same probe run are shifted back over the gap so lookups never need tombstones.
+static void RemoveSlot(RoomTable *Table, size_t Index) {
+    size_t Mask = Table->Capacity - 1;
+    size_t Next = Index;
+    size_t Home;
+
+    Table->Slots[Index] = NULL;
+    Table->Count--;
+
+    for (;;) {
+        Next = (Next + 1) & Mask;
+        if (Table->Slots[Next] == NULL)
+            return;
+
+        Home = Table->Slots[Next]->Hash & Mask;
+        // Move it back if its home slot is at or before the gap, going round the probe run from the gap to where it is now.
+        if (((Next - Home) & Mask) >= ((Next - Index) & Mask)) {
+            Table->Slots[Index] = Table->Slots[Next];
+            Table->Slots[Next] = NULL;
+            Index = Next;
+        }
+    }
+}
+
+static bool Reserve(void **Array, int *Capacity, int Needed, size_t ElementSize) {
+    int NewCapacity;
+    void *NewArray;
+
+    if (Needed <= *Capacity)
+        return true;
+
+    NewCapacity = *Capacity ? *Capacity * 2 : INITIAL_MEMBERS;
+    NewArray = realloc(*Array, (size_t)NewCapacity * ElementSize);
+    if (NewArray == NULL)
+        return false;
+    *Array = NewArray;
+    *Capacity = NewCapacity;
+    return true;
+}
+
+Room *RoomJoin(RoomTable *Table, const uint8_t *Name, size_t Length, void *Owner, MembershipList *List, bool *bCreated) {
+    uint32_t Hash = RoomHash(Name, Length);
+    Room *Joined = RoomFind(Table, Name, Length, Hash);
+    RoomMember *Member;
+
+    *bCreated = false;
+    if (Joined != NULL && RoomMembershipFind(List, Joined) != -1)
+        return NULL;
+
+    if (!Reserve((void **)&List->Entries, &List->Capacity, List->Count + 1, sizeof(Membership)))
+        return NULL;
+
+    if (Joined == NULL) {
+        if ((Table->Count + 1) * 4 > Table->Capacity * 3 && !Grow(Table))
+            return NULL;
+
+        Joined = calloc(1, sizeof(Room));
+        if (Joined == NULL)
+            return NULL;
+        memcpy(Joined->Name, Name, Length);
+        Joined->NameLength = Length;
+        Joined->Hash = Hash;
+        Table->Slots[Probe(Table, Name, Length, Hash)] = Joined;
+        Table->Count++;
+        *bCreated = true;
+    }
+
+    if (!Reserve((void **)&Joined->Members, &Joined->MemberCapacity, Joined->MemberCount + 1, sizeof(RoomMember))) {
+        if (*bCreated) {
+            RemoveSlot(Table, Probe(Table, Name, Length, Hash));
+            FreeRoom(Joined);
+            *bCreated = false;
+        }
+        return NULL;
+    }
+
+    Member = &Joined->Members[Joined->MemberCount];
+    Member->Owner = Owner;
+    Member->List = List;
+    Member->Slot = List->Count;
+    List->Entries[List->Count].Joined = Joined;
+    List->Entries[List->Count].Index = Joined->MemberCount;
+    List->Count++;
+    Joined->MemberCount++;
+    return Joined;
+}
+
+bool RoomLeave(RoomTable *Table, MembershipList *List, int Slot) {
+    Room *Left = List->Entries[Slot].Joined;
+    int Index = List->Entries[Slot].Index;
+    RoomMember *Moved;
+    Membership *MovedEntry;
+
+    // Swap-remove from the room, then tell the member moved into the gap where it is now.
+    Left->Members[Index] = Left->Members[--Left->MemberCount];
+    if (Index < Left->MemberCount) {
+        Moved = &Left->Members[Index];
+        Moved->List->Entries[Moved->Slot].Index = Index;
+    }
+
+    // Same again for the owner's list of rooms.
+    List->Entries[Slot] = List->Entries[--List->Count];
+    if (Slot < List->Count) {
+        MovedEntry = &List->Entries[Slot];
+        MovedEntry->Joined->Members[MovedEntry->Index].Slot = Slot;
+    }
+
+    if (Left->MemberCount > 0)
+        return false;
+
+    RemoveSlot(Table, Probe(Table, (const uint8_t *)Left->Name, Left->NameLength, Left->Hash));
+    FreeRoom(Left);
+    return true;
+}
+
+int RoomMembershipFind(const MembershipList *List, const Room *Joined) {
+    int Counter;
+
+    for (Counter = 0; Counter < List->Count; Counter++) { // A client is only ever in a handful of rooms.
+        if (List->Entries[Counter].Joined == Joined)
+            return Counter;
+    }
+    return -1;
+}
+
+void RoomMembershipFree(MembershipList *List) {
+    free(List->Entries);
+    memset(List, 0, sizeof(MembershipList));
+}
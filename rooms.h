@@ -0,0 +1,78 @@
+/*
+Chat rooms.
+
+Each worker keeps its own RoomTable, an open addressing hash map from room name to Room, holding only that worker's clients.  A room's
+members are a packed array, so sending to a room walks contiguous memory instead of a list.  Every member also keeps a list of the
+rooms it's in, and each side records where it sits in the other's array:
+
+    Room->Members[I]        = { Owner, List, Slot }    List->Entries[Slot] = { Room, I }
+
+so joining is an append and leaving is a swap-remove on both arrays, O(1) either way, with no searching.
+
+A room is freed as soon as its last member leaves.  Only the owning worker ever touches its table, so none of this takes a lock.
+*/
+
+#ifndef ROOMS_H
+#define ROOMS_H
+
+#include "stdbool.h"
+#include "stddef.h"
+#include "stdint.h"
+#include "frame.h"
+#include "ratelimit.h"
+
+typedef struct Room Room;
+typedef struct MembershipList MembershipList;
+
+typedef struct RoomMember {
+    void *Owner; // The member itself (a server Client).
+    MembershipList *List; // Owner's list of rooms.
+    int Slot; // Where this room is in List.
+} RoomMember;
+
+struct Room {
+    char Name[ROOM_NAME_MAX + 1];
+    size_t NameLength;
+    uint32_t Hash;
+    RoomMember *Members;
+    int MemberCount;
+    int MemberCapacity;
+    RateBucket Messages; // What this worker's members have sent it, against the room rate limits (see server.h).
+    RateBucket Bytes;
+};
+
+typedef struct Membership {
+    Room *Joined;
+    int Index; // Where the owner is in Joined->Members.
+} Membership;
+
+struct MembershipList {
+    Membership *Entries;
+    int Count;
+    int Capacity;
+};
+
+typedef struct RoomTable {
+    Room **Slots; // NULL = empty.  Capacity is a power of two, kept under 3/4 full.
+    size_t Capacity;
+    size_t Count;
+} RoomTable;
+
+uint32_t RoomHash(const uint8_t *Name, size_t Length); // FNV-1a.  Also used to pick a room's presence bucket (see server.c).
+
+void RoomTableInit(RoomTable *Table);
+void RoomTableFree(RoomTable *Table); // Frees the rooms too.  Members' lists aren't touched.
+
+Room *RoomFind(const RoomTable *Table, const uint8_t *Name, size_t Length, uint32_t Hash);
+
+// Add Owner to the room called Name, creating the room if need be.  Returns the room, or NULL if Owner is already in it or out of
+// memory.  *bCreated says whether the room is new.
+Room *RoomJoin(RoomTable *Table, const uint8_t *Name, size_t Length, void *Owner, MembershipList *List, bool *bCreated);
+
+// Take List's owner out of the room at List->Entries[Slot].  Returns true if that emptied the room, which is then freed.
+bool RoomLeave(RoomTable *Table, MembershipList *List, int Slot);
+
+int RoomMembershipFind(const MembershipList *List, const Room *Joined); // Slot of Joined in List, -1 if not a member.
+void RoomMembershipFree(MembershipList *List); // Call once every room has been left.
+
+#endif // ROOMS_H
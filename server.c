@@ -0,0 +1,2688 @@
+#define _GNU_SOURCE // pthread_setaffinity_np & CPU_SET on Linux.
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "stdatomic.h"
+#include "platform.h"
+#include "poller.h"
+#include "frame.h"
+#include "outbuf.h"
+#include "message.h"
+#include "pool.h"
+#include "mpsc.h"
+#include "input.h"
+#include "console.h"
+#include "tls.h"
+#include "metrics.h"
+#include "rooms.h"
+#include "users.h"
+#include "history.h"
+#include "journal.h"
+#include "cluster.h"
+#include "uring.h"
+#include "timer.h"
+#include "compress.h"
+#include "ratelimit.h"
+#include "handoff.h"
+#include "text.h"
+#include "capture.h"
+#include "server.h"
+#include "pthread.h"
+#ifdef __linux__
+#include <sched.h>
+#endif // __linux__
+
+#define POLL_TIMEOUT_MS -1 // Workers sleep until a socket is ready or something wakes them, so an idle server uses no CPU.
+#define MAX_EVENTS 64 // Socket events handled per wait.
+#define MAX_ROOMS_PER_CLIENT 64
+#define ROOM_PRESENCE_BUCKETS 1024 // Power of two.
+#define HISTORY_QUERY_MAX 1000 // Messages sent back for one FRAME_HISTORY.
+#define URING_ENTRIES 4096 // Submission queue slots per worker ring.
+#define URING_BUFFERS 1024 // Provided receive buffers per worker ring, shared by all its clients.
+#define URING_BUFFER_BYTES 16384
+#define TIMER_TICK_US 100000 // Timeouts are checked to within this.
+#define PACK_MIN_BYTES 24 // Payloads shorter than this aren't worth compressing.
+#define STREAM_WINDOW 8 // File chunks a sender may have relayed that haven't yet been sent to everyone.  See SendStream().
+#define STREAM_STALL_US 1000000 // Stop waiting on receivers that have sat on a chunk this long.  They're skipped instead, see server.h.
+#define STREAM_CHECK_MS 1 // How often a worker with senders waiting on their window looks again.
+#define HELD_MIN_BYTES 16384 // Smallest buffer for the bytes a client sends while it's paused.
+#define STREAM_SOCKET_BUFFER 131072 // Receive buffer of a client sending files, so what it says next doesn't queue behind megabytes of them.
+#define DRAIN_CHECK_MS 10 // How often a worker handing over to a new server looks to see if it's done.
+#define SAVED_PACKED 1 // SaveClient() flag: the client agreed to compression.
+
+typedef struct Worker Worker;
+
+typedef struct Client {
+    SOCKET Socket;
+    int Index; // Position in the owning worker's Clients array.
+    Worker *Owner; // The only thread that ever touches this client.
+    TlsConnection *Tls; // NULL for plaintext.
+    FrameDecoder Decoder; // Reassembles frames sent by this client.
+    OutBuffer Out; // Frames waiting to be sent to this client.
+    MembershipList Rooms; // Rooms this client has joined.
+    UserId Id; // USER_NONE until it logs in.
+    uint32_t Generation; // Of Id, to tell this client from whoever had the ID before.
+    uint32_t Captured; // Its connection number in the capture (see capture.h).  CAPTURE_NONE if there isn't one.
+    bool bWantWrite; // Out is waiting on the socket becoming writable.  On a ring: a send is in flight.
+    bool bReadPaused; // Out went over the high watermark.  The socket isn't read until it drains below the low watermark.
+    bool bFlushQueued; // Already on the FlushList.
+    struct Client *NextFlush;
+    struct Client *NextDead; // Clients dropped this loop iteration.  Freed once no pending event can refer to them any more.
+    struct Client *NextDeparted; // Logged in clients dropped this loop iteration, still to be announced as gone.
+    Timer Alarm; // Next time it has to be pinged, or checked for having gone quiet or not finished its handshake.
+    int64_t JoinedUs;
+    int64_t HeardUs; // When it last sent anything.  Kept up to date without touching the timer, which looks at it when it fires.
+    bool bPinged; // Since HeardUs.
+    bool bHandshaking; // TLS, not secured yet.
+    bool bPacked; // Agreed to compression: sent each message's Packed twin where it has one.
+    Message *Relayed[STREAM_WINDOW]; // Its last file chunks, held to see when they've been sent to everyone.
+    int RelayedNext; // The oldest, replaced by the next.
+    bool bStreamPaused; // Not read until the oldest has been sent to everyone.
+    bool bStreamed; // Has offered a file, and had its receive buffer cut down.
+    int64_t StreamPausedUs;
+    struct Client *NextStreamPaused;
+    uint8_t *Held; // Bytes received while paused, or after the pause in the same read, to be decoded once it's over.
+    size_t HeldStart; // Already decoded.
+    size_t HeldLength;
+    size_t HeldCapacity;
+    RateBucket SentMessages; // Against the client rate limits.
+    RateBucket SentBytes;
+    bool bThrottled; // Went over a rate limit.  Not read from or decoded until ThrottledUntilUs.
+    int64_t ThrottledUntilUs;
+    struct Client *NextThrottled;
+    bool bHandedOver; // To a new server, which has its own copy of the socket.
+    // io_uring only (see uring.h).
+    UringSendState *Sending; // Vectors of the send in flight.
+    int Pending; // Requests in flight that name this client.  It isn't freed until they've all completed.
+    bool bRecvArmed; // Its multishot recv is in the ring.
+    bool bRecvCancelled; // ...and is being cancelled, because reading is paused.
+} Client;
+
+// Work posted to a worker by another thread.
+enum { INBOX_BROADCAST, INBOX_ROOM, INBOX_DIRECT, INBOX_SOCKET };
+
+typedef struct InboxItem {
+    MpscNode Node; // Must come first, the inbox hands back MpscNode pointers.
+    int Kind;
+    Message *Shared; // INBOX_BROADCAST / INBOX_ROOM: message for every client of the worker, or for its members of a room.  The item owns one reference.
+    SOCKET Socket; // INBOX_SOCKET: newly accepted client the worker should take on.
+    int64_t ReceivedUs; // When the message was read, for the broadcast latency histogram.
+    const uint8_t *RoomName; // INBOX_ROOM: points into Shared, so it lives as long as the item's reference.
+    size_t RoomNameLength;
+    uint32_t RoomHash;
+    UserId TargetId; // INBOX_DIRECT: who Shared is for, if that ID still has the same generation.
+    uint32_t TargetGeneration;
+} InboxItem;
+
+struct Worker {
+    int Index;
+    pthread_t Thread;
+    Poller *Poller;
+    SOCKET ListenSocket; // INVALID_SOCKET if this worker is handed its sockets by worker 0.
+    Client **Clients; // Every client of this worker, packed at the front of the array.
+    int ClientCount;
+    int ClientCapacity;
+    Client *DeadClients;
+    Client *Departed;
+    Client **ById; // This worker's logged in clients, indexed by user ID.  NULL = elsewhere or nobody.
+    UserId ByIdCapacity;
+    Client *FlushList; // Clients with frames queued since the last flush.
+    MpscQueue Inbox;
+    char *ReceiveBuffer; // Bytes just read from a socket, until the frame decoder has picked them apart.
+    int64_t ReadUs; // When ReceiveBuffer was filled.
+    Metrics Stats;
+    RoomTable Rooms; // Rooms with at least one member on this worker.
+    // Rooms on this worker, counted by hash bucket.  Other workers read it to skip posting room messages here when no member could
+    // be here.  A collision only costs a wasted post.
+    atomic_uint RoomPresence[ROOM_PRESENCE_BUCKETS];
+    HistoryEntry *Replay; // Room history being sent to a new member.  HistoryMessages long.
+    Uring *Ring; // Set when the worker runs on io_uring.  The poller is then only used for wakeups.
+    TimerWheel Timers; // Every client's Alarm.
+    Compressor *Packer; // NULL unless compression is on.
+    Client *StreamPaused; // Clients waiting on their file chunks to go out before they're read from again.
+    Client *Throttled; // Clients waiting to be back under their rate limits.
+    uint8_t *Cleaned; // The frame being handled, if its text had to be cleaned (see CleanText()).
+    size_t CleanedCapacity;
+    bool bAccepting; // Counted in AcceptingWorkers.
+    bool bDraining; // Handing over to a new server: not accepting or reading, only sending what's queued.  See StartDraining().
+    int64_t DrainUntilUs;
+};
+
+// A client the old server handed over (see handoff.h), until there's a worker to give it to.
+typedef struct HandedClient {
+    SOCKET Socket;
+    uint8_t *State; // What SaveClient() saved of it.
+    size_t Length;
+} HandedClient;
+
+// Reads what SaveClient() wrote.  A field that would run off the end reads as nothing and sets bBad.
+typedef struct StateReader {
+    const uint8_t *Data;
+    size_t Left;
+    bool bBad;
+} StateReader;
+
+static ServerConfig Settings;
+static RateLimit ClientMessages; // Settings' rate limits, see server.h.
+static RateLimit ClientBytes;
+static RateLimit RoomMessages;
+static RateLimit RoomBytes;
+static Worker *Workers;
+static int WorkerCount;
+static bool bShardedListeners; // Every worker has its own SO_REUSEPORT listen socket.
+static int NextWorker; // Round-robin position for handing out accepted sockets.  Only worker 0 uses it.
+static atomic_bool bStopping;
+static atomic_int TotalClients; // Connected clients across all workers.
+static Pool *ClientPool; // Client objects are recycled through a slab pool rather than malloc'd per connection.
+static Pool *InboxPool;
+static TlsContext *ListenerTls; // Set when the server speaks TLS.  Shared by every worker.
+static Metrics **AllStats; // Every worker's Stats, for the reporter.
+static SOCKET MetricsSocket = INVALID_SOCKET; // Listening for scrapes.  Owned by the reporter once it's started.
+static Message *PingFrame; // The one ping every client is sent.
+static atomic_int PackedClients; // Clients across all workers that agreed to compression.  None = nothing is compressed.
+static Compressor *NodePacker; // For messages from other cluster nodes, on the cluster thread.
+static _Thread_local Compressor *ThreadPacker; // The calling thread's: its worker's, or NodePacker.
+static atomic_bool bHandingOver; // A new server asked to take over.
+static atomic_int AcceptingWorkers; // Workers that may still take on a new client.  The drain can't end before they all stop.
+static SOCKET *HandedListeners; // From the old server, until AdoptListeners().
+static int HandedListenerCount;
+static HandedClient *HandedClients; // From the old server, until RestoreClients().
+static int HandedClientCount;
+static int HandedClientCapacity;
+static Message *HandedGone; // HANDOFF_GONE from the old server, for everyone once the workers start.
+
+static void *WorkerMain(void *Arg);
+static void RunWorker(Worker *Self);
+static void HandleEvents(Worker *Self, const PollEvent *Events, int Count);
+static void HandleCompletions(Worker *Self, const UringCompletion *Done, int Count);
+static void AcceptClients(Worker *Self);
+static void HandOut(Worker *Self, SOCKET NewSocket);
+static Client *AddClient(Worker *Self, SOCKET NewSocket);
+static void ReadFromClient(Client *Sender);
+static bool ClientBytesReceived(Client *Sender, const uint8_t *Data, size_t Length);
+static bool DecodeBytes(Client *Sender, const uint8_t *Data, size_t Length, size_t *Decoded);
+static bool HoldBytes(Client *Sender, const uint8_t *Data, size_t Length);
+static bool ArmRecv(Client *Reader);
+static void RingReceived(Client *Sender, const UringCompletion *Done);
+static void RingSent(Client *Receiver, int Result);
+static bool ClientFrameReceived(void *Context, uint8_t Type, const uint8_t *Payload, size_t Length);
+static void DropClient(Client *Leaver);
+static void ScheduleAlarm(Client *Watched);
+static void ClientAlarm(Timer *Expired);
+static void FreeDeadClients(Worker *Self);
+static void PublishStats(Worker *Self, int64_t NowUs);
+static void BroadcastMessage(Worker *Self, const char *Text, size_t Length, Client *Sender);
+static void DeliverLocally(Worker *Self, Message *Shared, Client *Sender, int64_t ReceivedUs);
+static bool JoinRoom(Client *Member, const uint8_t *Name, size_t Length);
+static Room *EnterRoom(Client *Member, const uint8_t *Name, size_t Length);
+static bool LeaveRoom(Client *Member, const uint8_t *Name, size_t Length);
+static void LeaveRoomSlot(Client *Member, int Slot);
+static bool SendToRoom(Client *Sender, const uint8_t *Payload, size_t Length);
+static bool SendRoomHistory(Client *Asker, const uint8_t *Payload, size_t Length);
+static bool ReplayTo(Client *Member, int Count);
+static Message *WithoutSender(const Message *Shared);
+static bool LogIn(Client *Member, const uint8_t *Name, size_t Length);
+static bool ReserveById(Worker *Self, UserId Id);
+static void AnnounceDepartures(Worker *Self);
+static bool SendDirect(Client *Sender, const uint8_t *Payload, size_t Length);
+static bool SendStream(Client *Sender, uint8_t Type, const uint8_t *Payload, size_t Length);
+static void ChargeRoom(Client *Sender, Room *Target, size_t Length);
+static void DeliverDirect(Worker *Self, UserId Target, uint32_t Generation, Message *Shared, int64_t ReceivedUs);
+static bool SendNotice(Client *Receiver, const char *Text);
+static bool SendPong(Client *Pinger, const uint8_t *Payload, size_t Length);
+static bool AgreeToCompress(Client *Asker, const uint8_t *Payload, size_t Length);
+static void PackMessage(Message *Shared);
+static Message *CreateUserFrame(uint8_t Type, UserId Sender, const void *Body, size_t Length);
+static const uint8_t *CleanText(Worker *Self, const uint8_t *Payload, size_t *Length, size_t Skip);
+static void BroadcastShared(Worker *Self, Message *Shared, Client *Sender, int64_t ReceivedUs);
+static void PostBroadcast(Message *Shared, int Except, int64_t ReceivedUs);
+static void PostToRoom(Message *Shared, size_t NameOffset, size_t NameLength, uint32_t Hash, int Except, int64_t ReceivedUs);
+static void DeliverFromNode(int FromNode, uint8_t Type, const uint8_t *Payload, size_t Length);
+static void DeliverToRoom(Worker *Self, Room *Target, Message *Shared, Client *Sender, int64_t ReceivedUs);
+static bool DeliverTo(Worker *Self, Client *Receiver, Message *Shared);
+static void PostToWorker(Worker *Target, InboxItem *Item);
+static void DrainInbox(Worker *Self);
+static void QueueFlush(Client *Receiver);
+static void WatchClient(Client *Watched);
+static void PauseReading(Client *Laggard);
+static bool ReadingPaused(const Client *Reader);
+static bool DecodePaused(const Client *Reader);
+static void DecodeHeld(Client *Paused);
+static bool ResumeStreams(Worker *Self);
+static void StreamUnpause(Client *Sender);
+static void Throttle(Client *Sender, int64_t WaitUs);
+static int ResumeThrottled(Worker *Self);
+static void Unthrottle(Client *Sender);
+static void FlushClient(Client *Receiver);
+static int FlushClients(Worker *Self);
+static void TakeOver(SOCKET Link);
+static bool AdoptListeners();
+static void RestoreClients();
+static void RestoreClient(Worker *Self, SOCKET Socket, const uint8_t *State, size_t Length);
+static void DecodeRestored(Worker *Self);
+static void RequestHandOver();
+static void StartDraining(Worker *Self);
+static void StopAccepting(Worker *Self);
+static bool Drained(Worker *Self, int64_t NowUs);
+static void HandOver(SOCKET Link);
+static uint8_t *SaveClient(Client *Saved, size_t *Length);
+
+void ServerConfigDefaults(ServerConfig *Config) {
+    memset(Config, 0, sizeof(ServerConfig));
+    Config->WorkerCount = 0;
+    Config->bPinWorkers = true;
+    Config->bHeadless = false;
+    Config->MaxClients = 0;
+    Config->MaxFrameBytes = FRAME_DEFAULT_MAX_PAYLOAD;
+    Config->ReceiveBufferSize = 65536;
+    Config->CoalesceWindowUs = 0;
+    Config->FlushThresholdBytes = 65536;
+    Config->bTcpNoDelay = true;
+    Config->bTcpCork = false;
+    Config->HighWatermarkBytes = 1 << 20;
+    Config->LowWatermarkBytes = 256 << 10;
+    Config->MaxQueuedBytes = 8 << 20;
+    Config->HistoryMessages = 50;
+    Config->HistoryBytes = 64 << 10;
+    Config->LogSegmentBytes = 64 << 20;
+    Config->LogMaxSegments = 16;
+    Config->LogSyncMs = 1000;
+    Config->PingIntervalMs = 30000;
+    Config->IdleTimeoutMs = 90000;
+    Config->HandshakeTimeoutMs = 10000;
+}
+
+static int OnlineCpus() {
+    #ifdef _WIN32
+    SYSTEM_INFO Info;
+    GetSystemInfo(&Info);
+    return (int)Info.dwNumberOfProcessors;
+    #else
+    long Cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return Cpus > 0 ? (int)Cpus : 1;
+    #endif // _WIN32
+}
+
+static void SetRateLimit(RateLimit *Limit, int64_t PerSecond, int64_t Burst) {
+    Limit->PerSecond = PerSecond;
+    Limit->Burst = Burst;
+}
+
+// Rebuild a room's in-memory history from the log on startup.
+static void RestoreFromJournal(const uint8_t *Room, size_t RoomLength, uint32_t Hash, const uint8_t *Frame, size_t Length) {
+    Message *Restored = MessageCreate(Length);
+
+    if (Restored == NULL)
+        return;
+    memcpy(Restored->Data, Frame, Length);
+    HistoryRestore(Room, RoomLength, Hash, Restored);
+    MessageRelease(Restored);
+}
+
+static SOCKET ListenOn(const struct addrinfo *Address, bool bReusePort) {
+    SOCKET NewSocket;
+    int On = 1;
+    int Off = 0;
+
+    // define TCP socket stream
+    NewSocket = socket(Address->ai_family, Address->ai_socktype, Address->ai_protocol);
+    if (NewSocket == INVALID_SOCKET)
+        return INVALID_SOCKET;
+
+    #ifndef _WIN32
+    setsockopt(NewSocket, SOL_SOCKET, SO_REUSEADDR, &On, sizeof(On)); // Lets a restarted server bind while old connections sit in TIME_WAIT.
+    #endif // _WIN32
+    #ifdef SO_REUSEPORT
+    if (bReusePort && setsockopt(NewSocket, SOL_SOCKET, SO_REUSEPORT, &On, sizeof(On)) == SOCKET_ERROR) {
+        close(NewSocket);
+        return INVALID_SOCKET;
+    }
+    #else
+    (void)On;
+    (void)bReusePort;
+    #endif // SO_REUSEPORT
+    if (Address->ai_family == AF_INET6) // Dual stack: IPv4 clients arrive on the same socket as mapped addresses.
+        setsockopt(NewSocket, IPPROTO_IPV6, IPV6_V6ONLY, (const char *)&Off, sizeof(Off));
+
+    if (bind(NewSocket, Address->ai_addr, (socklen_t)Address->ai_addrlen) == SOCKET_ERROR
+        || listen(NewSocket, SOMAXCONN) == SOCKET_ERROR
+        || !SetNonBlocking(NewSocket)) {
+        close(NewSocket);
+        return INVALID_SOCKET;
+    }
+    return NewSocket;
+}
+
+// Listen on BindAddress, or on every interface if it's empty.  Every interface means a dual stack IPv6 socket where the system has
+// IPv6, and plain IPv4 where it doesn't.
+static SOCKET OpenListenSocket(int PortNo, const char *BindAddress, bool bReusePort) {
+    struct addrinfo Hints;
+    struct addrinfo *Results;
+    struct addrinfo *Entry;
+    SOCKET NewSocket = INVALID_SOCKET;
+    char PortText[8];
+    int Pass;
+
+    memset(&Hints, 0, sizeof(Hints));
+    Hints.ai_family = AF_UNSPEC;
+    Hints.ai_socktype = SOCK_STREAM;
+    Hints.ai_protocol = IPPROTO_TCP;
+    Hints.ai_flags = AI_PASSIVE;
+    snprintf(PortText, sizeof(PortText), "%d", PortNo);
+
+    if (getaddrinfo(BindAddress[0] != '\0' ? BindAddress : NULL, PortText, &Hints, &Results) != 0)
+        return INVALID_SOCKET;
+
+    for (Pass = 0; Pass < 2 && NewSocket == INVALID_SOCKET; Pass++) { // IPv6 first when binding to every interface.
+        for (Entry = Results; Entry && NewSocket == INVALID_SOCKET; Entry = Entry->ai_next) {
+            bool bFirstChoice = BindAddress[0] != '\0' || Entry->ai_family == AF_INET6;
+            if (bFirstChoice == (Pass == 0))
+                NewSocket = ListenOn(Entry, bReusePort);
+        }
+    }
+
+    freeaddrinfo(Results);
+    return NewSocket;
+}
+
+bool HostServer(const ServerConfig *Config) {
+    Worker *Self;
+    SOCKET ClusterSocket;
+    SOCKET Link;
+    int Counter;
+
+    #ifdef _WIN32
+    WSADATA wsadata;
+
+    int error = WSAStartup(0x0202, &wsadata);
+
+    if (error)
+        return false;
+
+    if (wsadata.wVersion != 0x0202) // Exit if it's not the right winsock version.
+    {
+        WSACleanup();
+        return false;
+    }
+    #endif // _WIN32
+
+    Settings = *Config;
+    SetRateLimit(&ClientMessages, Settings.ClientMessagesPerSec, Settings.ClientMessageBurst);
+    SetRateLimit(&ClientBytes, (int64_t)Settings.ClientBytesPerSec, (int64_t)Settings.ClientByteBurst);
+    SetRateLimit(&RoomMessages, Settings.RoomMessagesPerSec, Settings.RoomMessageBurst);
+    SetRateLimit(&RoomBytes, (int64_t)Settings.RoomBytesPerSec, (int64_t)Settings.RoomByteBurst);
+    WorkerCount = Settings.WorkerCount > 0 ? Settings.WorkerCount : OnlineCpus();
+    atomic_store(&bStopping, false);
+    atomic_store(&bHandingOver, false);
+    atomic_store(&TotalClients, 0);
+    atomic_store(&AcceptingWorkers, WorkerCount);
+
+    if (Settings.LowWatermarkBytes > Settings.HighWatermarkBytes || Settings.HighWatermarkBytes > Settings.MaxQueuedBytes) {
+        printf("ERROR: the watermarks must satisfy low <= high <= max queued!\n");
+        return false;
+    }
+    if (Settings.MaxQueuedBytes < Settings.MaxFrameBytes + 16) { // A single message would be enough to drop its receivers.
+        printf("ERROR: max queued bytes must be bigger than the max frame size!\n");
+        return false;
+    }
+    if (Settings.PingIntervalMs > 0 && Settings.IdleTimeoutMs > 0 && Settings.PingIntervalMs >= Settings.IdleTimeoutMs) {
+        printf("ERROR: the ping interval must be shorter than the idle timeout!\n");
+        return false;
+    }
+
+    if (ClientPool == NULL)
+        ClientPool = PoolCreate(sizeof(Client), 256);
+    if (InboxPool == NULL)
+        InboxPool = PoolCreate(sizeof(InboxItem), 1024);
+    if (PingFrame == NULL)
+        PingFrame = MessageCreateFrame(FRAME_PING, "", 0);
+    if (ClientPool == NULL || InboxPool == NULL || PingFrame == NULL)
+        return false;
+
+    if (Settings.bIoUring && Config->TlsCertFile[0] != '\0') {
+        printf("ERROR: io_uring workers can't serve TLS!\n");
+        return false;
+    }
+
+    if (Config->TlsCertFile[0] != '\0') { // A key file isn't needed if the certificate file holds the key too.
+        ListenerTls = TlsServerContext(Config->TlsCertFile, Config->TlsKeyFile[0] ? Config->TlsKeyFile : Config->TlsCertFile);
+        if (ListenerTls == NULL)
+            return false;
+    }
+
+    // Before anything the old server has to let go of first: its listen sockets, log & cluster port.
+    if (Settings.HandoffPath[0] != '\0' && (Link = HandoffConnect(Settings.HandoffPath)) != INVALID_SOCKET)
+        TakeOver(Link);
+
+    Workers = calloc(WorkerCount, sizeof(Worker));
+    AllStats = calloc(WorkerCount, sizeof(Metrics *));
+    if (Workers == NULL || AllStats == NULL) {
+        free(Workers);
+        Workers = NULL;
+        return false;
+    }
+    if (!ClusterConfigure(Settings.ClusterNodes, Settings.NodeName))
+        return false;
+    if (Settings.bCompression) {
+        if (!CompressionConfigure(Settings.CompressDictFile) || (ClusterEnabled() && (NodePacker = CompressorCreate()) == NULL))
+            return false;
+        printf("Compressing messages for clients that ask, dictionary %08x.\n", (unsigned)CompressionDictionaryId());
+    }
+    HistoryConfigure(Settings.HistoryMessages, Settings.HistoryBytes);
+    if (Settings.LogDirectory[0] != '\0') {
+        if (!JournalOpen(Settings.LogDirectory, Settings.LogSegmentBytes, Settings.LogMaxSegments, Settings.LogSyncMs, RestoreFromJournal))
+            return false;
+        printf("Logging room messages to %s.\n", Settings.LogDirectory);
+    }
+    if (Settings.CaptureFile[0] != '\0') {
+        if (!CaptureOpen(Settings.CaptureFile))
+            return false;
+        printf("Capturing what clients send to %s.\n", Settings.CaptureFile);
+    }
+
+    for (Counter = 0; Counter < WorkerCount; Counter++) { // First, so CloseServer() can always free them.
+        MetricsInit(&Workers[Counter].Stats);
+        AllStats[Counter] = &Workers[Counter].Stats;
+    }
+
+    for (Counter = 0; Counter < WorkerCount; Counter++) {
+        Self = &Workers[Counter];
+        Self->Index = Counter;
+        Self->ListenSocket = INVALID_SOCKET;
+        Self->bAccepting = true;
+        MpscInit(&Self->Inbox);
+        RoomTableInit(&Self->Rooms);
+        TimerWheelInit(&Self->Timers, MonotonicUs(), TIMER_TICK_US);
+        Self->Poller = PollerCreate();
+        Self->ReceiveBuffer = malloc(Settings.ReceiveBufferSize);
+        Self->Replay = malloc((Settings.HistoryMessages + 1) * sizeof(HistoryEntry));
+        if (Settings.bCompression && (Self->Packer = CompressorCreate()) == NULL)
+            return false;
+        if (Self->Poller == NULL || Self->ReceiveBuffer == NULL || Self->Replay == NULL)
+            return false;
+        // On a ring the poller only has the wakeup, and the ring watches the poller.
+        if (Settings.bIoUring && ((Self->Ring = UringCreate(URING_ENTRIES, URING_BUFFERS, URING_BUFFER_BYTES)) == NULL
+                                  || !UringPoll(Self->Ring, PollerHandle(Self->Poller), Self)))
+            return false;
+    }
+
+    // Only Linux spreads connections evenly over SO_REUSEPORT sockets.  BSD's SO_REUSEPORT sends them all to one socket.
+    bShardedListeners = false;
+    if (HandedListenerCount > 0) {
+        if (!AdoptListeners())
+            return false;
+    }
+    #if defined(__linux__) && defined(SO_REUSEPORT)
+    else if (WorkerCount > 1) {
+        bShardedListeners = true;
+        for (Counter = 0; Counter < WorkerCount && bShardedListeners; Counter++) {
+            Workers[Counter].ListenSocket = OpenListenSocket(Config->PortNo, Config->BindAddress, true);
+            bShardedListeners = Workers[Counter].ListenSocket != INVALID_SOCKET;
+        }
+
+        if (!bShardedListeners) { // Fall back to a single acceptor.
+            for (Counter = 0; Counter < WorkerCount; Counter++) {
+                if (Workers[Counter].ListenSocket != INVALID_SOCKET)
+                    close(Workers[Counter].ListenSocket);
+                Workers[Counter].ListenSocket = INVALID_SOCKET;
+            }
+        }
+    }
+    #endif
+
+    if (!bShardedListeners && Workers[0].ListenSocket == INVALID_SOCKET)
+        Workers[0].ListenSocket = OpenListenSocket(Config->PortNo, Config->BindAddress, false);
+
+    for (Counter = 0; Counter < WorkerCount; Counter++) {
+        Self = &Workers[Counter];
+        if (Self->ListenSocket != INVALID_SOCKET
+            && !(Self->Ring ? UringAccept(Self->Ring, Self->ListenSocket, &Self->ListenSocket)
+                            : PollerAdd(Self->Poller, Self->ListenSocket, &Self->ListenSocket, POLL_READ)))
+            return false;
+    }
+
+    if (Workers[0].ListenSocket == INVALID_SOCKET)
+        return false;
+
+    printf("\nSocket listening on port %d using %s with %d worker(s)%s%s.  Waiting on connections from clients...\n", Config->PortNo,
+           Settings.bIoUring ? "io_uring" : PollerBackendName(), WorkerCount, bShardedListeners ? " sharing it via SO_REUSEPORT" : "", ListenerTls ? ", TLS only" : "");
+
+    if (Config->MetricsPortNo > 0) {
+        MetricsSocket = OpenListenSocket(Config->MetricsPortNo, Config->BindAddress, false);
+        if (MetricsSocket == INVALID_SOCKET) {
+            printf("ERROR: unable to listen for metrics scrapes on port %d!\n", Config->MetricsPortNo);
+            return false;
+        }
+        printf("Serving metrics at http://%s:%d/metrics\n", Config->BindAddress[0] ? Config->BindAddress : "localhost", Config->MetricsPortNo);
+    }
+
+    if (ClusterEnabled()) { // Last, so the workers are there to take what other nodes send.
+        ClusterSocket = OpenListenSocket(ClusterPortNo(), Config->BindAddress, false);
+        if (ClusterSocket == INVALID_SOCKET) {
+            printf("ERROR: unable to listen for other cluster nodes on port %d!\n", ClusterPortNo());
+            return false;
+        }
+        if (!ClusterStart(ClusterSocket, Settings.MaxFrameBytes, DeliverFromNode)) { // Closed by ClusterStop() either way.
+            printf("ERROR: unable to start the cluster thread!\n");
+            return false;
+        }
+        printf("Cluster node %s, linking to the others on port %d.\n", ClusterNodeName(ClusterSelf()), ClusterPortNo());
+    }
+
+    if (Settings.HandoffPath[0] != '\0') {
+        if (!HandoffListen(Settings.HandoffPath, RequestHandOver))
+            return false;
+        printf("The next server started with --handoff %s takes over from this one.\n", Settings.HandoffPath);
+    }
+    RestoreClients();
+    return true;
+}
+
+// Take what the old server on Link hands over, until it has let go of everything else.  Kept until there are workers for it.
+static void TakeOver(SOCKET Link) {
+    SOCKET Sockets[HANDOFF_SOCKETS_MAX];
+    uint8_t *Payload;
+    size_t Length;
+    uint8_t Type = 0;
+    int Count;
+    int Counter;
+    void *Grown;
+
+    printf("Taking over from the server on %s...\n", Settings.HandoffPath);
+    while (Type != HANDOFF_DONE) {
+        if (!HandoffReceive(Link, &Type, &Payload, &Length, Sockets, &Count)) {
+            printf("ERROR: lost the link to the old server!  Carrying on with what it handed over.\n");
+            break;
+        }
+
+        if (Type == HANDOFF_LISTEN && Count > 0
+            && (Grown = realloc(HandedListeners, (HandedListenerCount + Count) * sizeof(SOCKET))) != NULL) {
+            HandedListeners = Grown;
+            memcpy(HandedListeners + HandedListenerCount, Sockets, Count * sizeof(SOCKET));
+            HandedListenerCount += Count;
+            Count = 0;
+        }
+        else if (Type == HANDOFF_CLIENT && Count == 1) {
+            if (HandedClientCount == HandedClientCapacity
+                && (Grown = realloc(HandedClients, (HandedClientCapacity ? HandedClientCapacity * 2 : 64) * sizeof(HandedClient))) != NULL) {
+                HandedClients = Grown;
+                HandedClientCapacity = HandedClientCapacity ? HandedClientCapacity * 2 : 64;
+            }
+            if (HandedClientCount < HandedClientCapacity) {
+                HandedClients[HandedClientCount].Socket = Sockets[0];
+                HandedClients[HandedClientCount].State = Payload;
+                HandedClients[HandedClientCount++].Length = Length;
+                Payload = NULL;
+                Count = 0;
+            }
+        }
+        else if (Type == HANDOFF_GONE && Length > 0 && HandedGone == NULL && (HandedGone = MessageCreate(Length)) != NULL)
+            memcpy(HandedGone->Data, Payload, Length);
+
+        for (Counter = 0; Counter < Count; Counter++) // Nowhere to keep them.
+            close(Sockets[Counter]);
+        free(Payload);
+    }
+    close(Link);
+    printf("Took over %d listen socket(s) & %d client(s).\n", HandedListenerCount, HandedClientCount);
+}
+
+// Listen on the sockets the old server handed over instead of opening new ones, so whoever was waiting on them is served and nobody
+// is refused in between.  Sharded if they were, which the old server only did with SO_REUSEPORT, so more can join them.
+static bool AdoptListeners() {
+    bool bOpened = true;
+    int Counter;
+
+    #if defined(__linux__) && defined(SO_REUSEPORT)
+    bShardedListeners = WorkerCount > 1 && HandedListenerCount > 1;
+    #endif
+    for (Counter = 0; Counter < WorkerCount && (Counter == 0 || bShardedListeners); Counter++) {
+        if (Counter < HandedListenerCount)
+            Workers[Counter].ListenSocket = HandedListeners[Counter];
+        else if ((Workers[Counter].ListenSocket = OpenListenSocket(Settings.PortNo, Settings.BindAddress, true)) == INVALID_SOCKET) {
+            bOpened = false;
+            break;
+        }
+    }
+
+    if (Counter < HandedListenerCount)
+        printf("Closing %d of the old server's listen sockets: this one has fewer workers.  Connections waiting on them are refused.\n",
+               HandedListenerCount - Counter);
+    for (; Counter < HandedListenerCount; Counter++)
+        close(HandedListeners[Counter]);
+    free(HandedListeners);
+    HandedListeners = NULL;
+    HandedListenerCount = 0;
+    return bOpened;
+}
+
+// Give the clients the old server handed over to the workers, round-robin.
+static void RestoreClients() {
+    int Counter;
+
+    if (HandedClientCount > 0 && ListenerTls != NULL)
+        printf("Closing the %d client(s) handed over: they're plaintext and this server is TLS only.\n", HandedClientCount);
+    for (Counter = 0; Counter < HandedClientCount; Counter++) {
+        if (ListenerTls != NULL)
+            close(HandedClients[Counter].Socket);
+        else
+            RestoreClient(&Workers[Counter % WorkerCount], HandedClients[Counter].Socket, HandedClients[Counter].State, HandedClients[Counter].Length);
+        free(HandedClients[Counter].State);
+    }
+    free(HandedClients);
+    HandedClients = NULL;
+    HandedClientCount = HandedClientCapacity = 0;
+
+    if (HandedGone != NULL) { // Delivered before anything the workers read.
+        PostBroadcast(HandedGone, -1, MonotonicUs());
+        MessageRelease(HandedGone);
+        HandedGone = NULL;
+    }
+}
+
+static uint8_t ReadByte(StateReader *Reader) {
+    if (Reader->Left == 0) {
+        Reader->bBad = true;
+        return 0;
+    }
+    Reader->Left--;
+    return *Reader->Data++;
+}
+
+static uint64_t ReadVarint(StateReader *Reader) {
+    uint64_t Value = 0;
+    size_t Length = VarintDecode(Reader->Data, Reader->Left, &Value);
+
+    Reader->bBad |= Length == 0;
+    Reader->Data += Length;
+    Reader->Left -= Length;
+    return Value;
+}
+
+static const uint8_t *ReadBytes(StateReader *Reader, uint64_t Length) {
+    const uint8_t *Bytes = Reader->Data;
+
+    if (Length > Reader->Left) {
+        Reader->bBad = true;
+        return NULL;
+    }
+    Reader->Data += Length;
+    Reader->Left -= (size_t)Length;
+    return Bytes;
+}
+
+// One client the old server handed over, carrying on with what SaveClient() saved of it.  Nobody else is told anything: as far as
+// they're concerned it never left.  What it had sent that the old server didn't get to is decoded once the worker starts.
+static void RestoreClient(Worker *Self, SOCKET Socket, const uint8_t *State, size_t Length) {
+    StateReader Reader;
+    const uint8_t *Name;
+    const uint8_t *Rooms[MAX_ROOMS_PER_CLIENT];
+    uint8_t RoomLengths[MAX_ROOMS_PER_CLIENT];
+    const uint8_t *Unread;
+    uint64_t Id;
+    uint64_t Generation;
+    uint64_t Dictionary;
+    uint64_t UnreadLength;
+    uint8_t NameLength;
+    uint8_t Flags;
+    int RoomCount;
+    int Counter;
+    Client *Restored;
+    Message *Unsent;
+
+    Reader.Data = State;
+    Reader.Left = Length;
+    Reader.bBad = false;
+    Id = ReadVarint(&Reader);
+    Generation = ReadVarint(&Reader);
+    NameLength = ReadByte(&Reader);
+    Name = ReadBytes(&Reader, NameLength);
+    Flags = ReadByte(&Reader);
+    Dictionary = ReadVarint(&Reader);
+    RoomCount = ReadByte(&Reader);
+    for (Counter = 0; Counter < RoomCount && Counter < MAX_ROOMS_PER_CLIENT; Counter++) {
+        RoomLengths[Counter] = ReadByte(&Reader);
+        Rooms[Counter] = ReadBytes(&Reader, RoomLengths[Counter]);
+    }
+    UnreadLength = ReadVarint(&Reader);
+    Unread = ReadBytes(&Reader, UnreadLength);
+    if (Reader.bBad || RoomCount > MAX_ROOMS_PER_CLIENT || Id > UINT32_MAX || Generation > UINT32_MAX) {
+        printf("ERROR: the old server handed over a client it didn't describe properly!\n");
+        close(Socket);
+        return;
+    }
+
+    if ((Restored = AddClient(Self, Socket)) == NULL)
+        return;
+    if (Id != USER_NONE && UserRestore(Name, NameLength, (UserId)Id, (uint32_t)Generation, Self->Index)) {
+        if (ReserveById(Self, (UserId)Id)) {
+            Restored->Id = (UserId)Id;
+            Restored->Generation = (uint32_t)Generation;
+            Self->ById[Id] = Restored;
+        }
+        else
+            UserUnregister((UserId)Id);
+    }
+    if ((Flags & SAVED_PACKED) && Self->Packer != NULL && Dictionary == CompressionDictionaryId()) {
+        Restored->bPacked = true;
+        atomic_fetch_add(&PackedClients, 1);
+    }
+    for (Counter = 0; Counter < RoomCount; Counter++) {
+        if (RoomNameValid(Rooms[Counter], RoomLengths[Counter]))
+            EnterRoom(Restored, Rooms[Counter], RoomLengths[Counter]);
+    }
+
+    if (Reader.Left > 0 && (Unsent = MessageCreate(Reader.Left)) != NULL) { // The rest of what it was owed, from where the old server got to.
+        memcpy(Unsent->Data, Reader.Data, Reader.Left);
+        if (OutBufferAppendMessage(&Restored->Out, Unsent))
+            QueueFlush(Restored);
+        MessageRelease(Unsent);
+    }
+    if (UnreadLength > 0)
+        HoldBytes(Restored, Unread, (size_t)UnreadLength);
+}
+
+void ServeClients() {
+    int Counter;
+
+    if (Settings.bHeadless)
+        printf("Running headless: relaying only, no console input or output.  Stop the server with SIGINT or SIGTERM.\n");
+    else {
+        if (!ConsoleStart()) // Client messages are printed by their own thread so the terminal never holds up a worker.
+            printf("Error creating thread\n");
+
+        ConsolePrintf("Type a message and press enter to send it to every client.  Type QUIT and press enter to shut down the server.\n");
+
+        if (!StartInputThread(Workers[0].Poller)) // Console input is handled by worker 0.
+            ConsolePrintf("Error creating thread\n");
+    }
+
+    if (MetricsSocket != INVALID_SOCKET || Settings.StatsIntervalSecs > 0) {
+        if (MetricsStartReporter(AllStats, WorkerCount, MetricsSocket, Settings.StatsIntervalSecs))
+            MetricsSocket = INVALID_SOCKET; // The reporter closes it.
+        else
+            ConsolePrintf("Error creating metrics thread\n");
+    }
+
+    for (Counter = 1; Counter < WorkerCount; Counter++) {
+        if (pthread_create(&Workers[Counter].Thread, NULL, WorkerMain, &Workers[Counter])) {
+            ConsolePrintf("Error creating worker thread\n");
+            WorkerCount = Counter; // Carry on with the workers that did start.
+            break;
+        }
+    }
+
+    WorkerMain(&Workers[0]);
+
+    for (Counter = 1; Counter < WorkerCount; Counter++)
+        pthread_join(Workers[Counter].Thread, NULL);
+
+    if (atomic_load(&bHandingOver))
+        HandOver(HandoffAccepted());
+
+    MetricsStopReporter();
+
+    ConsolePrintf("Server shutting down.\n");
+    ConsoleFlush();
+}
+
+void StopServer() {
+    int Counter;
+
+    atomic_store(&bStopping, true);
+    for (Counter = 0; Counter < WorkerCount; Counter++)
+        PollerWakeup(Workers[Counter].Poller);
+}
+
+static void *WorkerMain(void *Arg) {
+    Worker *Self = Arg;
+
+    ThreadPacker = Self->Packer;
+
+    #ifdef __linux__
+    if (Settings.bPinWorkers) { // One worker per core, and it stays on that core with a warm cache.
+        cpu_set_t Cpus;
+        CPU_ZERO(&Cpus);
+        CPU_SET(Self->Index % OnlineCpus(), &Cpus);
+        pthread_setaffinity_np(pthread_self(), sizeof(Cpus), &Cpus);
+    }
+    #endif // __linux__
+
+    RunWorker(Self);
+    return NULL;
+}
+
+// The event loop of one worker.
+static void RunWorker(Worker *Self) {
+    PollEvent Events[MAX_EVENTS];
+    UringCompletion Done[MAX_EVENTS];
+    int EventCount;
+    int Counter;
+    int TimeoutMs = 0; // Straight through the first pass, which flushes what clients handed over by the old server are owed.
+    int ThrottledMs;
+    char *Line;
+    int64_t WokeUs;
+    int64_t NowUs;
+    int64_t AlarmUs;
+
+    DecodeRestored(Self);
+    while (!atomic_load_explicit(&bStopping, memory_order_relaxed)) {
+        while (Self->Index == 0 && (Line = NextInputLine()) != NULL) { // The server operator typed a message.  Send it to everyone.
+            if (strcmp(Line, "QUIT") == 0) {
+                atomic_store(&bStopping, true);
+                for (Counter = 1; Counter < WorkerCount; Counter++)
+                    PollerWakeup(Workers[Counter].Poller);
+            }
+            else
+                BroadcastMessage(Self, Line, strlen(Line), NULL);
+            free(Line);
+        }
+        if (atomic_load(&bStopping))
+            break;
+        if (!Self->bDraining && atomic_load_explicit(&bHandingOver, memory_order_relaxed)) {
+            StartDraining(Self);
+            TimeoutMs = 0; // Straight round, to see how the drain is going from now on.
+        }
+
+        if (Self->Ring != NULL) // Also submits everything the last pass queued on the ring.
+            EventCount = UringWait(Self->Ring, Done, MAX_EVENTS, TimeoutMs);
+        else
+            EventCount = PollerWait(Self->Poller, Events, MAX_EVENTS, TimeoutMs);
+        WokeUs = MonotonicUs();
+        MetricsCount(&Self->Stats, METRIC_LOOPS, 1);
+
+        if (EventCount == -1) {
+            ConsolePrintf("Socket Error! Code: %d\n", LastSocketError());
+            break;
+        }
+
+        if (Self->Ring != NULL)
+            HandleCompletions(Self, Done, EventCount);
+        else
+            HandleEvents(Self, Events, EventCount);
+
+        DrainInbox(Self); // Messages (and sockets) other workers posted while we were busy or asleep.
+
+        TimerWheelAdvance(&Self->Timers, MonotonicUs(), ClientAlarm); // Pings & timeouts due by now.
+
+        AnnounceDepartures(Self);
+
+        ThrottledMs = ResumeThrottled(Self); // Before the flush, so whatever they were holding back goes out with the rest.
+
+        TimeoutMs = FlushClients(Self); // Everything relayed during this pass goes out now, one write per client.
+        if (ResumeStreams(Self) && (TimeoutMs < 0 || TimeoutMs > STREAM_CHECK_MS))
+            TimeoutMs = STREAM_CHECK_MS;
+        if (ThrottledMs >= 0 && (TimeoutMs < 0 || TimeoutMs > ThrottledMs))
+            TimeoutMs = ThrottledMs;
+
+        FreeDeadClients(Self);
+        if (Self->Departed != NULL) // Dropped while flushing.  Come straight back round to announce them.
+            TimeoutMs = 0;
+
+        NowUs = MonotonicUs();
+        if (EventCount > 0) // Not a wakeup to publish or flush on time, which would otherwise keep an idle worker waking itself up.
+            MetricsRecord(&Self->Stats, HISTOGRAM_LOOP_US, NowUs - WokeUs);
+        if (MetricsPublishDue(&Self->Stats, NowUs))
+            PublishStats(Self, NowUs);
+        if (MetricsPending(&Self->Stats) && (TimeoutMs < 0 || TimeoutMs > METRICS_PUBLISH_US / 1000)) // Don't sit on samples while idle.
+            TimeoutMs = METRICS_PUBLISH_US / 1000;
+        if ((AlarmUs = TimerWheelNextUs(&Self->Timers, NowUs)) >= 0 && (TimeoutMs < 0 || TimeoutMs > (AlarmUs + 999) / 1000))
+            TimeoutMs = (int)((AlarmUs + 999) / 1000);
+
+        if (Self->bDraining) {
+            if (Drained(Self, NowUs))
+                break;
+            if (TimeoutMs < 0 || TimeoutMs > DRAIN_CHECK_MS)
+                TimeoutMs = DRAIN_CHECK_MS;
+        }
+    }
+
+    if (Self->Index != 0) // Worker 0 is on the main thread and stops everyone else.  The others just need to stop themselves.
+        return;
+    for (Counter = 1; Counter < WorkerCount; Counter++)
+        PollerWakeup(Workers[Counter].Poller);
+}
+
+static void HandleEvents(Worker *Self, const PollEvent *Events, int Count) {
+    Client *Ready;
+    int Counter;
+
+    for (Counter = 0; Counter < Count; Counter++) {
+        if (Events[Counter].Context == NULL) // Woken by another thread.  Its work is picked up after this & at the top of the loop.
+            continue;
+        else if (Events[Counter].Context == &Self->ListenSocket)
+            AcceptClients(Self);
+        else {
+            Ready = Events[Counter].Context;
+            if (Ready->Socket != INVALID_SOCKET && (Events[Counter].Events & POLL_ERROR)) // Skip clients dropped earlier in this batch.
+                ReadFromClient(Ready);
+            else if (Ready->Socket != INVALID_SOCKET && (Events[Counter].Events & POLL_READ) && !ReadingPaused(Ready))
+                ReadFromClient(Ready);
+            if (Ready->Socket != INVALID_SOCKET && (Events[Counter].Events & POLL_WRITE) && Ready->bWantWrite)
+                FlushClient(Ready);
+        }
+    }
+}
+
+// The ring's counterpart of HandleEvents(): what finished rather than what's ready.  Multishot requests that ended are queued again.
+static void HandleCompletions(Worker *Self, const UringCompletion *Done, int Count) {
+    PollEvent Wakeups[MAX_EVENTS];
+    int Counter;
+
+    for (Counter = 0; Counter < Count; Counter++) {
+        switch (Done[Counter].Kind) {
+        case URING_POLL: // The poller only holds the wakeup.  Waiting on it with no timeout resets it.
+            PollerWait(Self->Poller, Wakeups, MAX_EVENTS, 0);
+            if (!Done[Counter].bMore)
+                UringPoll(Self->Ring, PollerHandle(Self->Poller), Self);
+            break;
+
+        case URING_ACCEPT:
+            if (Done[Counter].Result >= 0)
+                HandOut(Self, (SOCKET)Done[Counter].Result);
+            if (!Done[Counter].bMore && Self->bDraining) // Cancelled by StartDraining().
+                StopAccepting(Self);
+            else if (!Done[Counter].bMore)
+                UringAccept(Self->Ring, Self->ListenSocket, &Self->ListenSocket);
+            break;
+
+        case URING_RECV:
+            RingReceived(Done[Counter].Context, &Done[Counter]);
+            break;
+
+        case URING_SEND:
+            RingSent(Done[Counter].Context, Done[Counter].Result);
+            break;
+        }
+    }
+}
+
+static void AcceptClients(Worker *Self) {
+    SOCKET NewSocket;
+
+    // The listen socket is only reported once for any number of pending connections, so keep accepting until there are none left.
+    while ((NewSocket = accept(Self->ListenSocket, NULL, NULL)) != INVALID_SOCKET)
+        HandOut(Self, NewSocket);
+}
+
+// Give a newly accepted socket to the worker that should have it.
+static void HandOut(Worker *Self, SOCKET NewSocket) {
+    InboxItem *Item;
+    Worker *Target;
+
+    if (bShardedListeners || WorkerCount == 1) { // This worker's own listen socket: the kernel already picked the worker.
+        AddClient(Self, NewSocket);
+        return;
+    }
+
+    Target = &Workers[NextWorker];
+    NextWorker = (NextWorker + 1) % WorkerCount;
+
+    if (Target == Self) {
+        AddClient(Self, NewSocket);
+        return;
+    }
+
+    Item = PoolAlloc(InboxPool);
+    if (Item == NULL) {
+        close(NewSocket);
+        return;
+    }
+    Item->Kind = INBOX_SOCKET;
+    Item->Socket = NewSocket;
+    PostToWorker(Target, Item);
+}
+
+// Returns the new client, or NULL if it was refused (and its socket closed).
+static Client *AddClient(Worker *Self, SOCKET NewSocket) {
+    Client *NewClient;
+
+    if (atomic_fetch_add(&TotalClients, 1) >= Settings.MaxClients && Settings.MaxClients > 0) {
+        atomic_fetch_sub(&TotalClients, 1);
+        ConsolePrintf("Client refused: the server is full!\n");
+        close(NewSocket);
+        return NULL;
+    }
+
+    if (Self->ClientCount == Self->ClientCapacity) {
+        int NewCapacity = Self->ClientCapacity ? Self->ClientCapacity * 2 : 16;
+        Client **NewClients = realloc(Self->Clients, NewCapacity * sizeof(Client *));
+        if (NewClients == NULL) {
+            ConsolePrintf("Client refused: out of memory!\n");
+            atomic_fetch_sub(&TotalClients, 1);
+            close(NewSocket);
+            return NULL;
+        }
+        Self->Clients = NewClients;
+        Self->ClientCapacity = NewCapacity;
+    }
+
+    NewClient = PoolAlloc(ClientPool);
+    if (NewClient != NULL)
+        memset(NewClient, 0, sizeof(Client));
+
+    if (NewClient != NULL && ListenerTls != NULL && (NewClient->Tls = TlsAccept(ListenerTls, NewSocket)) == NULL) {
+        ConsolePrintf("Client refused: unable to start TLS!\n");
+        PoolFree(ClientPool, NewClient);
+        NewClient = NULL;
+    }
+
+    if (NewClient == NULL || !SetNonBlocking(NewSocket)
+        || !(Self->Ring ? UringRecv(Self->Ring, NewSocket, NewClient) : PollerAdd(Self->Poller, NewSocket, NewClient, POLL_READ))) {
+        ConsolePrintf("Client refused: unable to watch its socket!\n");
+        if (NewClient) {
+            TlsFree(NewClient->Tls);
+            PoolFree(ClientPool, NewClient);
+        }
+        atomic_fetch_sub(&TotalClients, 1);
+        close(NewSocket);
+        return NULL;
+    }
+
+    SetNoDelay(NewSocket, Settings.bTcpNoDelay);
+    NewClient->Socket = NewSocket;
+    NewClient->Index = Self->ClientCount;
+    NewClient->Owner = Self;
+    NewClient->bRecvArmed = Self->Ring != NULL;
+    NewClient->Pending = Self->Ring != NULL;
+    NewClient->JoinedUs = NewClient->HeardUs = MonotonicUs();
+    NewClient->bHandshaking = NewClient->Tls != NULL;
+    NewClient->Captured = CaptureConnection();
+    TimerInit(&NewClient->Alarm, NewClient);
+    ScheduleAlarm(NewClient);
+    FrameDecoderInit(&NewClient->Decoder, Settings.MaxFrameBytes);
+    OutBufferInit(&NewClient->Out);
+    Self->Clients[Self->ClientCount++] = NewClient;
+    MetricsCount(&Self->Stats, METRIC_ACCEPTED, 1);
+    MetricsSet(&Self->Stats, GAUGE_CLIENTS, Self->ClientCount);
+    if (!Settings.bHeadless)
+        ConsolePrintf("Client %d joined worker %d! %d client(s) on that worker.\n", (int)NewSocket, Self->Index, Self->ClientCount);
+    if (ReadingPaused(NewClient)) // Accepted while draining.
+        WatchClient(NewClient);
+    return NewClient;
+}
+
+static void ReadFromClient(Client *Sender) {
+    char *ReceiveBuffer = Sender->Owner->ReceiveBuffer;
+    char Description[128];
+    long BytesReceived;
+
+    for (;;) { // Drain the socket.  Edge-triggered backends won't report it again until more data arrives.
+        if (Sender->Tls)
+            BytesReceived = TlsRecv(Sender->Tls, ReceiveBuffer, Settings.ReceiveBufferSize);
+        else
+            BytesReceived = recv(Sender->Socket, ReceiveBuffer, (int)Settings.ReceiveBufferSize, 0);
+        MetricsCount(&Sender->Owner->Stats, METRIC_RECV_CALLS, 1);
+
+        if (Sender->Tls && TlsHandshakeCompleted(Sender->Tls, Description, sizeof(Description))) {
+            Sender->bHandshaking = false; // Its alarm finds out when it next goes off.
+            if (!Settings.bHeadless)
+                ConsolePrintf("Client %d secured: %s\n", (int)Sender->Socket, Description);
+            QueueFlush(Sender); // Messages broadcast to it during the handshake were held back.
+        }
+
+        if (BytesReceived == SOCKET_ERROR && SocketWouldBlock())
+            return;
+
+        if (BytesReceived == SOCKET_ERROR || BytesReceived == 0) { // Error or graceful close.  Either way the client is gone.
+            if (BytesReceived == SOCKET_ERROR)
+                MetricsCount(&Sender->Owner->Stats, METRIC_RECV_ERRORS, 1);
+            if (!Settings.bHeadless)
+                ConsolePrintf("Client %d left!\n", (int)Sender->Socket);
+            DropClient(Sender);
+            return;
+        }
+
+        if (!ClientBytesReceived(Sender, (const uint8_t *)ReceiveBuffer, (size_t)BytesReceived) || ReadingPaused(Sender))
+            return;
+    }
+}
+
+// Hand bytes read from a client to its frame decoder.  Returns false if the client was dropped.
+static bool ClientBytesReceived(Client *Sender, const uint8_t *Data, size_t Length) {
+    size_t Decoded;
+    int64_t WaitUs;
+
+    Sender->Owner->ReadUs = Sender->HeardUs = MonotonicUs();
+    Sender->bPinged = false;
+    MetricsCount(&Sender->Owner->Stats, METRIC_BYTES_IN, Length);
+    CaptureBytes(Sender->Captured, Data, Length);
+
+    if ((WaitUs = RateTake(&Sender->SentBytes, &ClientBytes, (int64_t)Length, Sender->Owner->ReadUs)) > 0)
+        Throttle(Sender, WaitUs); // Over the limit with these.  They wait with it, undecoded.
+    if (DecodePaused(Sender) || Sender->HeldLength > 0) // On a ring, what was already on its way when the pause began.
+        return HoldBytes(Sender, Data, Length);
+    if (!DecodeBytes(Sender, Data, Length, &Decoded))
+        return false;
+    return Decoded == Length || HoldBytes(Sender, Data + Decoded, Length - Decoded);
+}
+
+// Decode until the client is paused (see SendStream() & Throttle()), which stops the decoder straight after the frame that did it.
+// Decoded is set to how far that got.  Returns false if the client was dropped.
+static bool DecodeBytes(Client *Sender, const uint8_t *Data, size_t Length, size_t *Decoded) {
+    *Decoded = 0;
+    if (DecodePaused(Sender))
+        return true;
+    if (!FrameDecoderFeed(&Sender->Decoder, Data, Length, ClientFrameReceived, Sender)) {
+        if (Sender->Socket != INVALID_SOCKET) { // Else it was dropped while answering it, for not reading what it was sent.
+            MetricsCount(&Sender->Owner->Stats, METRIC_PROTOCOL_ERRORS, 1);
+            ConsolePrintf("Client %d sent a malformed message and was dropped!\n", (int)Sender->Socket);
+            DropClient(Sender);
+        }
+        return false;
+    }
+    *Decoded = Length - Sender->Decoder.Unread;
+    return true;
+}
+
+// Keep bytes for ResumeStreams() to decode after a pause.  Returns false (having dropped the client) if out of memory.
+static bool HoldBytes(Client *Sender, const uint8_t *Data, size_t Length) {
+    size_t Capacity = Sender->HeldCapacity ? Sender->HeldCapacity : HELD_MIN_BYTES;
+    uint8_t *Held;
+
+    if (Sender->HeldStart > 0) { // Only what's still to be decoded is kept.
+        memmove(Sender->Held, Sender->Held + Sender->HeldStart, Sender->HeldLength - Sender->HeldStart);
+        Sender->HeldLength -= Sender->HeldStart;
+        Sender->HeldStart = 0;
+    }
+    while (Capacity < Sender->HeldLength + Length)
+        Capacity *= 2;
+    if (Capacity != Sender->HeldCapacity) {
+        if ((Held = realloc(Sender->Held, Capacity)) == NULL) {
+            ConsolePrintf("Client %d dropped: out of memory!\n", (int)Sender->Socket);
+            DropClient(Sender);
+            return false;
+        }
+        Sender->Held = Held;
+        Sender->HeldCapacity = Capacity;
+    }
+    memcpy(Sender->Held + Sender->HeldLength, Data, Length);
+    Sender->HeldLength += Length;
+    return true;
+}
+
+// Queue the client's multishot recv on the ring again.  Returns false (having dropped it) if the ring is full.
+static bool ArmRecv(Client *Reader) {
+    if (!UringRecv(Reader->Owner->Ring, Reader->Socket, Reader)) {
+        ConsolePrintf("Client %d dropped: the worker's ring is full!\n", (int)Reader->Socket);
+        DropClient(Reader);
+        return false;
+    }
+    Reader->bRecvArmed = true;
+    Reader->Pending++;
+    return true;
+}
+
+// Bytes the ring read into one of its provided buffers (or why it couldn't).  The buffer goes straight back to the ring.
+static void RingReceived(Client *Sender, const UringCompletion *Done) {
+    Worker *Self = Sender->Owner;
+    bool bAlive = Sender->Socket != INVALID_SOCKET;
+
+    if (!Done->bMore) { // The recv has ended.
+        Sender->bRecvArmed = false;
+        Sender->bRecvCancelled = false;
+        Sender->Pending--;
+    }
+
+    if (bAlive && Done->Result > 0)
+        bAlive = ClientBytesReceived(Sender, UringBufferData(Self->Ring, Done->Buffer), (size_t)Done->Result);
+    else if (bAlive && Done->Result != -ENOBUFS && Done->Result != -ECANCELED) { // Out of buffers or paused isn't the client's doing.
+        if (Done->Result < 0)
+            MetricsCount(&Self->Stats, METRIC_RECV_ERRORS, 1);
+        if (!Settings.bHeadless)
+            ConsolePrintf("Client %d left!\n", (int)Sender->Socket);
+        DropClient(Sender);
+        bAlive = false;
+    }
+
+    if (Done->Buffer != -1)
+        UringRecycle(Self->Ring, Done->Buffer);
+    if (bAlive && Sender->Socket != INVALID_SOCKET && !Sender->bRecvArmed && !ReadingPaused(Sender))
+        ArmRecv(Sender);
+}
+
+// A send the ring finished.  The next one, with whatever was queued meanwhile, goes out with the rest of this pass's flushes.
+static void RingSent(Client *Receiver, int Result) {
+    Metrics *Stats = &Receiver->Owner->Stats;
+
+    Receiver->Pending--;
+    Receiver->bWantWrite = false;
+    if (Receiver->Socket == INVALID_SOCKET) { // Dropped while the send was in flight, which still needed its messages.
+        OutBufferFree(&Receiver->Out);
+        return;
+    }
+    if (Result < 0) {
+        MetricsCount(Stats, METRIC_SEND_ERRORS, 1);
+        if (!Settings.bHeadless)
+            ConsolePrintf("Client %d left!\n", (int)Receiver->Socket);
+        DropClient(Receiver);
+        return;
+    }
+
+    MetricsCount(Stats, METRIC_BYTES_OUT, Result);
+    OutBufferConsume(&Receiver->Out, (size_t)Result);
+    if (Receiver->bReadPaused && Receiver->Out.QueuedBytes <= Settings.LowWatermarkBytes) {
+        Receiver->bReadPaused = false;
+        WatchClient(Receiver);
+    }
+    if (Receiver->Out.Count > 0)
+        QueueFlush(Receiver);
+}
+
+static bool ClientFrameReceived(void *Context, uint8_t Type, const uint8_t *Payload, size_t Length) {
+    Client *Sender = Context;
+    int64_t WaitUs = RateTake(&Sender->SentMessages, &ClientMessages, 1, Sender->Owner->ReadUs);
+
+    if (WaitUs > 0)
+        Throttle(Sender, WaitUs); // Once this one's done.
+
+    switch (Type) {
+    case FRAME_MSG:
+        MetricsCount(&Sender->Owner->Stats, METRIC_MESSAGES_IN, 1);
+        if ((Payload = CleanText(Sender->Owner, Payload, &Length, 0)) == NULL || Length == 0)
+            return true;
+        if (!Settings.bHeadless)
+            ConsolePrintf("Client %d said: %.*s\n", (int)Sender->Socket, (int)Length, (const char *)Payload);
+        BroadcastMessage(Sender->Owner, (const char *)Payload, Length, Sender);
+        return true;
+
+    case FRAME_JOIN:
+        return JoinRoom(Sender, Payload, Length);
+
+    case FRAME_LEAVE:
+        return LeaveRoom(Sender, Payload, Length);
+
+    case FRAME_ROOM_MSG:
+        MetricsCount(&Sender->Owner->Stats, METRIC_MESSAGES_IN, 1);
+        return SendToRoom(Sender, Payload, Length);
+
+    case FRAME_HISTORY:
+        return SendRoomHistory(Sender, Payload, Length);
+
+    case FRAME_LOGIN:
+        return LogIn(Sender, Payload, Length);
+
+    case FRAME_DIRECT:
+        MetricsCount(&Sender->Owner->Stats, METRIC_MESSAGES_IN, 1);
+        return SendDirect(Sender, Payload, Length);
+
+    case FRAME_PING:
+        return SendPong(Sender, Payload, Length);
+
+    case FRAME_COMPRESS:
+        return AgreeToCompress(Sender, Payload, Length);
+
+    case FRAME_FILE:
+    case FRAME_CHUNK:
+    case FRAME_FILE_END:
+        return SendStream(Sender, Type, Payload, Length);
+    }
+    return true; // Frame types this version doesn't know are skipped so newer clients can still talk to it.
+}
+
+static void DropClient(Client *Leaver) {
+    Worker *Self = Leaver->Owner;
+    int Counter;
+
+    while (Leaver->Rooms.Count > 0)
+        LeaveRoomSlot(Leaver, Leaver->Rooms.Count - 1);
+    RoomMembershipFree(&Leaver->Rooms);
+
+    if (Leaver->Id != USER_NONE) { // Unrouted now.  Everyone is told once this pass is over (see AnnounceDepartures()).
+        UserUnregister(Leaver->Id);
+        Self->ById[Leaver->Id] = NULL;
+        Leaver->NextDeparted = Self->Departed;
+        Self->Departed = Leaver;
+    }
+
+    TimerCancel(&Self->Timers, &Leaver->Alarm);
+    CaptureClosed(Leaver->Captured);
+    StreamUnpause(Leaver);
+    Unthrottle(Leaver);
+    for (Counter = 0; Counter < STREAM_WINDOW; Counter++) {
+        if (Leaver->Relayed[Counter])
+            MessageRelease(Leaver->Relayed[Counter]);
+        Leaver->Relayed[Counter] = NULL;
+    }
+    if (Leaver->bPacked)
+        atomic_fetch_sub(&PackedClients, 1);
+    if (Self->Ring != NULL && !Leaver->bHandedOver) // Which would end the connection for the new server too.  It has none in flight.
+        shutdown(Leaver->Socket, SHUT_RDWR); // Ends its requests in the ring, which holds the socket open until they complete.
+    else if (Self->Ring == NULL)
+        PollerRemove(Self->Poller, Leaver->Socket);
+    TlsFree(Leaver->Tls);
+    Leaver->Tls = NULL;
+    close(Leaver->Socket);
+    FrameDecoderFree(&Leaver->Decoder);
+    if (Self->Ring == NULL || !Leaver->bWantWrite) // A send in flight still points into it.  Freed once it completes.
+        OutBufferFree(&Leaver->Out);
+    Leaver->Socket = INVALID_SOCKET;
+    atomic_fetch_sub(&TotalClients, 1);
+
+    Self->Clients[Leaver->Index] = Self->Clients[--Self->ClientCount]; // Move the last client into the free slot to keep the array packed.
+    Self->Clients[Leaver->Index]->Index = Leaver->Index;
+    MetricsCount(&Self->Stats, METRIC_CLOSED, 1);
+    MetricsSet(&Self->Stats, GAUGE_CLIENTS, Self->ClientCount);
+
+    Leaver->NextDead = Self->DeadClients;
+    Self->DeadClients = Leaver;
+}
+
+// No event still refers to clients dropped during this pass, so they can be freed now.  Except those still to be announced as gone,
+// which wait for the next pass, and those the ring still has requests for, which wait for them to complete.
+static void FreeDeadClients(Worker *Self) {
+    Client **Link = &Self->DeadClients;
+    Client *Dead;
+
+    while ((Dead = *Link) != NULL) {
+        if (Dead->Id != USER_NONE || Dead->Pending > 0) {
+            Link = &Dead->NextDead;
+            continue;
+        }
+        *Link = Dead->NextDead;
+        UringSendStateFree(Dead->Sending);
+        free(Dead->Held); // Not before, it may have been dropped while decoding what was held.
+        PoolFree(ClientPool, Dead);
+    }
+}
+
+// Set the client's alarm for the next thing that may be due: the end of its handshake, its ping, or its idle timeout.  Hearing from
+// it doesn't move the alarm (that would be a wheel operation per read), so it may go off early, and then just sets itself again.
+static void ScheduleAlarm(Client *Watched) {
+    int64_t DueUs = INT64_MAX;
+
+    if (Watched->bHandshaking && Settings.HandshakeTimeoutMs > 0)
+        DueUs = Watched->JoinedUs + Settings.HandshakeTimeoutMs * 1000LL;
+    if (!Watched->bPinged && Settings.PingIntervalMs > 0 && Watched->HeardUs + Settings.PingIntervalMs * 1000LL < DueUs)
+        DueUs = Watched->HeardUs + Settings.PingIntervalMs * 1000LL;
+    if (Settings.IdleTimeoutMs > 0 && Watched->HeardUs + Settings.IdleTimeoutMs * 1000LL < DueUs)
+        DueUs = Watched->HeardUs + Settings.IdleTimeoutMs * 1000LL;
+
+    if (DueUs == INT64_MAX)
+        TimerCancel(&Watched->Owner->Timers, &Watched->Alarm);
+    else
+        TimerSchedule(&Watched->Owner->Timers, &Watched->Alarm, DueUs);
+}
+
+static void ClientAlarm(Timer *Expired) {
+    Client *Watched = Expired->Context;
+    Metrics *Stats = &Watched->Owner->Stats;
+    int64_t NowUs = MonotonicUs();
+
+    if (Watched->bHandshaking && Settings.HandshakeTimeoutMs > 0 && NowUs - Watched->JoinedUs >= Settings.HandshakeTimeoutMs * 1000LL) {
+        MetricsCount(Stats, METRIC_TIMEOUTS, 1);
+        ConsolePrintf("Client %d dropped: it didn't finish its TLS handshake!\n", (int)Watched->Socket);
+        DropClient(Watched);
+        return;
+    }
+    if (Settings.IdleTimeoutMs > 0 && NowUs - Watched->HeardUs >= Settings.IdleTimeoutMs * 1000LL) {
+        MetricsCount(Stats, METRIC_TIMEOUTS, 1);
+        ConsolePrintf("Client %d dropped: nothing heard from it for %d ms!\n", (int)Watched->Socket, (int)((NowUs - Watched->HeardUs) / 1000));
+        DropClient(Watched);
+        return;
+    }
+    if (!Watched->bPinged && Settings.PingIntervalMs > 0 && NowUs - Watched->HeardUs >= Settings.PingIntervalMs * 1000LL) {
+        Watched->bPinged = true;
+        MetricsCount(Stats, METRIC_PINGS, 1);
+        if (!DeliverTo(Watched->Owner, Watched, PingFrame))
+            return;
+    }
+    ScheduleAlarm(Watched);
+}
+
+// Send a message to every client except the one who sent it.  Sender is NULL if the message came from the server operator.
+static void BroadcastMessage(Worker *Self, const char *Text, size_t Length, Client *Sender) {
+    Message *Shared = CreateUserFrame(FRAME_MSG, Sender ? Sender->Id : USER_NONE, Text, Length); // Framed & stored once.  Every client queues a reference to it.
+
+    if (Shared == NULL)
+        return;
+    ClusterBroadcast(Text, Length); // Once per other node, which delivers it to all its clients.
+    BroadcastShared(Self, Shared, Sender, Sender ? Self->ReadUs : MonotonicUs());
+}
+
+// Deliver Shared to every client on every worker but Sender's, then drop the caller's reference.
+static void BroadcastShared(Worker *Self, Message *Shared, Client *Sender, int64_t ReceivedUs) {
+    DeliverLocally(Self, Shared, Sender, ReceivedUs);
+    PostBroadcast(Shared, Self->Index, ReceivedUs); // The sender is local, so other workers deliver to all their clients.
+    MessageRelease(Shared); // Freed as soon as the last client has sent it.
+}
+
+// Post Shared to every worker but Except (-1 = none) for all its clients.
+static void PostBroadcast(Message *Shared, int Except, int64_t ReceivedUs) {
+    InboxItem *Item;
+    int Counter;
+
+    for (Counter = 0; Counter < WorkerCount; Counter++) {
+        if (Counter == Except)
+            continue;
+
+        Item = PoolAlloc(InboxPool);
+        if (Item == NULL)
+            continue;
+        Item->Kind = INBOX_BROADCAST;
+        Item->Shared = MessageRetain(Shared);
+        Item->ReceivedUs = ReceivedUs;
+        PostToWorker(&Workers[Counter], Item);
+    }
+}
+
+// Post a FRAME_ROOM_MSG to every worker but Except that may have members of its room.  The room's name is NameOffset bytes into it.
+static void PostToRoom(Message *Shared, size_t NameOffset, size_t NameLength, uint32_t Hash, int Except, int64_t ReceivedUs) {
+    InboxItem *Item;
+    int Counter;
+
+    for (Counter = 0; Counter < WorkerCount; Counter++) {
+        if (Counter == Except
+            || atomic_load_explicit(&Workers[Counter].RoomPresence[Hash & (ROOM_PRESENCE_BUCKETS - 1)], memory_order_relaxed) == 0)
+            continue;
+
+        Item = PoolAlloc(InboxPool);
+        if (Item == NULL)
+            continue;
+        Item->Kind = INBOX_ROOM;
+        Item->Shared = MessageRetain(Shared);
+        Item->ReceivedUs = ReceivedUs;
+        Item->RoomName = Shared->Data + NameOffset;
+        Item->RoomNameLength = NameLength;
+        Item->RoomHash = Hash;
+        PostToWorker(&Workers[Counter], Item);
+    }
+}
+
+// A message relayed by another node, on the cluster thread.  Its sender's ID means nothing here, so it goes out as from nobody.  A room
+// message is passed on first if this node is the room's owner (see cluster.h), then posted to the workers with members in it.
+static void DeliverFromNode(int FromNode, uint8_t Type, const uint8_t *Payload, size_t Length) {
+    const uint8_t *Name;
+    const uint8_t *Text;
+    size_t NameLength;
+    size_t TextLength;
+    uint32_t Hash;
+    Message *Shared;
+
+    ThreadPacker = NodePacker; // On the cluster thread.
+    if (Type == PEER_BROADCAST) {
+        if ((Shared = CreateUserFrame(FRAME_MSG, USER_NONE, Payload, Length)) != NULL) {
+            PostBroadcast(Shared, -1, MonotonicUs());
+            MessageRelease(Shared);
+        }
+        return;
+    }
+
+    if (!FrameSplitRoomMessage(Payload, Length, &Name, &NameLength, &Text, &TextLength))
+        return;
+    Hash = RoomHash(Name, NameLength);
+    ClusterRelayRoom(Payload, Length, Name, NameLength, Hash, FromNode);
+
+    if ((Shared = CreateUserFrame(FRAME_ROOM_MSG, USER_NONE, Payload, Length)) == NULL)
+        return;
+    HistoryRecord(Name, NameLength, Hash, Shared, USER_NONE, 0); // Every node keeps its own copy of the history, as it would for its own members.
+    JournalAppend(Name, NameLength, Hash, Shared);
+    PostToRoom(Shared, Shared->Length - Length + 1, NameLength, Hash, -1, MonotonicUs());
+    MessageRelease(Shared);
+}
+
+// The type byte of the frame Shared holds.
+static uint8_t FrameTypeOf(const Message *Shared) {
+    uint64_t PayloadLength;
+    size_t VarintLength = VarintDecode(Shared->Data, Shared->Length, &PayloadLength);
+
+    return VarintLength ? Shared->Data[VarintLength] : 0;
+}
+
+// Queue Shared for one client.  Returns false if the client was dropped instead, for being too far behind.
+static bool DeliverTo(Worker *Self, Client *Receiver, Message *Shared) {
+    if (Receiver->Out.QueuedBytes >= Settings.LowWatermarkBytes && FrameTypeOf(Shared) == FRAME_CHUNK) { // See server.h.
+        MetricsCount(&Self->Stats, METRIC_CHUNKS_SKIPPED, 1);
+        return true;
+    }
+    if (Receiver->bPacked && Shared->Packed)
+        Shared = Shared->Packed;
+    if (Receiver->Out.QueuedBytes + Shared->Length > Settings.MaxQueuedBytes) {
+        MetricsCount(&Self->Stats, METRIC_SLOW_DROPS, 1);
+        ConsolePrintf("Client %d dropped: it isn't reading its messages (%zu bytes queued)!\n", (int)Receiver->Socket, Receiver->Out.QueuedBytes);
+        DropClient(Receiver);
+        return false;
+    }
+
+    if (!OutBufferAppendMessage(&Receiver->Out, Shared))
+        return false;
+    QueueFlush(Receiver);
+    if (Receiver->Out.QueuedBytes >= Settings.HighWatermarkBytes && !Receiver->bReadPaused) {
+        PauseReading(Receiver);
+        WatchClient(Receiver);
+    }
+    return true;
+}
+
+// Dropping a client from inside these loops is safe because they run backwards: only entries already visited get moved into its slot.
+static void DeliverLocally(Worker *Self, Message *Shared, Client *Sender, int64_t ReceivedUs) {
+    int Delivered = 0;
+    int Counter;
+
+    for (Counter = Self->ClientCount - 1; Counter >= 0; Counter--) {
+        if (Self->Clients[Counter] != Sender && DeliverTo(Self, Self->Clients[Counter], Shared))
+            Delivered++;
+    }
+
+    MetricsCount(&Self->Stats, METRIC_DELIVERIES, Delivered);
+    MetricsRecord(&Self->Stats, HISTOGRAM_BROADCAST_US, MonotonicUs() - ReceivedUs);
+}
+
+// If the last member is dropped the room is freed, but that member was in slot 0, so the loop is finished by then.
+static void DeliverToRoom(Worker *Self, Room *Target, Message *Shared, Client *Sender, int64_t ReceivedUs) {
+    Client *Receiver;
+    int Delivered = 0;
+    int Counter;
+
+    for (Counter = Target->MemberCount - 1; Counter >= 0; Counter--) {
+        Receiver = Target->Members[Counter].Owner;
+        if (Receiver != Sender && DeliverTo(Self, Receiver, Shared))
+            Delivered++;
+    }
+
+    MetricsCount(&Self->Stats, METRIC_DELIVERIES, Delivered);
+    MetricsRecord(&Self->Stats, HISTOGRAM_BROADCAST_US, MonotonicUs() - ReceivedUs);
+}
+
+// Join a room & send the new member what was said in it recently, before anything new.  Returns false if the client had to be dropped.
+static bool JoinRoom(Client *Member, const uint8_t *Name, size_t Length) {
+    Worker *Self = Member->Owner;
+    Room *Joined;
+
+    if (!RoomNameValid(Name, Length))
+        return false;
+
+    if (Member->Rooms.Count >= MAX_ROOMS_PER_CLIENT) {
+        if (!Settings.bHeadless)
+            ConsolePrintf("Client %d can't join %.*s: already in %d rooms!\n", (int)Member->Socket, (int)Length, (const char *)Name, MAX_ROOMS_PER_CLIENT);
+        return true;
+    }
+
+    Joined = EnterRoom(Member, Name, Length);
+    if (Joined == NULL) // Already a member, or out of memory.
+        return true;
+    if (!Settings.bHeadless)
+        ConsolePrintf("Client %d joined room %.*s.\n", (int)Member->Socket, (int)Length, (const char *)Name);
+
+    // A message posted by another worker just before the snapshot may also arrive in the usual way once, a moment later.
+    return ReplayTo(Member, HistorySnapshot(Name, Length, Joined->Hash, Self->Replay, Settings.HistoryMessages));
+}
+
+// Make the client a member, opening the room on this worker if it's the first.  NULL if it's a member already, or out of memory.
+static Room *EnterRoom(Client *Member, const uint8_t *Name, size_t Length) {
+    Worker *Self = Member->Owner;
+    Room *Joined;
+    bool bCreated;
+
+    Joined = RoomJoin(&Self->Rooms, Name, Length, Member, &Member->Rooms, &bCreated);
+    if (Joined != NULL && bCreated) {
+        atomic_fetch_add_explicit(&Self->RoomPresence[Joined->Hash & (ROOM_PRESENCE_BUCKETS - 1)], 1, memory_order_relaxed);
+        HistoryRoomOpened(Name, Length, Joined->Hash);
+        ClusterRoomOpened(Name, Length, Joined->Hash);
+    }
+    return Joined;
+}
+
+// Queue the first Count of the worker's Replay messages & release them.  They're references to the messages the history already
+// holds, so they all go out in the member's next write.  Returns false if the client had to be dropped.
+//
+// A message whose sender has gone since is sent as from nobody instead, as the sender's ID may be someone else's by now.
+static bool ReplayTo(Client *Member, int Count) {
+    Worker *Self = Member->Owner;
+    HistoryEntry *Entry;
+    Message *Unsigned;
+    int WorkerIndex;
+    uint32_t Generation;
+    int Counter;
+
+    for (Counter = 0; Counter < Count; Counter++) {
+        Entry = &Self->Replay[Counter];
+        if (Member->Socket != INVALID_SOCKET) {
+            if (Entry->Sender == USER_NONE || (UserRoute(Entry->Sender, &WorkerIndex, &Generation) && Generation == Entry->Generation))
+                DeliverTo(Self, Member, Entry->Shared);
+            else if ((Unsigned = WithoutSender(Entry->Shared)) != NULL) {
+                DeliverTo(Self, Member, Unsigned);
+                MessageRelease(Unsigned);
+            }
+        }
+        MessageRelease(Entry->Shared);
+    }
+    return Member->Socket != INVALID_SOCKET;
+}
+
+// A copy of Shared, a frame starting with its sender's ID, with USER_NONE for the ID.  NULL if there's no memory for it.
+static Message *WithoutSender(const Message *Shared) {
+    uint64_t PayloadLength;
+    uint64_t Sender;
+    size_t VarintLength = VarintDecode(Shared->Data, Shared->Length, &PayloadLength);
+    const uint8_t *Payload = Shared->Data + VarintLength + 1;
+    size_t IdLength = VarintDecode(Payload, (size_t)PayloadLength, &Sender);
+
+    return CreateUserFrame(Shared->Data[VarintLength], USER_NONE, Payload + IdLength, (size_t)PayloadLength - IdLength);
+}
+
+// Answer a FRAME_HISTORY with the room's last messages: from the log if there is one, which goes back further, else from memory.
+static bool SendRoomHistory(Client *Asker, const uint8_t *Payload, size_t Length) {
+    Worker *Self = Asker->Owner;
+    uint64_t Count;
+    size_t CountLength = VarintDecode(Payload, Length, &Count);
+    const uint8_t *Name = Payload + CountLength;
+    size_t NameLength = Length - CountLength;
+    Room *Target;
+    Message *Replay;
+
+    if (CountLength == 0 || !RoomNameValid(Name, NameLength))
+        return false;
+
+    Target = RoomFind(&Self->Rooms, Name, NameLength, RoomHash(Name, NameLength));
+    if (Target == NULL || RoomMembershipFind(&Asker->Rooms, Target) == -1) // Members only, as for sending.
+        return true;
+    if (Count > HISTORY_QUERY_MAX)
+        Count = HISTORY_QUERY_MAX;
+
+    if (Settings.LogDirectory[0] == '\0')
+        return ReplayTo(Asker, HistorySnapshot(Name, NameLength, Target->Hash, Self->Replay,
+                                               (int)Count < Settings.HistoryMessages ? (int)Count : Settings.HistoryMessages));
+
+    // One message holding every frame, copied out of the log's mapped pages.  Kept under the high watermark, so the answer alone never
+    // pauses the asker.
+    Replay = JournalQuery(Name, NameLength, Target->Hash, (int)Count, Settings.HighWatermarkBytes);
+    if (Replay == NULL)
+        return true;
+    DeliverTo(Self, Asker, Replay);
+    MessageRelease(Replay);
+    return Asker->Socket != INVALID_SOCKET;
+}
+
+static bool LeaveRoom(Client *Member, const uint8_t *Name, size_t Length) {
+    Room *Left;
+    int Slot;
+
+    if (!RoomNameValid(Name, Length))
+        return false;
+
+    Left = RoomFind(&Member->Owner->Rooms, Name, Length, RoomHash(Name, Length));
+    if (Left == NULL || (Slot = RoomMembershipFind(&Member->Rooms, Left)) == -1)
+        return true;
+
+    LeaveRoomSlot(Member, Slot);
+    if (!Settings.bHeadless)
+        ConsolePrintf("Client %d left room %.*s.\n", (int)Member->Socket, (int)Length, (const char *)Name);
+    return true;
+}
+
+static void LeaveRoomSlot(Client *Member, int Slot) {
+    Worker *Self = Member->Owner;
+    Room *Left = Member->Rooms.Entries[Slot].Joined;
+    uint32_t Hash = Left->Hash; // The room is freed by RoomLeave() if this was its last member.
+    uint8_t Name[ROOM_NAME_MAX];
+    size_t Length = Left->NameLength;
+
+    memcpy(Name, Left->Name, Length);
+    if (RoomLeave(&Self->Rooms, &Member->Rooms, Slot)) {
+        atomic_fetch_sub_explicit(&Self->RoomPresence[Hash & (ROOM_PRESENCE_BUCKETS - 1)], 1, memory_order_relaxed);
+        HistoryRoomClosed(Name, Length, Hash);
+        ClusterRoomClosed(Name, Length, Hash);
+    }
+}
+
+// Relay a FRAME_ROOM_MSG to the room's other members, here & on every worker that may have some.  Only members may send to a room.
+static bool SendToRoom(Client *Sender, const uint8_t *Payload, size_t Length) {
+    Worker *Self = Sender->Owner;
+    const uint8_t *Name;
+    const uint8_t *Text;
+    size_t NameLength;
+    size_t TextLength;
+    size_t HeaderLength;
+    Room *Target;
+    Message *Shared;
+
+    if (!FrameSplitRoomMessage(Payload, Length, &Name, &NameLength, &Text, &TextLength))
+        return false;
+
+    Target = RoomFind(&Self->Rooms, Name, NameLength, RoomHash(Name, NameLength));
+    if (Target == NULL || RoomMembershipFind(&Sender->Rooms, Target) == -1)
+        return true;
+    ChargeRoom(Sender, Target, Length);
+    if ((Payload = CleanText(Self, Payload, &Length, 1 + NameLength)) == NULL || Length == 1 + NameLength)
+        return true;
+    Name = Payload + 1;
+    Text = Name + NameLength;
+    TextLength = Length - 1 - NameLength;
+
+    if (!Settings.bHeadless)
+        ConsolePrintf("Client %d said in %.*s: %.*s\n", (int)Sender->Socket, (int)NameLength, (const char *)Name, (int)TextLength, (const char *)Text);
+
+    Shared = CreateUserFrame(FRAME_ROOM_MSG, Sender->Id, Payload, Length); // Relayed as it came, so it's encoded once for every member.
+    if (Shared == NULL)
+        return true;
+    HeaderLength = Shared->Length - Length; // Frame header & sender ID.
+    HistoryRecord(Name, NameLength, Target->Hash, Shared, Sender->Id, Sender->Generation);
+    JournalAppend(Name, NameLength, Target->Hash, Shared); // Does nothing without a log.
+    ClusterRelayRoom(Payload, Length, Name, NameLength, Target->Hash, ClusterSelf()); // To the room's owner, or from it to the other nodes.
+
+    PostToRoom(Shared, HeaderLength + 1, NameLength, Target->Hash, Self->Index, Self->ReadUs);
+    DeliverToRoom(Self, Target, Shared, Sender, Self->ReadUs);
+    MessageRelease(Shared);
+    return true;
+}
+
+// FRAME_FILE, FRAME_CHUNK or FRAME_FILE_END, to the sender's room or everyone.  Receivers tell streams apart by sender & stream ID, so
+// only from a user with a name.
+//
+// A transfer goes as fast as its receivers take it.  The sender's last STREAM_WINDOW chunks are held here, and once the oldest of them
+// is still waiting to go out to someone, here or on another worker, the sender isn't read until it has.  Whoever holds it up for
+// STREAM_STALL_US is only waited on that once: by the time it could hold up another it's over the low watermark and being skipped.
+static bool SendStream(Client *Sender, uint8_t Type, const uint8_t *Payload, size_t Length) {
+    Worker *Self = Sender->Owner;
+    const uint8_t *Name;
+    const uint8_t *Rest;
+    size_t NameLength;
+    size_t RestLength;
+    uint64_t Stream;
+    uint64_t Size;
+    size_t SizeLength = 0;
+    size_t Skip;
+    Room *Target = NULL;
+    Message *Shared;
+
+    if (!FrameSplitStream(Payload, Length, &Name, &NameLength, &Stream, &Rest, &RestLength))
+        return false;
+    if (Type == FRAME_FILE && (SizeLength = VarintDecode(Rest, RestLength, &Size)) == 0)
+        return false;
+    if (Sender->Id == USER_NONE)
+        return Type != FRAME_FILE || SendNotice(Sender, "Pick a name with /name before sending files.");
+    if (NameLength > 0) {
+        Target = RoomFind(&Self->Rooms, Name, NameLength, RoomHash(Name, NameLength));
+        if (Target == NULL || RoomMembershipFind(&Sender->Rooms, Target) == -1)
+            return true;
+        ChargeRoom(Sender, Target, Length);
+    }
+    if (Type != FRAME_CHUNK) { // The file's name, or why it was cut short.  Chunks are the file itself.
+        Skip = Length - RestLength + SizeLength;
+        if ((Payload = CleanText(Self, Payload, &Length, Skip)) == NULL) // Receivers would be left with a stream they can't finish.
+            return false;
+    }
+
+    if (Type == FRAME_FILE && !Sender->bStreamed) {
+        SetSocketBuffer(Sender->Socket, SO_RCVBUF, STREAM_SOCKET_BUFFER);
+        Sender->bStreamed = true;
+    }
+
+    Shared = CreateUserFrame(Type, Sender->Id, Payload, Length);
+    if (Shared == NULL)
+        return true;
+    if (Type == FRAME_CHUNK) {
+        if (Sender->Relayed[Sender->RelayedNext])
+            MessageRelease(Sender->Relayed[Sender->RelayedNext]);
+        Sender->Relayed[Sender->RelayedNext] = MessageRetain(Shared);
+        Sender->RelayedNext = (Sender->RelayedNext + 1) % STREAM_WINDOW;
+    }
+
+    if (Target == NULL)
+        BroadcastShared(Self, Shared, Sender, Self->ReadUs);
+    else {
+        PostToRoom(Shared, Shared->Length - Length + 1, NameLength, Target->Hash, Self->Index, Self->ReadUs);
+        DeliverToRoom(Self, Target, Shared, Sender, Self->ReadUs);
+        MessageRelease(Shared);
+    }
+
+    Shared = Sender->Relayed[Sender->RelayedNext];
+    if (Type == FRAME_CHUNK && !Sender->bStreamPaused && Shared && atomic_load(&Shared->RefCount) > 1) {
+        Sender->bStreamPaused = true;
+        Sender->StreamPausedUs = MonotonicUs();
+        FrameDecoderPause(&Sender->Decoder);
+        Sender->NextStreamPaused = Self->StreamPaused;
+        Self->StreamPaused = Sender;
+        WatchClient(Sender);
+    }
+    return true;
+}
+
+// Read again from the senders whose oldest chunk has gone out, or that have waited long enough.  Returns true if any are still waiting.
+static bool ResumeStreams(Worker *Self) {
+    Client *Waiting;
+    int64_t NowUs = Self->StreamPaused ? MonotonicUs() : 0;
+    int Counter;
+
+    // From the top each time, as decoding what one held back can drop any of the others.
+    for (Waiting = Self->StreamPaused; Waiting != NULL; Waiting = Waiting ? Waiting->NextStreamPaused : Self->StreamPaused) {
+        if (atomic_load(&Waiting->Relayed[Waiting->RelayedNext]->RefCount) > 1) {
+            if (NowUs - Waiting->StreamPausedUs < STREAM_STALL_US)
+                continue;
+            for (Counter = 0; Counter < STREAM_WINDOW; Counter++) { // Given up on.  A new window, so it can't hold up the next chunk too.
+                if (Waiting->Relayed[Counter])
+                    MessageRelease(Waiting->Relayed[Counter]);
+                Waiting->Relayed[Counter] = NULL;
+            }
+        }
+        StreamUnpause(Waiting);
+        Self->ReadUs = NowUs;
+        DecodeHeld(Waiting);
+        Waiting = NULL;
+    }
+    return Self->StreamPaused != NULL;
+}
+
+// What was held back during a pause is decoded as if it had just been received, up to the next pause if there is one.
+static void DecodeHeld(Client *Paused) {
+    size_t Decoded;
+
+    if (!DecodeBytes(Paused, Paused->Held + Paused->HeldStart, Paused->HeldLength - Paused->HeldStart, &Decoded))
+        return;
+    Paused->HeldStart += Decoded;
+    if (Paused->HeldStart == Paused->HeldLength)
+        Paused->HeldStart = Paused->HeldLength = 0;
+    WatchClient(Paused);
+}
+
+// Off its worker's StreamPaused list, if it's on it.
+static void StreamUnpause(Client *Sender) {
+    Client **Link = &Sender->Owner->StreamPaused;
+
+    if (!Sender->bStreamPaused)
+        return;
+    while (*Link != Sender)
+        Link = &(*Link)->NextStreamPaused;
+    *Link = Sender->NextStreamPaused;
+    Sender->bStreamPaused = false;
+}
+
+// Count what a member sent to a room against the room rate limits.  Whoever puts the room over waits until it's back under.  So does
+// anyone who sends to it meanwhile, once what they sent has gone: it's the next thing they send that waits.
+static void ChargeRoom(Client *Sender, Room *Target, size_t Length) {
+    int64_t MessagesUs = RateTake(&Target->Messages, &RoomMessages, 1, Sender->Owner->ReadUs);
+    int64_t BytesUs = RateTake(&Target->Bytes, &RoomBytes, (int64_t)Length, Sender->Owner->ReadUs);
+
+    if (MessagesUs > 0 || BytesUs > 0)
+        Throttle(Sender, MessagesUs > BytesUs ? MessagesUs : BytesUs);
+}
+
+// A client went over a rate limit: don't read or decode any more from it for WaitUs.  Its socket fills up meanwhile and TCP holds the
+// client back, so what it sends next costs nothing until it's its turn.
+static void Throttle(Client *Sender, int64_t WaitUs) {
+    Worker *Self = Sender->Owner;
+    int64_t UntilUs = Self->ReadUs + WaitUs;
+
+    FrameDecoderPause(&Sender->Decoder); // In case this is from inside it.
+    if (Sender->bThrottled) {
+        if (UntilUs > Sender->ThrottledUntilUs)
+            Sender->ThrottledUntilUs = UntilUs;
+        return;
+    }
+    MetricsCount(&Self->Stats, METRIC_THROTTLED, 1);
+    Sender->bThrottled = true;
+    Sender->ThrottledUntilUs = UntilUs;
+    Sender->NextThrottled = Self->Throttled;
+    Self->Throttled = Sender;
+    WatchClient(Sender);
+}
+
+// Read again from the clients that are back under their rate limits.  Returns how many ms until the next of the rest is, -1 if none.
+static int ResumeThrottled(Worker *Self) {
+    Client *Waiting;
+    int64_t NowUs = Self->Throttled ? MonotonicUs() : 0;
+    int64_t NextUs = -1;
+
+    // From the top each time, as decoding what one held back can drop or throttle any of the others.
+    for (Waiting = Self->Throttled; Waiting != NULL; Waiting = Waiting ? Waiting->NextThrottled : Self->Throttled) {
+        if (Waiting->ThrottledUntilUs > NowUs)
+            continue;
+        Unthrottle(Waiting);
+        Self->ReadUs = NowUs;
+        DecodeHeld(Waiting);
+        Waiting = NULL;
+    }
+
+    for (Waiting = Self->Throttled; Waiting != NULL; Waiting = Waiting->NextThrottled) {
+        if (NextUs < 0 || Waiting->ThrottledUntilUs - NowUs < NextUs)
+            NextUs = Waiting->ThrottledUntilUs - NowUs;
+    }
+    return NextUs < 0 ? -1 : (int)((NextUs + 999) / 1000);
+}
+
+// Off its worker's Throttled list, if it's on it.
+static void Unthrottle(Client *Sender) {
+    Client **Link = &Sender->Owner->Throttled;
+
+    if (!Sender->bThrottled)
+        return;
+    while (*Link != Sender)
+        Link = &(*Link)->NextThrottled;
+    *Link = Sender->NextThrottled;
+    Sender->bThrottled = false;
+}
+
+// A frame from a user to other clients: the sender's ID, then Body.  See frame.h.
+static Message *CreateUserFrame(uint8_t Type, UserId Sender, const void *Body, size_t Length) {
+    uint8_t Id[10];
+    uint8_t Header[FRAME_HEADER_MAX];
+    size_t IdLength = VarintEncode(Id, Sender);
+    size_t HeaderLength = FrameEncodeHeader(Header, Type, IdLength + Length);
+    Message *Shared = MessageCreate(HeaderLength + IdLength + Length);
+
+    if (Shared == NULL)
+        return NULL;
+    memcpy(Shared->Data, Header, HeaderLength);
+    memcpy(Shared->Data + HeaderLength, Id, IdLength);
+    memcpy(Shared->Data + HeaderLength + IdLength, Body, Length);
+    PackMessage(Shared);
+    return Shared;
+}
+
+// Payload with its text, all but the first Skip bytes, cleaned for other people's terminals (see text.h).  Payload itself if that changes
+// nothing, else a copy in the worker's Cleaned buffer, which lasts until the next frame.  NULL if there's no memory for the copy.  It may
+// leave no text at all; whether that's still worth sending is up to the caller.
+static const uint8_t *CleanText(Worker *Self, const uint8_t *Payload, size_t *Length, size_t Skip) {
+    size_t Clean = Skip + TextCleanPrefix(Payload + Skip, *Length - Skip);
+    uint8_t *NewBuffer;
+
+    if (Clean == *Length) // Nearly always.
+        return Payload;
+    if (*Length > Self->CleanedCapacity) {
+        if ((NewBuffer = realloc(Self->Cleaned, *Length)) == NULL)
+            return NULL;
+        Self->Cleaned = NewBuffer;
+        Self->CleanedCapacity = *Length;
+    }
+    memcpy(Self->Cleaned, Payload, Clean);
+    *Length = Clean + TextClean(Self->Cleaned + Clean, Payload + Clean, *Length - Clean);
+    MetricsCount(&Self->Stats, METRIC_MESSAGES_CLEANED, 1);
+    return Self->Cleaned;
+}
+
+// Give a chat message its compressed twin, before anyone else can see it.  Only while some client wants it, and only if it's smaller.
+static void PackMessage(Message *Shared) {
+    uint64_t PayloadLength;
+    size_t VarintLength = VarintDecode(Shared->Data, Shared->Length, &PayloadLength);
+    size_t PrefixLength;
+    size_t PackedLength;
+    size_t HeaderLength;
+    uint8_t *Body;
+    Message *Packed;
+
+    if (ThreadPacker == NULL || atomic_load_explicit(&PackedClients, memory_order_relaxed) == 0 || PayloadLength < PACK_MIN_BYTES
+        || Shared->Data[VarintLength] == FRAME_CHUNK) // Files are mostly compressed already, and a chunk is big to deflate for nothing.
+        return;
+    if ((Packed = MessageCreate(Shared->Length)) == NULL) // Anything that doesn't fit in as many bytes isn't worth sending.
+        return;
+
+    // Compressed into place after room for the longest header, which is then moved up against the real one.
+    Body = Packed->Data + FRAME_HEADER_MAX;
+    Body[0] = Shared->Data[VarintLength];
+    PrefixLength = 1 + VarintEncode(Body + 1, PayloadLength);
+    if (FRAME_HEADER_MAX + PrefixLength < Shared->Length
+        && (PackedLength = Compress(ThreadPacker, Shared->Data + VarintLength + 1, (size_t)PayloadLength, Body + PrefixLength,
+                                    Shared->Length - FRAME_HEADER_MAX - PrefixLength)) > 0) {
+        HeaderLength = FrameEncodeHeader(Packed->Data, FRAME_PACKED, PrefixLength + PackedLength);
+        memmove(Packed->Data + HeaderLength, Body, PrefixLength + PackedLength);
+        Packed->Length = HeaderLength + PrefixLength + PackedLength;
+        if (Packed->Length < Shared->Length) {
+            Shared->Packed = Packed;
+            return;
+        }
+    }
+    MessageRelease(Packed);
+}
+
+// Queue a message from the server itself.  Returns false if the client was dropped instead.
+static bool SendNotice(Client *Receiver, const char *Text) {
+    Message *Shared = MessageCreateFrame(FRAME_NOTICE, Text, strlen(Text));
+
+    if (Shared == NULL)
+        return true;
+    DeliverTo(Receiver->Owner, Receiver, Shared);
+    MessageRelease(Shared);
+    return Receiver->Socket != INVALID_SOCKET;
+}
+
+// Answer a client's ping with its own payload.  Returns false if the client was dropped instead.
+static bool SendPong(Client *Pinger, const uint8_t *Payload, size_t Length) {
+    Message *Shared = MessageCreateFrame(FRAME_PONG, Payload, Length);
+
+    if (Shared == NULL)
+        return true;
+    DeliverTo(Pinger->Owner, Pinger, Shared);
+    MessageRelease(Shared);
+    return Pinger->Socket != INVALID_SOCKET;
+}
+
+// FRAME_COMPRESS: compress what the client is sent from now on, if it has the same dictionary.  The answer says whether.
+static bool AgreeToCompress(Client *Asker, const uint8_t *Payload, size_t Length) {
+    uint64_t Id;
+    uint8_t Answer[10];
+    size_t AnswerLength = 0;
+    Message *Shared;
+
+    if (VarintDecode(Payload, Length, &Id) == 0)
+        return false;
+    if (Asker->Owner->Packer != NULL && Id == CompressionDictionaryId()) {
+        AnswerLength = VarintEncode(Answer, Id);
+        if (!Asker->bPacked)
+            atomic_fetch_add(&PackedClients, 1);
+        Asker->bPacked = true;
+    }
+
+    Shared = MessageCreateFrame(FRAME_COMPRESS, Answer, AnswerLength);
+    if (Shared == NULL)
+        return true;
+    DeliverTo(Asker->Owner, Asker, Shared);
+    MessageRelease(Shared);
+    return Asker->Socket != INVALID_SOCKET;
+}
+
+static bool ReserveById(Worker *Self, UserId Id) {
+    UserId NewCapacity = Self->ByIdCapacity ? Self->ByIdCapacity : 64;
+    Client **NewById;
+
+    if (Id < Self->ByIdCapacity)
+        return true;
+
+    while (NewCapacity <= Id)
+        NewCapacity *= 2;
+    NewById = realloc(Self->ById, NewCapacity * sizeof(Client *));
+    if (NewById == NULL)
+        return false;
+    memset(NewById + Self->ByIdCapacity, 0, (NewCapacity - Self->ByIdCapacity) * sizeof(Client *));
+    Self->ById = NewById;
+    Self->ByIdCapacity = NewCapacity;
+    return true;
+}
+
+// Take a user name.  Everyone else is sent the new name once, and the client is sent every name there is in one message.  Logging in
+// again renames: the old ID is announced as gone.  Returns false if the client had to be dropped.
+static bool LogIn(Client *Member, const uint8_t *Name, size_t Length) {
+    Worker *Self = Member->Owner;
+    uint8_t Body[10];
+    UserId Id;
+    UserId OldId = Member->Id;
+    uint32_t Generation;
+    Message *Shared;
+
+    if (!UserNameValid(Name, Length))
+        return false;
+
+    Id = UserRegister(Name, Length, Self->Index, &Generation); // First, so a refused rename keeps the old name.
+    if (Id == USER_NONE)
+        return SendNotice(Member, "That name is taken.");
+    if (!ReserveById(Self, Id)) {
+        UserUnregister(Id);
+        return SendNotice(Member, "Out of memory.");
+    }
+
+    Member->Id = Id;
+    Member->Generation = Generation;
+    Self->ById[Id] = Member;
+    if (OldId != USER_NONE) {
+        UserUnregister(OldId);
+        Self->ById[OldId] = NULL;
+        if ((Shared = MessageCreateFrame(FRAME_USER_GONE, Body, VarintEncode(Body, OldId))) != NULL)
+            BroadcastShared(Self, Shared, Member, MonotonicUs());
+    }
+    if (!Settings.bHeadless)
+        ConsolePrintf("Client %d is %.*s.\n", (int)Member->Socket, (int)Length, (const char *)Name);
+
+    if ((Shared = MessageCreate(USER_FRAME_MAX)) != NULL) {
+        Shared->Length = UserFrameUser(Shared->Data, Id, Name, Length);
+        BroadcastShared(Self, Shared, Member, MonotonicUs());
+    }
+
+    if ((Shared = UserDirectory()) == NULL) // Includes Member itself, so it learns its own ID.
+        return true;
+    DeliverTo(Self, Member, Shared);
+    MessageRelease(Shared);
+    return Member->Socket != INVALID_SOCKET;
+}
+
+// Tell everyone who left during this pass, all in one message.  Done here rather than in DropClient() because broadcasting can drop
+// more clients, which mustn't happen in the middle of a loop over them.  Those are announced on the next time round.
+static void AnnounceDepartures(Worker *Self) {
+    Client *Gone;
+    Message *Shared;
+    size_t Length;
+    uint8_t Body[10];
+
+    while (Self->Departed != NULL) {
+        Length = 0;
+        for (Gone = Self->Departed; Gone != NULL; Gone = Gone->NextDeparted)
+            Length += FRAME_HEADER_MAX + VarintEncode(Body, Gone->Id);
+
+        Shared = MessageCreate(Length);
+        Length = 0;
+        for (Gone = Self->Departed; Gone != NULL; Gone = Gone->NextDeparted) {
+            if (Shared != NULL)
+                Length += FrameEncode(Shared->Data + Length, FRAME_USER_GONE, Body, VarintEncode(Body, Gone->Id));
+            Gone->Id = USER_NONE;
+        }
+        Self->Departed = NULL;
+
+        if (Shared != NULL) {
+            Shared->Length = Length;
+            BroadcastShared(Self, Shared, NULL, MonotonicUs());
+        }
+    }
+}
+
+// Relay a FRAME_DIRECT to the one client it names, wherever it is.  Only logged in users may send them, so they can be answered.
+static bool SendDirect(Client *Sender, const uint8_t *Payload, size_t Length) {
+    Worker *Self = Sender->Owner;
+    uint64_t Target;
+    size_t IdLength = VarintDecode(Payload, Length, &Target);
+    int WorkerIndex;
+    uint32_t Generation;
+    Message *Shared;
+    InboxItem *Item;
+
+    if (IdLength == 0)
+        return false;
+    if (Sender->Id == USER_NONE)
+        return SendNotice(Sender, "Pick a name before sending direct messages.");
+    if (Target > UINT32_MAX || !UserRoute((UserId)Target, &WorkerIndex, &Generation))
+        return SendNotice(Sender, "No such user.");
+
+    if ((Payload = CleanText(Self, Payload, &Length, IdLength)) == NULL || Length == IdLength)
+        return true;
+
+    Shared = CreateUserFrame(FRAME_DIRECT, Sender->Id, Payload + IdLength, Length - IdLength);
+    if (Shared == NULL)
+        return true;
+
+    if (WorkerIndex == Self->Index)
+        DeliverDirect(Self, (UserId)Target, Generation, Shared, Self->ReadUs);
+    else if ((Item = PoolAlloc(InboxPool)) != NULL) {
+        Item->Kind = INBOX_DIRECT;
+        Item->Shared = MessageRetain(Shared);
+        Item->ReceivedUs = Self->ReadUs;
+        Item->TargetId = (UserId)Target;
+        Item->TargetGeneration = Generation;
+        PostToWorker(&Workers[WorkerIndex], Item);
+    }
+    MessageRelease(Shared);
+    return Sender->Socket != INVALID_SOCKET; // Users may message themselves.
+}
+
+static void DeliverDirect(Worker *Self, UserId Target, uint32_t Generation, Message *Shared, int64_t ReceivedUs) {
+    Client *Receiver = Target < Self->ByIdCapacity ? Self->ById[Target] : NULL;
+
+    if (Receiver == NULL || Receiver->Generation != Generation) // Gone since it was routed, maybe with its ID handed to someone else.
+        return;
+    if (DeliverTo(Self, Receiver, Shared))
+        MetricsCount(&Self->Stats, METRIC_DELIVERIES, 1);
+    MetricsRecord(&Self->Stats, HISTOGRAM_BROADCAST_US, MonotonicUs() - ReceivedUs);
+}
+
+static void PostToWorker(Worker *Target, InboxItem *Item) {
+    atomic_fetch_add_explicit(&Target->Stats.InboxPosted, 1, memory_order_relaxed);
+    MpscPush(&Target->Inbox, &Item->Node);
+    PollerWakeup(Target->Poller); // Costs nothing extra if the target already has a wakeup pending.
+}
+
+static void DrainInbox(Worker *Self) {
+    MpscNode *Node;
+    InboxItem *Item;
+    Room *Target;
+
+    while ((Node = MpscPop(&Self->Inbox)) != NULL) {
+        Item = (InboxItem *)Node;
+        MetricsCount(&Self->Stats, METRIC_INBOX_DRAINED, 1);
+        if (Item->Kind == INBOX_BROADCAST) {
+            DeliverLocally(Self, Item->Shared, NULL, Item->ReceivedUs);
+            MessageRelease(Item->Shared);
+        }
+        else if (Item->Kind == INBOX_ROOM) {
+            Target = RoomFind(&Self->Rooms, Item->RoomName, Item->RoomNameLength, Item->RoomHash);
+            if (Target != NULL) // Its members here may have left since.
+                DeliverToRoom(Self, Target, Item->Shared, NULL, Item->ReceivedUs);
+            MessageRelease(Item->Shared);
+        }
+        else if (Item->Kind == INBOX_DIRECT) {
+            DeliverDirect(Self, Item->TargetId, Item->TargetGeneration, Item->Shared, Item->ReceivedUs);
+            MessageRelease(Item->Shared);
+        }
+        else
+            AddClient(Self, Item->Socket);
+        PoolFree(InboxPool, Item);
+    }
+}
+
+static void QueueFlush(Client *Receiver) {
+    if (Receiver->bFlushQueued || Receiver->bWantWrite) // A blocked client is flushed by its next POLL_WRITE event instead.
+        return;
+
+    Receiver->bFlushQueued = true;
+    Receiver->NextFlush = Receiver->Owner->FlushList;
+    Receiver->Owner->FlushList = Receiver;
+}
+
+// Tell the poller which events the client is waiting on.  Reading is switched off while it's paused, so level-triggered backends don't
+// keep reporting data nobody will read, and switching it back on makes edge-triggered ones report whatever arrived meanwhile.
+// On a ring, pausing cancels the client's recv and resuming queues it again.
+static void WatchClient(Client *Watched) {
+    Uring *Ring = Watched->Owner->Ring;
+
+    if (Ring == NULL)
+        PollerModify(Watched->Owner->Poller, Watched->Socket, Watched, (ReadingPaused(Watched) ? 0 : POLL_READ) | (Watched->bWantWrite ? POLL_WRITE : 0));
+    else if (ReadingPaused(Watched) && Watched->bRecvArmed && !Watched->bRecvCancelled)
+        Watched->bRecvCancelled = UringCancel(Ring, Watched, URING_RECV);
+    else if (!ReadingPaused(Watched) && !Watched->bRecvArmed)
+        ArmRecv(Watched);
+}
+
+static bool ReadingPaused(const Client *Reader) {
+    return Reader->bReadPaused || DecodePaused(Reader);
+}
+
+// Paused for what it sends, rather than for what it's sent: what it has sent already waits too.  While the server is handing over, it
+// waits for the new one.
+static bool DecodePaused(const Client *Reader) {
+    return Reader->bStreamPaused || Reader->bThrottled || Reader->Owner->bDraining;
+}
+
+// A client that isn't reading what it's sent gets no say in what everyone else is sent either, until it catches up.
+static void PauseReading(Client *Laggard) {
+    Laggard->bReadPaused = true;
+    MetricsCount(&Laggard->Owner->Stats, METRIC_READS_PAUSED, 1);
+}
+
+// Queue a sendmsg of what's waiting for the client on the worker's ring.  One at a time, so the bytes go out in order: the next one
+// is queued when this one completes (see RingSent()).
+static void FlushOnRing(Client *Receiver) {
+    Metrics *Stats = &Receiver->Owner->Stats;
+
+    if (Receiver->bWantWrite || Receiver->Out.Count == 0)
+        return;
+    if (!UringSend(Receiver->Owner->Ring, Receiver->Socket, &Receiver->Out, &Receiver->Sending, Receiver)) {
+        ConsolePrintf("Client %d dropped: the worker's ring is full!\n", (int)Receiver->Socket);
+        DropClient(Receiver);
+        return;
+    }
+    Receiver->bWantWrite = true;
+    Receiver->Pending++;
+    MetricsRecord(Stats, HISTOGRAM_FLUSH_WAIT_US, MonotonicUs() - Receiver->Out.FirstQueuedUs);
+    if (Receiver->Out.QueuedBytes >= Settings.HighWatermarkBytes && !Receiver->bReadPaused) {
+        PauseReading(Receiver);
+        WatchClient(Receiver);
+    }
+}
+
+static void FlushClient(Client *Receiver) {
+    Metrics *Stats = &Receiver->Owner->Stats;
+    size_t QueuedBefore = Receiver->Out.QueuedBytes;
+    int64_t FirstQueuedUs = Receiver->Out.FirstQueuedUs;
+    bool bWasWantWrite = Receiver->bWantWrite;
+    bool bWasPaused = Receiver->bReadPaused;
+    int Result;
+
+    if (Receiver->Owner->Ring != NULL) {
+        FlushOnRing(Receiver);
+        return;
+    }
+
+    Result = Receiver->Tls ? TlsFlush(Receiver->Tls, &Receiver->Out, Settings.bTcpCork)
+                           : OutBufferFlush(&Receiver->Out, Receiver->Socket, Settings.bTcpCork);
+
+    MetricsCount(Stats, METRIC_SEND_CALLS, Receiver->Out.SendCalls ? Receiver->Out.SendCalls : (Receiver->Tls != NULL)); // 1 SSL_write.
+    Receiver->Out.SendCalls = 0;
+    if (QueuedBefore > 0)
+        MetricsRecord(Stats, HISTOGRAM_FLUSH_WAIT_US, MonotonicUs() - FirstQueuedUs);
+
+    if (Result == OUTBUF_ERROR) {
+        MetricsCount(Stats, METRIC_SEND_ERRORS, 1);
+        if (!Settings.bHeadless)
+            ConsolePrintf("Client %d left!\n", (int)Receiver->Socket);
+        DropClient(Receiver);
+        return;
+    }
+
+    MetricsCount(Stats, METRIC_BYTES_OUT, QueuedBefore - Receiver->Out.QueuedBytes);
+    Receiver->bWantWrite = Result == OUTBUF_BLOCKED; // Socket buffer full.  Carry on when the backend says it's writable again.
+    if (Receiver->Out.QueuedBytes >= Settings.HighWatermarkBytes && !Receiver->bReadPaused)
+        PauseReading(Receiver);
+    else if (Receiver->Out.QueuedBytes <= Settings.LowWatermarkBytes)
+        Receiver->bReadPaused = false;
+
+    if (Receiver->bWantWrite != bWasWantWrite || Receiver->bReadPaused != bWasPaused)
+        WatchClient(Receiver);
+}
+
+// Flush every client on the FlushList whose coalescing window has run out (or that has queued enough).  Returns how long the loop
+// may sleep before the next window runs out, -1 if nothing is waiting.
+static int FlushClients(Worker *Self) {
+    Client **Link = &Self->FlushList;
+    Client *Receiver;
+    int64_t Now = Settings.CoalesceWindowUs > 0 ? MonotonicUs() : 0;
+    int64_t Wait;
+    int64_t ShortestWait = -1;
+
+    while ((Receiver = *Link) != NULL) {
+        if (Receiver->Socket != INVALID_SOCKET && Settings.CoalesceWindowUs > 0 && Receiver->Out.QueuedBytes < Settings.FlushThresholdBytes) {
+            Wait = Receiver->Out.FirstQueuedUs + Settings.CoalesceWindowUs - Now;
+            if (Wait > 0) { // Still inside its window.  Leave it queued so more frames can join the same write.
+                if (ShortestWait == -1 || Wait < ShortestWait)
+                    ShortestWait = Wait;
+                Link = &Receiver->NextFlush;
+                continue;
+            }
+        }
+
+        *Link = Receiver->NextFlush;
+        Receiver->bFlushQueued = false;
+        if (Receiver->Socket != INVALID_SOCKET)
+            FlushClient(Receiver);
+    }
+
+    return ShortestWait == -1 ? POLL_TIMEOUT_MS : (int)((ShortestWait + 999) / 1000);
+}
+
+// Hand this pass's histograms to the reporter, along with a fresh total of what's queued.
+static void PublishStats(Worker *Self, int64_t NowUs) {
+    size_t Queued = 0;
+    int Counter;
+
+    for (Counter = 0; Counter < Self->ClientCount; Counter++)
+        Queued += Self->Clients[Counter]->Out.QueuedBytes;
+    MetricsSet(&Self->Stats, GAUGE_QUEUED_BYTES, (int64_t)Queued);
+    MetricsPublish(&Self->Stats, NowUs);
+}
+
+// What the clients the old server handed over had sent it that it never got to, decoded before anything they send next.
+static void DecodeRestored(Worker *Self) {
+    int Counter;
+
+    Self->ReadUs = MonotonicUs();
+    for (Counter = Self->ClientCount - 1; Counter >= 0; Counter--) {
+        if (Counter < Self->ClientCount && Self->Clients[Counter]->HeldLength > 0) // Decoding can drop any of them.
+            DecodeHeld(Self->Clients[Counter]);
+    }
+}
+
+// On the handoff thread: a new server wants to take over.  Every worker drains & stops, then ServeClients() hands over what's left.
+static void RequestHandOver() {
+    int Counter;
+
+    atomic_store(&bHandingOver, true);
+    for (Counter = 0; Counter < WorkerCount; Counter++)
+        PollerWakeup(Workers[Counter].Poller);
+}
+
+// Stop accepting, so connections queue on the listen socket for the new server, drop what can't be handed over and stop reading
+// from everyone else.  What they're owed already still goes out until the worker has drained (see Drained()).
+static void StartDraining(Worker *Self) {
+    Client *Each;
+    int Counter;
+
+    Self->bDraining = true;
+    Self->DrainUntilUs = MonotonicUs() + HANDOFF_DRAIN_MS * 1000LL;
+    if (Self->Ring == NULL && Self->ListenSocket != INVALID_SOCKET)
+        PollerRemove(Self->Poller, Self->ListenSocket);
+
+    for (Counter = Self->ClientCount - 1; Counter >= 0; Counter--) {
+        Each = Self->Clients[Counter];
+        if (Each->Tls != NULL) {
+            ConsolePrintf("Client %d dropped: TLS connections can't be handed over to the new server!\n", (int)Each->Socket);
+            DropClient(Each);
+        }
+        else
+            WatchClient(Each);
+    }
+    AnnounceDepartures(Self); // While the other workers are sure to be there for it.
+
+    if (Self->Ring == NULL || Self->ListenSocket == INVALID_SOCKET || !UringCancel(Self->Ring, &Self->ListenSocket, URING_ACCEPT))
+        StopAccepting(Self); // Else once the accept has been cancelled.
+}
+
+static void StopAccepting(Worker *Self) {
+    if (!Self->bAccepting)
+        return;
+    Self->bAccepting = false;
+    atomic_fetch_sub(&AcceptingWorkers, 1);
+}
+
+// Done draining: no worker can take on a client any more (nor post one here), and everything queued, here & in the inbox, has gone
+// out.  On a ring, every recv has been cancelled too, so all that was read is in Held.  Or the time's up.
+static bool Drained(Worker *Self, int64_t NowUs) {
+    Client *Each;
+    int Counter;
+
+    if (NowUs >= Self->DrainUntilUs)
+        return true;
+    if (atomic_load(&AcceptingWorkers) > 0)
+        return false;
+    DrainInbox(Self);
+    if (Self->Departed != NULL)
+        return false;
+    for (Counter = 0; Counter < Self->ClientCount; Counter++) {
+        Each = Self->Clients[Counter];
+        if (Each->Out.Count > 0 || Each->bWantWrite || Each->bRecvArmed)
+            return false;
+    }
+    return true;
+}
+
+static int CompareClientIds(const void *Left, const void *Right) {
+    UserId LeftId = (*(Client *const *)Left)->Id;
+    UserId RightId = (*(Client *const *)Right)->Id;
+
+    return LeftId < RightId ? -1 : LeftId > RightId;
+}
+
+// Every worker has drained and stopped: hand the listen sockets & clients over to the new server on Link.  Lowest ID first, so the
+// new registry fills up in order.  Whoever can't be handed over is closed by CloseServer() as usual, and the new server tells
+// everyone they've gone, as nobody here will.
+static void HandOver(SOCKET Link) {
+    SOCKET Listeners[HANDOFF_SOCKETS_MAX];
+    Client **All;
+    Client *Each;
+    uint8_t *Gone;
+    uint8_t *State;
+    uint8_t Body[10];
+    size_t GoneLength = 0;
+    size_t Length;
+    int Total = 0;
+    int Handed = 0;
+    int Count = 0;
+    int Counter;
+    int Index;
+
+    for (Counter = 0; Counter < WorkerCount; Counter++) {
+        if (Workers[Counter].ListenSocket != INVALID_SOCKET)
+            Listeners[Count++] = Workers[Counter].ListenSocket;
+        if (Count > 0 && (Count == HANDOFF_SOCKETS_MAX || Counter == WorkerCount - 1)) {
+            if (!HandoffSend(Link, HANDOFF_LISTEN, NULL, 0, Listeners, Count)) {
+                ConsolePrintf("ERROR: lost the link to the new server!\n");
+                return;
+            }
+            Count = 0;
+        }
+        Total += Workers[Counter].ClientCount;
+    }
+
+    All = malloc((Total + 1) * sizeof(Client *));
+    Gone = malloc(Total * (FRAME_HEADER_MAX + 5) + 1);
+    if (All == NULL || Gone == NULL) {
+        ConsolePrintf("ERROR: out of memory handing the clients over!\n");
+        free(All);
+        free(Gone);
+        return;
+    }
+    for (Counter = 0, Total = 0; Counter < WorkerCount; Counter++) {
+        for (Index = 0; Index < Workers[Counter].ClientCount; Index++)
+            All[Total++] = Workers[Counter].Clients[Index];
+    }
+    qsort(All, Total, sizeof(Client *), CompareClientIds);
+
+    for (Counter = 0; Counter < Total; Counter++) {
+        Each = All[Counter];
+        State = NULL;
+        if (Each->Tls == NULL && !(Each->Owner->Ring != NULL && (Each->bWantWrite || Each->bRecvArmed))) // Nothing in flight.
+            State = SaveClient(Each, &Length);
+        if (State != NULL && HandoffSend(Link, HANDOFF_CLIENT, State, Length, &Each->Socket, 1)) {
+            Each->bHandedOver = true;
+            Handed++;
+        }
+        else if (Each->Id != USER_NONE)
+            GoneLength += FrameEncode(Gone + GoneLength, FRAME_USER_GONE, Body, VarintEncode(Body, Each->Id));
+        free(State);
+    }
+    if (GoneLength > 0)
+        HandoffSend(Link, HANDOFF_GONE, Gone, GoneLength, NULL, 0);
+    ConsolePrintf("Handed %d of %d client(s) over to the new server.\n", Handed, Total);
+    free(All);
+    free(Gone);
+}
+
+// What the new server needs to carry on with a client, for RestoreClient(): its ID, generation & name, the SAVED_ flags, the
+// dictionary it agreed to, the rooms it's in (each name's length, then the name), what it sent that hasn't been decoded (varint length
+// first) & what it's owed that hasn't been sent.  malloc'd, NULL if out of memory.
+static uint8_t *SaveClient(Client *Saved, size_t *Length) {
+    uint8_t Name[USER_NAME_MAX];
+    size_t NameLength = Saved->Id != USER_NONE ? UserNameOf(Saved->Id, Name) : 0;
+    size_t Unread = Saved->HeldLength - Saved->HeldStart;
+    size_t PendingLength;
+    size_t VarintLength;
+    size_t Written;
+    uint8_t Varint[10];
+    uint8_t *State;
+    Room *Joined;
+    int Counter;
+
+    State = malloc(4 * 10 + 3 + NameLength + Saved->Rooms.Count * (1 + ROOM_NAME_MAX) + FRAME_HEADER_MAX + Saved->Decoder.Have + Unread
+                   + Saved->Out.QueuedBytes);
+    if (State == NULL)
+        return NULL;
+
+    Written = VarintEncode(State, NameLength > 0 ? Saved->Id : USER_NONE);
+    Written += VarintEncode(State + Written, Saved->Generation);
+    State[Written++] = (uint8_t)NameLength;
+    memcpy(State + Written, Name, NameLength);
+    Written += NameLength;
+    State[Written++] = Saved->bPacked ? SAVED_PACKED : 0;
+    Written += VarintEncode(State + Written, Saved->bPacked ? CompressionDictionaryId() : 0);
+
+    State[Written++] = (uint8_t)Saved->Rooms.Count;
+    for (Counter = 0; Counter < Saved->Rooms.Count; Counter++) {
+        Joined = Saved->Rooms.Entries[Counter].Joined;
+        State[Written++] = (uint8_t)Joined->NameLength;
+        memcpy(State + Written, Joined->Name, Joined->NameLength);
+        Written += Joined->NameLength;
+    }
+
+    // The frame it's in the middle of, then what's held after it.  Moved down once its length is known.
+    PendingLength = FrameDecoderPending(&Saved->Decoder, State + Written + sizeof(Varint));
+    VarintLength = VarintEncode(Varint, PendingLength + Unread);
+    memcpy(State + Written, Varint, VarintLength);
+    memmove(State + Written + VarintLength, State + Written + sizeof(Varint), PendingLength);
+    Written += VarintLength + PendingLength;
+    if (Unread > 0)
+        memcpy(State + Written, Saved->Held + Saved->HeldStart, Unread);
+    Written += Unread;
+
+    Written += OutBufferGather(&Saved->Out, State + Written, Saved->Out.QueuedBytes);
+    *Length = Written;
+    return State;
+}
+
+void GetServerStats(ServerStats *Stats) {
+    Stats->PausedReads = MetricsTotal(AllStats, WorkerCount, METRIC_READS_PAUSED);
+    Stats->SlowConsumersDropped = MetricsTotal(AllStats, WorkerCount, METRIC_SLOW_DROPS);
+}
+
+void CloseServer() {
+    MpscNode *Node;
+    InboxItem *Item;
+    Worker *Self;
+    Client *Gone;
+    int Counter;
+
+    HandoffStop(); // First: it wakes the workers.
+    ClusterStop(); // Then: it posts to their inboxes.
+    if (ClusterDropped() > 0)
+        printf("%llu message(s) for other cluster nodes were dropped: their link was down or too far behind.\n", (unsigned long long)ClusterDropped());
+
+    for (Counter = 0; Counter < WorkerCount && Workers; Counter++) {
+        Self = &Workers[Counter];
+
+        while (Self->ClientCount > 0) // Close any clients still connected to the server.
+            DropClient(Self->Clients[Self->ClientCount - 1]);
+        if (Self->Ring != NULL) { // Closing the ring cancels what's still in flight, so nothing needs waiting for.
+            UringDestroy(Self->Ring);
+            Self->Ring = NULL;
+            for (Gone = Self->DeadClients; Gone != NULL; Gone = Gone->NextDead) {
+                if (Gone->bWantWrite)
+                    OutBufferFree(&Gone->Out);
+                Gone->Pending = 0;
+            }
+        }
+        for (Gone = Self->Departed; Gone != NULL; Gone = Gone->NextDeparted)
+            Gone->Id = USER_NONE; // Nobody left to tell.
+        Self->Departed = NULL;
+        FreeDeadClients(Self);
+        free(Self->Clients);
+        free(Self->ById);
+        RoomTableFree(&Self->Rooms);
+
+        while ((Node = MpscPop(&Self->Inbox)) != NULL) { // Anything posted after this worker stopped.
+            Item = (InboxItem *)Node;
+            if (Item->Kind == INBOX_SOCKET)
+                close(Item->Socket);
+            else
+                MessageRelease(Item->Shared);
+            PoolFree(InboxPool, Item);
+        }
+
+        if (Self->ListenSocket != INVALID_SOCKET)
+            close(Self->ListenSocket);
+        if (Self->Poller)
+            PollerDestroy(Self->Poller);
+        free(Self->ReceiveBuffer);
+        free(Self->Replay);
+        free(Self->Cleaned);
+        CompressorFree(Self->Packer);
+        MetricsFree(&Self->Stats);
+    }
+
+    if (MetricsSocket != INVALID_SOCKET) // The reporter never started.
+        close(MetricsSocket);
+    MetricsSocket = INVALID_SOCKET;
+
+    free(Workers);
+    Workers = NULL;
+    free(AllStats);
+    AllStats = NULL;
+    WorkerCount = 0;
+    UsersReset();
+    if (JournalDropped() > 0)
+        printf("%llu room message(s) weren't logged: the disk couldn't keep up.\n", (unsigned long long)JournalDropped());
+    JournalClose();
+    CaptureClose();
+    HistoryReset();
+
+    TlsContextFree(ListenerTls);
+    ListenerTls = NULL;
+    CompressorFree(NodePacker);
+    NodePacker = NULL;
+    if (PingFrame != NULL)
+        MessageRelease(PingFrame);
+    PingFrame = NULL;
+
+    for (Counter = 0; Counter < HandedListenerCount; Counter++) // Handed over to a server that never got as far as using them.
+        close(HandedListeners[Counter]);
+    free(HandedListeners);
+    HandedListeners = NULL;
+    HandedListenerCount = 0;
+    for (Counter = 0; Counter < HandedClientCount; Counter++) {
+        close(HandedClients[Counter].Socket);
+        free(HandedClients[Counter].State);
+    }
+    free(HandedClients);
+    HandedClients = NULL;
+    HandedClientCount = HandedClientCapacity = 0;
+    if (HandedGone != NULL)
+        MessageRelease(HandedGone);
+    HandedGone = NULL;
+    HandoffFinish(); // Last: the next server can have the ports, log & all now.
+
+    #ifdef _WIN32
+    WSACleanup(); //Clean up winsock
+    #endif
+}
@@ -0,0 +1,114 @@
+/*
+Multi-client chat server.
+
+The server runs WorkerCount event loops, one thread each, pinned to a core where the platform allows it.  Every worker owns its own
+poller, its own clients and their out buffers, so the hot path never takes a lock.
+
+- Linux: every worker has its own listen socket bound with SO_REUSEPORT and the kernel spreads new connections across them.
+- Elsewhere: worker 0 owns the only listen socket and hands accepted sockets to the workers round-robin.
+
+A message received by one worker is delivered to that worker's clients directly and posted to every other worker's MPSC inbox as a
+shared message reference, so broadcasts cross threads without a global lock or a copy.
+
+Several servers can also run as one cluster, each relaying to the others what its clients send (see cluster.h).  And a server can hand its sockets &
+clients over to the one replacing it, so a restart drops nobody (see handoff.h).
+
+Files (FRAME_FILE, FRAME_CHUNK & FRAME_FILE_END) are relayed like room messages, from logged in users only, to this server's clients
+only and not into history.  A sender is only read from while its last few chunks have gone out to everyone, so a transfer goes at its
+slowest receiver's pace.  And a chunk is skipped for a client that already has LowWatermarkBytes queued, so a transfer can never put more
+than that between a client and its chat, or get it dropped.  The client sees the gap in the offsets and gives up on that file.
+*/
+
+#ifndef SERVER_H
+#define SERVER_H
+
+#include "stdbool.h"
+#include "stddef.h"
+#include "platform.h"
+#include "frame.h"
+
+typedef struct ServerConfig {
+    int PortNo;
+    char BindAddress[MAX_HOST_LENGTH]; // Local address (IPv4 or IPv6) to listen on.  Empty = every interface, both families.
+    int WorkerCount; // Event loop threads.  0 = one per online CPU.
+    bool bPinWorkers; // Pin worker N to CPU N (Linux).
+    bool bIoUring; // Run the workers on io_uring (see uring.h) rather than the poller.  Linux builds with -DCHAT_IO_URING, no TLS.
+    char TlsCertFile[MAX_PATH_LENGTH]; // PEM certificate chain.  Set = accept TLS connections only (see tls.h).
+    char TlsKeyFile[MAX_PATH_LENGTH]; // PEM private key.  Empty = it's in TlsCertFile.
+    bool bHeadless; // Relay only: no console input, and nothing printed per client or per message.  Stop it with StopServer().
+    int MaxClients; // Connections beyond this are closed as soon as they're accepted.  0 = no limit.
+    size_t MaxFrameBytes; // Clients sending a bigger message are dropped.
+    size_t ReceiveBufferSize; // Bytes read per recv() call.  One buffer per worker.
+
+    // Output batching.  Frames are queued per connection and flushed together, one SendVector() call per connection per flush.
+    int CoalesceWindowUs; // How long queued frames may wait for more to join them.  0 flushes at the end of every pass of the loop.
+    size_t FlushThresholdBytes; // Flush straight away once this much is queued, whatever the window says.
+    bool bTcpNoDelay; // Batching replaces Nagle's algorithm, which would only delay the flushes further.
+    bool bTcpCork; // Wrap each flush in TCP_CORK (Linux).  Only pays off when flushes regularly span more than OUT_MAX_IOVECS messages.
+
+    // Backpressure.  Bytes queued for a client that isn't reading them are the only thing a slow client can cost the server, so the
+    // queue is bounded and nobody else waits on it.
+    size_t HighWatermarkBytes; // Stop reading from a client with this much queued for it...
+    size_t LowWatermarkBytes; // ...until it has drained below this.
+    size_t MaxQueuedBytes; // Drop a client with more than this queued for it.  It's too far behind to ever catch up.
+
+    // Rate limits (see ratelimit.h).  0 = no limit; a burst of 0 = one second's worth.  A client that goes over one isn't read from
+    // again until it's back under, so its input waits in its socket, undecoded, and it can't cost anyone else more than the limit.
+    int ClientMessagesPerSec; // Frames of any kind from one connection.
+    int ClientMessageBurst;
+    size_t ClientBytesPerSec; // Bytes received from one connection.
+    size_t ClientByteBurst;
+    int RoomMessagesPerSec; // Messages & file frames sent to one room, by the members on each worker: a room on N workers gets N times.
+    int RoomMessageBurst;
+    size_t RoomBytesPerSec;
+    size_t RoomByteBurst;
+
+    // Metrics (see metrics.h).  Always counted.  These only say where they're reported.
+    int MetricsPortNo; // Serve Prometheus text at http://<bind>:<port>/metrics.  0 = no endpoint.
+    int StatsIntervalSecs; // Print a stats line this often.  0 = never.
+
+    // Room history (see history.h).  New members are sent this much of what was said in the room before they joined.
+    int HistoryMessages; // Per room.  0 = keep none.
+    size_t HistoryBytes; // Per room.  Older messages are dropped to stay under it.
+
+    // Durable history (see journal.h).  Every room message is also appended to a log on disk, read back on startup.
+    char LogDirectory[MAX_PATH_LENGTH]; // Empty = no log.
+    size_t LogSegmentBytes; // Size of each segment file.
+    int LogMaxSegments; // Oldest segments are deleted past this many.
+    int LogSyncMs; // How often what was appended is synced to disk.
+
+    // Dead connections.  A connection that dies without a FIN or RST (a NAT forgetting it, a pulled cable) is only ever noticed by
+    // asking it something.  Every worker keeps these on one timer wheel (see timer.h), so they cost no system calls and no scans.
+    int PingIntervalMs; // Ping a client that has sent nothing for this long.  0 = never.
+    int IdleTimeoutMs; // Drop a client that has sent nothing, pongs included, for this long.  0 = never.
+    int HandshakeTimeoutMs; // Drop a TLS client that hasn't finished its handshake this long after connecting.  0 = never.
+
+    // Compression (see compress.h).  Messages are compressed once, when they're built, for the clients that ask for it.
+    bool bCompression; // Agree to clients' FRAME_COMPRESS.  Builds with -DCHAT_ZLIB.
+    char CompressDictFile[MAX_PATH_LENGTH]; // Empty = the built in dictionary.
+
+    // Cluster mode (see cluster.h).
+    char ClusterNodes[MAX_PATH_LENGTH]; // Every node, this one included: name=host:port,...  Empty = no cluster.
+    char NodeName[USER_NAME_MAX + 1]; // Which of them this is.
+
+    // Hot restart (see handoff.h).  A new server started with the same path takes over the listen sockets & clients.
+    char HandoffPath[MAX_PATH_LENGTH]; // Unix domain socket.  Empty = restarts drop every client.
+
+    // Traffic capture (see capture.h).  What clients send is written to a trace that replay.c can replay.
+    char CaptureFile[MAX_PATH_LENGTH]; // Empty = no capture.
+} ServerConfig;
+
+typedef struct ServerStats {
+    unsigned long long PausedReads; // Times a client went over the high watermark and stopped being read from.
+    unsigned long long SlowConsumersDropped; // Clients dropped for going over MaxQueuedBytes.
+} ServerStats;
+
+void ServerConfigDefaults(ServerConfig *Config);
+
+bool HostServer(const ServerConfig *Config); // Open the listen socket(s) & create the workers.
+void ServeClients(); // Run the workers until the operator types QUIT.  Worker 0 runs on the calling thread & handles console input.
+void StopServer(); // Make ServeClients() return.  Safe to call from any thread or a signal handler.
+void CloseServer(); // Close every socket & free the workers.
+void GetServerStats(ServerStats *Stats); // Counters since HostServer().  Safe to call from any thread.
+
+#endif // SERVER_H
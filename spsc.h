@@ -0,0 +1,65 @@
+/*
+Bounded lock-free single-producer / single-consumer ring of pointers.
+
+Exactly one thread may push and exactly one (other) thread may pop.  Head & Tail only ever grow, the slot is their value masked by the
+capacity, which is rounded up to a power of two.  Each index is written by one side only so no locks or compare-and-swap are needed,
+just acquire/release ordering on the index the other side reads.
+*/
+
+#ifndef SPSC_H
+#define SPSC_H
+
+#include "stdlib.h"
+#include "stdbool.h"
+#include "stdatomic.h"
+
+typedef struct SpscRing {
+    void **Slots;
+    size_t Mask; // Capacity - 1.
+    _Alignas(64) atomic_size_t Head; // Next slot to pop.  Written by the consumer only.
+    _Alignas(64) atomic_size_t Tail; // Next slot to push.  Written by the producer only.  Own cache line so the two sides don't false share.
+} SpscRing;
+
+static inline bool SpscInit(SpscRing *Ring, size_t Capacity) {
+    size_t RoundedCapacity = 1;
+    while (RoundedCapacity < Capacity)
+        RoundedCapacity <<= 1;
+
+    Ring->Slots = calloc(RoundedCapacity, sizeof(void *));
+    Ring->Mask = RoundedCapacity - 1;
+    atomic_init(&Ring->Head, 0);
+    atomic_init(&Ring->Tail, 0);
+    return Ring->Slots != NULL;
+}
+
+static inline void SpscFree(SpscRing *Ring) {
+    free(Ring->Slots);
+    Ring->Slots = NULL;
+}
+
+// Producer side.  Returns false if the ring is full.
+static inline bool SpscPush(SpscRing *Ring, void *Item) {
+    size_t Tail = atomic_load_explicit(&Ring->Tail, memory_order_relaxed);
+
+    if (Tail - atomic_load_explicit(&Ring->Head, memory_order_acquire) > Ring->Mask)
+        return false;
+
+    Ring->Slots[Tail & Ring->Mask] = Item;
+    atomic_store_explicit(&Ring->Tail, Tail + 1, memory_order_release); // Publishes the slot to the consumer.
+    return true;
+}
+
+// Consumer side.  Returns NULL if the ring is empty.
+static inline void *SpscPop(SpscRing *Ring) {
+    size_t Head = atomic_load_explicit(&Ring->Head, memory_order_relaxed);
+    void *Item;
+
+    if (Head == atomic_load_explicit(&Ring->Tail, memory_order_acquire))
+        return NULL;
+
+    Item = Ring->Slots[Head & Ring->Mask];
+    atomic_store_explicit(&Ring->Head, Head + 1, memory_order_release); // Hands the slot back to the producer.
+    return Item;
+}
+
+#endif // SPSC_H
@@ -0,0 +1,229 @@
+#include "string.h"
+#include "stdbool.h"
+#include "text.h"
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#define ESC 0x1B
+#define BEL 0x07
+#define ONES 0x0101010101010101ULL
+#define HIGHS 0x8080808080808080ULL
+
+static size_t AsciiRun(const uint8_t *Text, size_t Length);
+static size_t ByteRun(const uint8_t *Text, size_t Length);
+static size_t CharacterLength(const uint8_t *Text, size_t Length);
+static size_t SkipEscape(const uint8_t *Text, size_t Length, size_t At);
+static size_t SkipControlSequence(const uint8_t *Text, size_t Length, size_t At);
+static size_t SkipString(const uint8_t *Text, size_t Length, size_t At);
+
+size_t TextCleanPrefix(const uint8_t *Text, size_t Length) {
+    size_t Clean = 0;
+    size_t Character;
+
+    for (;;) {
+        Clean += AsciiRun(Text + Clean, Length - Clean);
+        if (Clean == Length || Text[Clean] < 0x80 || (Character = CharacterLength(Text + Clean, Length - Clean)) == 0)
+            return Clean;
+        Clean += Character;
+    }
+}
+
+size_t TextClean(uint8_t *Out, const uint8_t *Text, size_t Length) {
+    size_t Read = 0;
+    size_t Written = 0;
+    size_t Clean;
+    uint8_t Byte;
+
+    while (Read < Length) {
+        Clean = TextCleanPrefix(Text + Read, Length - Read);
+        memmove(Out + Written, Text + Read, Clean); // Never ahead of where it's read from, so in place works.
+        Read += Clean;
+        Written += Clean;
+        if (Read == Length)
+            break;
+
+        Byte = Text[Read];
+        if (Byte == ESC)
+            Read = SkipEscape(Text, Length, Read + 1);
+        else if (Byte == 0xC2 && Read + 1 < Length && Text[Read + 1] >= 0x80 && Text[Read + 1] < 0xA0) { // C1, as UTF-8.
+            Byte = Text[Read + 1];
+            Read += 2;
+            if (Byte == 0x9B) // CSI
+                Read = SkipControlSequence(Text, Length, Read);
+            else if (Byte == 0x90 || Byte == 0x98 || Byte == 0x9D || Byte == 0x9E || Byte == 0x9F) // DCS, SOS, OSC, PM & APC.
+                Read = SkipString(Text, Length, Read);
+        }
+        else if (Byte == '\t') {
+            Out[Written++] = ' ';
+            Read++;
+        }
+        else if (Byte < 0x80) // Any other C0 control, or DEL.
+            Read++;
+        else { // Not UTF-8.
+            Out[Written++] = '?';
+            Read++;
+        }
+    }
+    return Written;
+}
+
+// Printable ASCII at the start of Text, a vector at a time.
+static size_t AsciiRun(const uint8_t *Text, size_t Length) {
+    size_t Run = 0;
+
+    #if defined(__AVX2__)
+    {
+        const __m256i Below = _mm256_set1_epi8(0x1F);
+        const __m256i Above = _mm256_set1_epi8(0x7F);
+        __m256i Bytes;
+        uint32_t Bad;
+
+        for (; Run + 32 <= Length; Run += 32) { // Compared signed, so bytes from 0x80 up are below 0x1F as well.
+            Bytes = _mm256_loadu_si256((const __m256i *)(Text + Run));
+            Bad = ~(uint32_t)_mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpgt_epi8(Bytes, Below), _mm256_cmpgt_epi8(Above, Bytes)));
+            if (Bad)
+                return Run + (size_t)__builtin_ctz(Bad);
+        }
+    }
+    #endif // __AVX2__
+
+    #if defined(__SSE2__)
+    {
+        const __m128i Below = _mm_set1_epi8(0x1F);
+        const __m128i Above = _mm_set1_epi8(0x7F);
+        __m128i Bytes;
+        uint32_t Bad;
+
+        for (; Run + 16 <= Length; Run += 16) {
+            Bytes = _mm_loadu_si128((const __m128i *)(Text + Run));
+            Bad = ~(uint32_t)_mm_movemask_epi8(_mm_and_si128(_mm_cmpgt_epi8(Bytes, Below), _mm_cmpgt_epi8(Above, Bytes))) & 0xFFFF;
+            if (Bad)
+                return Run + (size_t)__builtin_ctz(Bad);
+        }
+    }
+    #elif defined(__ARM_NEON)
+    {
+        const uint8x16_t Lowest = vdupq_n_u8(0x20);
+        const uint8x16_t Above = vdupq_n_u8(0x7F);
+        uint8x16_t Good;
+        uint8x8_t Halves;
+
+        for (; Run + 16 <= Length; Run += 16) {
+            Good = vld1q_u8(Text + Run);
+            Good = vandq_u8(vcgeq_u8(Good, Lowest), vcltq_u8(Good, Above));
+            Halves = vand_u8(vget_low_u8(Good), vget_high_u8(Good));
+            if (vget_lane_u64(vreinterpret_u64_u8(Halves), 0) != ~0ULL)
+                return Run + ByteRun(Text + Run, 16);
+        }
+    }
+    #else
+    {
+        uint64_t Word;
+
+        // A byte below 0x20 borrows into its top bit, DEL carries into it, and anything else with it set isn't ASCII.  Carries &
+        // borrows only ever start at such a byte, so a clean word never looks dirty.
+        for (; Run + 8 <= Length; Run += 8) {
+            memcpy(&Word, Text + Run, 8);
+            if ((Word | (Word - 0x20 * ONES) | (Word + ONES)) & HIGHS)
+                return Run + ByteRun(Text + Run, 8);
+        }
+    }
+    #endif // __SSE2__
+
+    return Run + ByteRun(Text + Run, Length - Run);
+}
+
+static size_t ByteRun(const uint8_t *Text, size_t Length) {
+    size_t Run = 0;
+
+    while (Run < Length && Text[Run] >= 0x20 && Text[Run] < 0x7F)
+        Run++;
+    return Run;
+}
+
+// Length of the well formed UTF-8 character at Text, which starts with a byte from 0x80 up.  0 if it's malformed, or a C1 control.
+static size_t CharacterLength(const uint8_t *Text, size_t Length) {
+    uint8_t Lead = Text[0];
+    uint8_t Lowest = 0x80; // The second byte's range, narrowed for the leads where it'd otherwise let in an overlong form,
+    uint8_t Highest = 0xBF; // a surrogate or something past U+10FFFF.
+    size_t Needed;
+    size_t Counter;
+
+    if (Lead >= 0xC2 && Lead <= 0xDF) {
+        Needed = 2;
+        if (Lead == 0xC2)
+            Lowest = 0xA0;
+    }
+    else if (Lead >= 0xE0 && Lead <= 0xEF) {
+        Needed = 3;
+        if (Lead == 0xE0)
+            Lowest = 0xA0;
+        else if (Lead == 0xED)
+            Highest = 0x9F;
+    }
+    else if (Lead >= 0xF0 && Lead <= 0xF4) {
+        Needed = 4;
+        if (Lead == 0xF0)
+            Lowest = 0x90;
+        else if (Lead == 0xF4)
+            Highest = 0x8F;
+    }
+    else
+        return 0;
+
+    if (Length < Needed || Text[1] < Lowest || Text[1] > Highest)
+        return 0;
+    for (Counter = 2; Counter < Needed; Counter++) {
+        if ((Text[Counter] & 0xC0) != 0x80)
+            return 0;
+    }
+    return Needed;
+}
+
+// Past the escape sequence whose ESC came just before At.
+static size_t SkipEscape(const uint8_t *Text, size_t Length, size_t At) {
+    if (At == Length)
+        return At;
+    switch (Text[At]) {
+    case '[':
+        return SkipControlSequence(Text, Length, At + 1);
+    case ']':
+    case 'P':
+    case 'X':
+    case '^':
+    case '_':
+        return SkipString(Text, Length, At + 1);
+    }
+
+    while (At < Length && Text[At] >= 0x20 && Text[At] <= 0x2F) // Intermediate bytes, then the final one.
+        At++;
+    if (At < Length && Text[At] >= 0x30 && Text[At] <= 0x7E)
+        At++;
+    return At;
+}
+
+// Past the parameters & final byte of a CSI sequence.  One cut short ends at whatever interrupted it.
+static size_t SkipControlSequence(const uint8_t *Text, size_t Length, size_t At) {
+    while (At < Length && Text[At] >= 0x20 && Text[At] <= 0x3F)
+        At++;
+    if (At < Length && Text[At] >= 0x40 && Text[At] <= 0x7E)
+        At++;
+    return At;
+}
+
+// Past an OSC's (or DCS', ...) string and its terminator: BEL, ESC \ or ST.  Another ESC ends it too, & starts the next sequence.
+static size_t SkipString(const uint8_t *Text, size_t Length, size_t At) {
+    for (; At < Length; At++) {
+        if (Text[At] == BEL)
+            return At + 1;
+        if (Text[At] == ESC)
+            return At + 1 < Length && Text[At + 1] == '\\' ? At + 2 : At;
+        if (Text[At] == 0xC2 && At + 1 < Length && Text[At + 1] == 0x9C)
+            return At + 2;
+    }
+    return At; // Never terminated: the rest of the message is the string.
+}
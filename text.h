@@ -0,0 +1,29 @@
+/*
+Chat text made safe for terminals.
+
+The server passes on what one client typed to everyone else's terminal, so it cleans every message's text once, before fan-out:
+
+    * Invalid UTF-8 (a stray byte, an overlong form, a surrogate, anything past U+10FFFF) becomes a '?' per bad byte.
+    * Escape sequences are dropped whole: ESC [ ... final byte (CSI), ESC ] ... BEL or ESC \ (OSC, and the DCS, SOS, PM & APC strings
+      likewise), and ESC followed by anything else with its one final byte.  So are their one-character C1 forms (U+009B, U+009D, ...).
+    * Every other control character goes, C0, DEL & C1, CR & LF included.  A tab becomes a space.
+
+Nothing ever grows, so a message can be cleaned into a buffer the size it came in, or in place.
+
+Most messages need nothing done, and most of their text is printable ASCII.  TextCleanPrefix() checks 32 bytes at a time with AVX2, 16
+with SSE2 or NEON, and 8 as a 64 bit word otherwise, and only decodes the bytes of multi-byte characters one at a time.  Building with
+-mavx2 (or -march=native) picks AVX2; SSE2 is always there on x86-64.
+*/
+
+#ifndef TEXT_H
+#define TEXT_H
+
+#include "stddef.h"
+#include "stdint.h"
+
+size_t TextCleanPrefix(const uint8_t *Text, size_t Length); // How many bytes at the start need no cleaning.  Length = all of them.
+
+// Clean Text into Out, which has room for Length bytes and may be Text itself.  Returns the length written.
+size_t TextClean(uint8_t *Out, const uint8_t *Text, size_t Length);
+
+#endif // TEXT_H
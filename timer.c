@@ -0,0 +1,157 @@
+#include "stddef.h"
+#include "string.h"
+#include "timer.h"
+
+#define SLOT_MASK (TIMER_SLOTS - 1)
+#define LEVEL_SPAN(Level) (1ull << (TIMER_SLOT_BITS * (Level))) // Ticks per slot of a level.
+#define WHEEL_SPAN LEVEL_SPAN(TIMER_LEVELS) // How far off the wheel reaches.
+
+void TimerWheelInit(TimerWheel *Wheel, int64_t NowUs, int64_t TickUs) {
+    memset(Wheel, 0, sizeof(TimerWheel));
+    Wheel->TickUs = TickUs;
+    Wheel->Now = (uint64_t)(NowUs / TickUs);
+}
+
+void TimerInit(Timer *Unscheduled, void *Context) {
+    memset(Unscheduled, 0, sizeof(Timer));
+    Unscheduled->Context = Context;
+}
+
+bool TimerScheduled(const Timer *Queried) {
+    return Queried->Link != NULL;
+}
+
+static void Push(Timer **Head, Timer *Pushed) {
+    Pushed->Next = *Head;
+    Pushed->Link = Head;
+    if (*Head)
+        (*Head)->Link = &Pushed->Next;
+    *Head = Pushed;
+}
+
+// Out of whatever list it's in.  A slot left empty keeps its bit until the wheel next gets to it.
+static void Unlink(Timer *Unlinked) {
+    *Unlinked->Link = Unlinked->Next;
+    if (Unlinked->Next)
+        Unlinked->Next->Link = Unlinked->Link;
+    Unlinked->Next = NULL;
+    Unlinked->Link = NULL;
+}
+
+// The lowest level whose reach covers the timer, in the slot its due tick falls in.
+static void Place(TimerWheel *Wheel, Timer *Placed) {
+    uint64_t Due = Placed->DueTick < Wheel->Now ? Wheel->Now : Placed->DueTick;
+    int Level = 0;
+    int Slot;
+
+    if (Due - Wheel->Now >= WHEEL_SPAN) // Too far off.  Parked in the last slot the wheel reaches, and placed again from there.
+        Due = Wheel->Now + WHEEL_SPAN - 1;
+    while (Level < TIMER_LEVELS - 1 && Due - Wheel->Now >= LEVEL_SPAN(Level + 1))
+        Level++;
+    Slot = (int)((Due >> (TIMER_SLOT_BITS * Level)) & SLOT_MASK);
+    Push(&Wheel->Slots[Level][Slot], Placed);
+    Wheel->Occupied[Level] |= 1ull << Slot;
+}
+
+void TimerSchedule(TimerWheel *Wheel, Timer *Scheduled, int64_t DueUs) {
+    if (Scheduled->Link)
+        Unlink(Scheduled);
+    else
+        Wheel->Count++;
+    Scheduled->DueTick = DueUs <= 0 ? 0 : (uint64_t)((DueUs + Wheel->TickUs - 1) / Wheel->TickUs); // Rounded up: never early.
+    Place(Wheel, Scheduled);
+}
+
+void TimerCancel(TimerWheel *Wheel, Timer *Cancelled) {
+    if (Cancelled->Link == NULL)
+        return;
+    Unlink(Cancelled);
+    Wheel->Count--;
+}
+
+// Take a slot's timers out into a list of the caller's.  They stay cancellable there: their links point into it.
+static void Detach(TimerWheel *Wheel, int Level, int Slot, Timer **Out) {
+    *Out = Wheel->Slots[Level][Slot];
+    Wheel->Slots[Level][Slot] = NULL;
+    Wheel->Occupied[Level] &= ~(1ull << Slot);
+    if (*Out)
+        (*Out)->Link = Out;
+}
+
+// Level 0 has come round.  Move the timers in the slots of the levels above that have now come round too down into the levels below,
+// highest first.  None are due yet: each slot holds nothing due before its first tick.
+static void Cascade(TimerWheel *Wheel) {
+    Timer *Moving;
+    Timer *Moved;
+    int Top = 1;
+    int Level;
+
+    while (Top < TIMER_LEVELS - 1 && (Wheel->Now & (LEVEL_SPAN(Top + 1) - 1)) == 0)
+        Top++;
+    for (Level = Top; Level >= 1; Level--) {
+        Detach(Wheel, Level, (int)((Wheel->Now >> (TIMER_SLOT_BITS * Level)) & SLOT_MASK), &Moving);
+        while ((Moved = Moving) != NULL) {
+            Unlink(Moved);
+            Place(Wheel, Moved);
+        }
+    }
+}
+
+int TimerWheelAdvance(TimerWheel *Wheel, int64_t NowUs, TimerHandler Handler) {
+    uint64_t Target = (uint64_t)(NowUs / Wheel->TickUs);
+    uint64_t Ahead;
+    uint64_t Step;
+    Timer *Expiring;
+    Timer *Expired;
+    int Slot;
+    int Fired = 0;
+
+    while (Wheel->Now <= Target) {
+        if (Wheel->Count == 0) { // Nothing to do on the way.
+            Wheel->Now = Target + 1;
+            break;
+        }
+        Slot = (int)(Wheel->Now & SLOT_MASK);
+        if (Slot == 0)
+            Cascade(Wheel);
+
+        Ahead = Wheel->Occupied[0] >> Slot; // Skip straight to the next slot with timers in it, or to the next time round.
+        Step = Ahead ? (uint64_t)__builtin_ctzll(Ahead) : (uint64_t)(TIMER_SLOTS - Slot);
+        if (Step > 0) {
+            Wheel->Now += Step < Target - Wheel->Now + 1 ? Step : Target - Wheel->Now + 1;
+            continue;
+        }
+
+        Detach(Wheel, 0, Slot, &Expiring);
+        Wheel->Now++; // So a timer scheduled again from its handler lands in a later slot.
+        while ((Expired = Expiring) != NULL) {
+            Unlink(Expired);
+            if (Expired->DueTick >= Wheel->Now) { // Due a later time round.
+                Place(Wheel, Expired);
+                continue;
+            }
+            Wheel->Count--;
+            Fired++;
+            Handler(Expired);
+        }
+    }
+    return Fired;
+}
+
+int64_t TimerWheelNextUs(const TimerWheel *Wheel, int64_t NowUs) {
+    int Slot = (int)(Wheel->Now & SLOT_MASK);
+    uint64_t Ahead = Wheel->Occupied[0] >> Slot;
+    uint64_t Tick;
+    int64_t WaitUs;
+
+    if (Wheel->Count == 0)
+        return -1;
+    if (Ahead)
+        Tick = Wheel->Now + (uint64_t)__builtin_ctzll(Ahead);
+    else
+        Tick = (Wheel->Now | SLOT_MASK) + 1; // Round to the next cascade.
+    if (Slot == 0) // A cascade still to run.
+        Tick = Wheel->Now;
+    WaitUs = (int64_t)Tick * Wheel->TickUs - NowUs;
+    return WaitUs > 0 ? WaitUs : 0;
+}
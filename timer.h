@@ -0,0 +1,59 @@
+/*
+Hierarchical timer wheel, one per worker, for the timeouts an event loop keeps per connection.
+
+Time is counted in ticks.  The wheel has TIMER_LEVELS levels of TIMER_SLOTS slots each: level 0 holds the timers due in the next 64
+ticks, one slot per tick, level 1 the ones due in the next 64 * 64 ticks, 64 ticks per slot, and so on.  Every time level 0 comes
+round, the level 1 slot that's now current is emptied into level 0 (and every 64 of those, a level 2 slot into level 1...), so a timer
+is only ever moved TIMER_LEVELS times however far off it's due.
+
+- Adding or cancelling a timer is O(1): it's linked into (or out of) one slot's list.  The timers are embedded in what they time.
+- Advancing only visits slots that hold timers, found from a bit mask per level, and never looks at the timers not yet due.
+- Nothing is asked of the kernel.  The loop just waits no longer than TimerWheelNextUs() says.
+
+Timers due further off than the wheel reaches wait in its last slot and are placed again each time it comes round.  A timer fires on
+the first advance at or after its due tick, so it's up to a tick late, never early.  Only the owning thread touches a wheel.
+*/
+
+#ifndef TIMER_H
+#define TIMER_H
+
+#include "stdbool.h"
+#include "stdint.h"
+
+#define TIMER_LEVELS 4
+#define TIMER_SLOT_BITS 6
+#define TIMER_SLOTS (1 << TIMER_SLOT_BITS) // 64, one bit each in a level's mask.
+
+typedef struct Timer Timer;
+
+typedef void (*TimerHandler)(Timer *Expired); // Called once per expired timer.  It may add or cancel any timer, itself included.
+
+struct Timer {
+    Timer *Next;
+    Timer **Link; // What points at this timer: the slot head or the previous timer's Next.  NULL = not scheduled.
+    uint64_t DueTick;
+    void *Context; // Whatever the timer is for.  Not used by the wheel.
+};
+
+typedef struct TimerWheel {
+    int64_t TickUs;
+    uint64_t Now; // Next tick to run.  Everything due before it has fired.
+    Timer *Slots[TIMER_LEVELS][TIMER_SLOTS];
+    uint64_t Occupied[TIMER_LEVELS]; // Bit N set = Slots[Level][N] isn't empty.
+    int Count; // Timers scheduled.
+} TimerWheel;
+
+void TimerWheelInit(TimerWheel *Wheel, int64_t NowUs, int64_t TickUs);
+
+void TimerInit(Timer *Unscheduled, void *Context);
+void TimerSchedule(TimerWheel *Wheel, Timer *Scheduled, int64_t DueUs); // Moves it if it's already scheduled.
+void TimerCancel(TimerWheel *Wheel, Timer *Cancelled); // Does nothing if it isn't scheduled.
+bool TimerScheduled(const Timer *Queried);
+
+int TimerWheelAdvance(TimerWheel *Wheel, int64_t NowUs, TimerHandler Handler); // Fire every timer due by NowUs.  Returns how many.
+
+// How long from NowUs the loop may sleep before the wheel next needs advancing.  -1 = no timers.  Sometimes early (the wheel then moves
+// timers down a level and nothing fires), never late.
+int64_t TimerWheelNextUs(const TimerWheel *Wheel, int64_t NowUs);
+
+#endif // TIMER_H
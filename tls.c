@@ -0,0 +1,368 @@
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "tls.h"
+
+#ifdef CHAT_TLS
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/pem.h>
+#include <openssl/x509v3.h>
+
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+#define HAVE_KTLS
+#endif
+
+#define STAGING_SIZE 65536 // Four full records per SSL_write.
+
+struct TlsContext {
+    SSL_CTX *Ssl;
+    char SessionFile[MAX_PATH_LENGTH]; // Client: where the latest session ticket is kept.
+};
+
+struct TlsConnection {
+    SSL *Ssl;
+    SOCKET Socket;
+    TlsContext *Context;
+    bool bServer;
+    bool bReported; // TlsHandshakeCompleted() has returned true.
+    bool bKernelSend; // The kernel encrypts what we send (kTLS).
+    bool bSslWantsWrite; // OpenSSL has record data of its own waiting for the socket.  Nothing may bypass it until it's out.
+    size_t RetryLength; // After SSL_write would block, it must be called again with the same bytes.
+};
+
+static _Thread_local uint8_t Staging[STAGING_SIZE]; // One per worker.  Rebuilt from the out buffer each flush, never kept.
+
+static void PrintTlsErrors(const char *What) {
+    unsigned long Error;
+    char Text[256];
+
+    printf("TLS error: %s\n", What);
+    while ((Error = ERR_get_error()) != 0) {
+        ERR_error_string_n(Error, Text, sizeof(Text));
+        printf("  %s\n", Text);
+    }
+}
+
+static void SetSocketError(bool bWouldBlock) {
+    #ifdef _WIN32
+    WSASetLastError(bWouldBlock ? WSAEWOULDBLOCK : WSAECONNRESET);
+    #else
+    errno = bWouldBlock ? EAGAIN : ECONNRESET;
+    #endif // _WIN32
+}
+
+static SSL_CTX *NewContext(const SSL_METHOD *Method) {
+    SSL_CTX *Ssl = SSL_CTX_new(Method);
+
+    if (Ssl == NULL)
+        return NULL;
+
+    SSL_CTX_set_min_proto_version(Ssl, TLS1_2_VERSION);
+    SSL_CTX_set_mode(Ssl, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER | SSL_MODE_RELEASE_BUFFERS);
+    #ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+    SSL_CTX_set_options(Ssl, SSL_OP_IGNORE_UNEXPECTED_EOF); // A peer vanishing without close_notify is just a disconnect here.
+    #endif
+    #ifdef HAVE_KTLS
+    SSL_CTX_set_options(Ssl, SSL_OP_ENABLE_KTLS); // Used when the kernel & cipher support it, silently skipped when not.
+    #endif
+    return Ssl;
+}
+
+TlsContext *TlsServerContext(const char *CertFile, const char *KeyFile) {
+    TlsContext *Context = calloc(1, sizeof(TlsContext));
+
+    if (Context == NULL || (Context->Ssl = NewContext(TLS_server_method())) == NULL) {
+        free(Context);
+        PrintTlsErrors("unable to create server context");
+        return NULL;
+    }
+
+    if (SSL_CTX_use_certificate_chain_file(Context->Ssl, CertFile) != 1
+        || SSL_CTX_use_PrivateKey_file(Context->Ssl, KeyFile, SSL_FILETYPE_PEM) != 1
+        || SSL_CTX_check_private_key(Context->Ssl) != 1) {
+        PrintTlsErrors("unable to load the certificate / key");
+        TlsContextFree(Context);
+        return NULL;
+    }
+
+    // Stateless tickets (on by default) let any worker resume any session.  One per handshake is all a chat client ever uses.
+    SSL_CTX_set_session_id_context(Context->Ssl, (const unsigned char *)"chat", 4);
+    SSL_CTX_set_num_tickets(Context->Ssl, 1);
+    return Context;
+}
+
+// A new session (ticket) arrived from the server.  Keep it for the next run.
+static int SaveSession(SSL *Ssl, SSL_SESSION *Session) {
+    TlsConnection *Connection = SSL_get_app_data(Ssl);
+    FILE *File;
+
+    if (Connection == NULL || Connection->Context->SessionFile[0] == '\0')
+        return 0;
+
+    File = fopen(Connection->Context->SessionFile, "w");
+    if (File) {
+        PEM_write_SSL_SESSION(File, Session);
+        fclose(File);
+    }
+    return 0; // We didn't keep a reference to Session.
+}
+
+TlsContext *TlsClientContext(const char *CaFile, bool bVerify, const char *SessionFile) {
+    TlsContext *Context = calloc(1, sizeof(TlsContext));
+
+    if (Context == NULL || (Context->Ssl = NewContext(TLS_client_method())) == NULL) {
+        free(Context);
+        PrintTlsErrors("unable to create client context");
+        return NULL;
+    }
+
+    if (bVerify) {
+        if ((CaFile && CaFile[0] ? SSL_CTX_load_verify_locations(Context->Ssl, CaFile, NULL) : SSL_CTX_set_default_verify_paths(Context->Ssl)) != 1) {
+            PrintTlsErrors("unable to load trusted certificates");
+            TlsContextFree(Context);
+            return NULL;
+        }
+        SSL_CTX_set_verify(Context->Ssl, SSL_VERIFY_PEER, NULL);
+    }
+    else
+        SSL_CTX_set_verify(Context->Ssl, SSL_VERIFY_NONE, NULL);
+
+    if (SessionFile && SessionFile[0]) {
+        snprintf(Context->SessionFile, sizeof(Context->SessionFile), "%s", SessionFile);
+        SSL_CTX_set_session_cache_mode(Context->Ssl, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+        SSL_CTX_sess_set_new_cb(Context->Ssl, SaveSession);
+    }
+    return Context;
+}
+
+void TlsContextFree(TlsContext *Context) {
+    if (Context == NULL)
+        return;
+    SSL_CTX_free(Context->Ssl);
+    free(Context);
+}
+
+static TlsConnection *NewConnection(TlsContext *Context, SOCKET Socket, bool bServer) {
+    TlsConnection *Connection = calloc(1, sizeof(TlsConnection));
+
+    if (Connection == NULL)
+        return NULL;
+
+    Connection->Ssl = SSL_new(Context->Ssl);
+    if (Connection->Ssl == NULL || SSL_set_fd(Connection->Ssl, (int)Socket) != 1) {
+        SSL_free(Connection->Ssl);
+        free(Connection);
+        return NULL;
+    }
+    Connection->Socket = Socket;
+    Connection->Context = Context;
+    Connection->bServer = bServer;
+    SSL_set_app_data(Connection->Ssl, Connection);
+    return Connection;
+}
+
+TlsConnection *TlsAccept(TlsContext *Context, SOCKET Socket) {
+    TlsConnection *Connection = NewConnection(Context, Socket, true);
+
+    if (Connection)
+        SSL_set_accept_state(Connection->Ssl);
+    return Connection;
+}
+
+TlsConnection *TlsConnect(TlsContext *Context, SOCKET Socket, const char *ServerName) {
+    TlsConnection *Connection = NewConnection(Context, Socket, false);
+    unsigned char Address[16];
+    bool bLiteral;
+    FILE *File;
+    SSL_SESSION *Session;
+
+    if (Connection == NULL)
+        return NULL;
+
+    bLiteral = inet_pton(AF_INET, ServerName, Address) == 1 || inet_pton(AF_INET6, ServerName, Address) == 1;
+    if (bLiteral) // Certificates name IP addresses separately, and SNI can't carry one.
+        X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(Connection->Ssl), ServerName);
+    else {
+        SSL_set_tlsext_host_name(Connection->Ssl, ServerName);
+        SSL_set1_host(Connection->Ssl, ServerName);
+    }
+
+    if (Context->SessionFile[0] && (File = fopen(Context->SessionFile, "r")) != NULL) { // Offer the last session for resumption.
+        Session = PEM_read_SSL_SESSION(File, NULL, NULL, NULL);
+        fclose(File);
+        if (Session) {
+            SSL_set_session(Connection->Ssl, Session);
+            SSL_SESSION_free(Session);
+        }
+        ERR_clear_error();
+    }
+
+    SSL_set_connect_state(Connection->Ssl);
+    return Connection;
+}
+
+void TlsFree(TlsConnection *Connection) {
+    if (Connection == NULL)
+        return;
+    if (SSL_is_init_finished(Connection->Ssl))
+        SSL_shutdown(Connection->Ssl); // Best effort, we don't wait for the peer's reply.
+    SSL_free(Connection->Ssl);
+    free(Connection);
+}
+
+static void CheckKernelSend(TlsConnection *Connection) {
+    #ifdef HAVE_KTLS
+    Connection->bKernelSend = BIO_get_ktls_send(SSL_get_wbio(Connection->Ssl));
+    #else
+    (void)Connection;
+    #endif
+}
+
+bool TlsHandshake(TlsConnection *Connection, int TimeoutMs) {
+    int64_t Deadline = MonotonicUs() + (int64_t)TimeoutMs * 1000;
+    PollFd Wait;
+    int Result;
+    int Error;
+    long VerifyResult;
+
+    while ((Result = SSL_do_handshake(Connection->Ssl)) != 1) {
+        Error = SSL_get_error(Connection->Ssl, Result);
+        if (Error != SSL_ERROR_WANT_READ && Error != SSL_ERROR_WANT_WRITE) {
+            VerifyResult = SSL_get_verify_result(Connection->Ssl);
+            if (VerifyResult != X509_V_OK)
+                printf("TLS error: the server's certificate was rejected: %s\n", X509_verify_cert_error_string(VerifyResult));
+            else
+                PrintTlsErrors("handshake failed");
+            return false;
+        }
+
+        int64_t Left = Deadline - MonotonicUs();
+        if (Left <= 0) {
+            printf("TLS error: handshake timed out\n");
+            return false;
+        }
+        Wait.fd = Connection->Socket;
+        Wait.events = Error == SSL_ERROR_WANT_READ ? POLLIN : POLLOUT;
+        Wait.revents = 0;
+        poll(&Wait, 1, (int)((Left + 999) / 1000));
+    }
+
+    CheckKernelSend(Connection);
+    return true;
+}
+
+long TlsRecv(TlsConnection *Connection, void *Buffer, size_t Length) {
+    int Result = SSL_read(Connection->Ssl, Buffer, (int)(Length > 0x7fffffff ? 0x7fffffff : Length));
+
+    if (Result > 0) {
+        Connection->bSslWantsWrite = false;
+        return Result;
+    }
+
+    switch (SSL_get_error(Connection->Ssl, Result)) {
+    case SSL_ERROR_WANT_READ: // Includes the middle of the handshake.
+        if (!Connection->bKernelSend && SSL_is_init_finished(Connection->Ssl))
+            CheckKernelSend(Connection);
+        SetSocketError(true);
+        return SOCKET_ERROR;
+
+    case SSL_ERROR_WANT_WRITE: // A handshake flight didn't fit in the socket buffer.  Rare: it's empty at that point.
+        Connection->bSslWantsWrite = true;
+        SetSocketError(true);
+        return SOCKET_ERROR;
+
+    case SSL_ERROR_ZERO_RETURN: // close_notify, or the connection closed (see SSL_OP_IGNORE_UNEXPECTED_EOF).
+        return 0;
+
+    default:
+        if (!SSL_is_init_finished(Connection->Ssl) && Connection->bServer)
+            ERR_clear_error(); // A client that failed its handshake.  Logging every scanner that pokes the port would flood the console.
+        SetSocketError(false);
+        return SOCKET_ERROR;
+    }
+}
+
+int TlsFlush(TlsConnection *Connection, OutBuffer *Out, bool bCork) {
+    size_t Length;
+    int Result;
+
+    if (!SSL_is_init_finished(Connection->Ssl))
+        return OUTBUF_DONE; // Stays queued.  Whoever sees TlsHandshakeCompleted() flushes it.
+
+    if (Connection->bKernelSend && !Connection->bSslWantsWrite && Connection->RetryLength == 0)
+        return OutBufferFlush(Out, Connection->Socket, bCork); // The kernel encrypts the shared messages in place.
+
+    if (bCork)
+        SetCork(Connection->Socket, true);
+
+    while (Out->QueuedBytes > 0) {
+        Length = OutBufferGather(Out, Staging, Connection->RetryLength ? Connection->RetryLength : STAGING_SIZE);
+        Result = SSL_write(Connection->Ssl, Staging, (int)Length);
+
+        if (Result > 0) {
+            OutBufferConsume(Out, (size_t)Result);
+            Connection->RetryLength = 0;
+            Connection->bSslWantsWrite = false;
+            continue;
+        }
+
+        switch (SSL_get_error(Connection->Ssl, Result)) {
+        case SSL_ERROR_WANT_WRITE:
+        case SSL_ERROR_WANT_READ:
+            Connection->RetryLength = Length; // Same bytes next time: they're still at the front of the out buffer.
+            if (bCork)
+                SetCork(Connection->Socket, false);
+            return OUTBUF_BLOCKED;
+
+        default:
+            if (bCork)
+                SetCork(Connection->Socket, false);
+            return OUTBUF_ERROR;
+        }
+    }
+
+    if (bCork)
+        SetCork(Connection->Socket, false);
+    return OUTBUF_DONE;
+}
+
+bool TlsHandshakeCompleted(TlsConnection *Connection, char *Description, size_t Size) {
+    if (Connection->bReported || !SSL_is_init_finished(Connection->Ssl))
+        return false;
+
+    Connection->bReported = true;
+    CheckKernelSend(Connection);
+    snprintf(Description, Size, "%s %s, %s%s", SSL_get_version(Connection->Ssl), SSL_get_cipher_name(Connection->Ssl),
+             SSL_session_reused(Connection->Ssl) ? "resumed" : "full handshake", Connection->bKernelSend ? ", kTLS" : "");
+    return true;
+}
+
+#else // CHAT_TLS
+
+TlsContext *TlsServerContext(const char *CertFile, const char *KeyFile) {
+    (void)CertFile;
+    (void)KeyFile;
+    printf("TLS error: this build has no TLS support.  Rebuild with -DCHAT_TLS -lssl -lcrypto.\n");
+    return NULL;
+}
+
+TlsContext *TlsClientContext(const char *CaFile, bool bVerify, const char *SessionFile) {
+    (void)CaFile;
+    (void)bVerify;
+    (void)SessionFile;
+    printf("TLS error: this build has no TLS support.  Rebuild with -DCHAT_TLS -lssl -lcrypto.\n");
+    return NULL;
+}
+
+void TlsContextFree(TlsContext *Context) { (void)Context; }
+TlsConnection *TlsAccept(TlsContext *Context, SOCKET Socket) { (void)Context; (void)Socket; return NULL; }
+TlsConnection *TlsConnect(TlsContext *Context, SOCKET Socket, const char *ServerName) { (void)Context; (void)Socket; (void)ServerName; return NULL; }
+bool TlsHandshake(TlsConnection *Connection, int TimeoutMs) { (void)Connection; (void)TimeoutMs; return false; }
+void TlsFree(TlsConnection *Connection) { (void)Connection; }
+long TlsRecv(TlsConnection *Connection, void *Buffer, size_t Length) { (void)Connection; (void)Buffer; (void)Length; return SOCKET_ERROR; }
+int TlsFlush(TlsConnection *Connection, OutBuffer *Out, bool bCork) { (void)Connection; (void)Out; (void)bCork; return OUTBUF_ERROR; }
+bool TlsHandshakeCompleted(TlsConnection *Connection, char *Description, size_t Size) { (void)Connection; (void)Description; (void)Size; return false; }
+
+#endif // CHAT_TLS
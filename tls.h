@@ -0,0 +1,46 @@
+/*
+TLS transport (OpenSSL).  Compiled in with -DCHAT_TLS and linked with -lssl -lcrypto.  Without CHAT_TLS the same functions exist but
+creating a context fails with a message, so callers need no #ifdefs of their own.
+
+Connections run over the same non-blocking sockets & event loops as plaintext ones.  TlsRecv() behaves like recv(): it returns
+SOCKET_ERROR with SocketWouldBlock() true when there's nothing to read, and carries the handshake along on the way.
+
+Sending keeps the batching:
+- With kernel TLS (Linux, OpenSSL built with kTLS, AES-GCM), the kernel encrypts.  TlsFlush() hands the queued shared messages to the
+  same single vectored send as plaintext, and broadcasts stay zero-copy up to the socket.
+- Otherwise everything queued for a connection is gathered into one buffer and encrypted with one SSL_write, so a burst pays for full
+  16 KiB records, not one record and one syscall per message.
+
+Resumption: the server issues session tickets (shared by every worker, since they use one context).  A client given a session file
+saves its latest ticket there and offers it on the next connect, so a reconnect skips the full handshake & certificate check.
+*/
+
+#ifndef TLS_H
+#define TLS_H
+
+#include "stdbool.h"
+#include "stddef.h"
+#include "platform.h"
+#include "outbuf.h"
+
+typedef struct TlsContext TlsContext;
+typedef struct TlsConnection TlsConnection;
+
+// NULL after printing why if the files can't be loaded (or TLS isn't compiled in).
+TlsContext *TlsServerContext(const char *CertFile, const char *KeyFile);
+// CaFile NULL / empty = the system's trusted roots.  SessionFile NULL / empty = no resumption across runs.
+TlsContext *TlsClientContext(const char *CaFile, bool bVerify, const char *SessionFile);
+void TlsContextFree(TlsContext *Context);
+
+TlsConnection *TlsAccept(TlsContext *Context, SOCKET Socket); // Server side.  The handshake runs from TlsRecv().
+TlsConnection *TlsConnect(TlsContext *Context, SOCKET Socket, const char *ServerName); // Client side.  ServerName is verified.
+bool TlsHandshake(TlsConnection *Connection, int TimeoutMs); // Client side: finish the handshake before chatting.  Prints failures.
+void TlsFree(TlsConnection *Connection); // Sends close_notify if the socket will take it.  Doesn't close the socket.
+
+long TlsRecv(TlsConnection *Connection, void *Buffer, size_t Length); // Like recv().
+int TlsFlush(TlsConnection *Connection, OutBuffer *Out, bool bCork); // Like OutBufferFlush().  Holds data back until the handshake is done.
+
+// True exactly once, after the handshake has completed, with e.g. "TLSv1.3 TLS_AES_256_GCM_SHA384, resumed, kTLS" in Description.
+bool TlsHandshakeCompleted(TlsConnection *Connection, char *Description, size_t Size);
+
+#endif // TLS_H
@@ -0,0 +1,364 @@
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "ctype.h"
+#include "inttypes.h"
+#include "transfer.h"
+#include "frame.h"
+#include "console.h"
+
+#define STREAM_PREFIX_MAX (1 + ROOM_NAME_MAX + 10 + 10) // Room, stream ID & offset in front of a chunk's data.
+#define SAVE_ATTEMPTS 100 // NAME, NAME.1 ... before giving up on finding a free name.
+#define SAVE_PATH_MAX (MAX_PATH_LENGTH + 1 + TRANSFER_NAME_MAX + 4) // Directory, slash, name, ".NN" & the terminator.
+
+#ifdef _WIN32
+#define SeekFile _fseeki64
+#define TellFile _ftelli64
+#else
+#define SeekFile fseeko
+#define TellFile ftello
+#endif // _WIN32
+
+typedef struct Receiving {
+    FILE *File; // NULL = free.
+    uint64_t Sender;
+    uint64_t Stream;
+    uint64_t Size;
+    uint64_t Have; // Bytes written so far, so the offset the next chunk must start at.
+    char Name[TRANSFER_NAME_MAX + 1];
+    char Path[SAVE_PATH_MAX];
+} Receiving;
+
+static struct {
+    FILE *File; // NULL = nothing being sent.
+    char Name[TRANSFER_NAME_MAX + 1];
+    char Room[ROOM_NAME_MAX + 1];
+    uint64_t Stream;
+    uint64_t Size;
+    uint64_t Offset; // Next byte of the file to go out.
+    uint8_t Header[FRAME_HEADER_MAX + STREAM_PREFIX_MAX]; // The chunk sendfile() is sending: its frame header & the start of its payload.
+    size_t HeaderLength; // 0 = not in the middle of a chunk.
+    size_t HeaderSent;
+    size_t BodyLeft; // Bytes of the chunk's file data still to go.
+} Sending;
+
+static uint64_t NextStream = 1;
+static Receiving Receives[TRANSFER_RECEIVES_MAX];
+static char DownloadDirectory[MAX_PATH_LENGTH];
+
+void TransferConfigure(const char *Directory) {
+    snprintf(DownloadDirectory, sizeof(DownloadDirectory), "%s", Directory);
+}
+
+// Tell the room it won't get the rest, or the end if Reason is NULL, and close the file.
+static bool EndSending(OutBuffer *Out, const char *Reason) {
+    uint8_t Payload[STREAM_PREFIX_MAX + 128];
+    size_t Length = FrameBuildStream(Payload, Sending.Room, strlen(Sending.Room), Sending.Stream);
+    size_t ReasonLength = Reason ? strlen(Reason) : 0;
+
+    if (ReasonLength > 128)
+        ReasonLength = 128;
+    memcpy(Payload + Length, Reason ? Reason : "", ReasonLength);
+    fclose(Sending.File);
+    Sending.File = NULL;
+    if (Reason)
+        ConsolePrintf("Stopped sending %s: %s.\n", Sending.Name, Reason);
+    else
+        ConsolePrintf("Sent %s.\n", Sending.Name);
+    return OutBufferAppendFrame(Out, FRAME_FILE_END, Payload, Length + ReasonLength);
+}
+
+bool TransferStart(OutBuffer *Out, SOCKET Socket, const char *Path, const char *Room) {
+    uint8_t Payload[STREAM_PREFIX_MAX + 10 + TRANSFER_NAME_MAX];
+    const char *Name = Path;
+    const char *Slash;
+    size_t NameLength;
+    size_t Length;
+    int64_t Size;
+
+    if (Sending.File) {
+        ConsolePrintf("Already sending %s.  Wait for it to finish.\n", Sending.Name);
+        return true;
+    }
+    for (Slash = Path; *Slash; Slash++) { // Only the base name goes out.
+        if (*Slash == '/' || *Slash == '\\')
+            Name = Slash + 1;
+    }
+    if ((NameLength = strlen(Name)) == 0) {
+        ConsolePrintf("Type /send FILE.\n");
+        return true;
+    }
+    if ((Sending.File = fopen(Path, "rb")) == NULL) {
+        ConsolePrintf("Unable to open %s.\n", Path);
+        return true;
+    }
+    if (SeekFile(Sending.File, 0, SEEK_END) != 0 || (Size = TellFile(Sending.File)) < 0 || SeekFile(Sending.File, 0, SEEK_SET) != 0) {
+        ConsolePrintf("Unable to read %s.\n", Path);
+        fclose(Sending.File);
+        Sending.File = NULL;
+        return true;
+    }
+
+    if (NameLength > TRANSFER_NAME_MAX)
+        NameLength = TRANSFER_NAME_MAX;
+    memcpy(Sending.Name, Name, NameLength);
+    Sending.Name[NameLength] = '\0';
+    snprintf(Sending.Room, sizeof(Sending.Room), "%s", Room);
+    Sending.Stream = NextStream++;
+    Sending.Size = (uint64_t)Size;
+    Sending.Offset = 0;
+    Sending.HeaderLength = 0;
+
+    SetSocketBuffer(Socket, SO_SNDBUF, TRANSFER_SOCKET_BUFFER);
+    Length = FrameBuildStream(Payload, Room, strlen(Room), Sending.Stream);
+    Length += VarintEncode(Payload + Length, Sending.Size);
+    memcpy(Payload + Length, Sending.Name, NameLength);
+    ConsolePrintf("Sending %s (%" PRIu64 " bytes) to %s.\n", Sending.Name, Sending.Size, Room[0] ? Room : "everyone");
+    return OutBufferAppendFrame(Out, FRAME_FILE, Payload, Length + NameLength);
+}
+
+// The start of the next chunk's payload: room, stream ID & offset.  Returns its size.
+static size_t BuildChunkPrefix(uint8_t *Out) {
+    size_t Length = FrameBuildStream(Out, Sending.Room, strlen(Sending.Room), Sending.Stream);
+
+    return Length + VarintEncode(Out + Length, Sending.Offset);
+}
+
+// Read the next chunk into a frame in Out.  Returns false if out of memory.
+static bool QueueChunk(OutBuffer *Out) {
+    size_t Length = Sending.Size - Sending.Offset < TRANSFER_CHUNK_BYTES ? (size_t)(Sending.Size - Sending.Offset) : TRANSFER_CHUNK_BYTES;
+    uint8_t *Payload = malloc(STREAM_PREFIX_MAX + Length);
+    size_t PrefixLength;
+    bool bQueued;
+
+    if (Payload == NULL)
+        return false;
+    PrefixLength = BuildChunkPrefix(Payload);
+    if (fread(Payload + PrefixLength, 1, Length, Sending.File) != Length) {
+        free(Payload);
+        return EndSending(Out, "it couldn't be read");
+    }
+    bQueued = OutBufferAppendFrame(Out, FRAME_CHUNK, Payload, PrefixLength + Length);
+    Sending.Offset += Length;
+    free(Payload);
+    return bQueued;
+}
+
+// Frame the next chunk for sendfile().  Only its header is built, the data stays in the file.
+static void StartChunk() {
+    uint8_t Prefix[STREAM_PREFIX_MAX];
+    size_t PrefixLength = BuildChunkPrefix(Prefix);
+
+    Sending.BodyLeft = Sending.Size - Sending.Offset < TRANSFER_CHUNK_BYTES ? (size_t)(Sending.Size - Sending.Offset) : TRANSFER_CHUNK_BYTES;
+    Sending.HeaderLength = FrameEncodeHeader(Sending.Header, FRAME_CHUNK, PrefixLength + Sending.BodyLeft);
+    memcpy(Sending.Header + Sending.HeaderLength, Prefix, PrefixLength);
+    Sending.HeaderLength += PrefixLength;
+    Sending.HeaderSent = 0;
+}
+
+// Carry on with the chunk started.  TRANSFER_IDLE once it's all gone.
+static int SendChunk(SOCKET Socket) {
+    IoVec Vector;
+    long Sent;
+
+    while (Sending.HeaderSent < Sending.HeaderLength) {
+        IOVEC_BASE(Vector) = (void *)(Sending.Header + Sending.HeaderSent);
+        IOVEC_LEN(Vector) = Sending.HeaderLength - Sending.HeaderSent;
+        if ((Sent = SendVector(Socket, &Vector, 1)) == SOCKET_ERROR)
+            return SocketWouldBlock() ? TRANSFER_BLOCKED : TRANSFER_ERROR;
+        Sending.HeaderSent += (size_t)Sent;
+    }
+    while (Sending.BodyLeft > 0) {
+        if ((Sent = SendFileRange(Socket, fileno(Sending.File), (int64_t)Sending.Offset, Sending.BodyLeft)) == SOCKET_ERROR)
+            return SocketWouldBlock() ? TRANSFER_BLOCKED : TRANSFER_ERROR;
+        if (Sent == 0) { // The file got shorter.  The frame has promised bytes there's no way to send now.
+            ConsolePrintf("%s changed while it was being sent!\n", Sending.Name);
+            return TRANSFER_ERROR;
+        }
+        Sending.Offset += (uint64_t)Sent;
+        Sending.BodyLeft -= (size_t)Sent;
+    }
+    Sending.HeaderLength = 0;
+    return TRANSFER_IDLE;
+}
+
+int TransferPump(OutBuffer *Out, SOCKET Socket, bool bZeroCopy) {
+    int Result;
+
+    #ifndef HAVE_SEND_FILE
+    bZeroCopy = false;
+    #endif // HAVE_SEND_FILE
+
+    if (Sending.File == NULL)
+        return TRANSFER_IDLE;
+    if (Sending.HeaderLength > 0 && (Result = SendChunk(Socket)) != TRANSFER_IDLE) // Nothing else can go out in the middle of a chunk.
+        return Result;
+    if (Out->QueuedBytes > 0) // Chat first.  Called again once it's gone.
+        return TRANSFER_MORE;
+    if (Sending.Offset == Sending.Size)
+        return EndSending(Out, NULL) ? TRANSFER_IDLE : TRANSFER_ERROR;
+
+    if (!bZeroCopy)
+        return QueueChunk(Out) ? TRANSFER_MORE : TRANSFER_ERROR;
+    StartChunk();
+    Result = SendChunk(Socket);
+    return Result == TRANSFER_IDLE ? TRANSFER_MORE : Result; // Back to the loop between chunks, for what's been typed or received.
+}
+
+// Give up on a file coming in & delete what there is of it.
+static void Abandon(Receiving *Incoming, const char *Reason) {
+    fclose(Incoming->File);
+    Incoming->File = NULL;
+    remove(Incoming->Path);
+    if (Reason)
+        ConsolePrintf("Gave up on %s: %s.\n", Incoming->Name, Reason);
+}
+
+static Receiving *FindReceiving(uint64_t Sender, uint64_t Stream) {
+    int Counter;
+
+    for (Counter = 0; Counter < TRANSFER_RECEIVES_MAX; Counter++) {
+        if (Receives[Counter].File && Receives[Counter].Sender == Sender && Receives[Counter].Stream == Stream)
+            return &Receives[Counter];
+    }
+    return NULL;
+}
+
+// Somewhere new in the download directory, so nothing is overwritten.  The name is only letters, digits & ._- so it can't lead out.
+static FILE *CreateDownload(const char *Name, char *Path) {
+    FILE *File;
+    int Attempt;
+
+    for (Attempt = 0; Attempt < SAVE_ATTEMPTS; Attempt++) {
+        if (Attempt == 0)
+            snprintf(Path, SAVE_PATH_MAX, "%s/%s", DownloadDirectory, Name);
+        else
+            snprintf(Path, SAVE_PATH_MAX, "%s/%s.%d", DownloadDirectory, Name, Attempt);
+        if ((File = fopen(Path, "wbx")) != NULL)
+            return File;
+    }
+    return NULL;
+}
+
+static void OfferReceived(uint64_t Sender, const char *SenderName, const uint8_t *Room, size_t RoomLength, uint64_t Stream,
+                          const uint8_t *Rest, size_t RestLength) {
+    Receiving *Incoming = NULL;
+    char Name[TRANSFER_NAME_MAX + 1];
+    uint64_t Size;
+    size_t SizeLength = VarintDecode(Rest, RestLength, &Size);
+    size_t Counter;
+    size_t NameLength;
+
+    if (SizeLength == 0)
+        return;
+    NameLength = RestLength - SizeLength < TRANSFER_NAME_MAX ? RestLength - SizeLength : TRANSFER_NAME_MAX;
+    for (Counter = 0; Counter < NameLength; Counter++) {
+        Name[Counter] = (char)Rest[SizeLength + Counter];
+        if (!isalnum((unsigned char)Name[Counter]) && Name[Counter] != '-' && Name[Counter] != '_' && (Name[Counter] != '.' || Counter == 0))
+            Name[Counter] = '_';
+    }
+    Name[NameLength] = '\0';
+    if (NameLength == 0)
+        snprintf(Name, sizeof(Name), "file");
+
+    if (RoomLength > 0)
+        ConsolePrintf("[%.*s] %s is sending %s (%" PRIu64 " bytes).\n", (int)RoomLength, (const char *)Room, SenderName, Name, Size);
+    else
+        ConsolePrintf("%s is sending %s (%" PRIu64 " bytes).\n", SenderName, Name, Size);
+    if (DownloadDirectory[0] == '\0') {
+        ConsolePrintf("Start the client with --download-dir to save files.\n");
+        return;
+    }
+
+    for (Counter = 0; Counter < TRANSFER_RECEIVES_MAX && Incoming == NULL; Counter++) {
+        if (Receives[Counter].File == NULL)
+            Incoming = &Receives[Counter];
+    }
+    if (Incoming == NULL || FindReceiving(Sender, Stream)) {
+        ConsolePrintf("Not saving %s: too many files coming in at once.\n", Name);
+        return;
+    }
+    if ((Incoming->File = CreateDownload(Name, Incoming->Path)) == NULL) {
+        ConsolePrintf("Not saving %s: unable to create it in %s.\n", Name, DownloadDirectory);
+        return;
+    }
+    Incoming->Sender = Sender;
+    Incoming->Stream = Stream;
+    Incoming->Size = Size;
+    Incoming->Have = 0;
+    memcpy(Incoming->Name, Name, NameLength + 1);
+}
+
+static void ChunkReceived(Receiving *Incoming, const uint8_t *Rest, size_t RestLength) {
+    uint64_t Offset;
+    size_t OffsetLength = VarintDecode(Rest, RestLength, &Offset);
+
+    if (OffsetLength == 0 || Offset != Incoming->Have) // A chunk was skipped, see server.h.
+        Abandon(Incoming, "part of it never arrived, this client fell too far behind");
+    else if (RestLength - OffsetLength > Incoming->Size - Incoming->Have)
+        Abandon(Incoming, "it's bigger than it was meant to be");
+    else if (fwrite(Rest + OffsetLength, 1, RestLength - OffsetLength, Incoming->File) != RestLength - OffsetLength)
+        Abandon(Incoming, "unable to write it");
+    else
+        Incoming->Have += RestLength - OffsetLength;
+}
+
+static void EndReceived(Receiving *Incoming, const char *SenderName, const uint8_t *Rest, size_t RestLength) {
+    if (RestLength > 0) {
+        ConsolePrintf("%s stopped sending %s: %.*s.\n", SenderName, Incoming->Name, (int)RestLength, (const char *)Rest);
+        Abandon(Incoming, NULL);
+    }
+    else if (Incoming->Have != Incoming->Size)
+        Abandon(Incoming, "it ended early");
+    else if (fclose(Incoming->File) != 0) {
+        Incoming->File = NULL;
+        remove(Incoming->Path);
+        ConsolePrintf("Gave up on %s: unable to write it.\n", Incoming->Name);
+    }
+    else {
+        Incoming->File = NULL;
+        ConsolePrintf("Saved %s from %s as %s.\n", Incoming->Name, SenderName, Incoming->Path);
+    }
+}
+
+void TransferReceived(uint8_t Type, uint64_t Sender, const char *SenderName, const uint8_t *Payload, size_t Length) {
+    const uint8_t *Room;
+    const uint8_t *Rest;
+    size_t RoomLength;
+    size_t RestLength;
+    uint64_t Stream;
+    Receiving *Incoming;
+
+    if (!FrameSplitStream(Payload, Length, &Room, &RoomLength, &Stream, &Rest, &RestLength))
+        return;
+    if (Type == FRAME_FILE)
+        OfferReceived(Sender, SenderName, Room, RoomLength, Stream, Rest, RestLength);
+    else if ((Incoming = FindReceiving(Sender, Stream)) == NULL) // Not being saved.
+        return;
+    else if (Type == FRAME_CHUNK)
+        ChunkReceived(Incoming, Rest, RestLength);
+    else
+        EndReceived(Incoming, SenderName, Rest, RestLength);
+}
+
+void TransferSenderGone(uint64_t Sender) {
+    int Counter;
+
+    for (Counter = 0; Counter < TRANSFER_RECEIVES_MAX; Counter++) {
+        if (Receives[Counter].File && Receives[Counter].Sender == Sender)
+            Abandon(&Receives[Counter], "its sender left");
+    }
+}
+
+void TransferStop() {
+    int Counter;
+
+    if (Sending.File) {
+        fclose(Sending.File);
+        Sending.File = NULL;
+    }
+    for (Counter = 0; Counter < TRANSFER_RECEIVES_MAX; Counter++) {
+        if (Receives[Counter].File)
+            Abandon(&Receives[Counter], NULL);
+    }
+}
@@ -0,0 +1,45 @@
+/*
+File transfers for the chat client.  /send streams a file to the current room or everyone, and files other people send are saved in
+the download directory, if there is one (see FRAME_FILE in frame.h).
+
+A file goes out in TRANSFER_CHUNK_BYTES chunks, and a chunk is only started once everything else queued for the server has gone.  So
+a line typed during a transfer waits behind one chunk at most, never behind the rest of the file.  On a plaintext connection each chunk
+is sent with sendfile() (see platform.h), from the page cache straight to the socket: only the few bytes of frame header in front of
+it pass through the client.  Over TLS, or where there's no sendfile(), the chunk is read into a frame in the out buffer instead.
+
+One file is sent at a time.  Up to TRANSFER_RECEIVES_MAX can come in at once.
+*/
+
+#ifndef TRANSFER_H
+#define TRANSFER_H
+
+#include "stdbool.h"
+#include "stdint.h"
+#include "platform.h"
+#include "outbuf.h"
+
+#define TRANSFER_CHUNK_BYTES 16384
+#define TRANSFER_RECEIVES_MAX 8
+#define TRANSFER_NAME_MAX 255 // File names offered longer than this are cut short.
+#define TRANSFER_SOCKET_BUFFER 131072 // Send buffer once a file has been sent, so what's typed doesn't queue behind too much of one.
+
+enum { TRANSFER_IDLE, TRANSFER_MORE, TRANSFER_BLOCKED, TRANSFER_ERROR };
+
+void TransferConfigure(const char *DownloadDirectory); // Empty = files others send are announced but not saved.
+
+// /send: open Path & queue its offer to Room (empty = everyone) in Out, to go out on Socket.  Prints why if it can't.  Returns false if
+// out of memory.
+bool TransferStart(OutBuffer *Out, SOCKET Socket, const char *Path, const char *Room);
+
+// Send more of the file, once Out is empty.  bZeroCopy sends the chunks on Socket with sendfile(), otherwise they're queued in Out.
+// Returns TRANSFER_MORE if there's more to send straight away, TRANSFER_BLOCKED if Socket is full in the middle of a chunk (nothing else
+// may be sent until it's finished), TRANSFER_IDLE if there's nothing to send, or TRANSFER_ERROR if the connection failed.
+int TransferPump(OutBuffer *Out, SOCKET Socket, bool bZeroCopy);
+
+// FRAME_FILE, FRAME_CHUNK or FRAME_FILE_END from the server, without the sender's ID.  SenderName is for what's printed.
+void TransferReceived(uint8_t Type, uint64_t Sender, const char *SenderName, const uint8_t *Payload, size_t Length);
+void TransferSenderGone(uint64_t Sender); // Give up on whatever it was sending.
+
+void TransferStop(); // The chat is over.  Closes the file being sent & deletes the ones half received.
+
+#endif // TRANSFER_H
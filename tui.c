@@ -0,0 +1,723 @@
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "stdarg.h"
+#include "stdatomic.h"
+#include "pthread.h"
+#include "platform.h"
+#include "frame.h"
+#include "console.h"
+#include "tui.h"
+
+#ifndef _WIN32
+
+#include <termios.h>
+
+#define PROMPT_MAX (ROOM_NAME_MAX + 2) // "ROOM> "
+#define KEY_BATCH 256 // Bytes read from stdin at once, so a paste isn't a system call per character.
+#define LINE(Index) Lines[(FirstLine + (Index)) % TUI_SCROLLBACK_LINES] // 0 = the oldest.
+
+typedef struct TuiLine {
+    size_t Length;
+    int Rows; // Rows it takes at the current width.
+    char Text[];
+} TuiLine;
+
+enum { KEYS_PLAIN, KEYS_ESCAPE, KEYS_SEQUENCE }; // Where the input thread is in an escape sequence (arrow keys & the like).
+
+static atomic_bool bActive;
+static struct termios SavedMode;
+static int ResizePipe[2] = { -1, -1 }; // SIGWINCH writes a byte here to wake the input thread, about all a handler may safely do.
+static pthread_mutex_t ScreenLock = PTHREAD_MUTEX_INITIALIZER; // Held by the writer while it draws, so TuiStop() never lands mid frame.
+
+// The writer's: the scrollback & what's on the screen.
+static TuiLine *Lines[TUI_SCROLLBACK_LINES]; // A ring, oldest at FirstLine.
+static int FirstLine;
+static int LineCount;
+static char *Partial; // Output after the last '\n', waiting for the rest of its line.
+static size_t PartialLength;
+static int ScreenRows;
+static int ScreenColumns;
+static int TotalRows; // Rows the whole scrollback takes.
+static int NewRows; // Added at the bottom since the last frame.
+static int ScrolledRows; // How far the pane is scrolled back from the newest row.
+static int UnseenLines; // Added below while scrolled back.
+static bool bRedrawAll = true;
+static bool bRedrawPane;
+static bool bStatusChanged;
+static int InputScroll; // Columns of the input line scrolled off to the left.
+static char *Frame; // What this frame writes.
+static size_t FrameLength;
+static size_t FrameCapacity;
+
+// Shared with the input thread, under InputLock.
+static pthread_mutex_t InputLock = PTHREAD_MUTEX_INITIALIZER;
+static char InputLine[TUI_INPUT_MAX];
+static size_t InputLength;
+static size_t InputCursor; // A byte offset, always at the start of a character.
+static char Prompt[PROMPT_MAX + 1] = "> ";
+static atomic_bool bInputChanged;
+static atomic_bool bResized;
+static atomic_int ScrollPages; // PgUp adds one, PgDn takes one away.  The writer scrolls that many pages.
+
+// The input thread's.
+static unsigned char Keys[KEY_BATCH];
+static size_t KeysLength;
+static size_t KeysNext;
+static int KeyState = KEYS_PLAIN;
+static int SequenceNumber;
+static bool bSequenceModifiers; // Past the ';' in e.g. ESC [ 1 ; 5 C (Ctrl+Right).  The modifiers are ignored.
+
+static void HandleResize(int Signal) {
+    char Byte = 0;
+    int SavedErrno = errno;
+    ssize_t Written = write(ResizePipe[1], &Byte, 1); // Non-blocking.  If the pipe is full a resize is already waiting to be seen.
+
+    (void)Signal;
+    (void)Written;
+    errno = SavedErrno;
+}
+
+static void WriteAll(const char *Data, size_t Length) {
+    ssize_t Written;
+
+    while (Length > 0) {
+        if ((Written = write(STDOUT_FILENO, Data, Length)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+        Data += Written;
+        Length -= (size_t)Written;
+    }
+}
+
+static void QueryScreenSize() {
+    struct winsize Size;
+
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &Size) == 0 && Size.ws_row > 0 && Size.ws_col > 0) {
+        ScreenRows = Size.ws_row;
+        ScreenColumns = Size.ws_col;
+    }
+    else {
+        ScreenRows = 24;
+        ScreenColumns = 80;
+    }
+}
+
+bool TuiStart() {
+    struct termios Raw;
+    struct sigaction Action;
+
+    if (atomic_load(&bActive))
+        return true;
+    if (!isatty(STDIN_FILENO) || !isatty(STDOUT_FILENO)) {
+        printf("ERROR: --tui needs a terminal!  Carrying on without it.\n");
+        return false;
+    }
+    if (tcgetattr(STDIN_FILENO, &SavedMode) != 0 || (ResizePipe[0] == -1 && pipe(ResizePipe) != 0)) {
+        printf("ERROR: unable to take over the terminal!  Carrying on without the TUI.\n");
+        return false;
+    }
+    SetNonBlocking(ResizePipe[0]);
+    SetNonBlocking(ResizePipe[1]);
+
+    Raw = SavedMode;
+    Raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON); // Keys as they are, Enter, Ctrl+S & Ctrl+Q included.
+    Raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG); // No echo & no line editing (it's done here), and Ctrl+C is just a key.
+    Raw.c_cc[VMIN] = 1;
+    Raw.c_cc[VTIME] = 0;
+    if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &Raw) != 0) {
+        printf("ERROR: unable to switch the terminal to raw mode!  Carrying on without the TUI.\n");
+        return false;
+    }
+
+    memset(&Action, 0, sizeof(Action));
+    Action.sa_handler = HandleResize;
+    sigemptyset(&Action.sa_mask);
+    Action.sa_flags = SA_RESTART;
+    sigaction(SIGWINCH, &Action, NULL);
+
+    QueryScreenSize();
+    bRedrawAll = true;
+    fflush(stdout);
+    WriteAll("\x1b[?1049h", 8); // The alternate screen, so the terminal's own scrollback is left as it was.
+    atomic_store(&bActive, true);
+    return true;
+}
+
+bool TuiActive() {
+    return atomic_load(&bActive);
+}
+
+static void FrameAdd(const char *Data, size_t Length) {
+    size_t NewCapacity = FrameCapacity ? FrameCapacity : 4096;
+    char *NewFrame;
+
+    if (FrameLength + Length > FrameCapacity) {
+        while (NewCapacity < FrameLength + Length)
+            NewCapacity *= 2;
+        if ((NewFrame = realloc(Frame, NewCapacity)) == NULL) // Drawn short.  The next full redraw puts it right.
+            return;
+        Frame = NewFrame;
+        FrameCapacity = NewCapacity;
+    }
+    memcpy(Frame + FrameLength, Data, Length);
+    FrameLength += Length;
+}
+
+static void FramePrintf(const char *Format, ...) {
+    char Text[64];
+    va_list Args;
+    int Length;
+
+    va_start(Args, Format);
+    Length = vsnprintf(Text, sizeof(Text), Format, Args);
+    va_end(Args);
+    if (Length > 0)
+        FrameAdd(Text, (size_t)Length < sizeof(Text) ? (size_t)Length : sizeof(Text) - 1);
+}
+
+// Text as it is, except control characters (C1 ones included), which would move the cursor or worse.  They're shown as '?'.
+static void FrameAddText(const char *Text, size_t Length) {
+    size_t Start = 0;
+    size_t Counter;
+    size_t Skip;
+    unsigned char Byte;
+
+    for (Counter = 0; Counter < Length; Counter++) {
+        Byte = (unsigned char)Text[Counter];
+        if (Byte < 0x20 || Byte == 0x7f)
+            Skip = 1;
+        else if (Byte == 0xc2 && Counter + 1 < Length && (unsigned char)Text[Counter + 1] < 0xa0)
+            Skip = 2;
+        else
+            continue;
+        FrameAdd(Text + Start, Counter - Start);
+        FrameAdd("?", 1);
+        Counter += Skip - 1;
+        Start = Counter + 1;
+    }
+    FrameAdd(Text + Start, Length - Start);
+}
+
+// Columns Text takes, one per UTF-8 character.  Wide characters are rare enough in chat not to be worth a table.
+static int Width(const char *Text, size_t Length) {
+    int Columns = 0;
+    size_t Counter;
+
+    for (Counter = 0; Counter < Length; Counter++) {
+        if (((unsigned char)Text[Counter] & 0xc0) != 0x80)
+            Columns++;
+    }
+    return Columns;
+}
+
+// Bytes of Text that fill its first Columns columns.
+static size_t Advance(const char *Text, size_t Length, int Columns) {
+    size_t Counter;
+
+    for (Counter = 0; Counter < Length; Counter++) {
+        if (((unsigned char)Text[Counter] & 0xc0) != 0x80 && Columns-- == 0)
+            break;
+    }
+    return Counter;
+}
+
+static int RowsOf(const TuiLine *Line) {
+    int Columns = Width(Line->Text, Line->Length);
+
+    return Columns > 0 ? (Columns + ScreenColumns - 1) / ScreenColumns : 1;
+}
+
+static int PaneRows() {
+    return ScreenRows > 2 ? ScreenRows - 2 : 0; // The status & input lines under it.
+}
+
+static void AddLine(const char *Text, size_t Length) {
+    TuiLine *Line;
+
+    if (Length > 0 && Text[Length - 1] == '\r')
+        Length--;
+    if ((Line = malloc(sizeof(TuiLine) + Length)) == NULL)
+        return;
+    memcpy(Line->Text, Text, Length);
+    Line->Length = Length;
+    Line->Rows = RowsOf(Line);
+
+    if (LineCount == TUI_SCROLLBACK_LINES) { // Forget the oldest.
+        TotalRows -= LINE(0)->Rows;
+        free(LINE(0));
+        LINE(0) = Line;
+        FirstLine = (FirstLine + 1) % TUI_SCROLLBACK_LINES;
+    }
+    else {
+        LINE(LineCount) = Line;
+        LineCount++;
+    }
+    TotalRows += Line->Rows;
+
+    if (ScrolledRows > 0) { // Keep showing what's being read.
+        ScrolledRows += Line->Rows;
+        UnseenLines++;
+        bStatusChanged = true;
+    }
+    else
+        NewRows += Line->Rows;
+}
+
+bool TuiAppend(const char *Text, size_t Length) {
+    const char *End;
+    size_t LineLength;
+    char *Joined;
+
+    pthread_mutex_lock(&ScreenLock);
+    if (!atomic_load(&bActive)) {
+        pthread_mutex_unlock(&ScreenLock);
+        return false;
+    }
+
+    while ((End = memchr(Text, '\n', Length)) != NULL) {
+        LineLength = (size_t)(End - Text);
+        if (PartialLength == 0)
+            AddLine(Text, LineLength);
+        else if ((Joined = realloc(Partial, PartialLength + LineLength + 1)) != NULL) {
+            Partial = Joined;
+            memcpy(Partial + PartialLength, Text, LineLength);
+            AddLine(Partial, PartialLength + LineLength);
+        }
+        PartialLength = 0;
+        Text += LineLength + 1;
+        Length -= LineLength + 1;
+    }
+    if (Length > 0 && (Joined = realloc(Partial, PartialLength + Length)) != NULL) {
+        Partial = Joined;
+        memcpy(Partial + PartialLength, Text, Length);
+        PartialLength += Length;
+    }
+
+    pthread_mutex_unlock(&ScreenLock);
+    return true;
+}
+
+bool TuiPending() {
+    return atomic_load(&bActive) && (atomic_load(&bInputChanged) || atomic_load(&bResized) || atomic_load(&ScrollPages) != 0);
+}
+
+// The line & the row within it that are Back rows above the newest row.  Back is less than TotalRows.
+static void FindRow(int Back, int *Index, int *Row) {
+    *Index = LineCount - 1;
+    while (Back >= LINE(*Index)->Rows) {
+        Back -= LINE(*Index)->Rows;
+        (*Index)--;
+    }
+    *Row = LINE(*Index)->Rows - 1 - Back;
+}
+
+// Draw Count rows, from the one Back rows above the newest row down.  At TopRow onwards, or with TopRow 0 each on a new line at the
+// bottom of the pane, which scrolls the rest of it up.
+static void DrawRows(int Back, int Count, int TopRow) {
+    TuiLine *Line;
+    int Index;
+    int Row;
+    int Counter;
+    size_t Start;
+    size_t Length;
+
+    FindRow(Back, &Index, &Row);
+    for (Counter = 0; Counter < Count; Counter++) {
+        if (TopRow > 0)
+            FramePrintf("\x1b[%d;1H", TopRow + Counter);
+        else
+            FrameAdd("\r\n", 2);
+        Line = LINE(Index);
+        Start = Advance(Line->Text, Line->Length, Row * ScreenColumns);
+        Length = Advance(Line->Text + Start, Line->Length - Start, ScreenColumns);
+        FrameAddText(Line->Text + Start, Length);
+        if (Width(Line->Text + Start, Length) < ScreenColumns) // Erasing from the last column would erase what's in it.
+            FrameAdd("\x1b[K", 3);
+        if (++Row == Line->Rows) {
+            Index++;
+            Row = 0;
+        }
+    }
+}
+
+static void DrawPane() {
+    int Pane = PaneRows();
+    int Shown = TotalRows - ScrolledRows < Pane ? TotalRows - ScrolledRows : Pane;
+    int Counter;
+
+    for (Counter = 0; Counter < Pane - Shown; Counter++) // Blank at the top until there's enough to fill the pane.
+        FramePrintf("\x1b[%d;1H\x1b[K", Counter + 1);
+    if (Shown > 0)
+        DrawRows(ScrolledRows + Shown - 1, Shown, Pane - Shown + 1);
+}
+
+static void DrawStatus() {
+    char Status[128];
+    int Length;
+
+    if (ScrolledRows > 0 && UnseenLines > 0)
+        Length = snprintf(Status, sizeof(Status), " %d new line(s) below.  PgDn to scroll down. ", UnseenLines);
+    else if (ScrolledRows > 0)
+        Length = snprintf(Status, sizeof(Status), " Scrolled back.  PgDn to scroll down. ");
+    else
+        Length = snprintf(Status, sizeof(Status), " PgUp & PgDn scroll.  QUIT or Ctrl+C quits. ");
+    if (Length > ScreenColumns)
+        Length = ScreenColumns;
+    FramePrintf("\x1b[%d;1H\x1b[7m", ScreenRows - 1);
+    FrameAdd(Status, (size_t)Length);
+    for (; Length < ScreenColumns; Length++) // Padded rather than erased: not every terminal erases in reverse video.
+        FrameAdd(" ", 1);
+    FrameAdd("\x1b[m", 3);
+}
+
+// Holding InputLock.  Sets *Column to where the cursor goes.
+static void DrawInput(bool bDraw, int *Column) {
+    int PromptColumns = Width(Prompt, strlen(Prompt));
+    int Visible = ScreenColumns - PromptColumns - 1;
+    int Cursor = Width(InputLine, InputCursor);
+    size_t Start;
+
+    if (Visible < 1)
+        Visible = 1;
+    if (Cursor < InputScroll) // Keep the cursor in sight.
+        InputScroll = Cursor;
+    if (Cursor >= InputScroll + Visible)
+        InputScroll = Cursor - Visible + 1;
+    *Column = PromptColumns + Cursor - InputScroll + 1;
+    if (!bDraw)
+        return;
+
+    Start = Advance(InputLine, InputLength, InputScroll);
+    FramePrintf("\x1b[%d;1H", ScreenRows);
+    FrameAddText(Prompt, strlen(Prompt));
+    FrameAddText(InputLine + Start, Advance(InputLine + Start, InputLength - Start, Visible));
+    FrameAdd("\x1b[K", 3);
+}
+
+void TuiRender() {
+    int Pane;
+    int Pages;
+    int MostScrolled;
+    int Column;
+    int Counter;
+    bool bInput;
+
+    pthread_mutex_lock(&ScreenLock);
+    if (!atomic_load(&bActive)) {
+        pthread_mutex_unlock(&ScreenLock);
+        return;
+    }
+
+    if (atomic_exchange(&bResized, false)) { // Or Ctrl+L.  Every line may wrap differently now.
+        QueryScreenSize();
+        TotalRows = 0;
+        for (Counter = 0; Counter < LineCount; Counter++) {
+            LINE(Counter)->Rows = RowsOf(LINE(Counter));
+            TotalRows += LINE(Counter)->Rows;
+        }
+        bRedrawAll = true;
+    }
+    Pane = PaneRows();
+    if ((Pages = atomic_exchange(&ScrollPages, 0)) != 0) {
+        ScrolledRows += Pages * (Pane > 1 ? Pane - 1 : 1); // A row of the last page stays in sight.
+        bRedrawPane = true;
+    }
+    MostScrolled = TotalRows > Pane ? TotalRows - Pane : 0;
+    if (ScrolledRows > MostScrolled) { // Scrolled past the top, or the top was forgotten.
+        ScrolledRows = MostScrolled;
+        bRedrawPane = true;
+    }
+    if (ScrolledRows < 0)
+        ScrolledRows = 0;
+    if (ScrolledRows == 0 && UnseenLines > 0) {
+        UnseenLines = 0;
+        bStatusChanged = true;
+    }
+    if (NewRows >= Pane) // Cheaper to draw the pane once than to scroll it past rows nobody will see.
+        bRedrawPane = true;
+    bInput = atomic_exchange(&bInputChanged, false) || bRedrawAll;
+    if (!bRedrawAll && !bRedrawPane && !bStatusChanged && NewRows == 0 && !bInput) {
+        pthread_mutex_unlock(&ScreenLock);
+        return;
+    }
+
+    FrameLength = 0;
+    FrameAdd("\x1b[?25l", 6); // Hide the cursor while it's moved about.
+    if (bRedrawAll) // Rows are cut up here, so no wrapping, and only the pane scrolls.
+        FramePrintf("\x1b[?7l\x1b[1;%dr", Pane > 1 ? Pane : 2);
+    if (Pane > 0 && (bRedrawAll || bRedrawPane))
+        DrawPane();
+    else if (Pane > 0 && NewRows > 0) {
+        FramePrintf("\x1b[%d;1H", Pane);
+        DrawRows(NewRows - 1, NewRows, 0);
+    }
+    if (ScreenRows > 1 && (bRedrawAll || bRedrawPane || bStatusChanged))
+        DrawStatus();
+
+    pthread_mutex_lock(&InputLock);
+    DrawInput(bInput, &Column);
+    pthread_mutex_unlock(&InputLock);
+    FramePrintf("\x1b[%d;%dH\x1b[?25h", ScreenRows, Column);
+
+    WriteAll(Frame, FrameLength);
+    NewRows = 0;
+    bRedrawAll = false;
+    bRedrawPane = false;
+    bStatusChanged = false;
+    pthread_mutex_unlock(&ScreenLock);
+}
+
+void TuiStop() {
+    int Shown;
+    int Counter;
+
+    pthread_mutex_lock(&ScreenLock);
+    if (!atomic_load(&bActive)) {
+        pthread_mutex_unlock(&ScreenLock);
+        return;
+    }
+    atomic_store(&bActive, false);
+    signal(SIGWINCH, SIG_DFL);
+
+    FrameLength = 0;
+    FrameAdd("\x1b[r\x1b[?7h\x1b[?1049l", 16); // Back to the normal screen, scrolling & wrapping as usual.
+    Shown = LineCount < PaneRows() ? LineCount : PaneRows(); // The end of the conversation stays on the terminal.
+    for (Counter = LineCount - Shown; Counter < LineCount; Counter++) {
+        FrameAddText(LINE(Counter)->Text, LINE(Counter)->Length);
+        FrameAdd("\n", 1);
+    }
+    WriteAll(Frame, FrameLength);
+    tcsetattr(STDIN_FILENO, TCSAFLUSH, &SavedMode);
+
+    for (Counter = 0; Counter < LineCount; Counter++)
+        free(LINE(Counter));
+    FirstLine = 0;
+    LineCount = 0;
+    TotalRows = 0;
+    NewRows = 0;
+    ScrolledRows = 0;
+    UnseenLines = 0;
+    free(Partial);
+    Partial = NULL;
+    PartialLength = 0;
+    free(Frame);
+    Frame = NULL;
+    FrameLength = 0;
+    FrameCapacity = 0;
+    pthread_mutex_unlock(&ScreenLock);
+}
+
+void TuiSetPrompt(const char *Room) {
+    pthread_mutex_lock(&InputLock);
+    if (Room[0] != '\0')
+        snprintf(Prompt, sizeof(Prompt), "%s> ", Room);
+    else
+        strcpy(Prompt, "> ");
+    pthread_mutex_unlock(&InputLock);
+    atomic_store(&bInputChanged, true);
+    ConsoleRedraw();
+}
+
+// The input line's editing.  All of these hold InputLock.
+static size_t PreviousCharacter(size_t At) {
+    while (At > 0 && ((unsigned char)InputLine[--At] & 0xc0) == 0x80)
+        ;
+    return At;
+}
+
+static size_t NextCharacter(size_t At) {
+    if (At < InputLength)
+        At++;
+    while (At < InputLength && ((unsigned char)InputLine[At] & 0xc0) == 0x80)
+        At++;
+    return At;
+}
+
+static void DeleteRange(size_t From, size_t To) {
+    memmove(InputLine + From, InputLine + To, InputLength - To);
+    InputLength -= To - From;
+    if (InputCursor >= To)
+        InputCursor -= To - From;
+    else if (InputCursor > From)
+        InputCursor = From;
+}
+
+static char *TakeLine() {
+    char *Line = malloc(InputLength + 1);
+
+    if (Line != NULL) {
+        memcpy(Line, InputLine, InputLength);
+        Line[InputLength] = '\0';
+    }
+    InputLength = 0;
+    InputCursor = 0;
+    return Line;
+}
+
+static char *Insert(unsigned char Key) {
+    char *Full = InputLength == TUI_INPUT_MAX ? TakeLine() : NULL; // Sent as it is.  The rest of the paste starts the next line.
+
+    memmove(InputLine + InputCursor + 1, InputLine + InputCursor, InputLength - InputCursor);
+    InputLine[InputCursor++] = (char)Key;
+    InputLength++;
+    return Full;
+}
+
+// The last byte of an escape sequence: ESC [ <number> <Final>.
+static void SequenceTyped(unsigned char Final, int Number) {
+    if (Final == 'C')
+        InputCursor = NextCharacter(InputCursor);
+    else if (Final == 'D')
+        InputCursor = PreviousCharacter(InputCursor);
+    else if (Final == 'H' || (Final == '~' && (Number == 1 || Number == 7)))
+        InputCursor = 0;
+    else if (Final == 'F' || (Final == '~' && (Number == 4 || Number == 8)))
+        InputCursor = InputLength;
+    else if (Final == '~' && Number == 3)
+        DeleteRange(InputCursor, NextCharacter(InputCursor));
+    else if (Final == '~' && Number == 5)
+        atomic_fetch_add(&ScrollPages, 1);
+    else if (Final == '~' && Number == 6)
+        atomic_fetch_sub(&ScrollPages, 1);
+}
+
+// One byte from the keyboard.  Returns the line once Enter is pressed.
+static char *KeyTyped(unsigned char Key) {
+    char *Quit;
+
+    if (KeyState == KEYS_ESCAPE) {
+        if (Key == '[' || Key == 'O') {
+            KeyState = KEYS_SEQUENCE;
+            SequenceNumber = 0;
+            bSequenceModifiers = false;
+            return NULL;
+        }
+        KeyState = KEYS_PLAIN; // Alt+key, taken as the key alone.
+    }
+    else if (KeyState == KEYS_SEQUENCE) {
+        if (Key >= '0' && Key <= '9') {
+            if (!bSequenceModifiers && SequenceNumber < 1000)
+                SequenceNumber = SequenceNumber * 10 + Key - '0';
+        }
+        else if (Key == ';')
+            bSequenceModifiers = true;
+        else if (Key >= 0x40 && Key <= 0x7e) {
+            KeyState = KEYS_PLAIN;
+            SequenceTyped(Key, SequenceNumber);
+        }
+        return NULL;
+    }
+
+    switch (Key) {
+    case 0x1b:
+        KeyState = KEYS_ESCAPE;
+        return NULL;
+    case '\r':
+    case '\n':
+        return InputLength > 0 ? TakeLine() : NULL; // Nothing to send, and Windows line endings pasted in don't send empty lines.
+    case 0x7f: // Backspace, or Ctrl+H.
+    case 0x08:
+        DeleteRange(PreviousCharacter(InputCursor), InputCursor);
+        return NULL;
+    case 0x01: // Ctrl+A
+        InputCursor = 0;
+        return NULL;
+    case 0x05: // Ctrl+E
+        InputCursor = InputLength;
+        return NULL;
+    case 0x0b: // Ctrl+K
+        DeleteRange(InputCursor, InputLength);
+        return NULL;
+    case 0x15: // Ctrl+U
+        DeleteRange(0, InputCursor);
+        return NULL;
+    case 0x0c: // Ctrl+L
+        atomic_store(&bResized, true);
+        return NULL;
+    case 0x04: // Ctrl+D deletes, or quits on an empty line.
+        if (InputLength > 0) {
+            DeleteRange(InputCursor, NextCharacter(InputCursor));
+            return NULL;
+        }
+        // Fall through.
+    case 0x03: // Ctrl+C
+        InputLength = 0;
+        InputCursor = 0;
+        if ((Quit = malloc(5)) != NULL)
+            strcpy(Quit, "QUIT");
+        return Quit;
+    case '\t':
+        return Insert(' ');
+    default:
+        return Key < 0x20 ? NULL : Insert(Key);
+    }
+}
+
+char *TuiReadLine() {
+    PollFd Waiting[2];
+    char Drained[64];
+    char Shown[PROMPT_MAX + 1];
+    char *Line = NULL;
+    ssize_t Got;
+
+    while (Line == NULL) {
+        if (KeysNext == KeysLength) {
+            Waiting[0].fd = STDIN_FILENO;
+            Waiting[0].events = POLLIN;
+            Waiting[0].revents = 0;
+            Waiting[1].fd = ResizePipe[0];
+            Waiting[1].events = POLLIN;
+            Waiting[1].revents = 0;
+            if (poll(Waiting, 2, -1) < 0 && errno != EINTR)
+                return NULL;
+            if (!atomic_load(&bActive))
+                return NULL;
+            if (Waiting[1].revents & POLLIN) {
+                while (read(ResizePipe[0], Drained, sizeof(Drained)) > 0)
+                    ;
+                atomic_store(&bResized, true);
+                ConsoleRedraw();
+            }
+            if (!(Waiting[0].revents & (POLLIN | POLLHUP | POLLERR)))
+                continue;
+            if ((Got = read(STDIN_FILENO, Keys, KEY_BATCH)) <= 0) {
+                if (Got < 0 && errno == EINTR)
+                    continue;
+                return NULL; // stdin closed.
+            }
+            KeysLength = (size_t)Got;
+            KeysNext = 0;
+        }
+
+        pthread_mutex_lock(&InputLock); // The whole batch, then one redraw.
+        while (Line == NULL && KeysNext < KeysLength)
+            Line = KeyTyped(Keys[KeysNext++]);
+        memcpy(Shown, Prompt, sizeof(Shown));
+        pthread_mutex_unlock(&InputLock);
+        atomic_store(&bInputChanged, true);
+        ConsoleRedraw();
+    }
+
+    ConsolePrintf("%s%s\n", Shown, Line); // What was typed stays in the scrollback, as it would on a plain terminal.
+    return Line;
+}
+
+#else // _WIN32
+
+bool TuiStart() {
+    printf("ERROR: the TUI needs a POSIX terminal!  Carrying on without it.\n");
+    return false;
+}
+
+void TuiStop() {}
+bool TuiActive() { return false; }
+void TuiSetPrompt(const char *Room) { (void)Room; }
+char *TuiReadLine() { return NULL; }
+bool TuiAppend(const char *Text, size_t Length) { (void)Text; (void)Length; return false; }
+bool TuiPending() { return false; }
+void TuiRender() {}
+
+#endif // _WIN32
@@ -0,0 +1,42 @@
+/*
+Full screen terminal UI for the chat client (--tui): a scrollback pane with a status line under it, and the line being typed kept at the
+bottom, so what others send never lands in the middle of it.  Solution 3 in main.c: the terminal is switched to raw mode and drawn with
+ANSI escapes, no curses.
+
+Only the console writer thread ever writes to the terminal (see console.h).  Received lines are added to the scrollback and keys typed
+change the input line, but neither draws anything.  The writer draws at most one frame every TUI_FRAME_MS, with whatever has changed
+since the last one, in one write():
+
+- new lines scroll the pane (a scroll region, so the status & input lines stay put) and only the rows they take are drawn;
+- a frame with more new lines than the pane has rows draws the pane once, with the newest of them only;
+- the input line is only drawn when it changed.
+
+So in a busy room the terminal gets a few dozen writes a second however many messages come in.  PgUp & PgDn scroll back.  Not on
+windows.
+*/
+
+#ifndef TUI_H
+#define TUI_H
+
+#include "stdbool.h"
+#include "stddef.h"
+
+#define TUI_FRAME_MS 33 // Frames drawn a second at most: 30.
+#define TUI_SCROLLBACK_LINES 2000 // Older lines are forgotten.
+#define TUI_INPUT_MAX 4096 // Longer lines (a paste, say) are sent as several messages of this many bytes.
+
+bool TuiStart(); // Take over the terminal.  Prints why & returns false if stdin or stdout isn't one.
+void TuiStop(); // Give it back, with the last screenful of the scrollback printed on it.  Call after ConsoleFlush().
+bool TuiActive();
+void TuiSetPrompt(const char *Room); // Shown in front of the input line.  Empty = talking to everyone.
+
+// The input thread: read & edit keys until a line is entered.  Returns it without a newline (the caller frees it), "QUIT" for Ctrl+C,
+// or NULL once stdin closes or the TUI stops.
+char *TuiReadLine();
+
+// The console writer thread.
+bool TuiAppend(const char *Text, size_t Length); // Add output to the scrollback, lines ending in '\n'.  False if the TUI isn't running.
+bool TuiPending(); // Something other than new lines needs drawing: a key, a resize or a scroll.
+void TuiRender(); // Draw what changed since the last frame.
+
+#endif // TUI_H
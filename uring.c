@@ -0,0 +1,364 @@
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "uring.h"
+
+#ifdef CHAT_IO_URING
+
+#include "stdatomic.h"
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <poll.h>
+#include <linux/io_uring.h>
+
+#define KIND_MASK 3 // Low bits of a request's user data: its kind.  The rest is the context pointer.
+#define CANCEL_DATA 0 // User data of cancel requests, whose own completions are skipped.
+#define BUFFER_GROUP 0
+
+struct UringSendState {
+    struct msghdr Header;
+    IoVec Vectors[OUT_MAX_IOVECS];
+};
+
+struct Uring {
+    int Fd;
+    void *SqRing; // Mapped submission & completion rings (one mapping where the kernel allows).
+    size_t SqRingBytes;
+    void *CqRing;
+    size_t CqRingBytes;
+    struct io_uring_sqe *Sqes;
+    size_t SqesBytes;
+    _Atomic unsigned *SqHead;
+    _Atomic unsigned *SqTail;
+    unsigned SqMask;
+    unsigned *SqArray;
+    unsigned SqEntries;
+    unsigned Queued; // Put in the submission ring since the last submit.
+    _Atomic unsigned *CqHead;
+    _Atomic unsigned *CqTail;
+    unsigned CqMask;
+    struct io_uring_cqe *Cqes;
+    struct io_uring_buf_ring *Buffers; // Provided buffer ring, shared with the kernel.
+    size_t BuffersBytes;
+    unsigned BufferCount; // A power of two.
+    unsigned BufferBytes;
+    uint8_t *BufferMemory;
+};
+
+static int Setup(unsigned Entries, struct io_uring_params *Params) {
+    return (int)syscall(__NR_io_uring_setup, Entries, Params);
+}
+
+static int Enter(int Fd, unsigned ToSubmit, unsigned MinComplete, unsigned Flags, const void *Arg, size_t ArgBytes) {
+    return (int)syscall(__NR_io_uring_enter, Fd, ToSubmit, MinComplete, Flags, Arg, ArgBytes);
+}
+
+static int Register(int Fd, unsigned Opcode, const void *Arg, unsigned Count) {
+    return (int)syscall(__NR_io_uring_register, Fd, Opcode, Arg, Count);
+}
+
+static bool MapRings(Uring *Ring, const struct io_uring_params *Params) {
+    Ring->SqRingBytes = Params->sq_off.array + Params->sq_entries * sizeof(unsigned);
+    Ring->CqRingBytes = Params->cq_off.cqes + Params->cq_entries * sizeof(struct io_uring_cqe);
+    if (Params->features & IORING_FEAT_SINGLE_MMAP) {
+        if (Ring->CqRingBytes > Ring->SqRingBytes)
+            Ring->SqRingBytes = Ring->CqRingBytes;
+        Ring->CqRingBytes = 0;
+    }
+
+    Ring->SqRing = mmap(NULL, Ring->SqRingBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, Ring->Fd, IORING_OFF_SQ_RING);
+    if (Ring->SqRing == MAP_FAILED)
+        return false;
+    Ring->CqRing = Ring->SqRing;
+    if (Ring->CqRingBytes > 0) {
+        Ring->CqRing = mmap(NULL, Ring->CqRingBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, Ring->Fd, IORING_OFF_CQ_RING);
+        if (Ring->CqRing == MAP_FAILED)
+            return false;
+    }
+    Ring->SqesBytes = Params->sq_entries * sizeof(struct io_uring_sqe);
+    Ring->Sqes = mmap(NULL, Ring->SqesBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, Ring->Fd, IORING_OFF_SQES);
+    if (Ring->Sqes == MAP_FAILED)
+        return false;
+
+    Ring->SqHead = (_Atomic unsigned *)((char *)Ring->SqRing + Params->sq_off.head);
+    Ring->SqTail = (_Atomic unsigned *)((char *)Ring->SqRing + Params->sq_off.tail);
+    Ring->SqMask = *(unsigned *)((char *)Ring->SqRing + Params->sq_off.ring_mask);
+    Ring->SqArray = (unsigned *)((char *)Ring->SqRing + Params->sq_off.array);
+    Ring->SqEntries = Params->sq_entries;
+    Ring->CqHead = (_Atomic unsigned *)((char *)Ring->CqRing + Params->cq_off.head);
+    Ring->CqTail = (_Atomic unsigned *)((char *)Ring->CqRing + Params->cq_off.tail);
+    Ring->CqMask = *(unsigned *)((char *)Ring->CqRing + Params->cq_off.ring_mask);
+    Ring->Cqes = (struct io_uring_cqe *)((char *)Ring->CqRing + Params->cq_off.cqes);
+    return true;
+}
+
+// Hand a buffer (back) to the kernel.  It's visible once the tail is stored.
+static void ProvideBuffer(Uring *Ring, unsigned Buffer, uint16_t Tail) {
+    struct io_uring_buf *Slot = &Ring->Buffers->bufs[Tail & (Ring->BufferCount - 1)];
+
+    Slot->addr = (uint64_t)(uintptr_t)(Ring->BufferMemory + (size_t)Buffer * Ring->BufferBytes);
+    Slot->len = Ring->BufferBytes;
+    Slot->bid = (uint16_t)Buffer;
+}
+
+static bool RegisterBuffers(Uring *Ring, unsigned BufferCount, unsigned BufferBytes) {
+    struct io_uring_buf_reg Registration;
+    unsigned Counter;
+
+    for (Ring->BufferCount = 1; Ring->BufferCount < BufferCount; Ring->BufferCount *= 2);
+    if (Ring->BufferCount > 32768)
+        Ring->BufferCount = 32768;
+    Ring->BufferBytes = BufferBytes;
+    Ring->BuffersBytes = Ring->BufferCount * sizeof(struct io_uring_buf);
+    Ring->Buffers = mmap(NULL, Ring->BuffersBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0); // Page aligned.
+    Ring->BufferMemory = malloc((size_t)Ring->BufferCount * BufferBytes);
+    if (Ring->Buffers == MAP_FAILED || Ring->BufferMemory == NULL) {
+        if (Ring->Buffers == MAP_FAILED)
+            Ring->Buffers = NULL;
+        return false;
+    }
+
+    memset(&Registration, 0, sizeof(Registration));
+    Registration.ring_addr = (uint64_t)(uintptr_t)Ring->Buffers;
+    Registration.ring_entries = Ring->BufferCount;
+    Registration.bgid = BUFFER_GROUP;
+    if (Register(Ring->Fd, IORING_REGISTER_PBUF_RING, &Registration, 1) < 0)
+        return false;
+
+    for (Counter = 0; Counter < Ring->BufferCount; Counter++)
+        ProvideBuffer(Ring, Counter, (uint16_t)Counter);
+    atomic_store_explicit((_Atomic uint16_t *)&Ring->Buffers->tail, (uint16_t)Ring->BufferCount, memory_order_release);
+    return true;
+}
+
+Uring *UringCreate(unsigned Entries, unsigned BufferCount, unsigned BufferBytes) {
+    struct io_uring_params Params;
+    Uring *Ring = calloc(1, sizeof(Uring));
+
+    if (Ring == NULL)
+        return NULL;
+
+    memset(&Params, 0, sizeof(Params));
+    Params.flags = IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN; // Only this worker waits on it, no interrupts needed.
+    Ring->Fd = Setup(Entries, &Params);
+    if (Ring->Fd < 0) {
+        printf("ERROR: unable to create an io_uring (%s)!\n", strerror(errno));
+        free(Ring);
+        return NULL;
+    }
+    if (!(Params.features & IORING_FEAT_EXT_ARG)) {
+        printf("ERROR: this kernel's io_uring is too old (it needs 6.0 or newer)!\n");
+        UringDestroy(Ring);
+        return NULL;
+    }
+    if (!MapRings(Ring, &Params)) {
+        printf("ERROR: unable to map the io_uring (%s)!\n", strerror(errno));
+        UringDestroy(Ring);
+        return NULL;
+    }
+    if (BufferCount > 0 && !RegisterBuffers(Ring, BufferCount, BufferBytes)) {
+        printf("ERROR: unable to register io_uring receive buffers (%s)!\n", strerror(errno));
+        UringDestroy(Ring);
+        return NULL;
+    }
+    return Ring;
+}
+
+void UringDestroy(Uring *Ring) {
+    if (Ring == NULL)
+        return;
+    close(Ring->Fd); // Cancels whatever is still in flight.
+    if (Ring->Sqes && Ring->Sqes != MAP_FAILED)
+        munmap(Ring->Sqes, Ring->SqesBytes);
+    if (Ring->CqRingBytes > 0 && Ring->CqRing && Ring->CqRing != MAP_FAILED)
+        munmap(Ring->CqRing, Ring->CqRingBytes);
+    if (Ring->SqRing && Ring->SqRing != MAP_FAILED)
+        munmap(Ring->SqRing, Ring->SqRingBytes);
+    if (Ring->Buffers)
+        munmap(Ring->Buffers, Ring->BuffersBytes);
+    free(Ring->BufferMemory);
+    free(Ring);
+}
+
+// Hand everything queued to the kernel without waiting.
+static bool Submit(Uring *Ring) {
+    int Submitted;
+
+    while (Ring->Queued > 0) {
+        Submitted = Enter(Ring->Fd, Ring->Queued, 0, 0, NULL, 0);
+        if (Submitted < 0 && errno != EINTR)
+            return false;
+        if (Submitted > 0)
+            Ring->Queued -= (unsigned)Submitted;
+    }
+    return true;
+}
+
+// A zeroed submission entry for the next request, submitting what's queued first if the ring is full.
+static struct io_uring_sqe *NextSqe(Uring *Ring, uint8_t Opcode, int Fd, void *Context, int Kind) {
+    unsigned Tail = atomic_load_explicit(Ring->SqTail, memory_order_relaxed);
+    struct io_uring_sqe *Sqe;
+
+    if (Tail - atomic_load_explicit(Ring->SqHead, memory_order_acquire) >= Ring->SqEntries && !Submit(Ring))
+        return NULL;
+    if (Tail - atomic_load_explicit(Ring->SqHead, memory_order_acquire) >= Ring->SqEntries)
+        return NULL;
+
+    Sqe = &Ring->Sqes[Tail & Ring->SqMask];
+    memset(Sqe, 0, sizeof(*Sqe));
+    Sqe->opcode = Opcode;
+    Sqe->fd = Fd;
+    Sqe->user_data = Context ? (uint64_t)(uintptr_t)Context | (uint64_t)Kind : CANCEL_DATA;
+    Ring->SqArray[Tail & Ring->SqMask] = Tail & Ring->SqMask;
+    return Sqe;
+}
+
+// Publish the entry NextSqe() gave out.
+static bool Queue(Uring *Ring) {
+    atomic_store_explicit(Ring->SqTail, atomic_load_explicit(Ring->SqTail, memory_order_relaxed) + 1, memory_order_release);
+    Ring->Queued++;
+    return true;
+}
+
+bool UringAccept(Uring *Ring, SOCKET Listening, void *Context) {
+    struct io_uring_sqe *Sqe = NextSqe(Ring, IORING_OP_ACCEPT, Listening, Context, URING_ACCEPT);
+
+    if (Sqe == NULL)
+        return false;
+    Sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    Sqe->accept_flags = SOCK_CLOEXEC;
+    return Queue(Ring);
+}
+
+bool UringRecv(Uring *Ring, SOCKET Socket, void *Context) {
+    struct io_uring_sqe *Sqe = NextSqe(Ring, IORING_OP_RECV, Socket, Context, URING_RECV);
+
+    if (Sqe == NULL)
+        return false;
+    Sqe->ioprio = IORING_RECV_MULTISHOT;
+    Sqe->flags = IOSQE_BUFFER_SELECT; // The kernel picks a buffer from the group for every completion.
+    Sqe->buf_group = BUFFER_GROUP;
+    return Queue(Ring);
+}
+
+bool UringSend(Uring *Ring, SOCKET Socket, const OutBuffer *Out, UringSendState **State, void *Context) {
+    struct io_uring_sqe *Sqe;
+
+    if (*State == NULL && (*State = calloc(1, sizeof(UringSendState))) == NULL)
+        return false;
+    if ((Sqe = NextSqe(Ring, IORING_OP_SENDMSG, Socket, Context, URING_SEND)) == NULL)
+        return false;
+
+    memset(&(*State)->Header, 0, sizeof((*State)->Header));
+    (*State)->Header.msg_iov = (*State)->Vectors;
+    (*State)->Header.msg_iovlen = OutBufferVectors(Out, (*State)->Vectors, OUT_MAX_IOVECS);
+    Sqe->addr = (uint64_t)(uintptr_t)&(*State)->Header;
+    Sqe->len = 1;
+    Sqe->msg_flags = MSG_NOSIGNAL;
+    return Queue(Ring);
+}
+
+bool UringPoll(Uring *Ring, int Descriptor, void *Context) {
+    struct io_uring_sqe *Sqe = NextSqe(Ring, IORING_OP_POLL_ADD, Descriptor, Context, URING_POLL);
+
+    if (Sqe == NULL)
+        return false;
+    Sqe->poll32_events = POLLIN;
+    Sqe->len = IORING_POLL_ADD_MULTI;
+    return Queue(Ring);
+}
+
+bool UringCancel(Uring *Ring, void *Context, int Kind) {
+    struct io_uring_sqe *Sqe = NextSqe(Ring, IORING_OP_ASYNC_CANCEL, -1, NULL, 0);
+
+    if (Sqe == NULL)
+        return false;
+    Sqe->addr = (uint64_t)(uintptr_t)Context | (uint64_t)Kind;
+    return Queue(Ring);
+}
+
+int UringWait(Uring *Ring, UringCompletion *Out, int Max, int TimeoutMs) {
+    struct io_uring_getevents_arg Arg;
+    struct __kernel_timespec Timeout;
+    struct io_uring_cqe *Cqe;
+    unsigned Head = atomic_load_explicit(Ring->CqHead, memory_order_relaxed);
+    unsigned Flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+    int Count = 0;
+
+    memset(&Arg, 0, sizeof(Arg));
+    if (atomic_load_explicit(Ring->CqTail, memory_order_acquire) != Head)
+        TimeoutMs = 0; // Completions already waiting.  Just submit.
+    if (TimeoutMs >= 0) {
+        Timeout.tv_sec = TimeoutMs / 1000;
+        Timeout.tv_nsec = (long long)(TimeoutMs % 1000) * 1000000;
+        Arg.ts = (uint64_t)(uintptr_t)&Timeout;
+    }
+
+    // The one system call of the pass: everything queued goes in, and it returns once something has completed.
+    if (Enter(Ring->Fd, Ring->Queued, TimeoutMs == 0 ? 0 : 1, Flags, &Arg, sizeof(Arg)) >= 0 || errno == ETIME || errno == EINTR)
+        Ring->Queued = 0; // IORING_SETUP_SUBMIT_ALL: either all were taken or the call failed.
+    else if (errno != EBUSY) // Completions overflowed the queue & nothing was taken.  Collect some, then submit again next time.
+        return -1;
+
+    while (Count < Max && Head != atomic_load_explicit(Ring->CqTail, memory_order_acquire)) {
+        Cqe = &Ring->Cqes[Head & Ring->CqMask];
+        Head++;
+        if (Cqe->user_data == CANCEL_DATA)
+            continue;
+        Out[Count].Context = (void *)(uintptr_t)(Cqe->user_data & ~(uint64_t)KIND_MASK);
+        Out[Count].Kind = (int)(Cqe->user_data & KIND_MASK);
+        Out[Count].Result = Cqe->res;
+        Out[Count].Buffer = (Cqe->flags & IORING_CQE_F_BUFFER) ? (int)(Cqe->flags >> IORING_CQE_BUFFER_SHIFT) : -1;
+        Out[Count].bMore = (Cqe->flags & IORING_CQE_F_MORE) != 0;
+        Count++;
+    }
+    atomic_store_explicit(Ring->CqHead, Head, memory_order_release);
+    return Count;
+}
+
+const uint8_t *UringBufferData(Uring *Ring, int Buffer) {
+    return Ring->BufferMemory + (size_t)Buffer * Ring->BufferBytes;
+}
+
+void UringRecycle(Uring *Ring, int Buffer) {
+    _Atomic uint16_t *Tail = (_Atomic uint16_t *)&Ring->Buffers->tail;
+    uint16_t Next = atomic_load_explicit(Tail, memory_order_relaxed);
+
+    ProvideBuffer(Ring, (unsigned)Buffer, Next);
+    atomic_store_explicit(Tail, (uint16_t)(Next + 1), memory_order_release);
+}
+
+void UringSendStateFree(UringSendState *State) {
+    free(State);
+}
+
+#else // CHAT_IO_URING
+
+Uring *UringCreate(unsigned Entries, unsigned BufferCount, unsigned BufferBytes) {
+    (void)Entries;
+    (void)BufferCount;
+    (void)BufferBytes;
+    printf("ERROR: this build has no io_uring support.  Rebuild with -DCHAT_IO_URING on Linux.\n");
+    return NULL;
+}
+
+void UringDestroy(Uring *Ring) { (void)Ring; }
+bool UringAccept(Uring *Ring, SOCKET Listening, void *Context) { (void)Ring; (void)Listening; (void)Context; return false; }
+bool UringRecv(Uring *Ring, SOCKET Socket, void *Context) { (void)Ring; (void)Socket; (void)Context; return false; }
+bool UringPoll(Uring *Ring, int Descriptor, void *Context) { (void)Ring; (void)Descriptor; (void)Context; return false; }
+bool UringCancel(Uring *Ring, void *Context, int Kind) { (void)Ring; (void)Context; (void)Kind; return false; }
+int UringWait(Uring *Ring, UringCompletion *Out, int Max, int TimeoutMs) { (void)Ring; (void)Out; (void)Max; (void)TimeoutMs; return -1; }
+const uint8_t *UringBufferData(Uring *Ring, int Buffer) { (void)Ring; (void)Buffer; return NULL; }
+void UringRecycle(Uring *Ring, int Buffer) { (void)Ring; (void)Buffer; }
+void UringSendStateFree(UringSendState *State) { (void)State; }
+
+bool UringSend(Uring *Ring, SOCKET Socket, const OutBuffer *Out, UringSendState **State, void *Context) {
+    (void)Ring;
+    (void)Socket;
+    (void)Out;
+    (void)State;
+    (void)Context;
+    return false;
+}
+
+#endif // CHAT_IO_URING
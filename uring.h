@@ -0,0 +1,57 @@
+/*
+io_uring engine for the server's workers (Linux 6.0 or newer).  Compiled in with -DCHAT_IO_URING and then picked with --io-uring.  It
+talks to the kernel with the raw system calls, so liburing isn't needed.  Without CHAT_IO_URING the same functions exist but
+UringCreate() only says so & returns NULL, and the server stays on its poller (poller.h).
+
+A readiness backend still costs a recv() and a sendmsg() per socket per pass.  A ring keeps standing requests in the kernel instead, and
+the worker only collects what they did:
+
+- a multishot accept on the listen socket: one completion per new connection, no accept() calls;
+- a multishot recv on every client, into buffers the kernel takes from a ring of provided buffers registered once per worker, so an
+  idle connection holds no buffer of its own;
+- one sendmsg per client per flush straight from its out buffer's shared messages, as the poller backends write them.
+
+Whatever a pass queues goes in with the same io_uring_enter() that waits for the next completions, so a pass costs one system call
+however many clients it reads from & writes to.
+*/
+
+#ifndef URING_H
+#define URING_H
+
+#include "stdbool.h"
+#include "stdint.h"
+#include "platform.h"
+#include "outbuf.h"
+
+typedef struct Uring Uring;
+typedef struct UringSendState UringSendState; // A client's send in flight: its header & vectors, which must outlive the call.
+
+enum { URING_ACCEPT, URING_RECV, URING_SEND, URING_POLL }; // What a completion is for.  Also what UringCancel() takes.
+
+typedef struct UringCompletion {
+    void *Context; // As given when the request was queued.
+    int Kind;
+    int Result; // What the system call would have returned, or -errno.
+    int Buffer; // URING_RECV: provided buffer holding the bytes, -1 if none.  Hand it back with UringRecycle() once they're used.
+    bool bMore; // A multishot request that's still armed.  If false it has ended & has to be queued again to carry on.
+} UringCompletion;
+
+// 0 BufferCount = no provided buffers, so no UringRecv().  Prints why & returns NULL if the kernel (or the build) can't do it.
+Uring *UringCreate(unsigned Entries, unsigned BufferCount, unsigned BufferBytes);
+void UringDestroy(Uring *Ring); // Cancels everything still in flight.
+
+// Queue requests.  Nothing reaches the kernel until the next UringWait().  False if the submission queue is full even after submitting.
+bool UringAccept(Uring *Ring, SOCKET Listening, void *Context); // Multishot.
+bool UringRecv(Uring *Ring, SOCKET Socket, void *Context); // Multishot, into provided buffers.
+bool UringSend(Uring *Ring, SOCKET Socket, const OutBuffer *Out, UringSendState **State, void *Context); // Makes *State if NULL.
+bool UringPoll(Uring *Ring, int Descriptor, void *Context); // Multishot, until readable.
+bool UringCancel(Uring *Ring, void *Context, int Kind); // Its completion comes back as -ECANCELED.
+
+// Submit what's queued & wait up to TimeoutMs (-1 = no limit) for completions.  Returns how many were put in Out, -1 on error.
+int UringWait(Uring *Ring, UringCompletion *Out, int Max, int TimeoutMs);
+
+const uint8_t *UringBufferData(Uring *Ring, int Buffer);
+void UringRecycle(Uring *Ring, int Buffer);
+void UringSendStateFree(UringSendState *State);
+
+#endif // URING_H
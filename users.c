@@ -0,0 +1,332 @@
+#include "stdlib.h"
+#include "string.h"
+#include "stdatomic.h"
+#include "pthread.h"
+#include "users.h"
+
+#define CHUNK_BITS 12
+#define CHUNK_SIZE (1 << CHUNK_BITS)
+#define CHUNK_COUNT (USERS_MAX / CHUNK_SIZE)
+#define ROUTE_VALID (1ULL << 63)
+#define INITIAL_NAME_SLOTS 64
+
+typedef struct UserEntry {
+    atomic_ullong Route; // ROUTE_VALID | generation << 16 | worker index, or 0 while the ID is free.  The only field read unlocked.
+    uint32_t Generation;
+    uint8_t NameLength;
+    char Name[USER_NAME_MAX];
+} UserEntry;
+
+static _Atomic(UserEntry *) Chunks[CHUNK_COUNT]; // Allocated as IDs reach them, freed only by UsersReset().
+static pthread_mutex_t Lock = PTHREAD_MUTEX_INITIALIZER; // Guards everything below, and every entry field but Route.
+static UserId NextId = 1; // Lowest ID never handed out.
+static UserId *FreeIds; // IDs given back, reused first.
+static size_t FreeCount;
+static size_t FreeCapacity;
+static UserId *NameSlots; // Open addressing hash map from name to ID.  USER_NONE = empty.
+static size_t NameCapacity;
+static size_t NameCount;
+
+static UserEntry *EntryOf(UserId Id) {
+    return &atomic_load_explicit(&Chunks[Id >> CHUNK_BITS], memory_order_relaxed)[Id & (CHUNK_SIZE - 1)];
+}
+
+static uint32_t NameHash(const uint8_t *Name, size_t Length) { // FNV-1a.
+    uint32_t Hash = 2166136261u;
+    size_t Counter;
+
+    for (Counter = 0; Counter < Length; Counter++) {
+        Hash ^= Name[Counter];
+        Hash *= 16777619u;
+    }
+    return Hash;
+}
+
+// Slot holding Name's ID, or the empty slot where it would go.
+static size_t ProbeName(const uint8_t *Name, size_t Length) {
+    size_t Mask = NameCapacity - 1;
+    size_t Index = NameHash(Name, Length) & Mask;
+    UserEntry *Entry;
+
+    while (NameSlots[Index] != USER_NONE) {
+        Entry = EntryOf(NameSlots[Index]);
+        if (Entry->NameLength == Length && memcmp(Entry->Name, Name, Length) == 0)
+            break;
+        Index = (Index + 1) & Mask;
+    }
+    return Index;
+}
+
+static bool GrowNames() {
+    size_t NewCapacity = NameCapacity ? NameCapacity * 2 : INITIAL_NAME_SLOTS;
+    UserId *NewSlots = calloc(NewCapacity, sizeof(UserId));
+    UserId *OldSlots = NameSlots;
+    size_t OldCapacity = NameCapacity;
+    size_t Counter;
+    UserEntry *Entry;
+
+    if (NewSlots == NULL)
+        return false;
+
+    NameSlots = NewSlots;
+    NameCapacity = NewCapacity;
+    for (Counter = 0; Counter < OldCapacity; Counter++) {
+        if (OldSlots[Counter] != USER_NONE) {
+            Entry = EntryOf(OldSlots[Counter]);
+            NameSlots[ProbeName((const uint8_t *)Entry->Name, Entry->NameLength)] = OldSlots[Counter];
+        }
+    }
+    free(OldSlots);
+    return true;
+}
+
+// Backward-shift deletion, as in rooms.c, so lookups never need tombstones.
+static void RemoveName(size_t Index) {
+    size_t Mask = NameCapacity - 1;
+    size_t Next = Index;
+    size_t Home;
+    UserEntry *Entry;
+
+    NameSlots[Index] = USER_NONE;
+    NameCount--;
+
+    for (;;) {
+        Next = (Next + 1) & Mask;
+        if (NameSlots[Next] == USER_NONE)
+            return;
+
+        Entry = EntryOf(NameSlots[Next]);
+        Home = NameHash((const uint8_t *)Entry->Name, Entry->NameLength) & Mask;
+        if (((Next - Home) & Mask) >= ((Next - Index) & Mask)) {
+            NameSlots[Index] = NameSlots[Next];
+            NameSlots[Next] = USER_NONE;
+            Index = Next;
+        }
+    }
+}
+
+// Allocate the chunk Id is in, if it isn't yet.  False if out of memory.
+static bool AllocateChunk(UserId Id) {
+    UserEntry *Chunk;
+
+    if (atomic_load_explicit(&Chunks[Id >> CHUNK_BITS], memory_order_relaxed) != NULL)
+        return true;
+    Chunk = calloc(CHUNK_SIZE, sizeof(UserEntry));
+    if (Chunk == NULL)
+        return false;
+    atomic_store_explicit(&Chunks[Id >> CHUNK_BITS], Chunk, memory_order_release); // Zeroed routes visible before the chunk.
+    return true;
+}
+
+// Room to give every ID below Below back later without needing memory then.
+static bool ReserveFreeIds(UserId Below) {
+    size_t NewCapacity = FreeCapacity ? FreeCapacity : 256;
+    UserId *NewFree;
+
+    if (FreeCapacity >= Below)
+        return true;
+    while (NewCapacity < Below)
+        NewCapacity *= 2;
+    NewFree = realloc(FreeIds, NewCapacity * sizeof(UserId));
+    if (NewFree == NULL)
+        return false;
+    FreeIds = NewFree;
+    FreeCapacity = NewCapacity;
+    return true;
+}
+
+// An ID nobody has, with its chunk allocated.  USER_NONE if the registry is full or out of memory.
+static UserId TakeId() {
+    if (FreeCount > 0)
+        return FreeIds[--FreeCount];
+    if (NextId >= USERS_MAX || !AllocateChunk(NextId))
+        return USER_NONE;
+    return NextId++;
+}
+
+// Give Entry its name & route, in the slot ProbeName() found for it.
+static void SetEntry(UserId Id, const uint8_t *Name, size_t Length, int WorkerIndex, size_t Slot) {
+    UserEntry *Entry = EntryOf(Id);
+
+    Entry->NameLength = (uint8_t)Length;
+    memcpy(Entry->Name, Name, Length);
+    atomic_store_explicit(&Entry->Route, ROUTE_VALID | (uint64_t)Entry->Generation << 16 | (uint64_t)WorkerIndex, memory_order_relaxed);
+    NameSlots[Slot] = Id;
+    NameCount++;
+}
+
+static UserId RegisterLocked(const uint8_t *Name, size_t Length, int WorkerIndex, uint32_t *Generation) {
+    UserId Id;
+    size_t Slot;
+
+    if ((NameCount + 1) * 4 > NameCapacity * 3 && !GrowNames())
+        return USER_NONE;
+    Slot = ProbeName(Name, Length);
+    if (NameSlots[Slot] != USER_NONE) // Taken.
+        return USER_NONE;
+
+    if ((FreeCount == 0 && !ReserveFreeIds(NextId + 1)) || (Id = TakeId()) == USER_NONE)
+        return USER_NONE;
+
+    EntryOf(Id)->Generation++;
+    SetEntry(Id, Name, Length, WorkerIndex, Slot);
+    *Generation = EntryOf(Id)->Generation;
+    return Id;
+}
+
+static bool RestoreLocked(const uint8_t *Name, size_t Length, UserId Id, uint32_t Generation, int WorkerIndex) {
+    size_t Slot;
+    size_t Counter;
+
+    if ((NameCount + 1) * 4 > NameCapacity * 3 && !GrowNames())
+        return false;
+    Slot = ProbeName(Name, Length);
+    if (NameSlots[Slot] != USER_NONE || !ReserveFreeIds(Id + 1))
+        return false;
+
+    if (Id >= NextId) { // The IDs skipped on the way are free.
+        for (; NextId < Id; NextId++) {
+            if (!AllocateChunk(NextId))
+                return false;
+            FreeIds[FreeCount++] = NextId;
+        }
+        if (!AllocateChunk(Id))
+            return false;
+        NextId = Id + 1;
+    }
+    else {
+        for (Counter = 0; Counter < FreeCount && FreeIds[Counter] != Id; Counter++)
+            ;
+        if (Counter == FreeCount) // Someone has it.
+            return false;
+        FreeIds[Counter] = FreeIds[--FreeCount];
+    }
+
+    EntryOf(Id)->Generation = Generation;
+    SetEntry(Id, Name, Length, WorkerIndex, Slot);
+    return true;
+}
+
+UserId UserRegister(const uint8_t *Name, size_t Length, int WorkerIndex, uint32_t *Generation) {
+    UserId Id;
+
+    if (!UserNameValid(Name, Length))
+        return USER_NONE;
+
+    pthread_mutex_lock(&Lock);
+    Id = RegisterLocked(Name, Length, WorkerIndex, Generation);
+    pthread_mutex_unlock(&Lock);
+    return Id;
+}
+
+bool UserRestore(const uint8_t *Name, size_t Length, UserId Id, uint32_t Generation, int WorkerIndex) {
+    bool bRestored;
+
+    if (!UserNameValid(Name, Length) || Id == USER_NONE || Id >= USERS_MAX)
+        return false;
+
+    pthread_mutex_lock(&Lock);
+    bRestored = RestoreLocked(Name, Length, Id, Generation, WorkerIndex);
+    pthread_mutex_unlock(&Lock);
+    return bRestored;
+}
+
+void UserUnregister(UserId Id) {
+    UserEntry *Entry;
+
+    if (Id == USER_NONE)
+        return;
+
+    pthread_mutex_lock(&Lock);
+    Entry = EntryOf(Id);
+    RemoveName(ProbeName((const uint8_t *)Entry->Name, Entry->NameLength));
+    atomic_store_explicit(&Entry->Route, 0, memory_order_relaxed);
+    FreeIds[FreeCount++] = Id;
+    pthread_mutex_unlock(&Lock);
+}
+
+bool UserRoute(UserId Id, int *WorkerIndex, uint32_t *Generation) {
+    UserEntry *Chunk;
+    uint64_t Route;
+
+    if (Id == USER_NONE || Id >= USERS_MAX)
+        return false;
+    Chunk = atomic_load_explicit(&Chunks[Id >> CHUNK_BITS], memory_order_acquire);
+    if (Chunk == NULL)
+        return false;
+
+    Route = atomic_load_explicit(&Chunk[Id & (CHUNK_SIZE - 1)].Route, memory_order_relaxed);
+    if ((Route & ROUTE_VALID) == 0)
+        return false;
+    *WorkerIndex = (int)(Route & 0xFFFF);
+    *Generation = (uint32_t)(Route >> 16);
+    return true;
+}
+
+size_t UserNameOf(UserId Id, uint8_t *Name) {
+    size_t Length = 0;
+    int WorkerIndex;
+    uint32_t Generation;
+
+    pthread_mutex_lock(&Lock);
+    if (UserRoute(Id, &WorkerIndex, &Generation)) {
+        Length = EntryOf(Id)->NameLength;
+        memcpy(Name, EntryOf(Id)->Name, Length);
+    }
+    pthread_mutex_unlock(&Lock);
+    return Length;
+}
+
+size_t UserFrameUser(uint8_t *Out, UserId Id, const uint8_t *Name, size_t Length) {
+    uint8_t Body[5 + USER_NAME_MAX];
+    size_t BodyLength = VarintEncode(Body, Id);
+
+    memcpy(Body + BodyLength, Name, Length);
+    return FrameEncode(Out, FRAME_USER, Body, BodyLength + Length);
+}
+
+Message *UserDirectory() {
+    Message *Directory = NULL;
+    uint8_t Frame[USER_FRAME_MAX];
+    UserEntry *Entry;
+    size_t Total = 0;
+    size_t Written = 0;
+    size_t Counter;
+    int Pass;
+
+    pthread_mutex_lock(&Lock);
+    for (Pass = 0; Pass < 2; Pass++) { // Measure, then write.
+        for (Counter = 0; Counter < NameCapacity; Counter++) {
+            if (NameSlots[Counter] == USER_NONE)
+                continue;
+            Entry = EntryOf(NameSlots[Counter]);
+            if (Pass == 0)
+                Total += UserFrameUser(Frame, NameSlots[Counter], (const uint8_t *)Entry->Name, Entry->NameLength);
+            else
+                Written += UserFrameUser(Directory->Data + Written, NameSlots[Counter], (const uint8_t *)Entry->Name, Entry->NameLength);
+        }
+        if (Pass == 0 && (Total == 0 || (Directory = MessageCreate(Total)) == NULL))
+            break;
+    }
+    pthread_mutex_unlock(&Lock);
+    return Directory;
+}
+
+void UsersReset() {
+    size_t Counter;
+    UserEntry *Chunk;
+
+    pthread_mutex_lock(&Lock);
+    for (Counter = 0; Counter < CHUNK_COUNT; Counter++) {
+        Chunk = atomic_load_explicit(&Chunks[Counter], memory_order_relaxed);
+        free(Chunk);
+        atomic_store_explicit(&Chunks[Counter], NULL, memory_order_relaxed);
+    }
+    free(FreeIds);
+    free(NameSlots);
+    FreeIds = NULL;
+    NameSlots = NULL;
+    FreeCount = FreeCapacity = NameCapacity = NameCount = 0;
+    NextId = 1;
+    pthread_mutex_unlock(&Lock);
+}
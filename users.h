@@ -0,0 +1,49 @@
+/*
+User name registry, shared by every worker.
+
+A client logs in once with a name and is given a small integer ID for it.  The name is sent to every client once, in a FRAME_USER
+frame, and from then on only the ID travels: in front of each message the user sends, and as the address of a direct message.  So
+routing never touches a string, and a message costs a byte or two of ID instead of the sender's name.
+
+IDs are reused once their user has gone, so they stay small and dense.  Each reuse bumps the ID's generation, which lets a worker
+tell a direct message meant for an ID's previous user from one meant for its current user.
+
+Logging in & out take a lock.  Looking up where to route an ID (UserRoute) doesn't: route words live in fixed chunks that never move
+while the server runs, and are read with a single atomic load.
+*/
+
+#ifndef USERS_H
+#define USERS_H
+
+#include "stdbool.h"
+#include "stddef.h"
+#include "stdint.h"
+#include "frame.h"
+#include "message.h"
+
+typedef uint32_t UserId;
+
+#define USERS_MAX (1 << 22) // Users logged in at once, across all workers.
+
+// Register Name for a client of WorkerIndex.  Returns its ID, or USER_NONE if the name is taken (or the registry is full or out of
+// memory).  *Generation receives the ID's generation.
+UserId UserRegister(const uint8_t *Name, size_t Length, int WorkerIndex, uint32_t *Generation);
+void UserUnregister(UserId Id);
+
+// Register Name with the ID & generation it had on the server this one took over from (see handoff.h).  False if the name or the ID
+// is taken here already, or out of memory.
+bool UserRestore(const uint8_t *Name, size_t Length, UserId Id, uint32_t Generation, int WorkerIndex);
+
+bool UserRoute(UserId Id, int *WorkerIndex, uint32_t *Generation); // Where the user with this ID is.  False if nobody has it.
+size_t UserNameOf(UserId Id, uint8_t *Name); // Copy the name of the user with this ID into Name (USER_NAME_MAX).  0 if nobody has it.
+
+// Every user currently registered, as FRAME_USER frames one after the other in one message, so a new client learns every name in a
+// single write.  NULL if there's nobody (or no memory).
+Message *UserDirectory();
+
+size_t UserFrameUser(uint8_t *Out, UserId Id, const uint8_t *Name, size_t Length); // Encode a FRAME_USER.  Out needs USER_FRAME_MAX.
+#define USER_FRAME_MAX (FRAME_HEADER_MAX + 5 + USER_NAME_MAX)
+
+void UsersReset(); // Forget everyone & free the registry.  Only once no worker is running.
+
+#endif // USERS_H